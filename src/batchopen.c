@@ -0,0 +1,341 @@
+/**
+ * Copyright (C) 2009-2017 Fabio Leone
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * @file batchopen.c
+ * @brief Opening many connections at once with bounded concurrency
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <gtk/gtk.h>
+#include <gio/gio.h>
+#include "main.h"
+#include "connection.h"
+#include "gui.h"
+#include "sshbackend.h"
+#include "prober.h"
+#include "timerwheel.h"
+#include "batchopen.h"
+
+extern Prefs prefs;
+extern Globals globals;
+extern GtkWidget *main_window;
+extern GList *connection_tab_list;
+
+/*
+ * Credentials are asked once for the whole batch. Host names are then
+ * resolved asynchronously, at most prefs.batch_concurrency at a time, so
+ * that unknown hosts fail without a tab. Resolved connections get their
+ * tab in order of resolution, one per main loop iteration, while fewer
+ * than prefs.batch_concurrency tabs of the batch are still connecting.
+ * A non modal dialog shows the progress and the failures and can stop
+ * the batch.
+ */
+
+typedef struct _BatchOpen {
+	GPtrArray *conns;         /* Connection *, with the batch credentials */
+	guint next;               /* next connection to resolve */
+	int n_resolving;
+	GQueue ready;             /* resolved, waiting for a tab */
+	GPtrArray *connecting;    /* BatchItem *, tabs not yet connected */
+	int n_opened;
+	int n_failed;
+	GString *failures;
+	GResolver *resolver;
+	GCancellable *cancellable;
+	WheelTimer *poll;
+	gboolean closed;          /* dialog closed, stop opening */
+	GtkWidget *dialog, *progress, *label, *text;
+} BatchOpen;
+
+typedef struct _BatchItem {
+	BatchOpen *b;
+	Connection *conn;
+	struct ConnectionTab *p_ct;
+} BatchItem;
+
+static int concurrency(void)
+{
+	return prefs.batch_concurrency > 0 ? prefs.batch_concurrency : BATCH_OPEN_CONCURRENCY;
+}
+
+static void batch_free(BatchOpen *b)
+{
+	wheel_timer_cancel(b->poll);
+	g_queue_clear(&b->ready);
+	g_ptr_array_free(b->connecting, TRUE);
+	g_ptr_array_free(b->conns, TRUE);
+	g_string_free(b->failures, TRUE);
+	g_object_unref(b->cancellable);
+	g_object_unref(b->resolver);
+	g_free(b);
+}
+
+static gboolean batch_done(BatchOpen *b)
+{
+	return b->n_opened + b->n_failed == b->conns->len;
+}
+
+static void batch_failed(BatchOpen *b, const char *name, const char *reason)
+{
+	b->n_failed ++;
+	g_string_append_printf(b->failures, "%s: %s\n", name, reason);
+	log_write("[%s] %s: %s\n", __func__, name, reason);
+}
+
+static void batch_update(BatchOpen *b)
+{
+	char text[256];
+	if (b->closed)
+		return;
+	g_snprintf(text, sizeof(text), "%d of %d opened, %d connecting, %d failed",
+	           b->n_opened, b->conns->len, b->connecting->len, b->n_failed);
+	gtk_label_set_text(GTK_LABEL(b->label), text);
+	gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(b->progress),
+	                              (double) (b->n_opened + b->n_failed) / b->conns->len);
+	gtk_text_buffer_set_text(gtk_text_view_get_buffer(GTK_TEXT_VIEW(b->text)), b->failures->str, -1);
+	if (batch_done(b))
+		gtk_dialog_set_response_sensitive(GTK_DIALOG(b->dialog), GTK_RESPONSE_CANCEL, FALSE);
+}
+
+static void resolve_next(BatchOpen *b);
+static gboolean poll_cb(gpointer data);
+
+static void schedule_poll(BatchOpen *b)
+{
+	if (b->poll == NULL)
+		b->poll = wheel_timer_add(BATCH_OPEN_POLL_MS, poll_cb, b);
+}
+
+static void resolved_cb(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+	BatchItem *item = user_data;
+	BatchOpen *b = item->b;
+	GError *error = NULL;
+	GList *addresses;
+	b->n_resolving --;
+	addresses = g_resolver_lookup_by_name_finish(G_RESOLVER(source), res, &error);
+	if (addresses) {
+		g_resolver_free_addresses(addresses);
+		if (!b->closed) {
+			g_queue_push_tail(&b->ready, item->conn);
+			schedule_poll(b);
+		}
+	} else {
+		if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			batch_failed(b, item->conn->name, error->message);
+		g_error_free(error);
+	}
+	g_free(item);
+	if (b->closed) {
+		if (b->n_resolving == 0)
+			batch_free(b);
+		return;
+	}
+	resolve_next(b);
+	batch_update(b);
+}
+
+static void resolve_next(BatchOpen *b)
+{
+	BatchItem *item;
+	const ProbeResult *res;
+	Connection *c;
+	while (b->n_resolving < concurrency() && b->next < b->conns->len) {
+		c = g_ptr_array_index(b->conns, b->next++);
+		/* hosts the prober found dead a moment ago are skipped */
+		res = prober_cached(c->host, c->port);
+		if (res && (res->state == PROBE_DOWN || res->state == PROBE_UNRESOLVED)) {
+			batch_failed(b, c->name, res->state == PROBE_DOWN ? "not reachable" : "unknown host");
+			continue;
+		}
+		item = g_new0(BatchItem, 1);
+		item->b = b;
+		item->conn = c;
+		b->n_resolving ++;
+		g_resolver_lookup_by_name_async(b->resolver, item->conn->host, b->cancellable, resolved_cb, item);
+	}
+}
+
+/* follows the connecting tabs, opens new ones while there is room */
+static gboolean poll_cb(gpointer data)
+{
+	BatchOpen *b = data;
+	BatchItem *item;
+	Connection *c;
+	int i;
+	for (i = b->connecting->len - 1; i >= 0; i--) {
+		item = g_ptr_array_index(b->connecting, i);
+		/* the tab may have been closed by the user */
+		if (g_list_find(connection_tab_list, item->p_ct) == NULL)
+			batch_failed(b, item->conn->name, "tab closed while connecting");
+		else if (tabIsConnected(item->p_ct))
+			b->n_opened ++;
+		else if (tabGetConnectionStatus(item->p_ct) == TAB_CONN_STATUS_DISCONNECTED)
+			batch_failed(b, item->conn->name, "connection failed");
+		else
+			continue;
+		g_ptr_array_remove_index(b->connecting, i);
+	}
+	/* one tab per iteration, the interface stays responsive */
+	if (b->connecting->len < concurrency() && (c = g_queue_pop_head(&b->ready)) != NULL) {
+		item = g_new0(BatchItem, 1);
+		item->b = b;
+		item->conn = c;
+		item->p_ct = connection_log_on_param(c);
+		if (item->p_ct) {
+			g_ptr_array_add(b->connecting, item);
+		} else {
+			batch_failed(b, c->name, "cancelled");
+			g_free(item);
+		}
+	}
+	batch_update(b);
+	if (b->connecting->len == 0 && g_queue_is_empty(&b->ready)) {
+		b->poll = NULL;
+		if (batch_done(b) && b->n_failed == 0)
+			gtk_widget_destroy(b->dialog);
+		return G_SOURCE_REMOVE;
+	}
+	return G_SOURCE_CONTINUE;
+}
+
+static void response_cb(GtkDialog *dialog, gint response_id, gpointer user_data)
+{
+	gtk_widget_destroy(GTK_WIDGET(dialog));
+}
+
+static void destroy_cb(GtkWidget *widget, gpointer user_data)
+{
+	BatchOpen *b = user_data;
+	b->closed = TRUE;
+	if (!batch_done(b))
+		log_write("[%s] stopped, %d of %d opened\n", __func__, b->n_opened, b->conns->len);
+	g_cancellable_cancel(b->cancellable);
+	/* pending lookups still refer to the batch */
+	if (b->n_resolving == 0)
+		batch_free(b);
+	else {
+		wheel_timer_cancel(b->poll);
+		b->poll = NULL;
+	}
+}
+
+static void create_dialog(BatchOpen *b, const char *title)
+{
+	GtkWidget *box, *scrolled;
+	b->dialog = gtk_dialog_new_with_buttons(title, GTK_WINDOW(main_window), GTK_DIALOG_DESTROY_WITH_PARENT,
+	                                        "Stop", GTK_RESPONSE_CANCEL, "Close", GTK_RESPONSE_CLOSE, NULL);
+	gtk_window_set_default_size(GTK_WINDOW(b->dialog), 420, 260);
+	box = gtk_dialog_get_content_area(GTK_DIALOG(b->dialog));
+	gtk_container_set_border_width(GTK_CONTAINER(box), 8);
+	gtk_box_set_spacing(GTK_BOX(box), 6);
+	b->label = gtk_label_new("");
+	gtk_box_pack_start(GTK_BOX(box), b->label, FALSE, FALSE, 0);
+	b->progress = gtk_progress_bar_new();
+	gtk_box_pack_start(GTK_BOX(box), b->progress, FALSE, FALSE, 0);
+	b->text = gtk_text_view_new();
+	gtk_text_view_set_editable(GTK_TEXT_VIEW(b->text), FALSE);
+	scrolled = gtk_scrolled_window_new(NULL, NULL);
+	gtk_container_add(GTK_CONTAINER(scrolled), b->text);
+	gtk_box_pack_start(GTK_BOX(box), scrolled, TRUE, TRUE, 0);
+	g_signal_connect(b->dialog, "response", G_CALLBACK(response_cb), b);
+	g_signal_connect(b->dialog, "destroy", G_CALLBACK(destroy_cb), b);
+	gtk_widget_show_all(b->dialog);
+}
+
+/*
+ * asks user and password once for the connections that would ask them;
+ * the password is a secret to release with conn_secret_unref()
+ */
+static int ask_credentials(GPtrArray *conns, const char **user, const char **password)
+{
+	Connection *c, *tmp;
+	char buf[256], name[64];
+	int i, need_user = 0, need_password = 0;
+	*user = *password = "";
+	for (i = 0; i < conns->len; i++) {
+		c = g_ptr_array_index(conns, i);
+		if (c->auth_mode == CONN_AUTH_MODE_SAVE)
+			continue;
+		if (!c->user[0] && strstr(globals.ssh_proto.args, "%u"))
+			need_user ++;
+		/* only the in-process backend can use a password given here */
+		if (!c->password[0] && c->auth_mode == CONN_AUTH_MODE_PROMPT && ssh_backend_usable(c))
+			need_password ++;
+	}
+	if (need_user == 0 && need_password == 0)
+		return 0;
+	/* same questions as for a single connection, allocated to own the password */
+	tmp = connection_new();
+	tmp->auth_mode = CONN_AUTH_MODE_PROMPT;
+	g_snprintf(name, sizeof(name), "%d connections", MAX(need_user, need_password));
+	tmp->name = name;
+	c = g_ptr_array_index(conns, 0);
+	tmp->last_user = c->last_user;
+	if (need_user) {
+		if (expand_arg('u', buf, sizeof(buf), tmp) == NULL) {
+			connection_unref(tmp);
+			return 1;
+		}
+		*user = tmp->user;
+	}
+	/* an empty password leaves the question to each connection */
+	if (need_password && expand_arg('P', buf, sizeof(buf), tmp))
+		*password = conn_secret_ref(tmp->password);
+	connection_unref(tmp);
+	return 0;
+}
+
+/**
+ * batch_open() - opens a tab for each connection, progressively
+ * @param[in] conns Connection *, released by the batch
+ */
+void batch_open(const char *title, GPtrArray *conns)
+{
+	BatchOpen *b;
+	Connection *c;
+	const char *user, *password;
+	int i;
+	if (conns->len == 0 || ask_credentials(conns, &user, &password)) {
+		g_ptr_array_free(conns, TRUE);
+		return;
+	}
+	b = g_new0(BatchOpen, 1);
+	b->conns = g_ptr_array_new_full(conns->len, (GDestroyNotify) connection_unref);
+	for (i = 0; i < conns->len; i++) {
+		c = connection_dup(g_ptr_array_index(conns, i));
+		if (c->auth_mode != CONN_AUTH_MODE_SAVE) {
+			if (!c->user[0])
+				conn_set(c->user, user);
+			if (!c->password[0])
+				connection_set_password(c, password);
+		}
+		g_ptr_array_add(b->conns, c);
+	}
+	conn_secret_unref(password);
+	g_ptr_array_free(conns, TRUE);
+	g_queue_init(&b->ready);
+	b->connecting = g_ptr_array_new_with_free_func(g_free);
+	b->failures = g_string_new("");
+	b->resolver = g_resolver_get_default();
+	b->cancellable = g_cancellable_new();
+	log_write("[%s] opening %d connections, %d at a time\n", __func__, b->conns->len, concurrency());
+	create_dialog(b, title);
+	resolve_next(b);
+	batch_update(b);
+}
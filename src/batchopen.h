@@ -0,0 +1,15 @@
+
+#ifndef _BATCHOPEN_H
+#define _BATCHOPEN_H
+
+#include "connection.h"
+
+/* default hosts resolved and tabs connecting at the same time */
+#define BATCH_OPEN_CONCURRENCY 8
+
+/* how often the connecting tabs are checked */
+#define BATCH_OPEN_POLL_MS 100
+
+void batch_open(const char *title, GPtrArray *conns);
+
+#endif
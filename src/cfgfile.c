@@ -0,0 +1,200 @@
+
+/**
+ * Copyright (C) 2009-2017 Fabio Leone
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * @file cfgfile.c
+ * @brief Configuration file I/O: whole file reads and atomic buffered writes
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "main.h"
+#include "cfgfile.h"
+
+#define CFG_WRITER_BUFSIZE (64 * 1024)
+
+/**
+ * cfg_buffer_open() - reads a whole file in memory
+ * For files other programs may write: a mapped file truncated or
+ * rewritten in place would kill lterm with SIGBUS. The stat is the one of
+ * the file actually read, even if it's replaced meanwhile.
+ * @return 0 if ok, 1 otherwise
+ */
+int cfg_buffer_open(CfgBuffer *buf, const char *filename)
+{
+	gsize size;
+	ssize_t n;
+	int fd;
+	memset(buf, 0, sizeof(CfgBuffer));
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &buf->st) != 0) {
+		log_debug("%s: %s\n", filename, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return 1;
+	}
+	/* the file may still grow */
+	size = buf->st.st_size + 1;
+	buf->contents = g_malloc(size);
+	while ((n = read(fd, buf->contents + buf->len, size - buf->len)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			log_debug("%s: %s\n", filename, strerror(errno));
+			close(fd);
+			cfg_buffer_close(buf);
+			return 1;
+		}
+		buf->len += n;
+		if (buf->len == size) {
+			size *= 2;
+			buf->contents = g_realloc(buf->contents, size);
+		}
+	}
+	close(fd);
+	buf->data = buf->contents;
+	return 0;
+}
+
+/**
+ * cfg_buffer_map() - maps a whole file in memory
+ * Only for lterm's own files, replaced by rename and never rewritten in place.
+ * @return 0 if ok, 1 otherwise
+ */
+int cfg_buffer_map(CfgBuffer *buf, const char *filename)
+{
+	GError *error = NULL;
+	memset(buf, 0, sizeof(CfgBuffer));
+	buf->map = g_mapped_file_new(filename, FALSE, &error);
+	if (!buf->map) {
+		log_debug("%s\n", error->message);
+		g_error_free(error);
+		return 1;
+	}
+	buf->data = g_mapped_file_get_contents(buf->map);
+	buf->len = g_mapped_file_get_length(buf->map);
+	if (buf->data == NULL)
+		buf->len = 0;   /* empty file */
+	return 0;
+}
+
+void cfg_buffer_close(CfgBuffer *buf)
+{
+	if (buf->map)
+		g_mapped_file_unref(buf->map);
+	g_free(buf->contents);
+	memset(buf, 0, sizeof(CfgBuffer));
+}
+
+static void cfg_writer_free(CfgWriter *w)
+{
+	g_free(w->filename);
+	g_free(w->tmp_filename);
+	w->fp = NULL;
+	w->filename = w->tmp_filename = NULL;
+}
+
+/**
+ * cfg_writer_open() - starts writing a new version of filename
+ * Data goes to a temporary file in the same directory; the target is only
+ * replaced by cfg_writer_commit(), so a crash while saving leaves it intact.
+ * @return 0 if ok, 1 otherwise
+ */
+int cfg_writer_open(CfgWriter *w, const char *filename)
+{
+	int fd;
+	memset(w, 0, sizeof(CfgWriter));
+	w->filename = g_strdup(filename);
+	w->tmp_filename = g_strconcat(filename, ".XXXXXX", NULL);
+	fd = g_mkstemp(w->tmp_filename);
+	if (fd < 0) {
+		log_write("[%s] can't create %s: %s\n", __func__, w->tmp_filename, strerror(errno));
+		cfg_writer_free(w);
+		return 1;
+	}
+	w->fp = fdopen(fd, "w");
+	if (w->fp == NULL) {
+		log_write("[%s] can't open %s: %s\n", __func__, w->tmp_filename, strerror(errno));
+		close(fd);
+		g_unlink(w->tmp_filename);
+		cfg_writer_free(w);
+		return 1;
+	}
+	setvbuf(w->fp, NULL, _IOFBF, CFG_WRITER_BUFSIZE);
+	return 0;
+}
+
+void cfg_writer_write(CfgWriter *w, const char *data, gsize len)
+{
+	if (w->error)
+		return;
+	if (fwrite(data, 1, len, w->fp) != len)
+		w->error = errno;
+}
+
+void cfg_writer_printf(CfgWriter *w, const char *fmt, ...)
+{
+	va_list ap;
+	if (w->error)
+		return;
+	va_start(ap, fmt);
+	if (vfprintf(w->fp, fmt, ap) < 0)
+		w->error = errno;
+	va_end(ap);
+}
+
+/**
+ * cfg_writer_commit() - flushes data to disk and atomically replaces the target file
+ * @return 0 if ok, 1 otherwise (the target file is left untouched)
+ */
+int cfg_writer_commit(CfgWriter *w)
+{
+	if (!w->error && fflush(w->fp) != 0)
+		w->error = errno;
+	if (!w->error && fsync(fileno(w->fp)) != 0)
+		w->error = errno;
+	if (!w->error && fstat(fileno(w->fp), &w->st) != 0)
+		w->error = errno;
+	if (fclose(w->fp) != 0 && !w->error)
+		w->error = errno;
+	if (!w->error && g_rename(w->tmp_filename, w->filename) != 0)
+		w->error = errno;
+	if (w->error) {
+		log_write("[%s] can't save %s: %s\n", __func__, w->filename, strerror(w->error));
+		g_unlink(w->tmp_filename);
+		cfg_writer_free(w);
+		return 1;
+	}
+	cfg_writer_free(w);
+	return 0;
+}
+
+void cfg_writer_abort(CfgWriter *w)
+{
+	fclose(w->fp);
+	g_unlink(w->tmp_filename);
+	cfg_writer_free(w);
+}
+
@@ -0,0 +1,39 @@
+
+#ifndef _CFGFILE_H
+#define _CFGFILE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <glib.h>
+
+/* read-only view of a whole configuration file */
+typedef struct _CfgBuffer {
+	GMappedFile *map;     /* cfg_buffer_map() */
+	gchar *contents;      /* cfg_buffer_open() */
+	const gchar *data;    /* not nul-terminated */
+	gsize len;
+	struct stat st;       /* of the file read, cfg_buffer_open() */
+} CfgBuffer;
+
+/* buffered writer to a temporary file, renamed over the target on commit */
+typedef struct _CfgWriter {
+	FILE *fp;
+	gchar *filename;
+	gchar *tmp_filename;
+	int error;
+	struct stat st;       /* of the file written, after cfg_writer_commit() */
+} CfgWriter;
+
+int cfg_buffer_open(CfgBuffer *buf, const char *filename);
+int cfg_buffer_map(CfgBuffer *buf, const char *filename);
+void cfg_buffer_close(CfgBuffer *buf);
+
+int cfg_writer_open(CfgWriter *w, const char *filename);
+void cfg_writer_write(CfgWriter *w, const char *data, gsize len);
+void cfg_writer_printf(CfgWriter *w, const char *fmt, ...) G_GNUC_PRINTF(2, 3);
+int cfg_writer_commit(CfgWriter *w);
+void cfg_writer_abort(CfgWriter *w);
+
+#endif
+
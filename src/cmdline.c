@@ -0,0 +1,228 @@
+/**
+ * Copyright (C) 2009-2017 Fabio Leone
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * @file cmdline.c
+ * @brief Command line templates compiled once and expanded into argv
+ */
+
+#include <string.h>
+#include <glib.h>
+#include "cmdline.h"
+#include "main.h"
+
+/*
+ * A template like "ssh -p %p -l %u %h" is split in arguments when
+ * compiled, with the rules of splitString(text, " ", TRUE, "\"", ...):
+ * arguments are separated by spaces, one starting with a quote extends to
+ * the closing quote, quotes are removed. Each argument becomes a sequence
+ * of text and variable operations ended by OP_END. Variable values are
+ * never split, so a value with spaces or quotes stays one argument.
+ */
+
+#define OP_TEXT 0
+#define OP_VAR 1
+#define OP_END 2    /* end of an argument, skipped if empty */
+
+typedef struct _CmdOp {
+	guint8 type;
+	guint8 var;
+	guint32 offset;     /* OP_TEXT: position in text */
+	guint32 len;
+} CmdOp;
+
+struct _CmdTemplate {
+	GArray *ops;        /* CmdOp */
+	GString *text;      /* literal parts of all the arguments */
+};
+
+static void add_op(CmdTemplate *tmpl, int type, int var)
+{
+	CmdOp op = { type, var, 0, 0 };
+	g_array_append_val(tmpl->ops, op);
+}
+
+static void add_text(CmdTemplate *tmpl, char c)
+{
+	CmdOp *last = tmpl->ops->len ? &g_array_index(tmpl->ops, CmdOp, tmpl->ops->len - 1) : NULL;
+	if (last == NULL || last->type != OP_TEXT) {
+		add_op(tmpl, OP_TEXT, 0);
+		last = &g_array_index(tmpl->ops, CmdOp, tmpl->ops->len - 1);
+		last->offset = tmpl->text->len;
+	}
+	g_string_append_c(tmpl->text, c);
+	last->len ++;
+}
+
+/**
+ * cmd_template_new() - compiles a command line
+ * @param[in] expand_vars TRUE to expand %x sequences, FALSE to take them literally
+ */
+CmdTemplate *cmd_template_new(const char *text, gboolean expand_vars)
+{
+	CmdTemplate *tmpl = g_new0(CmdTemplate, 1);
+	int k, inside, var;
+	guint n_ops;
+	tmpl->ops = g_array_new(FALSE, FALSE, sizeof(CmdOp));
+	tmpl->text = g_string_new("");
+	while (*text) {
+		inside = 0;
+		n_ops = tmpl->ops->len;
+		for (k = 0; text[k]; ) {
+			if (k == 0 && text[k] == '"') {
+				inside = 1;
+				k ++;
+				continue;
+			}
+			if (inside && text[k] == '"')
+				inside = 0;
+			if (!inside && text[k] == ' ') {
+				k ++;
+				break;
+			}
+			if (expand_vars && text[k] == '%') {
+				var = text[k + 1];
+				if (var == '%')
+					add_text(tmpl, '%');
+				else if (var > 0 && var < 128)
+					add_op(tmpl, OP_VAR, var);
+				/* a trailing % is dropped */
+				k += var ? 2 : 1;
+			} else {
+				if (text[k] != '"')
+					add_text(tmpl, text[k]);
+				k ++;
+			}
+			if (!inside && (text[k] == ' ' || text[k] == 0)) {
+				if (text[k])
+					k ++;
+				break;
+			}
+		}
+		if (tmpl->ops->len > n_ops)
+			add_op(tmpl, OP_END, 0);
+		text += k;
+	}
+	return tmpl;
+}
+
+void cmd_template_free(CmdTemplate *tmpl)
+{
+	if (tmpl == NULL)
+		return;
+	g_array_free(tmpl->ops, TRUE);
+	g_string_free(tmpl->text, TRUE);
+	g_free(tmpl);
+}
+
+/* values of the variables, each one looked up once per expansion */
+struct VarCache {
+	const char *value[128];
+	gsize len[128];
+	char buf[CMD_MAX_VARS][CMD_VAR_SIZE];
+	int n;              /* buffers holding a value */
+	CmdVarFunc lookup;
+	gpointer data;
+};
+
+static const char *get_var(struct VarCache *vc, int var)
+{
+	if (vc->value[var])
+		return vc->value[var];
+	if (vc->n == CMD_MAX_VARS) {
+		log_write("[%s] more than %d variables filling a buffer in a command line\n", __func__, CMD_MAX_VARS);
+		return NULL;
+	}
+	vc->value[var] = vc->lookup ? vc->lookup(var, vc->buf[vc->n], CMD_VAR_SIZE, vc->data) : "";
+	/* a value living elsewhere leaves the buffer to the next variable */
+	if (vc->value[var] == vc->buf[vc->n])
+		vc->n ++;
+	if (vc->value[var])
+		vc->len[var] = strlen(vc->value[var]);
+	return vc->value[var];
+}
+
+/**
+ * cmd_template_expand() - builds the argv of the concatenated templates
+ * Variables are looked up in the order they appear, which is also the
+ * order of any question the lookup function asks the user.
+ * @param[in] lookup gives the variable values, NULL for empty values
+ * @return NULL terminated argv in a single block to be freed with g_free(), NULL if aborted
+ */
+char **cmd_template_expand(CmdTemplate **parts, int n_parts, CmdVarFunc lookup, gpointer data)
+{
+	struct VarCache vc_data, *vc = &vc_data;
+	CmdOp *op;
+	char **argv;
+	char *p, *start;
+	gsize arg_len = 0, bytes = 0;
+	int i, j, n_args = 0;
+	memset(vc->value, 0, sizeof(vc->value));
+	vc->n = 0;
+	vc->lookup = lookup;
+	vc->data = data;
+	/* sizes, also resolving the variables */
+	for (i = 0; i < n_parts; i++) {
+		for (j = 0; j < parts[i]->ops->len; j++) {
+			op = &g_array_index(parts[i]->ops, CmdOp, j);
+			switch (op->type) {
+			case OP_TEXT:
+				arg_len += op->len;
+				break;
+			case OP_VAR:
+				if (get_var(vc, op->var) == NULL)
+					return NULL;
+				arg_len += vc->len[op->var];
+				break;
+			case OP_END:
+				if (arg_len) {
+					n_args ++;
+					bytes += arg_len + 1;
+				}
+				arg_len = 0;
+				break;
+			}
+		}
+	}
+	/* pointers followed by the strings */
+	argv = g_malloc((n_args + 1) * sizeof(char *) + bytes);
+	start = p = (char *) (argv + n_args + 1);
+	n_args = 0;
+	for (i = 0; i < n_parts; i++) {
+		for (j = 0; j < parts[i]->ops->len; j++) {
+			op = &g_array_index(parts[i]->ops, CmdOp, j);
+			switch (op->type) {
+			case OP_TEXT:
+				memcpy(p, parts[i]->text->str + op->offset, op->len);
+				p += op->len;
+				break;
+			case OP_VAR:
+				memcpy(p, vc->value[op->var], vc->len[op->var]);
+				p += vc->len[op->var];
+				break;
+			case OP_END:
+				if (p > start) {
+					*p++ = 0;
+					argv[n_args++] = start;
+					start = p;
+				}
+				break;
+			}
+		}
+	}
+	argv[n_args] = NULL;
+	return argv;
+}
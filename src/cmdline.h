@@ -0,0 +1,25 @@
+
+#ifndef _CMDLINE_H
+#define _CMDLINE_H
+
+#include <glib.h>
+
+/* distinct %x variables in one expansion whose values are put in the buffer */
+#define CMD_MAX_VARS 8
+
+/* size of the buffer given to CmdVarFunc, values are truncated to it */
+#define CMD_VAR_SIZE 256
+
+typedef struct _CmdTemplate CmdTemplate;
+
+/*
+ * Returns the value of %var, either a string living until the expansion
+ * ends or buf filled with it. NULL aborts the expansion.
+ */
+typedef const char *(*CmdVarFunc)(int var, char *buf, gsize size, gpointer data);
+
+CmdTemplate *cmd_template_new(const char *text, gboolean expand_vars);
+void cmd_template_free(CmdTemplate *tmpl);
+char **cmd_template_expand(CmdTemplate **parts, int n_parts, CmdVarFunc lookup, gpointer data);
+
+#endif
@@ -0,0 +1,344 @@
+
+/**
+ * Copyright (C) 2009-2017 Fabio Leone
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * @file conncache.c
+ * @brief Binary cache of connections.xml, used at startup when up to date
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <glib.h>
+#include "connection.h"
+#include "conncache.h"
+#include "cfgfile.h"
+#include "main.h"
+#include "utils.h"
+
+#define CONN_CACHE_MAGIC "LTCC"
+
+/*
+ * File layout: header, then count records. Each record is a fixed block of
+ * 32 bit integers followed by the string fields as (32 bit length, bytes).
+ * The cache is only valid for the connections.xml it was built from, whose
+ * size and modification time are recorded in the header.
+ * What the cache saves is parsing the XML: loading still decodes every
+ * record, interns its strings and inserts it in the list, so startup stays
+ * linear in the number of connections (see test/connlist_bench.c).
+ */
+struct CacheHeader {
+	char magic[4];
+	guint32 version;
+	guint64 xml_size;
+	gint64 xml_mtime_sec;
+	gint64 xml_mtime_nsec;
+	guint32 count;
+	guint32 payload_len;
+	guint32 payload_hash;
+	guint32 reserved;
+};
+
+#define N_INT_FIELDS 10
+
+/* the writer is started and joined by the loader, the reload thread and main at exit */
+static GThread *writer_thread = NULL;
+static GMutex writer_mutex;
+
+guint32 conn_hash(const guchar *p, gsize len)
+{
+	guint32 h = 2166136261u;   /* FNV-1a */
+	while (len--) {
+		h ^= *p++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+void conn_pack_string(GByteArray *buf, const char *s)
+{
+	guint32 len = strlen(s);
+	g_byte_array_append(buf, (const guint8 *) &len, sizeof(len));
+	g_byte_array_append(buf, (const guint8 *) s, len);
+}
+
+/* len_size is the size of the length: 4, or 2 in version 1 journals */
+static int unpack_string(const guchar **p, const guchar *end, const char **dst, int len_size)
+{
+	guint32 len;
+	guint16 len16;
+	if (end - *p < len_size)
+		return 1;
+	if (len_size == sizeof(len16)) {
+		memcpy(&len16, *p, sizeof(len16));
+		len = len16;
+	} else
+		memcpy(&len, *p, sizeof(len));
+	*p += len_size;
+	if (end - *p < len)
+		return 1;
+	*dst = conn_intern_len((const char *) *p, len);
+	*p += len;
+	return 0;
+}
+
+/* reads a string packed by conn_pack_string() and interns it */
+int conn_unpack_string(const guchar **p, const guchar *end, const char **dst)
+{
+	return unpack_string(p, end, dst, sizeof(guint32));
+}
+
+/* same for the 16 bit lengths of version 1 journals */
+int conn_unpack_string_legacy(const guchar **p, const guchar *end, const char **dst)
+{
+	return unpack_string(p, end, dst, sizeof(guint16));
+}
+
+/* conn_pack() - appends the binary form of a connection to buf */
+void conn_pack(GByteArray *buf, Connection *p_conn)
+{
+	gint32 v[N_INT_FIELDS] = {
+		p_conn->port, p_conn->auth_mode, p_conn->flags,
+		p_conn->sshOptions.x11Forwarding,
+		p_conn->sshOptions.agentForwarding,
+		p_conn->sshOptions.disableStrictKeyChecking,
+		p_conn->sshOptions.flagKeepAlive,
+		p_conn->sshOptions.keepAliveInterval,
+		p_conn->sshOptions.flagConnectTimeout,
+		p_conn->sshOptions.connectTimeout
+	};
+	g_byte_array_append(buf, (const guint8 *) v, sizeof(v));
+	conn_pack_string(buf, p_conn->name);
+	conn_pack_string(buf, p_conn->host);
+	conn_pack_string(buf, p_conn->last_user);
+	conn_pack_string(buf, p_conn->user_options);
+	conn_pack_string(buf, p_conn->auth_user);
+	conn_pack_string(buf, p_conn->auth_password_encrypted);
+	conn_pack_string(buf, p_conn->identityFile);
+	conn_pack_string(buf, p_conn->folder);
+}
+
+static int unpack_connection(const guchar **p, const guchar *end, Connection *p_conn, int len_size)
+{
+	gint32 v[N_INT_FIELDS];
+	char password[64];
+	connection_init(p_conn);
+	if (end - *p < sizeof(v))
+		return 1;
+	memcpy(v, *p, sizeof(v));
+	*p += sizeof(v);
+	p_conn->port = v[0];
+	p_conn->auth_mode = v[1];
+	p_conn->flags = v[2];
+	p_conn->sshOptions.x11Forwarding = v[3];
+	p_conn->sshOptions.agentForwarding = v[4];
+	p_conn->sshOptions.disableStrictKeyChecking = v[5];
+	p_conn->sshOptions.flagKeepAlive = v[6];
+	p_conn->sshOptions.keepAliveInterval = v[7];
+	p_conn->sshOptions.flagConnectTimeout = v[8];
+	p_conn->sshOptions.connectTimeout = v[9];
+	if (unpack_string(p, end, &p_conn->name, len_size)
+	    || unpack_string(p, end, &p_conn->host, len_size)
+	    || unpack_string(p, end, &p_conn->last_user, len_size)
+	    || unpack_string(p, end, &p_conn->user_options, len_size)
+	    || unpack_string(p, end, &p_conn->auth_user, len_size)
+	    || unpack_string(p, end, &p_conn->auth_password_encrypted, len_size)
+	    || unpack_string(p, end, &p_conn->identityFile, len_size))
+		return 1;
+	/* the folder was added later, journal records written before have no room for it */
+	if (*p < end && unpack_string(p, end, &p_conn->folder, len_size))
+		return 1;
+	conn_set_secret(p_conn->auth_password, password_decode(p_conn->auth_password_encrypted, password, sizeof(password)));
+	return 0;
+}
+
+/**
+ * conn_unpack() - decodes a connection packed by conn_pack() and advances *p
+ * @return 0 if ok, 1 if data is truncated or malformed
+ */
+int conn_unpack(const guchar **p, const guchar *end, Connection *p_conn)
+{
+	return unpack_connection(p, end, p_conn, sizeof(guint32));
+}
+
+/* conn_unpack_legacy() - same for connections recorded in version 1 journals */
+int conn_unpack_legacy(const guchar **p, const guchar *end, Connection *p_conn)
+{
+	return unpack_connection(p, end, p_conn, sizeof(guint16));
+}
+
+static void set_xml_stamp(struct CacheHeader *h, const struct stat *st)
+{
+	h->xml_size = st->st_size;
+	h->xml_mtime_sec = st->st_mtim.tv_sec;
+	h->xml_mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+/**
+ * conn_cache_load() - fills the list from the cache if it matches xml_file
+ * @return 0 if the cache was used, 1 if it is missing, stale or corrupted
+ */
+int conn_cache_load(ConnectionList *p_cl, const char *cache_file, const char *xml_file)
+{
+	CfgBuffer buf;
+	struct CacheHeader h, stamp;
+	struct stat st;
+	Connection conn;
+	const guchar *p, *end;
+	int i;
+	if (stat(xml_file, &st) != 0)
+		return 1;
+	if (cfg_buffer_map(&buf, cache_file))
+		return 1;
+	if (buf.len < sizeof(h))
+		goto stale;
+	memcpy(&h, buf.data, sizeof(h));
+	set_xml_stamp(&stamp, &st);
+	if (memcmp(h.magic, CONN_CACHE_MAGIC, sizeof(h.magic)) || h.version != CONN_CACHE_VERSION
+	    || h.xml_size != stamp.xml_size
+	    || h.xml_mtime_sec != stamp.xml_mtime_sec
+	    || h.xml_mtime_nsec != stamp.xml_mtime_nsec
+	    || h.payload_len != buf.len - sizeof(h))
+		goto stale;
+	p = (const guchar *) buf.data + sizeof(h);
+	end = p + h.payload_len;
+	if (conn_hash(p, h.payload_len) != h.payload_hash) {
+		log_write("[%s] %s is corrupted\n", __func__, cache_file);
+		goto stale;
+	}
+	for (i = 0; i < h.count; i++) {
+		if (conn_unpack(&p, end, &conn)) {
+			log_write("[%s] %s: bad record %d\n", __func__, cache_file, i);
+			goto stale;
+		}
+		cl_append(p_cl, &conn);
+		conn_secrets_release(&conn);
+	}
+	cfg_buffer_close(&buf);
+	log_debug("%d connections loaded from %s\n", h.count, cache_file);
+	return 0;
+stale:
+	cfg_buffer_close(&buf);
+	return 1;
+}
+
+/* connections from connections.d are not part of connections.xml and are left out */
+static void pack_cb(gpointer data, gpointer user_data)
+{
+	Connection *p_conn = data;
+	GByteArray *buf = user_data;
+	struct CacheHeader *h = (struct CacheHeader *) buf->data;
+	if (p_conn->shard[0])
+		return;
+	h->count ++;    /* before packing, which may move buf->data */
+	conn_pack(buf, p_conn);
+}
+
+/**
+ * conn_cache_build() - serializes the list into a cache image
+ * The image must be stamped with conn_cache_stamp() before being written.
+ */
+GByteArray *conn_cache_build(ConnectionList *p_cl)
+{
+	struct CacheHeader h;
+	GByteArray *data;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CONN_CACHE_MAGIC, sizeof(h.magic));
+	h.version = CONN_CACHE_VERSION;
+	data = g_byte_array_new();
+	g_byte_array_append(data, (const guint8 *) &h, sizeof(h));
+	cl_foreach(p_cl, pack_cb, data);
+	memcpy(&h, data->data, sizeof(h));
+	h.payload_len = data->len - sizeof(h);
+	h.payload_hash = conn_hash(data->data + sizeof(h), h.payload_len);
+	memcpy(data->data, &h, sizeof(h));
+	return data;
+}
+
+/**
+ * conn_cache_stamp() - binds a cache image to the version of connections.xml it holds
+ * xml_st must come from the file descriptor the list was read from or
+ * written to: a later stat() could see a file replaced meanwhile.
+ */
+void conn_cache_stamp(GByteArray *data, const struct stat *xml_st)
+{
+	struct CacheHeader h;
+	memcpy(&h, data->data, sizeof(h));
+	set_xml_stamp(&h, xml_st);
+	memcpy(data->data, &h, sizeof(h));
+}
+
+int conn_cache_write(GByteArray *data, const char *cache_file)
+{
+	CfgWriter w;
+	if (cfg_writer_open(&w, cache_file))
+		return 1;
+	cfg_writer_write(&w, (const char *) data->data, data->len);
+	if (cfg_writer_commit(&w))
+		return 1;
+	log_debug("%s updated\n", cache_file);
+	return 0;
+}
+
+struct CacheJob {
+	gchar *cache_file;
+	GByteArray *data;
+};
+
+static gpointer cache_writer(gpointer user_data)
+{
+	struct CacheJob *job = (struct CacheJob *) user_data;
+	conn_cache_write(job->data, job->cache_file);
+	g_byte_array_free(job->data, TRUE);
+	g_free(job->cache_file);
+	g_free(job);
+	return NULL;
+}
+
+/**
+ * conn_cache_update() - rebuilds the cache for a list just parsed from connections.xml
+ * The list is serialized here, disk I/O is done in a background thread.
+ */
+void conn_cache_update(ConnectionList *p_cl, const char *cache_file, const struct stat *xml_st)
+{
+	struct CacheJob *job;
+	GByteArray *data;
+	data = conn_cache_build(p_cl);
+	conn_cache_stamp(data, xml_st);
+	job = g_new0(struct CacheJob, 1);
+	job->cache_file = g_strdup(cache_file);
+	job->data = data;
+	/* one writer at a time, so an older snapshot can't overwrite a newer one */
+	g_mutex_lock(&writer_mutex);
+	if (writer_thread)
+		g_thread_join(writer_thread);
+	writer_thread = g_thread_new("conncache", cache_writer, job);
+	g_mutex_unlock(&writer_mutex);
+}
+
+/* conn_cache_wait() - waits for a pending cache write */
+void conn_cache_wait(void)
+{
+	g_mutex_lock(&writer_mutex);
+	if (writer_thread) {
+		g_thread_join(writer_thread);
+		writer_thread = NULL;
+	}
+	g_mutex_unlock(&writer_mutex);
+}
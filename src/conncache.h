@@ -0,0 +1,25 @@
+
+#ifndef _CONNCACHE_H
+#define _CONNCACHE_H
+
+#include <glib.h>
+#include "connection.h"
+
+#define CONN_CACHE_VERSION 3
+
+guint32 conn_hash(const guchar *p, gsize len);
+void conn_pack_string(GByteArray *buf, const char *s);
+int conn_unpack_string(const guchar **p, const guchar *end, const char **dst);
+int conn_unpack_string_legacy(const guchar **p, const guchar *end, const char **dst);
+void conn_pack(GByteArray *buf, Connection *p_conn);
+int conn_unpack(const guchar **p, const guchar *end, Connection *p_conn);
+int conn_unpack_legacy(const guchar **p, const guchar *end, Connection *p_conn);
+
+int conn_cache_load(ConnectionList *p_cl, const char *cache_file, const char *xml_file);
+GByteArray *conn_cache_build(ConnectionList *p_cl);
+void conn_cache_stamp(GByteArray *data, const struct stat *xml_st);
+int conn_cache_write(GByteArray *data, const char *cache_file);
+void conn_cache_update(ConnectionList *p_cl, const char *cache_file, const struct stat *xml_st);
+void conn_cache_wait(void);
+
+#endif
@@ -32,13 +32,18 @@
 #include "connection.h"
 #include "main.h"
 #include "utils.h"
-#include "xml.h"
+#include "cfgfile.h"
+#include "conncache.h"
+#include "connjournal.h"
+#include "connmodel.h"
+#include "connwatch.h"
+#include "prober.h"
 
 extern Globals globals;
 extern Prefs prefs;
 extern GtkWidget *main_window;
 
-GList *conn_list;
+ConnectionList *conn_list;
 
 GtkWidget *port_spin_button;
 GtkWidget *check_x11, *check_agentForwarding;
@@ -53,26 +58,34 @@ struct _AuthWidgets {
 	GtkWidget *button_select_private_key, *button_clear_private_key;
 } authWidgets;
 
-enum {
-	NAME_COLUMN,
-	HOST_COLUMN,
-	PORT_COLUMN,
-	N_COLUMNS
-};
-
-int conn_update_last_user(char *cname, char *last_user)
+int conn_update_last_user(const char *cname, const char *last_user)
 {
 	Connection *p_conn;
+	Connection conn;
 	log_debug("updating last_user = %s for conn. %s\n", last_user, cname);
 	p_conn = cl_get_by_name(conn_list, cname);
-	if (p_conn)
-		strcpy(p_conn->last_user, last_user);
+	if (p_conn && strcmp(p_conn->last_user, last_user)) {
+		conn = *p_conn;
+		conn_set(conn.last_user, last_user);
+		/* connections.d is read-only, the user is remembered until exit */
+		if (!p_conn->shard[0])
+			conn_journal_put(p_conn->name, &conn);
+		cl_update(conn_list, p_conn, &conn);
+	}
 	return 0;
 }
 
-static void write_connection_node(FILE *fp, Connection *p_conn, int indent)
+static void write_connection_node(CfgWriter *w, Connection *p_conn, int indent)
 {
-	fprintf(fp, "%*s<connection name='%s' host='%s' port='%d' flags='%d'>\n"
+	/* names, hosts and users also come from imported files: escape everything */
+	gchar *name = g_markup_escape_text(p_conn->name, -1);
+	gchar *host = g_markup_escape_text(NVL(p_conn->host, ""), -1);
+	gchar *auth_user = g_markup_escape_text(NVL(p_conn->auth_user, ""), -1);
+	gchar *auth_password = g_markup_escape_text(NVL(p_conn->auth_password_encrypted, ""), -1);
+	gchar *identityFile = g_markup_escape_text(p_conn->identityFile, -1);
+	gchar *last_user = g_markup_escape_text(NVL(p_conn->last_user, ""), -1);
+	gchar *user_options = g_markup_escape_text(p_conn->user_options, -1);
+	cfg_writer_printf(w, "%*s<connection name='%s' host='%s' port='%d' flags='%d'>\n"
 	        "%*s  <authentication>\n"
 	        "%*s    <mode>%d</mode>\n"
 	        "%*s    <auth_user>%s</auth_user>\n"
@@ -88,15 +101,15 @@ static void write_connection_node(FILE *fp, Connection *p_conn, int indent)
 	        "%*s    <property name='keepAliveInterval' enabled='%d'>%d</property>\n"
 	        "%*s    <property name='connectTimeout' enabled='%d'>%d</property>\n"
 	        "%*s  </options>\n",
-	        indent, " ", p_conn->name, NVL(p_conn->host, ""), p_conn->port, p_conn->flags,
+	        indent, " ", name, host, p_conn->port, p_conn->flags,
 	        indent, " ",
 	        indent, " ", p_conn->auth_mode,
-	        indent, " ", NVL(p_conn->auth_user, ""),
-	        indent, " ", NVL(p_conn->auth_password_encrypted, ""),
-	        indent, " ", p_conn->identityFile[0] ? g_markup_escape_text(p_conn->identityFile, strlen(p_conn->identityFile)) : "",
+	        indent, " ", auth_user,
+	        indent, " ", auth_password,
+	        indent, " ", identityFile,
 	        indent, " ",
-	        indent, " ", NVL(p_conn->last_user, ""),
-	        indent, " ", p_conn->user_options,
+	        indent, " ", last_user,
+	        indent, " ", user_options,
 	        indent, " ",
 	        indent, " ", p_conn->sshOptions.x11Forwarding,
 	        indent, " ", p_conn->sshOptions.agentForwarding,
@@ -105,150 +118,624 @@ static void write_connection_node(FILE *fp, Connection *p_conn, int indent)
 	        indent, " ", p_conn->sshOptions.flagConnectTimeout, p_conn->sshOptions.connectTimeout,
 	        indent, " "
 	       );
-	fprintf(fp, "%*s</connection>\n", indent, " ");
+	cfg_writer_printf(w, "%*s</connection>\n", indent, " ");
+	g_free(name);
+	g_free(host);
+	g_free(auth_user);
+	g_free(auth_password);
+	g_free(identityFile);
+	g_free(last_user);
+	g_free(user_options);
+}
+
+/* TRUE if the folder has connections belonging to connections.xml */
+static gboolean folder_has_local(ConnFolder *folder)
+{
+	GSequenceIter *iter;
+	for (iter = g_sequence_get_begin_iter(folder->connections); !g_sequence_iter_is_end(iter); iter = g_sequence_iter_next(iter))
+		if (!((Connection *) g_sequence_get(iter))->shard[0])
+			return TRUE;
+	for (iter = g_sequence_get_begin_iter(folder->folders); !g_sequence_iter_is_end(iter); iter = g_sequence_iter_next(iter))
+		if (folder_has_local(g_sequence_get(iter)))
+			return TRUE;
+	return FALSE;
 }
 
-int save_connections(GList *pList, char *filename)
+/* writes a folder as nested elements: subfolders first, then connections (not those from connections.d) */
+static void write_folder_node(CfgWriter *w, ConnFolder *folder, int indent)
 {
-	FILE *fp;
-	fp = fopen(filename, "w");
-	if (fp == 0)
+	GSequenceIter *iter;
+	Connection *p_conn;
+	gchar *name;
+	for (iter = g_sequence_get_begin_iter(folder->folders); !g_sequence_iter_is_end(iter); iter = g_sequence_iter_next(iter)) {
+		ConnFolder *sub = g_sequence_get(iter);
+		if (!folder_has_local(sub))
+			continue;
+		name = g_markup_escape_text(sub->name, -1);
+		cfg_writer_printf(w, "%*s<folder name='%s'>\n", indent, " ", name);
+		g_free(name);
+		write_folder_node(w, sub, indent + 2);
+		cfg_writer_printf(w, "%*s</folder>\n", indent, " ");
+	}
+	for (iter = g_sequence_get_begin_iter(folder->connections); !g_sequence_iter_is_end(iter); iter = g_sequence_iter_next(iter)) {
+		p_conn = g_sequence_get(iter);
+		if (!p_conn->shard[0])
+			write_connection_node(w, p_conn, indent);
+	}
+}
+
+/* connections.xml was read, or doesn't exist yet: it may be written */
+static gboolean conn_file_read = FALSE;
+
+/* st, if not NULL, receives the stat of the file as written */
+int save_connections(ConnectionList *p_cl, char *filename, struct stat *st)
+{
+	CfgWriter w;
+	/* the list may lack what the file has */
+	if (!conn_file_read && strcmp(filename, globals.connections_xml) == 0) {
+		log_write("[%s] %s not read, not overwritten\n", __func__, filename);
+		return 1;
+	}
+	if (cfg_writer_open(&w, filename))
 		return 1;
-	fprintf(fp,
+	cfg_writer_printf(&w,
 	        "<?xml version = '1.0'?>\n"
 	        "<!DOCTYPE connectionset>\n"
 	        "<connectionset version=\"%d\">\n",
 	        CFG_XML_VERSION);
-	Connection *p_conn;
-	GList *item;
-	item = g_list_first(pList);
-	while (item) {
-		p_conn = (Connection *) item->data;
-		write_connection_node(fp, p_conn, 2);
-		item = g_list_next(item);
-	}
-	fprintf(fp, "</connectionset>\n");
-	fclose(fp);
-	return (0);
-}
-
-static void read_connection_node(XMLNode *node, Connection *pConn)
-{
-	char tmp_s[32];
-	char propertyName[128], propertyValue[1024];
-	XMLNode *child, *node_auth;
-	memset(pConn, 0, sizeof(Connection));
-	strcpy(pConn->name, xml_node_get_attribute(node, "name"));
-	//log_debug ("%s\n", pConn->name);
-	strcpy(pConn->host, xml_node_get_attribute(node, "host"));
-	strcpy(tmp_s, xml_node_get_attribute(node, "port"));
-	if (tmp_s[0])
-		pConn->port = atoi(tmp_s);
-	strcpy(tmp_s, NVL(xml_node_get_attribute(node, "flags"), ""));
-	if (tmp_s[0])
-		pConn->flags = atoi(tmp_s);
-	if ((child = xml_node_get_child(node, "last_user")))
-		strcpy(pConn->last_user, NVL(xml_node_get_value(child), ""));
-	if ((node_auth = xml_node_get_child(node, "authentication"))) {
-		if ((child = xml_node_get_child(node_auth, "mode"))) {
-			strcpy(tmp_s, NVL(xml_node_get_value(child), "0"));
-			if (tmp_s[0])
-				pConn->auth_mode = atoi(tmp_s);
-		}
-		if ((child = xml_node_get_child(node_auth, "auth_user")))
-			strcpy(pConn->auth_user, NVL(xml_node_get_value(child), ""));
-		if ((child = xml_node_get_child(node_auth, "auth_password"))) {
-			strcpy(pConn->auth_password_encrypted, NVL(xml_node_get_value(child), ""));
-			strcpy(pConn->auth_password, password_decode(pConn->auth_password_encrypted));
+	write_folder_node(&w, p_cl->root, 2);
+	cfg_writer_printf(&w, "</connectionset>\n");
+	if (cfg_writer_commit(&w))
+		return 1;
+	conn_watch_saved(&w.st);
+	if (st)
+		*st = w.st;
+	return 0;
+}
+
+/* state of the connections.xml parser */
+struct ConnectionParser {
+	ConnectionList *p_cl;
+	Connection conn;
+	int state;
+	int skip_depth;       /* > 0 while inside an unknown element */
+	GString *folder;      /* path of the current folder */
+	int folder_depth;
+	gsize folder_len[CONN_FOLDER_MAX_DEPTH + 1];
+	int prop_enabled;
+	char prop_name[32];
+	char text[1024];      /* text of the current leaf element */
+	int text_len;
+};
+
+/* bounded copy of a (not nul-terminated) text into a fixed size field */
+static void conn_set_field(char *dest, size_t size, const char *text, size_t len)
+{
+	if (len >= size)
+		len = size - 1;
+	memcpy(dest, text, len);
+	dest[len] = 0;
+}
+
+#define CONN_SET_FIELD(field, text) conn_set_field((field), sizeof(field), (text), strlen(text))
+
+static void conn_parser_start_element(GMarkupParseContext *context, const gchar *element_name, const gchar **attribute_names,
+                                      const gchar **attribute_values, gpointer user_data, GError **error)
+{
+	int i;
+	struct ConnectionParser *p = (struct ConnectionParser *) user_data;
+	int new_state = -1;
+	if (p->skip_depth) {
+		p->skip_depth ++;
+		return;
+	}
+	p->text_len = 0;
+	switch (p->state) {
+	case XML_STATE_INIT:
+		if (!strcmp(element_name, "connectionset"))
+			new_state = XML_STATE_CONNECTION_SET;
+		else
+			g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_UNKNOWN_ELEMENT, "can't find root node: connectionset");
+		break;
+	case XML_STATE_CONNECTION_SET:
+	case XML_STATE_FOLDER:
+		if (!strcmp(element_name, "folder")) {
+			new_state = XML_STATE_FOLDER;
+			/* deeper levels are flattened into the last allowed one */
+			if (p->folder_depth < CONN_FOLDER_MAX_DEPTH) {
+				p->folder_len[p->folder_depth] = p->folder->len;
+				for (i = 0; attribute_names[i]; i++) {
+					if (!strcmp(attribute_names[i], "name")) {
+						if (p->folder->len)
+							g_string_append_c(p->folder, '/');
+						g_string_append(p->folder, attribute_values[i]);
+					}
+				}
+			}
+			p->folder_depth ++;
+		} else if (!strcmp(element_name, "connection")) {
+			new_state = XML_STATE_CONNECTION;
+			connection_init(&p->conn);
+			p->conn.folder = conn_folder_normalize(p->folder->str);
+			for (i = 0; attribute_names[i]; i++) {
+				if (!strcmp(attribute_names[i], "name"))
+					conn_set(p->conn.name, attribute_values[i]);
+				else if (!strcmp(attribute_names[i], "host"))
+					conn_set(p->conn.host, attribute_values[i]);
+				else if (!strcmp(attribute_names[i], "port"))
+					p->conn.port = atoi(attribute_values[i]);
+				else if (!strcmp(attribute_names[i], "flags"))
+					p->conn.flags = atoi(attribute_values[i]);
+			}
 		}
-		if ((child = xml_node_get_child(node_auth, "identityFile")))
-			strcpy(pConn->identityFile, NVL(xml_node_get_value(child), ""));
-	}
-	if ((child = xml_node_get_child(node, "options"))) {
-		XMLNode *propNode = child->children;
-		while (propNode) {
-			strcpy(propertyName, xml_node_get_attribute(propNode, "name"));
-			strcpy(propertyValue, NVL(xml_node_get_value(propNode), "0"));
-			//log_debug ("%s = %s\n", propertyName, propertyValue);
-			if (!strcmp(propertyName, "x11Forwarding"))
-				pConn->sshOptions.x11Forwarding = atoi(propertyValue);
-			else if (!strcmp(propertyName, "agentForwarding"))
-				pConn->sshOptions.agentForwarding = atoi(propertyValue);
-			else if (!strcmp(propertyName, "disableStrictKeyChecking"))
-				pConn->sshOptions.disableStrictKeyChecking = atoi(propertyValue);
-			else if (!strcmp(propertyName, "keepAliveInterval")) {
-				pConn->sshOptions.flagKeepAlive = atoi(NVL(xml_node_get_attribute(propNode, "enabled"), "0"));
-				pConn->sshOptions.keepAliveInterval = atoi(propertyValue);
-			} else if (!strcmp(propertyName, "connectTimeout")) {
-				pConn->sshOptions.flagConnectTimeout = atoi(NVL(xml_node_get_attribute(propNode, "enabled"), "0"));
-				pConn->sshOptions.connectTimeout = atoi(propertyValue);
+		break;
+	case XML_STATE_CONNECTION:
+		if (!strcmp(element_name, "authentication"))
+			new_state = XML_STATE_AUTHENTICATION;
+		else if (!strcmp(element_name, "last_user"))
+			new_state = XML_STATE_LAST_USER;
+		else if (!strcmp(element_name, "user_options"))
+			new_state = XML_STATE_USER_OPTIONS;
+		else if (!strcmp(element_name, "options"))
+			new_state = XML_STATE_OPTIONS;
+		break;
+	case XML_STATE_AUTHENTICATION:
+		if (!strcmp(element_name, "mode"))
+			new_state = XML_STATE_AUTH_MODE;
+		else if (!strcmp(element_name, "auth_user"))
+			new_state = XML_STATE_AUTH_USER;
+		else if (!strcmp(element_name, "auth_password"))
+			new_state = XML_STATE_AUTH_PASSWORD;
+		else if (!strcmp(element_name, "identityFile"))
+			new_state = XML_STATE_AUTH_IDENTITY;
+		break;
+	case XML_STATE_OPTIONS:
+		if (!strcmp(element_name, "property")) {
+			new_state = XML_STATE_PROPERTY;
+			p->prop_name[0] = 0;
+			p->prop_enabled = 0;
+			for (i = 0; attribute_names[i]; i++) {
+				if (!strcmp(attribute_names[i], "name"))
+					CONN_SET_FIELD(p->prop_name, attribute_values[i]);
+				else if (!strcmp(attribute_names[i], "enabled"))
+					p->prop_enabled = atoi(attribute_values[i]);
 			}
-			propNode = propNode->next;
 		}
+		break;
 	}
+	if (new_state < 0)
+		p->skip_depth = 1;
+	else
+		p->state = new_state;
 }
 
-static int get_xml_doc(char *filename, XML *xmldoc)
+static void conn_parser_set_property(struct ConnectionParser *p, const char *value)
 {
-	char line[2048];
-	char *xml;
-	FILE *fp;
-	fp = fopen(filename, "r");
-	if (fp == NULL)
-		return (1);
-	xml = (char *) malloc(2048);
-	strcpy(xml, "");
-	while (fgets(line, 1024, fp) != 0) {
-		if (strlen(xml) + strlen(line) > sizeof(xml))
-			xml = (char *) realloc(xml, strlen(xml) + strlen(line) + 1);
-		strcat(xml, line);
-	}
-	fclose(fp);
-	/* Parse xml and create the connections tree */
-	xml_parse(xml, xmldoc);
-	if (xmldoc->error.code) {
-		log_write("%s\n", xmldoc->error.message);
-		return 1;
+	SSH_Options *opt = &p->conn.sshOptions;
+	int v = atoi(value[0] ? value : "0");
+	if (!strcmp(p->prop_name, "x11Forwarding"))
+		opt->x11Forwarding = v;
+	else if (!strcmp(p->prop_name, "agentForwarding"))
+		opt->agentForwarding = v;
+	else if (!strcmp(p->prop_name, "disableStrictKeyChecking"))
+		opt->disableStrictKeyChecking = v;
+	else if (!strcmp(p->prop_name, "keepAliveInterval")) {
+		opt->flagKeepAlive = p->prop_enabled;
+		opt->keepAliveInterval = v;
+	} else if (!strcmp(p->prop_name, "connectTimeout")) {
+		opt->flagConnectTimeout = p->prop_enabled;
+		opt->connectTimeout = v;
 	}
-	return 0;
 }
 
-/* loads connections into a list */
-static GList * load_connection_list_from_file_xml(char *filename)
+static void conn_parser_end_element(GMarkupParseContext *context, const gchar *element_name, gpointer user_data, GError **error)
 {
+	struct ConnectionParser *p = (struct ConnectionParser *) user_data;
+	Connection *c = &p->conn;
+	char password[64];
+	if (p->skip_depth) {
+		p->skip_depth --;
+		return;
+	}
+	p->text[p->text_len] = 0;
+	switch (p->state) {
+	case XML_STATE_CONNECTION_SET:
+		p->state = XML_STATE_INIT;
+		break;
+	case XML_STATE_FOLDER:
+		p->folder_depth --;
+		if (p->folder_depth < CONN_FOLDER_MAX_DEPTH)
+			g_string_truncate(p->folder, p->folder_len[p->folder_depth]);
+		p->state = p->folder_depth ? XML_STATE_FOLDER : XML_STATE_CONNECTION_SET;
+		break;
+	case XML_STATE_CONNECTION:
+		cl_insert_sorted(p->p_cl, c);
+		conn_secrets_release(c);
+		p->state = p->folder_depth ? XML_STATE_FOLDER : XML_STATE_CONNECTION_SET;
+		break;
+	case XML_STATE_AUTHENTICATION:
+	case XML_STATE_OPTIONS:
+		p->state = XML_STATE_CONNECTION;
+		break;
+	case XML_STATE_LAST_USER:
+		conn_set(c->last_user, p->text);
+		p->state = XML_STATE_CONNECTION;
+		break;
+	case XML_STATE_USER_OPTIONS:
+		conn_set(c->user_options, p->text);
+		p->state = XML_STATE_CONNECTION;
+		break;
+	case XML_STATE_AUTH_MODE:
+		c->auth_mode = atoi(p->text);
+		p->state = XML_STATE_AUTHENTICATION;
+		break;
+	case XML_STATE_AUTH_USER:
+		conn_set(c->auth_user, p->text);
+		p->state = XML_STATE_AUTHENTICATION;
+		break;
+	case XML_STATE_AUTH_PASSWORD:
+		conn_set(c->auth_password_encrypted, p->text);
+		conn_set_secret(c->auth_password, password_decode(c->auth_password_encrypted, password, sizeof(password)));
+		p->state = XML_STATE_AUTHENTICATION;
+		break;
+	case XML_STATE_AUTH_IDENTITY:
+		conn_set(c->identityFile, p->text);
+		p->state = XML_STATE_AUTHENTICATION;
+		break;
+	case XML_STATE_PROPERTY:
+		conn_parser_set_property(p, p->text);
+		p->state = XML_STATE_OPTIONS;
+		break;
+	}
+	p->text_len = 0;
+}
+
+static void conn_parser_text(GMarkupParseContext *context, const gchar *text, gsize text_len, gpointer user_data, GError **error)
+{
+	struct ConnectionParser *p = (struct ConnectionParser *) user_data;
+	int n;
+	if (p->skip_depth)
+		return;
+	/* only leaf elements carry a value */
+	switch (p->state) {
+	case XML_STATE_LAST_USER:
+	case XML_STATE_USER_OPTIONS:
+	case XML_STATE_AUTH_MODE:
+	case XML_STATE_AUTH_USER:
+	case XML_STATE_AUTH_PASSWORD:
+	case XML_STATE_AUTH_IDENTITY:
+	case XML_STATE_PROPERTY:
+		n = MIN(text_len, sizeof(p->text) - 1 - p->text_len);
+		memcpy(p->text + p->text_len, text, n);
+		p->text_len += n;
+		break;
+	}
+}
+
+static const GMarkupParser conn_parser = {
+	conn_parser_start_element,
+	conn_parser_end_element,
+	conn_parser_text,
+	NULL,
+	NULL
+};
+
+/*
+ * loads connections into a list, in a single pass without building a tree;
+ * st, if not NULL, receives the stat of the file actually parsed
+ */
+int load_connection_list_from_file_xml(const char *filename, ConnectionList *p_cl, struct stat *st)
+{
+	GMarkupParseContext *context;
+	GError *error = NULL;
+	struct ConnectionParser *parser;
+	CfgBuffer buf;
 	int rc = 0;
-	Connection *pConn;
-	XMLNode *node;
-	GList *list = NULL;
-	XML xmldoc;
-	rc = get_xml_doc(filename, &xmldoc);
-	if (rc != 0)
-		return (NULL);
-	if (xmldoc.cur_root) {
-		if (xmldoc.cur_root && strcmp(xmldoc.cur_root->name, "connectionset")) {
-			log_write("[%s] can't find root node: connectionset\n", __func__);
-			return NULL;
+	if (cfg_buffer_open(&buf, filename))
+		return (1);
+	parser = g_new0(struct ConnectionParser, 1);
+	parser->p_cl = p_cl;
+	parser->state = XML_STATE_INIT;
+	parser->folder = g_string_new("");
+	context = g_markup_parse_context_new(&conn_parser, G_MARKUP_TREAT_CDATA_AS_TEXT, parser, NULL);
+	if (!g_markup_parse_context_parse(context, buf.data, buf.len, &error)
+	    || !g_markup_parse_context_end_parse(context, &error)) {
+		log_write("[%s] %s: %s\n", __func__, filename, error->message);
+		g_error_free(error);
+		rc = 1;
+	}
+	if (st)
+		*st = buf.st;
+	g_markup_parse_context_free(context);
+	g_string_free(parser->folder, TRUE);
+	g_free(parser);
+	cfg_buffer_close(&buf);
+	return (rc);
+}
+
+/*
+ * Connections can also come from fragment files in connections.d, so that
+ * other tools can regenerate their part of the inventory without touching
+ * connections.xml. Fragments have the same format, are parsed in parallel
+ * and are read-only: their connections are tagged with the file name, are
+ * never written to connections.xml or the journal, and one edited in the
+ * manager becomes a connections.xml entry hiding the fragment one.
+ */
+
+struct Shard {
+	gchar *path;
+	const char *name;     /* interned file name */
+	ConnectionList *p_cl;
+	int rc;
+};
+
+static void parse_shard(gpointer data, gpointer user_data)
+{
+	struct Shard *shard = data;
+	shard->rc = load_connection_list_from_file_xml(shard->path, shard->p_cl, NULL);
+}
+
+static void tag_shard_cb(gpointer data, gpointer user_data)
+{
+	((Connection *) data)->shard = user_data;
+}
+
+static void merge_shard_cb(gpointer data, gpointer user_data)
+{
+	Connection *p_conn = data;
+	gpointer *args = user_data;
+	ConnectionList *p_cl = args[0];
+	Connection *p_old = cl_get_by_name(p_cl, p_conn->name);
+	if (p_old) {
+		log_write("%s: duplicate connection %s ignored, already in %s\n", p_conn->shard, p_conn->name,
+		          p_old->shard[0] ? p_old->shard : "connections.xml");
+		(*(int *) args[1]) ++;
+		return;
+	}
+	cl_insert_sorted(p_cl, p_conn);
+}
+
+static gint shardcmp(gconstpointer a, gconstpointer b)
+{
+	return strcmp(*(const char **) a, *(const char **) b);
+}
+
+/**
+ * load_connection_shards() - adds the connections of dir/\*.xml to a list
+ * Files are parsed on a thread pool and merged in name order: on duplicate
+ * names the entry already in the list, or in the first file, wins.
+ * @return 0 if ok, 1 if some file can't be read
+ */
+int load_connection_shards(const char *dir, ConnectionList *p_cl)
+{
+	GDir *d;
+	const char *fname;
+	GPtrArray *names;
+	GThreadPool *pool;
+	struct Shard *shards;
+	gpointer args[2];
+	int i, n, n_dup = 0, rc = 0;
+	if ((d = g_dir_open(dir, 0, NULL)) == NULL)
+		return 0;   /* optional */
+	names = g_ptr_array_new_with_free_func(g_free);
+	while ((fname = g_dir_read_name(d)) != NULL)
+		if (fname[0] != '.' && g_str_has_suffix(fname, ".xml"))
+			g_ptr_array_add(names, g_strdup(fname));
+	g_dir_close(d);
+	n = names->len;
+	if (n == 0) {
+		g_ptr_array_free(names, TRUE);
+		return 0;
+	}
+	g_ptr_array_sort(names, shardcmp);
+	shards = g_new0(struct Shard, n);
+	pool = g_thread_pool_new(parse_shard, NULL, MIN(n, (int) g_get_num_processors()), FALSE, NULL);
+	for (i = 0; i < n; i++) {
+		shards[i].name = conn_intern(g_ptr_array_index(names, i));
+		shards[i].path = g_build_filename(dir, shards[i].name, NULL);
+		shards[i].p_cl = cl_new();
+		g_thread_pool_push(pool, &shards[i], NULL);
+	}
+	g_thread_pool_free(pool, FALSE, TRUE);
+	args[0] = p_cl;
+	args[1] = &n_dup;
+	for (i = 0; i < n; i++) {
+		if (shards[i].rc) {
+			log_write("[%s] can't load %s\n", __func__, shards[i].path);
+			rc = 1;
+		} else {
+			/* the list is still private to this function */
+			cl_foreach(shards[i].p_cl, tag_shard_cb, (gpointer) shards[i].name);
+			cl_foreach(shards[i].p_cl, merge_shard_cb, args);
 		}
-		node = xmldoc.cur_root->children;
-		while (node) {
-			//log_debug ("%s\n", node->name);
-			if (!strcmp(node->name, "connection")) {
-				pConn = (Connection *) malloc(sizeof(Connection));
-				read_connection_node(node, pConn);
-				list = g_list_append(list, pConn);
-				//log_debug ("%s@%s\n", pConn->user, pConn->host);
-			}
-			node = node->next;
+		cl_release(shards[i].p_cl);
+		g_free(shards[i].path);
+	}
+	log_write("%d files read from %s, %d duplicates\n", n, dir, n_dup);
+	g_free(shards);
+	g_ptr_array_free(names, TRUE);
+	return rc;
+}
+
+/* loads cache or xml file into an empty list (that may be replaced), on any thread */
+static int load_connection_list(ConnectionList **pp_cl)
+{
+	ConnectionList *p_cl = *pp_cl;
+	struct stat st;
+	int rc = 0;
+	if (conn_cache_load(p_cl, globals.connections_cache, globals.connections_xml) != 0) {
+		/* drop what a corrupted cache may have added */
+		cl_release(p_cl);
+		p_cl = *pp_cl = cl_new();
+		if (!g_file_test(globals.connections_xml, G_FILE_TEST_EXISTS)) {
+			log_write("%s not found\n", globals.connections_xml);
+		} else if (load_connection_list_from_file_xml(globals.connections_xml, p_cl, &st)) {
+			/* a partial list must not be saved over the file */
+			cl_release(p_cl);
+			p_cl = *pp_cl = cl_new();
+			rc = 1;
+		} else {
+			conn_cache_update(p_cl, globals.connections_cache, &st);
 		}
-		xml_free(&xmldoc);
 	}
-	return (list);
+	load_connection_shards(globals.connections_dir, p_cl);
+	return rc;
 }
-/* load_connections() - loads user connection tree */
+
+/*
+ * Applies the changes pending in the journal to the loaded list and opens
+ * it for the next ones, on the main thread. Not when connections.xml
+ * couldn't be read: compacting would overwrite it with the changes alone.
+ */
+static void load_connections_finish(ConnectionList *p_cl, int rc)
+{
+	if (rc) {
+		log_write("[%s] can't read %s, changes won't be saved\n", __func__, globals.connections_xml);
+		return;
+	}
+	conn_file_read = TRUE;
+	conn_journal_open(globals.connections_journal, globals.connections_xml, globals.connections_cache);
+	if (conn_journal_replay(p_cl, globals.connections_journal) > 0)
+		conn_journal_compact(p_cl);
+}
+
+/**
+ * load_connections() - loads user connection tree
+ * Uses the binary cache when it matches connections.xml, otherwise parses
+ * the xml file and rebuilds the cache in background. Connections from
+ * connections.d and changes found in the journal are then applied, the
+ * latter compacted.
+ */
 int load_connections()
 {
-	conn_list = load_connection_list_from_file_xml(globals.connections_xml);
-	return conn_list ? 0 : -1;
+	int rc;
+	cl_release(conn_list);
+	conn_list = cl_new();
+	rc = load_connection_list(&conn_list);
+	load_connections_finish(conn_list, rc);
+	return rc;
+}
+
+/*
+ * Background loading: the list is built by a worker thread and replaces
+ * conn_list on the main thread when complete. Until then conn_list is an
+ * empty list and actions needing the connections are queued.
+ */
+
+typedef struct _PendingAction {
+	void (*func)(gpointer);
+	gpointer data;
+} PendingAction;
+
+static struct {
+	GThread *thread;
+	ConnectionList *p_cl;     /* loaded list not yet installed */
+	int rc;                   /* of load_connection_list() */
+	gboolean ready;
+	GSList *pending;          /* PendingAction *, most recent first */
+} loader = { NULL, NULL, 0, TRUE, NULL };
+
+static gpointer load_connections_thread(gpointer data);
+
+static void set_busy_cursor(gboolean busy)
+{
+	GdkWindow *window = main_window ? gtk_widget_get_window(main_window) : NULL;
+	GdkCursor *cursor;
+	if (!window)
+		return;
+	if (busy) {
+		cursor = gdk_cursor_new_from_name(gdk_window_get_display(window), "progress");
+		gdk_window_set_cursor(window, cursor);
+		g_object_unref(cursor);
+	} else
+		gdk_window_set_cursor(window, NULL);
+}
+
+/* joins the loader and makes its list the current one */
+static void install_loaded_list()
+{
+	if (loader.thread == NULL)
+		return;
+	g_thread_join(loader.thread);
+	loader.thread = NULL;
+	cl_release(conn_list);
+	conn_list = loader.p_cl;
+	loader.p_cl = NULL;
+	load_connections_finish(conn_list, loader.rc);
+	loader.ready = TRUE;
+	log_write("%d connections loaded\n", cl_count(conn_list));
+}
+
+static gboolean load_connections_done(gpointer data)
+{
+	GSList *l;
+	install_loaded_list();
+	set_busy_cursor(FALSE);
+	if (loader.rc)
+		msgbox_error("Can't read %s.\nChanges to the connections won't be saved until it's fixed and lterm restarted.",
+		             globals.connections_xml);
+	conn_watch_start(globals.connections_xml, globals.connections_cache, globals.connections_dir);
+	/* run queued actions in order */
+	loader.pending = g_slist_reverse(loader.pending);
+	for (l = loader.pending; l; l = l->next) {
+		PendingAction *action = l->data;
+		action->func(action->data);
+	}
+	g_slist_free_full(loader.pending, g_free);
+	loader.pending = NULL;
+	return G_SOURCE_REMOVE;
+}
+
+static gpointer load_connections_thread(gpointer data)
+{
+	ConnectionList *p_cl = cl_new();
+	gint64 t0 = g_get_monotonic_time();
+	loader.rc = load_connection_list(&p_cl);
+	log_debug("connections loaded in %" G_GINT64_FORMAT " us\n", g_get_monotonic_time() - t0);
+	loader.p_cl = p_cl;
+	g_idle_add(load_connections_done, NULL);
+	return NULL;
+}
+
+/**
+ * load_connections_async() - starts loading the connections in a worker thread
+ * conn_list stays empty until the main loop installs the loaded list.
+ */
+void load_connections_async()
+{
+	if (conn_list == NULL)
+		conn_list = cl_new();
+	loader.ready = FALSE;
+	loader.thread = g_thread_new("conn-loader", load_connections_thread, NULL);
+}
+
+/* load_connections_wait() - waits for a background load, used at exit */
+void load_connections_wait()
+{
+	install_loaded_list();
+}
+
+int connections_ready()
+{
+	return loader.ready;
+}
+
+/**
+ * connections_when_ready() - runs func now, or once the connections are loaded
+ */
+void connections_when_ready(void (*func)(gpointer), gpointer data)
+{
+	PendingAction *action;
+	if (loader.ready) {
+		func(data);
+		return;
+	}
+	log_write("Connections still loading, action queued\n");
+	action = g_new0(PendingAction, 1);
+	action->func = func;
+	action->data = data;
+	loader.pending = g_slist_prepend(loader.pending, action);
+	set_busy_cursor(TRUE);
 }
 
 /* ---[ Graphic User Interface section ]--- */
@@ -340,19 +827,21 @@ static int validate_name(Connection *p_conn, char *item_name)
 	return 0;
 }
 
-/* add_update_connection() - add or update connections */
-static int add_update_connection(Connection *p_conn)
+/* add_update_connection() - add or update connections, new ones start in folder */
+static int add_update_connection(Connection *p_conn, const char *folder)
 {
 	GtkBuilder *builder;
 	GError *error = NULL;
 	GtkWidget *notebook;
 	char title[64];
 	char connection_name[1024];
+	char host[1024];
 	int err_name_validation;
 	GtkWidget *dialog;
-	GtkWidget *name_entry, *host_entry, *user_options_entry;
+	GtkWidget *name_entry, *host_entry, *folder_entry, *user_options_entry;
 	gint result;
 	Connection conn_new;
+	const char *auth_password = NULL;
 	char ui[600];
 	int rc;
 	log_debug("Loading gui\n");
@@ -380,6 +869,8 @@ static int add_update_connection(Connection *p_conn)
 	if (p_conn)
 		gtk_entry_set_text(GTK_ENTRY(host_entry), p_conn->host);
 	port_spin_button = GTK_WIDGET(gtk_builder_get_object(builder, "spin_port"));
+	folder_entry = GTK_WIDGET(gtk_builder_get_object(builder, "entry_folder"));
+	gtk_entry_set_text(GTK_ENTRY(folder_entry), p_conn ? p_conn->folder : NVL(folder, ""));
 	// X11 Forwarding
 	check_x11 = GTK_WIDGET(gtk_builder_get_object(builder, "check_x11forwarding"));
 	if (p_conn)
@@ -459,7 +950,7 @@ static int add_update_connection(Connection *p_conn)
 			strcpy(connection_name, gtk_entry_get_text(GTK_ENTRY(name_entry)));
 			trim(connection_name);
 			/* initialize a new connection structure */
-			memset(&conn_new, 0x00, sizeof(Connection));
+			connection_init(&conn_new);
 			/*
 			 * if we are updating an existing connection, make a copy before updating
 			 * to keep some values
@@ -467,11 +958,13 @@ static int add_update_connection(Connection *p_conn)
 			if (p_conn)
 				connection_copy(&conn_new, p_conn);
 			/* update values */
-			strcpy(conn_new.name, connection_name);
-			strcpy(conn_new.host, gtk_entry_get_text(GTK_ENTRY(host_entry)));
-			trim(conn_new.host);
+			conn_set(conn_new.name, connection_name);
+			g_strlcpy(host, gtk_entry_get_text(GTK_ENTRY(host_entry)), sizeof(host));
+			trim(host);
+			conn_set(conn_new.host, host);
 			conn_new.port = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(port_spin_button));
-			strcpy(conn_new.user_options, gtk_entry_get_text(GTK_ENTRY(user_options_entry)));
+			conn_new.folder = conn_folder_normalize(gtk_entry_get_text(GTK_ENTRY(folder_entry)));
+			conn_set(conn_new.user_options, gtk_entry_get_text(GTK_ENTRY(user_options_entry)));
 			conn_new.sshOptions.x11Forwarding = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(check_x11)) ? 1 : 0;
 			conn_new.sshOptions.agentForwarding = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(check_agentForwarding)) ? 1 : 0;
 			conn_new.sshOptions.disableStrictKeyChecking = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(check_disable_key_checking)) ? 1 : 0;
@@ -485,19 +978,25 @@ static int add_update_connection(Connection *p_conn)
 				conn_new.auth_mode = CONN_AUTH_MODE_SAVE;
 			else if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(authWidgets.radio_auth_key)))
 				conn_new.auth_mode = CONN_AUTH_MODE_KEY;
-			strcpy(conn_new.auth_user, gtk_entry_get_text(GTK_ENTRY(authWidgets.user_entry)));
-			strcpy(conn_new.auth_password, gtk_entry_get_text(GTK_ENTRY(authWidgets.password_entry)));
+			conn_set(conn_new.auth_user, gtk_entry_get_text(GTK_ENTRY(authWidgets.user_entry)));
+			/* held until the dialog closes, the list takes its own reference */
+			conn_secret_unref(auth_password);
+			auth_password = conn_secret_ref(conn_secret(gtk_entry_get_text(GTK_ENTRY(authWidgets.password_entry))));
+			conn_new.auth_password = auth_password;
 			if (conn_new.auth_password[0] != 0)
-				strcpy(conn_new.auth_password_encrypted, password_encode(conn_new.auth_password));
+				conn_set(conn_new.auth_password_encrypted, password_encode((char *) conn_new.auth_password));
 			// Private key
-			strcpy(conn_new.identityFile, gtk_entry_get_text(GTK_ENTRY(authWidgets.entry_private_key)));
+			conn_set(conn_new.identityFile, gtk_entry_get_text(GTK_ENTRY(authWidgets.entry_private_key)));
 			if (p_conn) { /* edit */
 				log_debug("Edit\n");
 				log_debug("Validating %s ...\n", connection_name);
 				err_name_validation = validate_name(p_conn, connection_name);
 				if (!err_name_validation) {
 					log_debug("Name validated\n");
-					connection_copy(p_conn, &conn_new);
+					/* from now on it's saved in connections.xml, hiding the connections.d entry */
+					conn_new.shard = "";
+					conn_journal_put(p_conn->name, &conn_new);
+					cl_update(conn_list, p_conn, &conn_new);
 					rc = 0;
 					break;
 				} else
@@ -506,8 +1005,8 @@ static int add_update_connection(Connection *p_conn)
 				log_debug("add one connection %s %s %d\n", conn_new.name, conn_new.host, conn_new.port);
 				err_name_validation = validate_name(&conn_new, connection_name);
 				if (!err_name_validation) {
-					cl_insert_sorted(&conn_list, &conn_new);
-					save_connections(conn_list, globals.connections_xml);
+					cl_insert_sorted(conn_list, &conn_new);
+					conn_journal_put("", &conn_new);
 					rc = 0;
 					break;
 				} else
@@ -519,30 +1018,126 @@ static int add_update_connection(Connection *p_conn)
 			break;
 		}
 	}
+	conn_secret_unref(auth_password);
 	gtk_widget_destroy(dialog);
 	g_object_unref(G_OBJECT(builder));
 	return rc;
 }
 
-static void create_connections_tree_view(GtkTreeView *tree_view)
+static GtkTreeViewColumn *add_fixed_column(GtkTreeView *tree_view, const char *title, int model_column, int width)
 {
 	GtkCellRenderer *cell;
 	GtkTreeViewColumn *column;
-	GtkListStore *ls;
-	ls = gtk_list_store_new(N_COLUMNS, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_INT);
-	gtk_tree_view_set_model(tree_view, GTK_TREE_MODEL(ls));
-	/* Name */
 	cell = gtk_cell_renderer_text_new();
-	column = gtk_tree_view_column_new_with_attributes("Name", cell, "text", NAME_COLUMN, NULL);
-	gtk_tree_view_append_column(tree_view, GTK_TREE_VIEW_COLUMN(column));
-	/* Address */
+	column = gtk_tree_view_column_new_with_attributes(title, cell, "text", model_column, NULL);
+	gtk_tree_view_column_set_sizing(column, GTK_TREE_VIEW_COLUMN_FIXED);
+	gtk_tree_view_column_set_fixed_width(column, width);
+	gtk_tree_view_column_set_resizable(column, TRUE);
+	gtk_tree_view_append_column(tree_view, column);
+	return column;
+}
+
+/* folders show the number of connections instead of host and port */
+static void host_cell_data_func(GtkTreeViewColumn *column, GtkCellRenderer *cell, GtkTreeModel *model, GtkTreeIter *iter, gpointer data)
+{
+	gboolean is_folder;
+	gint count;
+	gchar *host, *text;
+	gtk_tree_model_get(model, iter, CONN_MODEL_IS_FOLDER_COLUMN, &is_folder, CONN_MODEL_COUNT_COLUMN, &count, CONN_MODEL_HOST_COLUMN, &host, -1);
+	if (is_folder) {
+		text = g_strdup_printf(count == 1 ? "%d connection" : "%d connections", count);
+		g_object_set(cell, "text", text, "style", PANGO_STYLE_ITALIC, NULL);
+		g_free(text);
+	} else
+		g_object_set(cell, "text", host, "style", PANGO_STYLE_NORMAL, NULL);
+	g_free(host);
+}
+
+static void port_cell_data_func(GtkTreeViewColumn *column, GtkCellRenderer *cell, GtkTreeModel *model, GtkTreeIter *iter, gpointer data)
+{
+	gboolean is_folder;
+	gint port;
+	char text[16];
+	gtk_tree_model_get(model, iter, CONN_MODEL_IS_FOLDER_COLUMN, &is_folder, CONN_MODEL_PORT_COLUMN, &port, -1);
+	if (is_folder)
+		text[0] = 0;
+	else
+		sprintf(text, "%d", port);
+	g_object_set(cell, "text", text, NULL);
+}
+
+/* reachability, probed when the row is shown */
+static void probe_cell_data_func(GtkTreeViewColumn *column, GtkCellRenderer *cell, GtkTreeModel *model, GtkTreeIter *iter, gpointer data)
+{
+	gboolean is_folder;
+	gint port;
+	gchar *host;
+	const ProbeResult *res;
+	char text[32];
+	gtk_tree_model_get(model, iter, CONN_MODEL_IS_FOLDER_COLUMN, &is_folder, CONN_MODEL_HOST_COLUMN, &host, CONN_MODEL_PORT_COLUMN, &port, -1);
+	if (is_folder) {
+		g_object_set(cell, "text", "", NULL);
+	} else {
+		res = prober_lookup(host, port);
+		g_object_set(cell, "text", prober_state_desc(res, text, sizeof(text)),
+		             "foreground", res->state == PROBE_DOWN || res->state == PROBE_UNRESOLVED ? "red" : NULL, NULL);
+	}
+	g_free(host);
+}
+
+static void probe_result_cb(gpointer data)
+{
+	gtk_widget_queue_draw(GTK_WIDGET(data));
+}
+
+static void tree_view_destroy_cb(GtkWidget *widget, gpointer user_data)
+{
+	prober_unwatch(probe_result_cb, widget);
+}
+
+static void icon_cell_data_func(GtkTreeViewColumn *column, GtkCellRenderer *cell, GtkTreeModel *model, GtkTreeIter *iter, gpointer data)
+{
+	gboolean is_folder;
+	gtk_tree_model_get(model, iter, CONN_MODEL_IS_FOLDER_COLUMN, &is_folder, -1);
+	g_object_set(cell, "icon-name", is_folder ? "folder" : "network-server", NULL);
+}
+
+/*
+ * The folder tree is shown through a model reading the connection list
+ * directly: children are only read when a folder is expanded, and fixed
+ * height rows let the view skip measuring all of them.
+ */
+static void create_connections_tree_view(GtkTreeView *tree_view)
+{
+	GtkTreeModel *model;
+	GtkTreeViewColumn *column;
+	GtkCellRenderer *cell;
+	column = add_fixed_column(tree_view, "Name", CONN_MODEL_NAME_COLUMN, 200);
+	cell = gtk_cell_renderer_pixbuf_new();
+	gtk_tree_view_column_pack_start(column, cell, FALSE);
+	gtk_tree_view_column_reorder(column, cell, 0);
+	gtk_tree_view_column_set_cell_data_func(column, cell, icon_cell_data_func, NULL, NULL);
+	column = add_fixed_column(tree_view, "Host", CONN_MODEL_HOST_COLUMN, 160);
+	cell = gtk_cell_renderer_text_new();
+	gtk_tree_view_column_clear(column);
+	gtk_tree_view_column_pack_start(column, cell, TRUE);
+	gtk_tree_view_column_set_cell_data_func(column, cell, host_cell_data_func, NULL, NULL);
+	column = add_fixed_column(tree_view, "Port", CONN_MODEL_PORT_COLUMN, 60);
 	cell = gtk_cell_renderer_text_new();
-	column = gtk_tree_view_column_new_with_attributes("Host", cell, "text", HOST_COLUMN, NULL);
-	gtk_tree_view_append_column(tree_view, GTK_TREE_VIEW_COLUMN(column));
-	/* Port */
+	gtk_tree_view_column_clear(column);
+	gtk_tree_view_column_pack_start(column, cell, TRUE);
+	gtk_tree_view_column_set_cell_data_func(column, cell, port_cell_data_func, NULL, NULL);
+	column = add_fixed_column(tree_view, "Reachable", CONN_MODEL_HOST_COLUMN, 90);
 	cell = gtk_cell_renderer_text_new();
-	column = gtk_tree_view_column_new_with_attributes("Port", cell, "text", PORT_COLUMN, NULL);
-	gtk_tree_view_append_column(tree_view, GTK_TREE_VIEW_COLUMN(column));
+	gtk_tree_view_column_clear(column);
+	gtk_tree_view_column_pack_start(column, cell, TRUE);
+	gtk_tree_view_column_set_cell_data_func(column, cell, probe_cell_data_func, NULL, NULL);
+	prober_watch(probe_result_cb, tree_view);
+	g_signal_connect(tree_view, "destroy", G_CALLBACK(tree_view_destroy_cb), NULL);
+	gtk_tree_view_set_fixed_height_mode(tree_view, TRUE);
+	model = conn_list_model_new(conn_list);
+	g_object_set_data_full(G_OBJECT(tree_view), "conn_model", model, g_object_unref);
+	gtk_tree_view_set_model(tree_view, model);
 }
 
 static void treeview_add_one_conn(gpointer data, gpointer userdata)
@@ -551,13 +1146,45 @@ static void treeview_add_one_conn(gpointer data, gpointer userdata)
 	Connection *c = (Connection *)data;
 	GtkTreeIter iter;
 	gtk_list_store_append(ls, &iter);
-	gtk_list_store_set(ls, &iter, NAME_COLUMN, c->name, HOST_COLUMN, c->host, PORT_COLUMN, c->port, -1);
+	gtk_list_store_set(ls, &iter, CONN_MODEL_NAME_COLUMN, c->name, CONN_MODEL_HOST_COLUMN, c->host, CONN_MODEL_PORT_COLUMN, c->port,
+	                   CONN_MODEL_IS_FOLDER_COLUMN, FALSE, CONN_MODEL_COUNT_COLUMN, 0, CONN_MODEL_FOLDER_COLUMN, c->folder, -1);
 }
+
+/*
+ * update_connections_tree_view() - shows the connections matching the search entry
+ * Without a search the view shows the list model, which already follows
+ * every change, so there's nothing to rebuild.
+ */
 static void update_connections_tree_view(GtkTreeView *tv)
 {
-	GtkListStore *ls = GTK_LIST_STORE(gtk_tree_view_get_model(tv));
-	gtk_list_store_clear(ls);
-	g_list_foreach(conn_list, treeview_add_one_conn, ls);
+	GtkTreeModel *model = g_object_get_data(G_OBJECT(tv), "conn_model");
+	GtkWidget *search_entry = g_object_get_data(G_OBJECT(tv), "search_entry");
+	const char *query = search_entry ? gtk_entry_get_text(GTK_ENTRY(search_entry)) : "";
+	GtkListStore *ls;
+	GtkTreeIter iter;
+	GPtrArray *found;
+	gint64 t0;
+	if (query[0] == 0) {
+		if (gtk_tree_view_get_model(tv) != model)
+			gtk_tree_view_set_model(tv, model);
+		return;
+	}
+	t0 = g_get_monotonic_time();
+	found = cl_search(conn_list, query, CONN_SEARCH_MAX_RESULTS);
+	log_debug("search '%s': %d results in %" G_GINT64_FORMAT " us\n", query, found->len, g_get_monotonic_time() - t0);
+	ls = gtk_list_store_new(CONN_MODEL_N_COLUMNS, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_INT, G_TYPE_BOOLEAN, G_TYPE_INT, G_TYPE_STRING);
+	g_ptr_array_foreach(found, treeview_add_one_conn, ls);
+	g_ptr_array_free(found, TRUE);
+	gtk_tree_view_set_model(tv, GTK_TREE_MODEL(ls));
+	g_object_unref(ls);
+	/* select the best match, so that Enter connects to it */
+	if (gtk_tree_model_get_iter_first(GTK_TREE_MODEL(ls), &iter))
+		gtk_tree_selection_select_iter(gtk_tree_view_get_selection(tv), &iter);
+}
+
+static void search_changed_cb(GtkSearchEntry *entry, gpointer user_data)
+{
+	update_connections_tree_view(GTK_TREE_VIEW(user_data));
 }
 
 static gboolean conn_key_press_cb(GtkWidget *widget, GdkEventKey *event, gpointer user_data)
@@ -575,35 +1202,68 @@ static gboolean conn_key_press_cb(GtkWidget *widget, GdkEventKey *event, gpointe
 	return FALSE;
 }
 
-/* when a row has been double-clicked in the dialog */
+/* when a row has been double-clicked in the dialog: folders are expanded, connections opened */
 static void row_activated_cb(GtkTreeView *tree_view, GtkTreePath *path, GtkTreeViewColumn *column, gpointer user_data)
 {
-	gtk_dialog_response(GTK_DIALOG(user_data), GTK_RESPONSE_OK);
+	GtkTreeModel *model = gtk_tree_view_get_model(tree_view);
+	GtkTreeIter iter;
+	gboolean is_folder = FALSE;
+	if (gtk_tree_model_get_iter(model, &iter, path))
+		gtk_tree_model_get(model, &iter, CONN_MODEL_IS_FOLDER_COLUMN, &is_folder, -1);
+	if (!is_folder)
+		gtk_dialog_response(GTK_DIALOG(user_data), GTK_RESPONSE_OK);
+	else if (gtk_tree_view_row_expanded(tree_view, path))
+		gtk_tree_view_collapse_row(tree_view, path);
+	else
+		gtk_tree_view_expand_row(tree_view, path, FALSE);
 }
 
+/* get_selected_connection() - selected connection, NULL if nothing or a folder is selected */
 static Connection *get_selected_connection(GtkTreeView *tree_view)
 {
 	GtkTreeIter iter;
 	gchar *sel_name;
+	gboolean is_folder;
 	GtkTreeSelection *selection;
 	GtkTreeModel *model;
 	Connection *p_conn_selected = NULL;
 	model = gtk_tree_view_get_model(tree_view);
 	selection = gtk_tree_view_get_selection(tree_view);
 	if (gtk_tree_selection_get_selected(selection, NULL, &iter)) {
-		gtk_tree_model_get(model, &iter, NAME_COLUMN, &sel_name, -1);
-		p_conn_selected = cl_get_by_name(conn_list, sel_name);
+		gtk_tree_model_get(model, &iter, CONN_MODEL_NAME_COLUMN, &sel_name, CONN_MODEL_IS_FOLDER_COLUMN, &is_folder, -1);
+		if (!is_folder)
+			p_conn_selected = cl_get_by_name(conn_list, sel_name);
 		log_debug("selected %s\n", sel_name);
 		g_free(sel_name);
 	}
 	return p_conn_selected;
 }
 
+/*
+ * get_selected_folder() - folder of the selected row (the row itself for a folder)
+ * @return newly allocated path, NULL if nothing is selected
+ */
+static gchar *get_selected_folder(GtkTreeView *tree_view, gboolean *is_folder)
+{
+	GtkTreeIter iter;
+	gchar *folder = NULL;
+	gboolean dummy;
+	if (is_folder == NULL)
+		is_folder = &dummy;
+	*is_folder = FALSE;
+	if (gtk_tree_selection_get_selected(gtk_tree_view_get_selection(tree_view), NULL, &iter))
+		gtk_tree_model_get(gtk_tree_view_get_model(tree_view), &iter, CONN_MODEL_FOLDER_COLUMN, &folder,
+		                   CONN_MODEL_IS_FOLDER_COLUMN, is_folder, -1);
+	return folder;
+}
+
 static void add_button_clicked_cb(GtkButton *button, gpointer user_data)
 {
 	GtkTreeView *tree_view = user_data;
-	if (add_update_connection(NULL) == 0)
+	gchar *folder = get_selected_folder(tree_view, NULL);
+	if (add_update_connection(NULL, folder) == 0)
 		update_connections_tree_view(tree_view);
+	g_free(folder);
 }
 
 static void edit_button_clicked_cb(GtkButton *button, gpointer user_data)
@@ -613,7 +1273,7 @@ static void edit_button_clicked_cb(GtkButton *button, gpointer user_data)
 	c = get_selected_connection(tree_view);
 	if (c == NULL)
 		return;
-	if (add_update_connection(c) == 0)
+	if (add_update_connection(c, NULL) == 0)
 		update_connections_tree_view(tree_view);
 }
 
@@ -626,23 +1286,34 @@ static void delete_button_clicked_cb(GtkButton *button, gpointer user_data)
 	c = get_selected_connection(tree_view);
 	if (c == NULL)
 		return;
+	if (c->shard[0]) {
+		msgbox_error("Connection '%s' comes from %s/%s, remove it from that file.", c->name, globals.connections_dir, c->shard);
+		return;
+	}
 	sprintf(confirm_remove_message, "Remove connection '%s'?", c->name);
 	rc = msgbox_yes_no(confirm_remove_message);
 	if (rc == GTK_RESPONSE_YES) {
 		log_debug("delete one connection %s %s %d\n", c->name, c->host, c->port);
-		cl_remove(&conn_list, c->name);
+		conn_journal_delete(c->name);
+		cl_remove(conn_list, c->name);
 		update_connections_tree_view(tree_view);
-		save_connections(conn_list, globals.connections_xml);
 	}
 }
 
-int choose_manage_connection(Connection *p_conn)
+/**
+ * choose_manage_connection() - runs the connection manager
+ * @param[in,out] pp_conn receives a reference to the selected connection
+ * @return 0 if a connection has been selected, 1 otherwise
+ */
+int choose_manage_connection(Connection **pp_conn)
 {
 	GtkBuilder *builder;
 	GtkWidget *dialog;
 	GtkWidget *tv;
-	GtkWidget *add_button, *del_button, *edit_button;
+	GtkWidget *add_button, *del_button, *edit_button, *search_entry;
 	char ui[1024];
+	gchar *folder;
+	gboolean is_folder;
 	int rc = 1;
 	builder = gtk_builder_new();
 	sprintf(ui, "%s/connections.glade", globals.data_dir);
@@ -656,10 +1327,14 @@ int choose_manage_connection(Connection *p_conn)
 	add_button = GTK_WIDGET(gtk_builder_get_object(builder, "conn_add"));
 	del_button = GTK_WIDGET(gtk_builder_get_object(builder, "conn_del"));
 	edit_button = GTK_WIDGET(gtk_builder_get_object(builder, "conn_edit"));
+	search_entry = GTK_WIDGET(gtk_builder_get_object(builder, "conn_search"));
 	gtk_dialog_add_buttons(GTK_DIALOG(dialog), "Cancel", GTK_RESPONSE_CANCEL, "Connect", GTK_RESPONSE_OK, NULL);
 	gtk_window_set_transient_for(GTK_WINDOW(dialog), GTK_WINDOW(main_window));
 	create_connections_tree_view(GTK_TREE_VIEW(tv));
+	g_object_set_data(G_OBJECT(tv), "search_entry", search_entry);
 	update_connections_tree_view(GTK_TREE_VIEW(tv));
+	g_signal_connect(search_entry, "search-changed", G_CALLBACK(search_changed_cb), tv);
+	gtk_widget_grab_focus(search_entry);
 	g_signal_connect(dialog, "key-press-event", G_CALLBACK(conn_key_press_cb), NULL);
 	g_signal_connect(tv, "row-activated", G_CALLBACK(row_activated_cb), dialog);
 	g_signal_connect(G_OBJECT(add_button), "clicked", G_CALLBACK(add_button_clicked_cb), tv);
@@ -668,11 +1343,23 @@ int choose_manage_connection(Connection *p_conn)
 	while (1) {
 		if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_OK) {
 			Connection *c = get_selected_connection(GTK_TREE_VIEW(tv));
-			if (c == NULL)
-				continue;
-			connection_copy(p_conn, c);
+			if (c == NULL) {
+				/* a folder opens all of its connections */
+				folder = get_selected_folder(GTK_TREE_VIEW(tv), &is_folder);
+				if (!is_folder) {
+					g_free(folder);
+					continue;
+				}
+				gtk_widget_hide(dialog);
+				connection_log_on_folder(folder);
+				g_free(folder);
+				rc = 1;
+				break;
+			}
+			connection_unref(*pp_conn);
+			*pp_conn = connection_ref(c);
 			rc = 0;
-			log_debug("selected %s %s %d\n", p_conn->name, p_conn->host, p_conn->port);
+			log_debug("selected %s %s %d\n", c->name, c->host, c->port);
 			break;
 		} else {
 			rc = 1;
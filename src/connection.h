@@ -2,7 +2,10 @@
 #ifndef _CONNECTION_H
 #define _CONNECTION_H
 
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <gtk/gtk.h>
+#include "connsearch.h"
 
 #define XML_STATE_INIT 0
 #define XML_STATE_CONNECTION_SET 1
@@ -15,6 +18,10 @@
 #define XML_STATE_DIRECTORY 8
 #define XML_STATE_USER_OPTIONS 9
 #define XML_STATE_NOTE 10
+#define XML_STATE_OPTIONS 11
+#define XML_STATE_PROPERTY 12
+#define XML_STATE_AUTH_MODE 13
+#define XML_STATE_AUTH_IDENTITY 14
 
 #define CONN_AUTH_MODE_PROMPT 0
 #define CONN_AUTH_MODE_SAVE 1
@@ -30,39 +37,134 @@ typedef struct _SSH_Options {
 	int connectTimeout;
 } SSH_Options;
 
+/*
+ * String fields are interned (see conn_intern()) and never NULL, so a
+ * Connection can be copied field by field and shared between the list
+ * and the tabs. Shared instances are read-only: call
+ * connection_make_writable() before changing one.
+ * Passwords are not interned but secrets (see conn_secret()), referenced
+ * by the allocated connections holding them and wiped with the last one;
+ * copies on the stack only borrow them.
+ */
 typedef struct _Connection {
-	char name[256];
-	char host[256];
+	gint ref_count;
+	const char *name;
+	const char *host;
 	int port;
-	char last_user[32];
-	char user_options[256];
+	const char *last_user;
+	const char *user_options;
 	int auth_mode;
-	char auth_user[32];
-	char auth_password[32];
-	char auth_password_encrypted[64];
-	char user[32];
-	char password[32];
+	const char *auth_user;
+	const char *auth_password;
+	const char *auth_password_encrypted;
+	const char *user;
+	const char *password;
 	unsigned int flags;
-	char identityFile[1024];
+	const char *identityFile;
+	const char *folder;   /* "dc1/web", "" for top level */
+	const char *shard;    /* file in connections.d it comes from, "" for connections.xml */
 	SSH_Options sshOptions;
 } Connection;
 
-extern GList *conn_list;
+#define CONN_FOLDER_MAX_DEPTH 16
 
-int save_connections(GList *pList, char *filename);
+/*
+ * Folders only exist while they contain connections. Each one lists its
+ * subfolders and its own connections, both sorted by name; in the tree
+ * subfolders come first.
+ */
+typedef struct _ConnFolder {
+	const char *path;             /* interned, "" for the root */
+	const char *name;             /* last component of path */
+	struct _ConnFolder *parent;
+	GSequenceIter *iter;          /* position in parent->folders */
+	GSequence *folders;           /* ConnFolder * */
+	GSequence *connections;       /* Connection * */
+	int count;                    /* connections in the whole subtree */
+} ConnFolder;
+
+/* position of a node in the folder tree, from the root down */
+typedef struct _ConnPath {
+	int depth;
+	int indices[CONN_FOLDER_MAX_DEPTH + 1];
+} ConnPath;
+
+/* connection registry: name index for lookups, sorted sequence for iteration */
+typedef struct _ConnectionList {
+	GHashTable *index;    /* name (case-insensitive) -> GSequenceIter */
+	GSequence *list;      /* Connection *, sorted by name */
+	ConnFolder *root;
+	GHashTable *folders;  /* path -> ConnFolder * */
+	ConnSearch *search;   /* built by the first cl_search() */
+	GList *listeners;     /* ConnectionListListener * */
+} ConnectionList;
+
+/*
+ * Changes of the folder tree, called after the tree has been modified
+ * (for removals, path is where the node was). Moving a connection is
+ * notified as a removal followed by an insertion; a folder is inserted
+ * before its first connection and removed after its last one. The
+ * folders holding an inserted or removed connection are changed, as
+ * their count is.
+ */
+typedef struct _ConnectionListListener {
+	void (*inserted)(ConnectionList *p_cl, const ConnPath *path, gpointer user_data);
+	void (*changed)(ConnectionList *p_cl, const ConnPath *path, gpointer user_data);
+	void (*removed)(ConnectionList *p_cl, const ConnPath *path, gpointer user_data);
+	void (*has_child_toggled)(ConnectionList *p_cl, const ConnPath *path, gpointer user_data);
+	gpointer user_data;
+} ConnectionListListener;
+
+extern ConnectionList *conn_list;
+
+int save_connections(ConnectionList *p_cl, char *filename, struct stat *st);
 int load_connections();
+int load_connection_list_from_file_xml(const char *filename, ConnectionList *p_cl, struct stat *st);
+int load_connection_shards(const char *dir, ConnectionList *p_cl);
+void load_connections_async();
+void load_connections_wait();
+int connections_ready();
+void connections_when_ready(void (*func)(gpointer), gpointer data);
+
+const char *conn_intern(const char *s);
+const char *conn_intern_len(const char *s, gsize len);
+#define conn_set(field, value) ((field) = conn_intern(value))
+const char *conn_secret(const char *s);
+const char *conn_secret_ref(const char *s);
+void conn_secret_unref(const char *s);
+void conn_secrets_release(Connection *p_conn);
+#define conn_set_secret(field, value) ((field) = conn_secret(value))
 
 void connection_init(Connection *);
-int choose_manage_connection(Connection *p_conn);
-int conn_update_last_user(char *cname, char *last_user);
-
-void cl_remove(GList **p_cl, char *name);
-void cl_release(GList **p_cl);
-int cl_count(GList *p_cl);
-Connection * cl_append(GList **p_cl, Connection *p_new);
-Connection *cl_insert_sorted(GList **p_cl, Connection *p_new);
-Connection *cl_get_by_index(GList *p_cl, int index);
-Connection *cl_get_by_name(GList *p_cl, char *name);
+Connection *connection_new(void);
+Connection *connection_dup(const Connection *p_conn);
+Connection *connection_ref(Connection *p_conn);
+void connection_unref(Connection *p_conn);
+Connection *connection_make_writable(Connection **pp_conn);
+void connection_set_password(Connection *p_conn, const char *password);
+int choose_manage_connection(Connection **pp_conn);
+int conn_update_last_user(const char *cname, const char *last_user);
+
+ConnectionList *cl_new(void);
+void cl_remove(ConnectionList *p_cl, const char *name);
+void cl_release(ConnectionList *p_cl);
+int cl_count(ConnectionList *p_cl);
+Connection * cl_append(ConnectionList *p_cl, Connection *p_new);
+Connection *cl_insert_sorted(ConnectionList *p_cl, Connection *p_new);
+Connection *cl_update(ConnectionList *p_cl, Connection *p_conn, Connection *p_new);
+Connection *cl_get_by_index(ConnectionList *p_cl, int index);
+Connection *cl_get_by_name(ConnectionList *p_cl, const char *name);
+void cl_foreach(ConnectionList *p_cl, GFunc func, gpointer user_data);
+GPtrArray *cl_snapshot(ConnectionList *p_cl);
+GPtrArray *cl_search(ConnectionList *p_cl, const char *query, guint max_results);
+void cl_add_listener(ConnectionList *p_cl, ConnectionListListener *listener);
+const char *conn_folder_normalize(const char *path);
+ConnFolder *cl_get_folder(ConnectionList *p_cl, const char *path);
+int cl_folder_count(ConnectionList *p_cl, const char *path);
+void cl_foreach_in_folder(ConnectionList *p_cl, const char *path, GFunc func, gpointer user_data);
+void cl_folder_path(ConnFolder *folder, ConnPath *path);
+void cl_connection_path(ConnectionList *p_cl, Connection *p_conn, ConnPath *path);
+void cl_remove_listener(ConnectionList *p_cl, ConnectionListListener *listener);
 
 void connection_copy(Connection *p_dst, Connection *p_src);
 
@@ -17,7 +17,7 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  *
  * @file connection_list.c
- * @brief
+ * @brief Connection registry: case-insensitive hash index, sorted sequence and folder tree
  */
 
 #include <string.h>
@@ -26,72 +26,624 @@
 #include "connection.h"
 #include "main.h"
 
+/* arena of interned strings, shared by all connections */
+static GStringChunk *strings = NULL;
+static GMutex strings_mutex;
+
 static void free_conn(gpointer data)
 {
-	free(data);
+	connection_unref((Connection *) data);
+}
+
+/* case-insensitive hash, same folding as strcasecmp() */
+static guint namehash(gconstpointer key)
+{
+	const unsigned char *p;
+	guint h = 5381;
+	for (p = key; *p; p++)
+		h = (h << 5) + h + g_ascii_tolower(*p);
+	return h;
+}
+
+static gboolean nameequal(gconstpointer n1, gconstpointer n2)
+{
+	return strcasecmp((const char *)n1, (const char *)n2) == 0;
 }
-static int namecmp(const void *n1, const void *n2)
+
+static gint conncmp(gconstpointer c1, gconstpointer c2, gpointer user_data)
 {
-	return strcasecmp((const char *)n1, (const char *)n2);
+	return strcasecmp(((const Connection *)c1)->name, ((const Connection *)c2)->name);
 }
 
+/**
+ * conn_intern() - returns the unique copy of a string in the arena
+ * Interned strings are never freed. Safe to call from any thread.
+ */
+const char *conn_intern(const char *s)
+{
+	const char *ret;
+	if (s == NULL || s[0] == 0)
+		return "";
+	g_mutex_lock(&strings_mutex);
+	if (strings == NULL)
+		strings = g_string_chunk_new(64 * 1024);
+	ret = g_string_chunk_insert_const(strings, s);
+	g_mutex_unlock(&strings_mutex);
+	return ret;
+}
+
+/* conn_intern_len() - same as conn_intern() for a string that is not nul-terminated */
+const char *conn_intern_len(const char *s, gsize len)
+{
+	char buffer[1024];
+	char *tmp;
+	const char *ret;
+	if (len < sizeof(buffer)) {
+		memcpy(buffer, s, len);
+		buffer[len] = 0;
+		return conn_intern(buffer);
+	}
+	tmp = g_strndup(s, len);
+	ret = conn_intern(tmp);
+	g_free(tmp);
+	return ret;
+}
+
+/*
+ * Secrets are private copies, with a reference count that starts at 0:
+ * connection_dup() takes a reference and connection_unref() drops it, so
+ * a secret given to a temporary belongs to the connections made from it.
+ * The last reference wipes the string before freeing it.
+ */
+typedef struct _Secret {
+	gint ref_count;
+	gsize len;
+	char s[];
+} Secret;
+
+#define SECRET(str) ((Secret *) ((str) - G_STRUCT_OFFSET(Secret, s)))
+
+/* conn_secret() - new secret copy of s, "" for an empty string */
+const char *conn_secret(const char *s)
+{
+	Secret *secret;
+	gsize len;
+	if (s == NULL || s[0] == 0)
+		return "";
+	len = strlen(s);
+	secret = g_malloc(sizeof(Secret) + len + 1);
+	secret->ref_count = 0;
+	secret->len = len;
+	memcpy(secret->s, s, len + 1);
+	return secret->s;
+}
+
+const char *conn_secret_ref(const char *s)
+{
+	if (s[0])
+		g_atomic_int_inc(&SECRET(s)->ref_count);
+	return s;
+}
+
+void conn_secret_unref(const char *s)
+{
+	Secret *secret;
+	volatile char *p;
+	gsize i;
+	if (s == NULL || s[0] == 0)
+		return;
+	secret = SECRET(s);
+	if (!g_atomic_int_dec_and_test(&secret->ref_count))
+		return;
+	/* volatile, so the compiler can't drop stores to memory being freed */
+	for (p = secret->s, i = 0; i < secret->len; i++)
+		p[i] = 0;
+	g_free(secret);
+}
+
+/**
+ * conn_secrets_release() - drops the secrets of a copy on the stack
+ * To call once the copy was given to the list: the secrets made for it
+ * are wiped unless a connection took them, as when the insert failed.
+ */
+void conn_secrets_release(Connection *p_conn)
+{
+	conn_secret_unref(conn_secret_ref(p_conn->auth_password));
+	conn_secret_unref(conn_secret_ref(p_conn->password));
+}
+
+/* connection_init() - clears a connection, all strings set to "" */
 void connection_init(Connection *pConn)
 {
 	memset(pConn, 0, sizeof(Connection));
+	pConn->ref_count = 1;
+	pConn->name = "";
+	pConn->host = "";
+	pConn->last_user = "";
+	pConn->user_options = "";
+	pConn->auth_user = "";
+	pConn->auth_password = "";
+	pConn->auth_password_encrypted = "";
+	pConn->user = "";
+	pConn->password = "";
+	pConn->identityFile = "";
+	pConn->folder = "";
+	pConn->shard = "";
 }
 
-void cl_release(GList **p_cl)
+Connection *connection_new(void)
 {
-	g_list_free_full(*p_cl, free_conn);
-	*p_cl = NULL;
+	Connection *p_conn;
+	p_conn = g_slice_new(Connection);
+	connection_init(p_conn);
+	return p_conn;
 }
 
-Connection *cl_append(GList **p_cl, Connection *p_new)
+/* connection_dup() - new instance with the same values (strings are shared) */
+Connection *connection_dup(const Connection *p_conn)
+{
+	Connection *p_new;
+	p_new = g_slice_dup(Connection, p_conn);
+	p_new->ref_count = 1;
+	conn_secret_ref(p_new->auth_password);
+	conn_secret_ref(p_new->password);
+	return p_new;
+}
+
+Connection *connection_ref(Connection *p_conn)
+{
+	g_atomic_int_inc(&p_conn->ref_count);
+	return p_conn;
+}
+
+void connection_unref(Connection *p_conn)
+{
+	if (p_conn && g_atomic_int_dec_and_test(&p_conn->ref_count)) {
+		conn_secret_unref(p_conn->auth_password);
+		conn_secret_unref(p_conn->password);
+		g_slice_free(Connection, p_conn);
+	}
+}
+
+/**
+ * connection_make_writable() - makes *pp_conn a private copy if it's shared
+ * @return the connection that can be modified
+ */
+Connection *connection_make_writable(Connection **pp_conn)
+{
+	Connection *p_new;
+	if (g_atomic_int_get(&(*pp_conn)->ref_count) == 1)
+		return *pp_conn;
+	p_new = connection_dup(*pp_conn);
+	connection_unref(*pp_conn);
+	*pp_conn = p_new;
+	return p_new;
+}
+
+/* connection_set_password() - replaces the password of an allocated, writable connection */
+void connection_set_password(Connection *p_conn, const char *password)
+{
+	const char *old = p_conn->password;
+	p_conn->password = conn_secret_ref(conn_secret(password));
+	conn_secret_unref(old);
+}
+
+static gint foldercmp(gconstpointer f1, gconstpointer f2, gpointer user_data)
+{
+	return strcasecmp(((const ConnFolder *)f1)->name, ((const ConnFolder *)f2)->name);
+}
+
+static ConnFolder *folder_new(ConnFolder *parent, const char *path)
+{
+	ConnFolder *folder;
+	const char *slash;
+	folder = g_new0(ConnFolder, 1);
+	folder->path = path;
+	slash = strrchr(path, '/');
+	folder->name = slash ? conn_intern(slash + 1) : path;
+	folder->parent = parent;
+	folder->folders = g_sequence_new(NULL);
+	folder->connections = g_sequence_new(NULL);
+	return folder;
+}
+
+static void folder_free(gpointer data)
+{
+	ConnFolder *folder = (ConnFolder *) data;
+	g_sequence_free(folder->folders);
+	g_sequence_free(folder->connections);
+	g_free(folder);
+}
+
+ConnectionList *cl_new(void)
+{
+	ConnectionList *p_cl;
+	p_cl = g_new0(ConnectionList, 1);
+	/* keys point to the name stored inside each Connection */
+	p_cl->index = g_hash_table_new(namehash, nameequal);
+	p_cl->list = g_sequence_new(free_conn);
+	/* folder paths are interned, so they can be compared by address */
+	p_cl->folders = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, folder_free);
+	p_cl->root = folder_new(NULL, conn_intern(""));
+	g_hash_table_insert(p_cl->folders, (gpointer) p_cl->root->path, p_cl->root);
+	return p_cl;
+}
+
+void cl_release(ConnectionList *p_cl)
+{
+	if (!p_cl)
+		return;
+	conn_search_free(p_cl->search);
+	g_list_free(p_cl->listeners);
+	g_hash_table_destroy(p_cl->folders);
+	g_hash_table_destroy(p_cl->index);
+	g_sequence_free(p_cl->list);
+	g_free(p_cl);
+}
+
+#define NOTIFY(p_cl, event, arg) do { \
+		GList *l; \
+		for (l = (p_cl)->listeners; l; l = l->next) { \
+			ConnectionListListener *listener = l->data; \
+			if (listener->event) \
+				listener->event((p_cl), (arg), listener->user_data); \
+		} \
+	} while (0)
+
+void cl_add_listener(ConnectionList *p_cl, ConnectionListListener *listener)
+{
+	p_cl->listeners = g_list_append(p_cl->listeners, listener);
+}
+
+void cl_remove_listener(ConnectionList *p_cl, ConnectionListListener *listener)
+{
+	p_cl->listeners = g_list_remove(p_cl->listeners, listener);
+}
+
+/**
+ * conn_folder_normalize() - canonical form of a folder path
+ * Empty components and surrounding blanks are dropped: " /dc1//web/" is "dc1/web".
+ * @return interned path
+ */
+const char *conn_folder_normalize(const char *path)
+{
+	gchar **parts;
+	GString *s;
+	const char *ret;
+	int i, depth = 0;
+	if (path == NULL || path[0] == 0)
+		return "";
+	parts = g_strsplit(path, "/", -1);
+	s = g_string_new("");
+	for (i = 0; parts[i]; i++) {
+		g_strstrip(parts[i]);
+		if (parts[i][0] == 0)
+			continue;
+		if (depth++ == CONN_FOLDER_MAX_DEPTH)
+			break;
+		if (s->len)
+			g_string_append_c(s, '/');
+		g_string_append(s, parts[i]);
+	}
+	ret = conn_intern(s->str);
+	g_string_free(s, TRUE);
+	g_strfreev(parts);
+	return ret;
+}
+
+static int folder_n_children(ConnFolder *folder)
+{
+	return g_sequence_get_length(folder->folders) + g_sequence_get_length(folder->connections);
+}
+
+void cl_folder_path(ConnFolder *folder, ConnPath *path)
+{
+	ConnFolder *f;
+	int depth = 0, i;
+	for (f = folder; f->parent; f = f->parent)
+		depth ++;
+	path->depth = depth;
+	for (f = folder, i = depth - 1; f->parent; f = f->parent, i--)
+		path->indices[i] = g_sequence_iter_get_position(f->iter);
+}
+
+static void connection_path_at(ConnFolder *folder, GSequenceIter *iter, ConnPath *path)
+{
+	cl_folder_path(folder, path);
+	path->indices[path->depth++] = g_sequence_get_length(folder->folders) + g_sequence_iter_get_position(iter);
+}
+
+/* cl_connection_path() - position of a connection in the folder tree (depth 0 if not found) */
+void cl_connection_path(ConnectionList *p_cl, Connection *p_conn, ConnPath *path)
+{
+	ConnFolder *folder;
+	GSequenceIter *iter;
+	path->depth = 0;
+	folder = g_hash_table_lookup(p_cl->folders, p_conn->folder);
+	if (!folder)
+		return;
+	iter = g_sequence_lookup(folder->connections, p_conn, conncmp, NULL);
+	if (iter)
+		connection_path_at(folder, iter, path);
+}
+
+/* a folder got its first child */
+static void notify_first_child(ConnectionList *p_cl, ConnFolder *folder)
+{
+	ConnPath path;
+	if (folder->parent && folder_n_children(folder) == 1) {
+		cl_folder_path(folder, &path);
+		NOTIFY(p_cl, has_child_toggled, &path);
+	}
+}
+
+/* the connection count of a folder and its ancestors changed */
+static void notify_counts(ConnectionList *p_cl, ConnFolder *folder)
+{
+	ConnPath path;
+	ConnFolder *f;
+	if (p_cl->listeners == NULL)
+		return;
+	for (f = folder; f->parent; f = f->parent) {
+		cl_folder_path(f, &path);
+		NOTIFY(p_cl, changed, &path);
+	}
+}
+
+/* returns the folder with the given (normalized) path, creating it if needed */
+static ConnFolder *folder_get(ConnectionList *p_cl, const char *path)
+{
+	ConnFolder *folder, *parent;
+	const char *slash;
+	gchar *parent_path;
+	ConnPath cpath;
+	folder = g_hash_table_lookup(p_cl->folders, path);
+	if (folder)
+		return folder;
+	slash = strrchr(path, '/');
+	if (slash) {
+		parent_path = g_strndup(path, slash - path);
+		parent = folder_get(p_cl, conn_intern(parent_path));
+		g_free(parent_path);
+	} else
+		parent = p_cl->root;
+	folder = folder_new(parent, path);
+	folder->iter = g_sequence_insert_sorted(parent->folders, folder, foldercmp, NULL);
+	g_hash_table_insert(p_cl->folders, (gpointer) folder->path, folder);
+	cl_folder_path(folder, &cpath);
+	NOTIFY(p_cl, inserted, &cpath);
+	notify_first_child(p_cl, parent);
+	return folder;
+}
+
+static void folder_add(ConnectionList *p_cl, Connection *p_conn)
+{
+	ConnFolder *folder, *f;
+	GSequenceIter *iter;
+	ConnPath path;
+	folder = folder_get(p_cl, p_conn->folder);
+	iter = g_sequence_insert_sorted(folder->connections, p_conn, conncmp, NULL);
+	for (f = folder; f; f = f->parent)
+		f->count ++;
+	connection_path_at(folder, iter, &path);
+	NOTIFY(p_cl, inserted, &path);
+	notify_first_child(p_cl, folder);
+	notify_counts(p_cl, folder);
+}
+
+static void folder_remove(ConnectionList *p_cl, Connection *p_conn)
+{
+	ConnFolder *folder, *parent, *f;
+	GSequenceIter *iter;
+	ConnPath path;
+	folder = g_hash_table_lookup(p_cl->folders, p_conn->folder);
+	if (!folder)
+		return;
+	iter = g_sequence_lookup(folder->connections, p_conn, conncmp, NULL);
+	if (!iter)
+		return;
+	connection_path_at(folder, iter, &path);
+	g_sequence_remove(iter);
+	for (f = folder; f; f = f->parent)
+		f->count --;
+	NOTIFY(p_cl, removed, &path);
+	/* drop the folders left empty */
+	while (folder->parent && folder_n_children(folder) == 0) {
+		parent = folder->parent;
+		cl_folder_path(folder, &path);
+		g_sequence_remove(folder->iter);
+		g_hash_table_remove(p_cl->folders, folder->path);
+		NOTIFY(p_cl, removed, &path);
+		folder = parent;
+	}
+	notify_counts(p_cl, folder);
+}
+
+static Connection *cl_insert(ConnectionList *p_cl, Connection *p_new)
 {
 	Connection *p_new_decl;
-	p_new_decl = (Connection *) malloc(sizeof(Connection));
-	memset(p_new_decl, 0, sizeof(Connection));
-	memcpy(p_new_decl, p_new, sizeof(Connection));
-	*p_cl = g_list_append(*p_cl, p_new_decl);
+	GSequenceIter *iter;
+	if (g_hash_table_contains(p_cl->index, p_new->name)) {
+		log_write("[%s] duplicate connection name '%s' skipped\n", __func__, p_new->name);
+		return NULL;
+	}
+	p_new_decl = connection_dup(p_new);
+	p_new_decl->folder = conn_folder_normalize(p_new_decl->folder);
+	iter = g_sequence_insert_sorted(p_cl->list, p_new_decl, conncmp, NULL);
+	g_hash_table_insert(p_cl->index, (gpointer) p_new_decl->name, iter);
+	if (p_cl->search)
+		conn_search_add(p_cl->search, p_new_decl);
+	folder_add(p_cl, p_new_decl);
 	return (p_new_decl);
 }
 
-void cl_remove(GList **p_cl, char *name)
+/* the list is always kept sorted, so appending is the same as a sorted insert */
+Connection *cl_append(ConnectionList *p_cl, Connection *p_new)
+{
+	return cl_insert(p_cl, p_new);
+}
+
+Connection *cl_insert_sorted(ConnectionList *p_cl, Connection *p_new)
+{
+	return cl_insert(p_cl, p_new);
+}
+
+void cl_remove(ConnectionList *p_cl, const char *name)
 {
-	GList *res = g_list_find_custom(*p_cl, name, namecmp);
-	if (!res) return;
-	*p_cl = g_list_remove_link(*p_cl, res);
-	g_list_free_full(res, free_conn);
+	GSequenceIter *iter;
+	Connection *p_conn;
+	if (!p_cl)
+		return;
+	iter = g_hash_table_lookup(p_cl->index, name);
+	if (!iter)
+		return;
+	p_conn = g_sequence_get(iter);
+	if (p_cl->search)
+		conn_search_remove(p_cl->search, p_conn);
+	folder_remove(p_cl, p_conn);
+	g_hash_table_remove(p_cl->index, name);
+	g_sequence_remove(iter);
 }
 
-Connection *cl_insert_sorted(GList **p_cl, Connection *p_new)
+/**
+ * cl_update() - replaces an existing connection, keeping index and order in sync
+ * p_conn is released by the list (tabs holding a reference keep their snapshot).
+ * @return the new connection or NULL if p_conn is not in the list
+ */
+Connection *cl_update(ConnectionList *p_cl, Connection *p_conn, Connection *p_new)
 {
+	GSequenceIter *iter, *folder_iter;
 	Connection *p_new_decl;
-	p_new_decl = (Connection *) malloc(sizeof(Connection));
-	memset(p_new_decl, 0, sizeof(Connection));
-	memcpy(p_new_decl, p_new, sizeof(Connection));
-	*p_cl = g_list_insert_sorted(*p_cl, p_new_decl, namecmp);
-	return (p_new_decl);
+	ConnFolder *folder;
+	ConnPath path;
+	iter = g_hash_table_lookup(p_cl->index, p_conn->name);
+	if (!iter || g_sequence_get(iter) != p_conn)
+		return NULL;
+	if (p_cl->search)
+		conn_search_remove(p_cl->search, p_conn);
+	p_new_decl = connection_dup(p_new);
+	p_new_decl->folder = conn_folder_normalize(p_new_decl->folder);
+	folder = g_hash_table_lookup(p_cl->folders, p_conn->folder);
+	if (p_conn->folder == p_new_decl->folder && strcmp(p_conn->name, p_new_decl->name) == 0) {
+		/* same place in the list and in the tree */
+		folder_iter = g_sequence_lookup(folder->connections, p_conn, conncmp, NULL);
+		g_sequence_set(folder_iter, p_new_decl);
+		g_hash_table_remove(p_cl->index, p_conn->name);
+		g_sequence_set(iter, p_new_decl);
+		g_hash_table_insert(p_cl->index, (gpointer) p_new_decl->name, iter);
+		connection_path_at(folder, folder_iter, &path);
+		NOTIFY(p_cl, changed, &path);
+	} else {
+		folder_remove(p_cl, p_conn);
+		g_hash_table_remove(p_cl->index, p_conn->name);
+		g_sequence_set(iter, p_new_decl);
+		g_sequence_sort_changed(iter, conncmp, NULL);
+		g_hash_table_insert(p_cl->index, (gpointer) p_new_decl->name, iter);
+		folder_add(p_cl, p_new_decl);
+	}
+	if (p_cl->search)
+		conn_search_add(p_cl->search, p_new_decl);
+	return p_new_decl;
+}
+
+Connection *cl_get_by_index(ConnectionList *p_cl, int index)
+{
+	GSequenceIter *iter;
+	if (!p_cl || index < 0 || index >= g_sequence_get_length(p_cl->list))
+		return NULL;
+	iter = g_sequence_get_iter_at_pos(p_cl->list, index);
+	return g_sequence_get(iter);
+}
+
+Connection *cl_get_by_name(ConnectionList *p_cl, const char *name)
+{
+	GSequenceIter *iter;
+	if (!p_cl)
+		return NULL;
+	iter = g_hash_table_lookup(p_cl->index, name);
+	return iter ? g_sequence_get(iter) : NULL;
+}
+
+int cl_count(ConnectionList *p_cl)
+{
+	return p_cl ? g_sequence_get_length(p_cl->list) : 0;
+}
+
+/* calls func for each connection in name order */
+void cl_foreach(ConnectionList *p_cl, GFunc func, gpointer user_data)
+{
+	if (p_cl)
+		g_sequence_foreach(p_cl->list, func, user_data);
+}
+
+static void snapshot_cb(gpointer data, gpointer user_data)
+{
+	g_ptr_array_add(user_data, connection_ref(data));
+}
+
+/**
+ * cl_snapshot() - references on the connections of the list, in order
+ * Connections in a list are replaced, never modified, so another thread
+ * can read the snapshot while the list changes. Free with g_ptr_array_unref().
+ */
+GPtrArray *cl_snapshot(ConnectionList *p_cl)
+{
+	GPtrArray *snapshot = g_ptr_array_new_full(cl_count(p_cl), (GDestroyNotify) connection_unref);
+	cl_foreach(p_cl, snapshot_cb, snapshot);
+	return snapshot;
+}
+
+ConnFolder *cl_get_folder(ConnectionList *p_cl, const char *path)
+{
+	return g_hash_table_lookup(p_cl->folders, conn_folder_normalize(path));
 }
 
-Connection *cl_get_by_index(GList *p_cl, int index)
+/* cl_folder_count() - number of connections in a folder and its subfolders */
+int cl_folder_count(ConnectionList *p_cl, const char *path)
 {
-	return g_list_nth_data(p_cl, index);
+	ConnFolder *folder = cl_get_folder(p_cl, path);
+	return folder ? folder->count : 0;
 }
 
-Connection *cl_get_by_name(GList *p_cl, char *name)
+static void folder_foreach(ConnFolder *folder, GFunc func, gpointer user_data)
 {
-	GList *res = g_list_find_custom(p_cl, name, namecmp);
-	return res ? res->data : NULL;
+	GSequenceIter *iter;
+	for (iter = g_sequence_get_begin_iter(folder->folders); !g_sequence_iter_is_end(iter); iter = g_sequence_iter_next(iter))
+		folder_foreach(g_sequence_get(iter), func, user_data);
+	g_sequence_foreach(folder->connections, func, user_data);
 }
 
-int cl_count(GList *p_cl)
+/* calls func for each connection in a folder and its subfolders, in tree order */
+void cl_foreach_in_folder(ConnectionList *p_cl, const char *path, GFunc func, gpointer user_data)
 {
-	return g_list_length(p_cl);
+	ConnFolder *folder = cl_get_folder(p_cl, path);
+	if (folder)
+		folder_foreach(folder, func, user_data);
 }
 
+static void search_add_cb(gpointer data, gpointer user_data)
+{
+	conn_search_add((ConnSearch *) user_data, (Connection *) data);
+}
+
+/**
+ * cl_search() - connections matching query, best matches first
+ * The index is built on the first call and kept up to date afterwards.
+ * @return array of Connection * owned by the list, to be freed by the caller
+ */
+GPtrArray *cl_search(ConnectionList *p_cl, const char *query, guint max_results)
+{
+	if (!p_cl->search) {
+		p_cl->search = conn_search_new();
+		g_sequence_foreach(p_cl->list, search_add_cb, p_cl->search);
+	}
+	return conn_search_query(p_cl->search, query, max_results);
+}
+
+/* connection_copy() - copies values into a temporary, the reference count of p_dst is kept */
 void connection_copy(Connection *p_dst, Connection *p_src)
 {
+	gint ref_count = p_dst->ref_count;
 	memcpy(p_dst, p_src, sizeof(Connection));
+	p_dst->ref_count = ref_count;
 }
-
@@ -0,0 +1,398 @@
+
+/**
+ * Copyright (C) 2009-2017 Fabio Leone
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * @file connjournal.c
+ * @brief Append-only journal of connection changes, compacted into connections.xml
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <glib.h>
+#include "connection.h"
+#include "connjournal.h"
+#include "conncache.h"
+#include "cfgfile.h"
+#include "main.h"
+
+#define CONN_JOURNAL_MAGIC "LTCJ"
+#define CONN_JOURNAL_VERSION 2
+
+/*
+ * File layout: magic and version, then records made of
+ * (32 bit payload length, 32 bit hash of op and payload, 8 bit op, payload).
+ * PUT payload is the name the connection had before the change ("" when
+ * added) followed by the packed connection; DELETE payload is the name.
+ * A record cut short by a crash fails the length or hash check and ends
+ * the replay. Version 1 packed strings with 16 bit lengths; such a journal
+ * is still replayed, then rewritten by the compaction that follows.
+ * All disk I/O is done by a single writer thread, in the order the
+ * requests are queued, so the GTK thread never waits on fsync. A
+ * compaction takes references on the connections of the list (see
+ * cl_snapshot()), the writer serializes them. Without a journal file
+ * the writer still runs and each change is saved by a compaction.
+ */
+
+enum {
+	JOB_APPEND,
+	JOB_COMPACT,
+	JOB_STOP
+};
+
+struct JournalJob {
+	int type;
+	GByteArray *data;     /* record to append */
+	GPtrArray *snapshot;  /* Connection *, to compact */
+};
+
+static struct {
+	int fd;               /* -1 without a journal file */
+	gchar *journal_file;
+	gchar *xml_file;
+	gchar *cache_file;
+	GAsyncQueue *queue;
+	GThread *thread;
+	int n_records;        /* records written since the last compaction */
+	GHashTable *dirty;    /* lower case name -> packed connection as it was in the xml file (NULL if not there) */
+} journal = { -1 };
+
+static void write_header(int fd)
+{
+	guint32 version = CONN_JOURNAL_VERSION;
+	if (write(fd, CONN_JOURNAL_MAGIC, 4) != 4 || write(fd, &version, sizeof(version)) != sizeof(version))
+		log_write("[%s] %s: %s\n", __func__, journal.journal_file, strerror(errno));
+}
+
+static void journal_append(GByteArray *data)
+{
+	if (journal.fd < 0)
+		return;
+	if (write(journal.fd, data->data, data->len) != data->len) {
+		log_write("[%s] %s: %s\n", __func__, journal.journal_file, strerror(errno));
+		return;
+	}
+	fdatasync(journal.fd);
+}
+
+/* writes a snapshot to connections.xml and the cache, then empties the journal */
+static void journal_compact(GPtrArray *snapshot)
+{
+	ConnectionList *p_cl;
+	Connection *p_conn;
+	GByteArray *data;
+	struct stat st;
+	int i;
+	/* connections.d is not part of connections.xml */
+	p_cl = cl_new();
+	for (i = 0; i < snapshot->len; i++) {
+		p_conn = g_ptr_array_index(snapshot, i);
+		if (!p_conn->shard[0])
+			cl_append(p_cl, p_conn);
+	}
+	if (save_connections(p_cl, journal.xml_file, &st) == 0) {
+		/* records up to here are in the xml file */
+		if (journal.fd >= 0) {
+			if (ftruncate(journal.fd, 0) == 0)
+				write_header(journal.fd);
+			fdatasync(journal.fd);
+		}
+		data = conn_cache_build(p_cl);
+		conn_cache_stamp(data, &st);
+		conn_cache_write(data, journal.cache_file);
+		g_byte_array_free(data, TRUE);
+		log_debug("%d connections compacted into %s\n", cl_count(p_cl), journal.xml_file);
+	}
+	cl_release(p_cl);
+}
+
+static gpointer journal_writer(gpointer user_data)
+{
+	struct JournalJob *job;
+	int type;
+	do {
+		job = g_async_queue_pop(journal.queue);
+		type = job->type;
+		if (type == JOB_APPEND)
+			journal_append(job->data);
+		else if (type == JOB_COMPACT)
+			journal_compact(job->snapshot);
+		if (job->data)
+			g_byte_array_free(job->data, TRUE);
+		if (job->snapshot)
+			g_ptr_array_unref(job->snapshot);
+		g_free(job);
+	} while (type != JOB_STOP);
+	return NULL;
+}
+
+static void push_job(int type, GByteArray *data, GPtrArray *snapshot)
+{
+	struct JournalJob *job;
+	job = g_new0(struct JournalJob, 1);
+	job->type = type;
+	job->data = data;
+	job->snapshot = snapshot;
+	g_async_queue_push(journal.queue, job);
+}
+
+static void free_base(gpointer data)
+{
+	if (data)
+		g_byte_array_unref((GByteArray *) data);
+}
+
+/**
+ * conn_journal_open() - opens the journal and starts the writer thread
+ * @return 0 if ok, 1 if the journal file can't be used: compactions alone save the changes
+ */
+int conn_journal_open(const char *journal_file, const char *xml_file, const char *cache_file)
+{
+	struct stat st;
+	if (journal.thread)
+		return 0;
+	journal.fd = open(journal_file, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+	if (journal.fd < 0)
+		log_write("[%s] can't open %s: %s\n", __func__, journal_file, strerror(errno));
+	else if (fstat(journal.fd, &st) == 0 && st.st_size == 0)
+		write_header(journal.fd);
+	journal.journal_file = g_strdup(journal_file);
+	journal.xml_file = g_strdup(xml_file);
+	journal.cache_file = g_strdup(cache_file);
+	journal.queue = g_async_queue_new();
+	journal.dirty = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free_base);
+	journal.thread = g_thread_new("connjournal", journal_writer, NULL);
+	return journal.fd < 0 ? 1 : 0;
+}
+
+static int replay_record(ConnectionList *p_cl, int op, const guchar *p, const guchar *end, gboolean legacy)
+{
+	const char *key;
+	Connection conn, *p_conn;
+	int rc = 0;
+	if ((legacy ? conn_unpack_string_legacy : conn_unpack_string)(&p, end, &key))
+		return 1;
+	if (op == CONN_JOURNAL_DELETE) {
+		cl_remove(p_cl, key);
+		return 0;
+	}
+	if (op != CONN_JOURNAL_PUT || (legacy ? conn_unpack_legacy : conn_unpack)(&p, end, &conn))
+		return 1;
+	p_conn = cl_get_by_name(p_cl, key[0] ? key : conn.name);
+	if (p_conn == NULL)
+		cl_insert_sorted(p_cl, &conn);
+	else if (cl_update(p_cl, p_conn, &conn) == NULL)
+		rc = 1;
+	conn_secrets_release(&conn);
+	return rc;
+}
+
+/**
+ * conn_journal_replay() - applies the changes recorded after the last compaction
+ * @return number of records applied
+ */
+int conn_journal_replay(ConnectionList *p_cl, const char *journal_file)
+{
+	CfgBuffer buf;
+	const guchar *p, *end;
+	guint32 len, hash, version;
+	int n = 0;
+	if (cfg_buffer_map(&buf, journal_file))
+		return 0;
+	p = (const guchar *) buf.data;
+	end = p + buf.len;
+	if (buf.len < 8 || memcmp(p, CONN_JOURNAL_MAGIC, 4)) {
+		cfg_buffer_close(&buf);
+		return 0;
+	}
+	memcpy(&version, p + 4, sizeof(version));
+	if (version != CONN_JOURNAL_VERSION && version != 1) {
+		log_write("[%s] %s: unknown version %u\n", __func__, journal_file, version);
+		cfg_buffer_close(&buf);
+		return 0;
+	}
+	p += 8;
+	while (end - p >= 9) {
+		memcpy(&len, p, sizeof(len));
+		memcpy(&hash, p + 4, sizeof(hash));
+		if (end - p - 8 < len + 1 || conn_hash(p + 8, len + 1) != hash) {
+			log_write("[%s] %s: incomplete record ignored\n", __func__, journal_file);
+			break;
+		}
+		if (replay_record(p_cl, p[8], p + 9, p + 9 + len, version == 1))
+			log_write("[%s] %s: bad record skipped\n", __func__, journal_file);
+		else
+			n++;
+		p += 9 + len;
+	}
+	cfg_buffer_close(&buf);
+	/* nothing to compact: new records must not follow the old header */
+	if (version != CONN_JOURNAL_VERSION && n == 0 && journal.fd >= 0
+	    && ftruncate(journal.fd, 0) == 0)
+		write_header(journal.fd);
+	journal.n_records = n;
+	log_debug("%d changes replayed from %s\n", n, journal_file);
+	return n;
+}
+
+/* remembers the saved version of a connection the first time it changes */
+static void mark_dirty(const char *name)
+{
+	gchar *key = g_ascii_strdown(name, -1);
+	Connection *p_conn;
+	GByteArray *base = NULL;
+	if (g_hash_table_contains(journal.dirty, key)) {
+		g_free(key);
+		return;
+	}
+	p_conn = cl_get_by_name(conn_list, name);
+	if (p_conn && !p_conn->shard[0]) {
+		base = g_byte_array_new();
+		conn_pack(base, p_conn);
+	}
+	g_hash_table_insert(journal.dirty, key, base);
+}
+
+static gboolean compact_idle_cb(gpointer data)
+{
+	if (journal.n_records >= CONN_JOURNAL_MAX_RECORDS || (journal.fd < 0 && journal.n_records))
+		conn_journal_compact(conn_list);
+	return G_SOURCE_REMOVE;
+}
+
+static void journal_record(int op, const char *key, Connection *p_conn)
+{
+	GByteArray *data;
+	guint32 len, hash;
+	guint8 op8 = op;
+	if (!journal.thread)
+		return;
+	/* records are written before the list is changed, except for additions */
+	if (key[0])
+		mark_dirty(key);
+	if (p_conn && strcasecmp(key, p_conn->name)) {
+		if (key[0])
+			mark_dirty(p_conn->name);
+		else {
+			/* already in the list: it wasn't in the file unless it was deleted before */
+			gchar *name = g_ascii_strdown(p_conn->name, -1);
+			if (!g_hash_table_contains(journal.dirty, name))
+				g_hash_table_insert(journal.dirty, name, NULL);
+			else
+				g_free(name);
+		}
+	}
+	if (journal.fd < 0) {
+		/* nowhere to append: the change is saved once the caller made it */
+		if (journal.n_records++ == 0)
+			g_idle_add(compact_idle_cb, NULL);
+		return;
+	}
+	data = g_byte_array_new();
+	g_byte_array_append(data, (const guint8 *) &len, sizeof(len));
+	g_byte_array_append(data, (const guint8 *) &hash, sizeof(hash));
+	g_byte_array_append(data, &op8, 1);
+	conn_pack_string(data, key);
+	if (p_conn)
+		conn_pack(data, p_conn);
+	len = data->len - 9;
+	hash = conn_hash(data->data + 8, len + 1);
+	memcpy(data->data, &len, sizeof(len));
+	memcpy(data->data + 4, &hash, sizeof(hash));
+	push_job(JOB_APPEND, data, NULL);
+	/* the caller changes the list after recording: compact once it's done */
+	if (++journal.n_records == CONN_JOURNAL_MAX_RECORDS)
+		g_idle_add(compact_idle_cb, NULL);
+}
+
+/**
+ * conn_journal_put() - records an added or modified connection
+ * @key name of the connection before the change, "" if it's a new one
+ */
+void conn_journal_put(const char *key, Connection *p_conn)
+{
+	journal_record(CONN_JOURNAL_PUT, key, p_conn);
+}
+
+void conn_journal_delete(const char *name)
+{
+	journal_record(CONN_JOURNAL_DELETE, name, NULL);
+}
+
+/**
+ * conn_journal_compact() - rewrites connections.xml from the list in background
+ * @return 0 if queued, 1 if the journal is not open and nothing was saved
+ */
+int conn_journal_compact(ConnectionList *p_cl)
+{
+	if (!journal.thread)
+		return 1;
+	push_job(JOB_COMPACT, NULL, cl_snapshot(p_cl));
+	journal.n_records = 0;
+	g_hash_table_remove_all(journal.dirty);
+	return 0;
+}
+
+/**
+ * conn_journal_dirty() - tells if a connection has changes not yet in connections.xml
+ * @param[in] name current or previous name of the connection
+ * @param[out] base packed connection as last saved, NULL if it wasn't saved
+ * @return TRUE if dirty
+ */
+gboolean conn_journal_dirty(const char *name, GByteArray **base)
+{
+	gchar *key;
+	gpointer value;
+	gboolean ret;
+	*base = NULL;
+	if (!journal.thread)
+		return FALSE;
+	key = g_ascii_strdown(name, -1);
+	ret = g_hash_table_lookup_extended(journal.dirty, key, NULL, &value);
+	*base = value;
+	g_free(key);
+	return ret;
+}
+
+/**
+ * conn_journal_close() - compacts pending changes and waits for the writer
+ * @return 0 if ok, 1 if the journal is not open and nothing was saved
+ */
+int conn_journal_close(ConnectionList *p_cl)
+{
+	if (!journal.thread)
+		return 1;
+	if (journal.n_records)
+		conn_journal_compact(p_cl);
+	push_job(JOB_STOP, NULL, NULL);
+	g_thread_join(journal.thread);
+	journal.thread = NULL;
+	g_async_queue_unref(journal.queue);
+	if (journal.fd >= 0)
+		close(journal.fd);
+	journal.fd = -1;
+	g_free(journal.journal_file);
+	g_free(journal.xml_file);
+	g_free(journal.cache_file);
+	g_hash_table_destroy(journal.dirty);
+	return 0;
+}
@@ -0,0 +1,21 @@
+
+#ifndef _CONNJOURNAL_H
+#define _CONNJOURNAL_H
+
+#include "connection.h"
+
+#define CONN_JOURNAL_PUT 1
+#define CONN_JOURNAL_DELETE 2
+
+/* journal is compacted into connections.xml after this many records */
+#define CONN_JOURNAL_MAX_RECORDS 512
+
+int conn_journal_open(const char *journal_file, const char *xml_file, const char *cache_file);
+int conn_journal_replay(ConnectionList *p_cl, const char *journal_file);
+void conn_journal_put(const char *key, Connection *p_conn);
+void conn_journal_delete(const char *name);
+int conn_journal_compact(ConnectionList *p_cl);
+gboolean conn_journal_dirty(const char *name, GByteArray **base);
+int conn_journal_close(ConnectionList *p_cl);
+
+#endif
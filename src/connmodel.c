@@ -0,0 +1,338 @@
+
+/**
+ * Copyright (C) 2009-2017 Fabio Leone
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * @file connmodel.c
+ * @brief GtkTreeModel reading the folder tree straight from a ConnectionList
+ */
+
+#include <gtk/gtk.h>
+#include <string.h>
+#include "connection.h"
+#include "connmodel.h"
+
+/*
+ * Nothing is copied: an iter holds the GSequenceIter of the node inside
+ * its parent folder, so a folder is only walked when the view expands it.
+ * The list notifies its changes, which are forwarded as row-inserted/
+ * changed/deleted/has-child-toggled.
+ *
+ * iter->user_data   GSequenceIter * in parent->folders or parent->connections
+ * iter->user_data2  ConnFolder *parent
+ * iter->user_data3  NODE_FOLDER or NODE_CONNECTION
+ */
+
+#define NODE_CONNECTION NULL
+#define NODE_FOLDER GINT_TO_POINTER(1)
+
+struct _ConnListModel {
+	GObject parent;
+	ConnectionList *p_cl;
+	ConnectionListListener listener;
+	gint stamp;
+};
+
+struct _ConnListModelClass {
+	GObjectClass parent_class;
+};
+
+static void conn_list_model_tree_model_init(GtkTreeModelIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE(ConnListModel, conn_list_model, G_TYPE_OBJECT,
+                        G_IMPLEMENT_INTERFACE(GTK_TYPE_TREE_MODEL, conn_list_model_tree_model_init))
+
+static void set_iter(ConnListModel *model, GtkTreeIter *iter, ConnFolder *parent, GSequenceIter *seq_iter, gpointer kind)
+{
+	iter->stamp = model->stamp;
+	iter->user_data = seq_iter;
+	iter->user_data2 = parent;
+	iter->user_data3 = kind;
+}
+
+/* folder the iter points to, NULL for the root or a connection */
+static ConnFolder *iter_folder(ConnListModel *model, GtkTreeIter *iter)
+{
+	if (iter == NULL)
+		return model->p_cl->root;
+	return iter->user_data3 == NODE_FOLDER ? g_sequence_get(iter->user_data) : NULL;
+}
+
+static GtkTreeModelFlags get_flags(GtkTreeModel *tree_model)
+{
+	return GTK_TREE_MODEL_ITERS_PERSIST;
+}
+
+static gint get_n_columns(GtkTreeModel *tree_model)
+{
+	return CONN_MODEL_N_COLUMNS;
+}
+
+static GType get_column_type(GtkTreeModel *tree_model, gint index)
+{
+	switch (index) {
+	case CONN_MODEL_PORT_COLUMN:
+	case CONN_MODEL_COUNT_COLUMN:
+		return G_TYPE_INT;
+	case CONN_MODEL_IS_FOLDER_COLUMN:
+		return G_TYPE_BOOLEAN;
+	default:
+		return G_TYPE_STRING;
+	}
+}
+
+static gboolean iter_nth_child(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreeIter *parent, gint n)
+{
+	ConnListModel *model = CONN_LIST_MODEL(tree_model);
+	ConnFolder *folder = iter_folder(model, parent);
+	gint n_folders;
+	if (folder == NULL || n < 0)
+		return FALSE;
+	n_folders = g_sequence_get_length(folder->folders);
+	if (n < n_folders)
+		set_iter(model, iter, folder, g_sequence_get_iter_at_pos(folder->folders, n), NODE_FOLDER);
+	else if (n - n_folders < g_sequence_get_length(folder->connections))
+		set_iter(model, iter, folder, g_sequence_get_iter_at_pos(folder->connections, n - n_folders), NODE_CONNECTION);
+	else
+		return FALSE;
+	return TRUE;
+}
+
+static gboolean get_iter(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreePath *path)
+{
+	gint *indices = gtk_tree_path_get_indices(path);
+	gint depth = gtk_tree_path_get_depth(path);
+	GtkTreeIter parent;
+	gint i;
+	if (depth < 1 || !iter_nth_child(tree_model, iter, NULL, indices[0]))
+		return FALSE;
+	for (i = 1; i < depth; i++) {
+		parent = *iter;
+		if (!iter_nth_child(tree_model, iter, &parent, indices[i]))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static GtkTreePath *path_from_conn_path(const ConnPath *cpath)
+{
+	GtkTreePath *path = gtk_tree_path_new();
+	gint i;
+	for (i = 0; i < cpath->depth; i++)
+		gtk_tree_path_append_index(path, cpath->indices[i]);
+	return path;
+}
+
+static GtkTreePath *get_path(GtkTreeModel *tree_model, GtkTreeIter *iter)
+{
+	ConnFolder *parent = iter->user_data2;
+	ConnPath cpath;
+	if (iter->user_data3 == NODE_FOLDER)
+		cl_folder_path(g_sequence_get(iter->user_data), &cpath);
+	else {
+		cl_folder_path(parent, &cpath);
+		cpath.indices[cpath.depth++] = g_sequence_get_length(parent->folders) + g_sequence_iter_get_position(iter->user_data);
+	}
+	return path_from_conn_path(&cpath);
+}
+
+static void get_value(GtkTreeModel *tree_model, GtkTreeIter *iter, gint column, GValue *value)
+{
+	ConnFolder *f = NULL;
+	Connection *c = NULL;
+	if (iter->user_data3 == NODE_FOLDER)
+		f = g_sequence_get(iter->user_data);
+	else
+		c = g_sequence_get(iter->user_data);
+	switch (column) {
+	case CONN_MODEL_NAME_COLUMN:
+		g_value_init(value, G_TYPE_STRING);
+		g_value_set_string(value, f ? f->name : c->name);
+		break;
+	case CONN_MODEL_HOST_COLUMN:
+		g_value_init(value, G_TYPE_STRING);
+		g_value_set_string(value, f ? "" : c->host);
+		break;
+	case CONN_MODEL_PORT_COLUMN:
+		g_value_init(value, G_TYPE_INT);
+		g_value_set_int(value, f ? 0 : c->port);
+		break;
+	case CONN_MODEL_IS_FOLDER_COLUMN:
+		g_value_init(value, G_TYPE_BOOLEAN);
+		g_value_set_boolean(value, f != NULL);
+		break;
+	case CONN_MODEL_COUNT_COLUMN:
+		g_value_init(value, G_TYPE_INT);
+		g_value_set_int(value, f ? f->count : 0);
+		break;
+	case CONN_MODEL_FOLDER_COLUMN:
+		g_value_init(value, G_TYPE_STRING);
+		g_value_set_string(value, f ? f->path : c->folder);
+		break;
+	}
+}
+
+static gboolean iter_next(GtkTreeModel *tree_model, GtkTreeIter *iter)
+{
+	ConnFolder *parent = iter->user_data2;
+	GSequenceIter *next = g_sequence_iter_next(iter->user_data);
+	if (!g_sequence_iter_is_end(next)) {
+		iter->user_data = next;
+		return TRUE;
+	}
+	/* connections follow the subfolders */
+	if (iter->user_data3 == NODE_FOLDER && g_sequence_get_length(parent->connections) > 0) {
+		iter->user_data = g_sequence_get_begin_iter(parent->connections);
+		iter->user_data3 = NODE_CONNECTION;
+		return TRUE;
+	}
+	iter->stamp = 0;
+	return FALSE;
+}
+
+static gboolean iter_previous(GtkTreeModel *tree_model, GtkTreeIter *iter)
+{
+	ConnFolder *parent = iter->user_data2;
+	if (!g_sequence_iter_is_begin(iter->user_data)) {
+		iter->user_data = g_sequence_iter_prev(iter->user_data);
+		return TRUE;
+	}
+	if (iter->user_data3 == NODE_CONNECTION && g_sequence_get_length(parent->folders) > 0) {
+		iter->user_data = g_sequence_iter_prev(g_sequence_get_end_iter(parent->folders));
+		iter->user_data3 = NODE_FOLDER;
+		return TRUE;
+	}
+	iter->stamp = 0;
+	return FALSE;
+}
+
+static gboolean iter_children(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreeIter *parent)
+{
+	return iter_nth_child(tree_model, iter, parent, 0);
+}
+
+static gint iter_n_children(GtkTreeModel *tree_model, GtkTreeIter *iter)
+{
+	ConnFolder *folder = iter_folder(CONN_LIST_MODEL(tree_model), iter);
+	if (folder == NULL)
+		return 0;
+	return g_sequence_get_length(folder->folders) + g_sequence_get_length(folder->connections);
+}
+
+static gboolean iter_has_child(GtkTreeModel *tree_model, GtkTreeIter *iter)
+{
+	return iter_n_children(tree_model, iter) > 0;
+}
+
+static gboolean iter_parent(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreeIter *child)
+{
+	ConnFolder *parent = child->user_data2;
+	if (parent->parent == NULL)
+		return FALSE;
+	set_iter(CONN_LIST_MODEL(tree_model), iter, parent->parent, parent->iter, NODE_FOLDER);
+	return TRUE;
+}
+
+static void conn_list_model_tree_model_init(GtkTreeModelIface *iface)
+{
+	iface->get_flags = get_flags;
+	iface->get_n_columns = get_n_columns;
+	iface->get_column_type = get_column_type;
+	iface->get_iter = get_iter;
+	iface->get_path = get_path;
+	iface->get_value = get_value;
+	iface->iter_next = iter_next;
+	iface->iter_previous = iter_previous;
+	iface->iter_children = iter_children;
+	iface->iter_has_child = iter_has_child;
+	iface->iter_n_children = iter_n_children;
+	iface->iter_nth_child = iter_nth_child;
+	iface->iter_parent = iter_parent;
+}
+
+/* list notifications */
+
+static void row_inserted(ConnectionList *p_cl, const ConnPath *cpath, gpointer user_data)
+{
+	GtkTreeModel *model = GTK_TREE_MODEL(user_data);
+	GtkTreeIter iter;
+	GtkTreePath *path = path_from_conn_path(cpath);
+	if (get_iter(model, &iter, path))
+		gtk_tree_model_row_inserted(model, path, &iter);
+	gtk_tree_path_free(path);
+}
+
+static void row_changed(ConnectionList *p_cl, const ConnPath *cpath, gpointer user_data)
+{
+	GtkTreeModel *model = GTK_TREE_MODEL(user_data);
+	GtkTreeIter iter;
+	GtkTreePath *path = path_from_conn_path(cpath);
+	if (get_iter(model, &iter, path))
+		gtk_tree_model_row_changed(model, path, &iter);
+	gtk_tree_path_free(path);
+}
+
+static void row_deleted(ConnectionList *p_cl, const ConnPath *cpath, gpointer user_data)
+{
+	GtkTreePath *path = path_from_conn_path(cpath);
+	gtk_tree_model_row_deleted(GTK_TREE_MODEL(user_data), path);
+	gtk_tree_path_free(path);
+}
+
+static void row_has_child_toggled(ConnectionList *p_cl, const ConnPath *cpath, gpointer user_data)
+{
+	GtkTreeModel *model = GTK_TREE_MODEL(user_data);
+	GtkTreeIter iter;
+	GtkTreePath *path = path_from_conn_path(cpath);
+	if (get_iter(model, &iter, path))
+		gtk_tree_model_row_has_child_toggled(model, path, &iter);
+	gtk_tree_path_free(path);
+}
+
+static void conn_list_model_finalize(GObject *object)
+{
+	ConnListModel *model = CONN_LIST_MODEL(object);
+	cl_remove_listener(model->p_cl, &model->listener);
+	G_OBJECT_CLASS(conn_list_model_parent_class)->finalize(object);
+}
+
+static void conn_list_model_class_init(ConnListModelClass *klass)
+{
+	G_OBJECT_CLASS(klass)->finalize = conn_list_model_finalize;
+}
+
+static void conn_list_model_init(ConnListModel *model)
+{
+	model->stamp = g_random_int();
+}
+
+/**
+ * conn_list_model_new() - creates a model showing the folder tree of a list
+ * The model must be released before the list.
+ */
+GtkTreeModel *conn_list_model_new(ConnectionList *p_cl)
+{
+	ConnListModel *model;
+	model = g_object_new(CONN_TYPE_LIST_MODEL, NULL);
+	model->p_cl = p_cl;
+	model->listener.inserted = row_inserted;
+	model->listener.changed = row_changed;
+	model->listener.removed = row_deleted;
+	model->listener.has_child_toggled = row_has_child_toggled;
+	model->listener.user_data = model;
+	cl_add_listener(p_cl, &model->listener);
+	return GTK_TREE_MODEL(model);
+}
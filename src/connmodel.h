@@ -0,0 +1,27 @@
+
+#ifndef _CONNMODEL_H
+#define _CONNMODEL_H
+
+#include <gtk/gtk.h>
+#include "connection.h"
+
+enum {
+	CONN_MODEL_NAME_COLUMN,
+	CONN_MODEL_HOST_COLUMN,
+	CONN_MODEL_PORT_COLUMN,
+	CONN_MODEL_IS_FOLDER_COLUMN,
+	CONN_MODEL_COUNT_COLUMN,
+	CONN_MODEL_FOLDER_COLUMN,    /* path of a folder, or folder of a connection */
+	CONN_MODEL_N_COLUMNS
+};
+
+#define CONN_TYPE_LIST_MODEL (conn_list_model_get_type())
+#define CONN_LIST_MODEL(obj) (G_TYPE_CHECK_INSTANCE_CAST((obj), CONN_TYPE_LIST_MODEL, ConnListModel))
+
+typedef struct _ConnListModel ConnListModel;
+typedef struct _ConnListModelClass ConnListModelClass;
+
+GType conn_list_model_get_type(void);
+GtkTreeModel *conn_list_model_new(ConnectionList *p_cl);
+
+#endif
@@ -0,0 +1,278 @@
+
+/**
+ * Copyright (C) 2009-2017 Fabio Leone
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * @file connsearch.c
+ * @brief Trigram index over connection name, host and users
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <glib.h>
+#include "connection.h"
+#include "connsearch.h"
+#include "main.h"
+
+/*
+ * Each indexed connection gets an entry with a numeric id. For every
+ * trigram of its (case folded) fields the index keeps a posting list of
+ * ids in ascending order. Removed entries are only marked as dead and
+ * skipped; the postings are rebuilt when dead entries outnumber live ones.
+ * A query scans the shortest posting list among its trigrams and checks
+ * the candidates with a plain substring match; queries shorter than a
+ * trigram scan all entries.
+ */
+
+enum {
+	FIELD_NAME,
+	FIELD_HOST,
+	FIELD_AUTH_USER,
+	FIELD_LAST_USER,
+	N_FIELDS
+};
+
+typedef struct _SearchEntry {
+	Connection *conn;         /* NULL if removed */
+	gchar *field[N_FIELDS];   /* folded copies, all in one allocation */
+} SearchEntry;
+
+struct _ConnSearch {
+	GArray *entries;          /* SearchEntry, by id */
+	GHashTable *ids;          /* Connection * -> id + 1 */
+	GHashTable *trigrams;     /* trigram -> GArray of guint32 ids */
+	guint n_dead;
+};
+
+typedef struct _SearchResult {
+	Connection *conn;
+	int score;
+} SearchResult;
+
+#define TRIGRAM(s) (((guint32)(guchar)(s)[0] << 16) | ((guint32)(guchar)(s)[1] << 8) | (guint32)(guchar)(s)[2])
+
+static void free_postings(gpointer data)
+{
+	g_array_free((GArray *) data, TRUE);
+}
+
+ConnSearch *conn_search_new(void)
+{
+	ConnSearch *cs;
+	cs = g_new0(ConnSearch, 1);
+	cs->entries = g_array_new(FALSE, FALSE, sizeof(SearchEntry));
+	cs->ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+	cs->trigrams = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free_postings);
+	return cs;
+}
+
+static void clear_entries(ConnSearch *cs)
+{
+	int i;
+	for (i = 0; i < cs->entries->len; i++)
+		g_free(g_array_index(cs->entries, SearchEntry, i).field[0]);
+	g_array_set_size(cs->entries, 0);
+	g_hash_table_remove_all(cs->ids);
+	g_hash_table_remove_all(cs->trigrams);
+	cs->n_dead = 0;
+}
+
+void conn_search_free(ConnSearch *cs)
+{
+	if (!cs)
+		return;
+	clear_entries(cs);
+	g_array_free(cs->entries, TRUE);
+	g_hash_table_destroy(cs->ids);
+	g_hash_table_destroy(cs->trigrams);
+	g_free(cs);
+}
+
+static void fold(char *s)
+{
+	for (; *s; s++)
+		*s = g_ascii_tolower(*s);
+}
+
+static void add_postings(ConnSearch *cs, guint32 id, const char *s)
+{
+	GArray *postings;
+	guint32 t;
+	for (; s[0] && s[1] && s[2]; s++) {
+		t = TRIGRAM(s);
+		postings = g_hash_table_lookup(cs->trigrams, GUINT_TO_POINTER(t));
+		if (!postings) {
+			postings = g_array_new(FALSE, FALSE, sizeof(guint32));
+			g_hash_table_insert(cs->trigrams, GUINT_TO_POINTER(t), postings);
+		}
+		/* same trigram twice in the entry */
+		if (postings->len && g_array_index(postings, guint32, postings->len - 1) == id)
+			continue;
+		g_array_append_val(postings, id);
+	}
+}
+
+static void index_entry(ConnSearch *cs, Connection *p_conn)
+{
+	SearchEntry e;
+	const char *src[N_FIELDS] = { p_conn->name, p_conn->host, p_conn->auth_user, p_conn->last_user };
+	gsize len[N_FIELDS], total = 0;
+	guint32 id;
+	char *p;
+	int i;
+	for (i = 0; i < N_FIELDS; i++)
+		total += (len[i] = strlen(src[i])) + 1;
+	e.conn = p_conn;
+	p = g_malloc(total);
+	for (i = 0; i < N_FIELDS; i++) {
+		memcpy(p, src[i], len[i] + 1);
+		fold(p);
+		e.field[i] = p;
+		p += len[i] + 1;
+	}
+	id = cs->entries->len;
+	g_array_append_val(cs->entries, e);
+	g_hash_table_insert(cs->ids, p_conn, GUINT_TO_POINTER(id + 1));
+	for (i = 0; i < N_FIELDS; i++)
+		add_postings(cs, id, e.field[i]);
+}
+
+/* drops dead entries and renumbers the live ones */
+static void rebuild(ConnSearch *cs)
+{
+	GPtrArray *live;
+	SearchEntry *e;
+	int i;
+	live = g_ptr_array_sized_new(cs->entries->len - cs->n_dead);
+	for (i = 0; i < cs->entries->len; i++) {
+		e = &g_array_index(cs->entries, SearchEntry, i);
+		if (e->conn)
+			g_ptr_array_add(live, e->conn);
+	}
+	clear_entries(cs);
+	for (i = 0; i < live->len; i++)
+		index_entry(cs, g_ptr_array_index(live, i));
+	log_debug("search index rebuilt, %d entries\n", live->len);
+	g_ptr_array_free(live, TRUE);
+}
+
+void conn_search_add(ConnSearch *cs, Connection *p_conn)
+{
+	if (g_hash_table_contains(cs->ids, p_conn))
+		return;
+	index_entry(cs, p_conn);
+}
+
+void conn_search_remove(ConnSearch *cs, Connection *p_conn)
+{
+	SearchEntry *e;
+	guint id;
+	id = GPOINTER_TO_UINT(g_hash_table_lookup(cs->ids, p_conn));
+	if (id == 0)
+		return;
+	g_hash_table_remove(cs->ids, p_conn);
+	e = &g_array_index(cs->entries, SearchEntry, id - 1);
+	g_free(e->field[0]);
+	memset(e, 0, sizeof(SearchEntry));
+	cs->n_dead ++;
+	if (cs->n_dead > 1024 && cs->n_dead > cs->entries->len / 2)
+		rebuild(cs);
+}
+
+/*
+ * ranking: exact name first, then name and host prefixes, then
+ * matches inside name, host and users; earlier positions rank higher
+ */
+static int score_entry(SearchEntry *e, const char *q)
+{
+	static const int weight[N_FIELDS] = { 400, 300, 200, 100 };
+	const char *m;
+	int i, score = 0, s;
+	if (!strcmp(e->field[FIELD_NAME], q))
+		return 1000;
+	for (i = 0; i < N_FIELDS; i++) {
+		m = strstr(e->field[i], q);
+		if (m == NULL)
+			continue;
+		if (m == e->field[i])
+			s = weight[i] + 50;
+		else
+			s = weight[i] - MIN(m - e->field[i], 49);
+		score = MAX(score, s);
+	}
+	return score;
+}
+
+static gint result_cmp(gconstpointer a, gconstpointer b)
+{
+	const SearchResult *r1 = a, *r2 = b;
+	if (r1->score != r2->score)
+		return r2->score - r1->score;
+	return strcasecmp(r1->conn->name, r2->conn->name);
+}
+
+static void match_entry(SearchEntry *e, const char *q, GArray *results)
+{
+	SearchResult r;
+	if (!e->conn)
+		return;
+	r.score = score_entry(e, q);
+	if (r.score > 0) {
+		r.conn = e->conn;
+		g_array_append_val(results, r);
+	}
+}
+
+/**
+ * conn_search_query() - finds connections whose name, host or users contain query
+ * @return array of Connection *, best matches first (to be freed by the caller)
+ */
+GPtrArray *conn_search_query(ConnSearch *cs, const char *query, guint max_results)
+{
+	GArray *results, *postings, *shortest = NULL;
+	GPtrArray *ret;
+	gchar *q;
+	gsize qlen;
+	int i;
+	q = g_strdup(query);
+	fold(q);
+	qlen = strlen(q);
+	results = g_array_new(FALSE, FALSE, sizeof(SearchResult));
+	if (qlen < 3) {
+		for (i = 0; i < cs->entries->len; i++)
+			match_entry(&g_array_index(cs->entries, SearchEntry, i), q, results);
+	} else {
+		for (i = 0; i + 2 < qlen; i++) {
+			postings = g_hash_table_lookup(cs->trigrams, GUINT_TO_POINTER(TRIGRAM(q + i)));
+			if (!postings) {
+				shortest = NULL;
+				break;
+			}
+			if (!shortest || postings->len < shortest->len)
+				shortest = postings;
+		}
+		for (i = 0; shortest && i < shortest->len; i++)
+			match_entry(&g_array_index(cs->entries, SearchEntry, g_array_index(shortest, guint32, i)), q, results);
+	}
+	g_array_sort(results, result_cmp);
+	ret = g_ptr_array_sized_new(MIN(results->len, max_results));
+	for (i = 0; i < results->len && i < max_results; i++)
+		g_ptr_array_add(ret, g_array_index(results, SearchResult, i).conn);
+	g_array_free(results, TRUE);
+	g_free(q);
+	return ret;
+}
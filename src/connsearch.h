@@ -0,0 +1,20 @@
+
+#ifndef _CONNSEARCH_H
+#define _CONNSEARCH_H
+
+#include <glib.h>
+
+struct _Connection;
+
+/* rows shown by the connection manager for a search */
+#define CONN_SEARCH_MAX_RESULTS 1000
+
+typedef struct _ConnSearch ConnSearch;
+
+ConnSearch *conn_search_new(void);
+void conn_search_free(ConnSearch *cs);
+void conn_search_add(ConnSearch *cs, struct _Connection *p_conn);
+void conn_search_remove(ConnSearch *cs, struct _Connection *p_conn);
+GPtrArray *conn_search_query(ConnSearch *cs, const char *query, guint max_results);
+
+#endif
@@ -0,0 +1,368 @@
+/**
+ * Copyright (C) 2009-2017 Fabio Leone
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * @file connwatch.c
+ * @brief Live reload of connections.xml and connections.d changed by other programs
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <gio/gio.h>
+#include "connection.h"
+#include "connjournal.h"
+#include "conncache.h"
+#include "connwatch.h"
+#include "gui.h"
+#include "main.h"
+#include "timerwheel.h"
+
+/*
+ * The file is watched with a GFileMonitor (inotify). Our own writes are
+ * recognized by the stat of the file left by save_connections(); other
+ * changes are parsed in a worker thread and merged into conn_list on the
+ * main thread, entry by entry, so views follow through the list
+ * notifications. Connections with changes still in the journal keep the
+ * local version; if the file changed them too it's a conflict.
+ * connections.d is watched too: its files are read-only for us, so they
+ * are simply reloaded all together and merged the same way.
+ */
+
+#define RELOAD_XML 1
+#define RELOAD_SHARDS 2
+
+struct Reload {
+	int what;
+	ConnectionList *p_xml;      /* NULL if not reloaded or unreadable */
+	ConnectionList *p_shards;
+};
+
+static struct {
+	GFileMonitor *monitor;
+	GFileMonitor *dir_monitor;
+	gchar *xml_file;
+	gchar *cache_file;
+	gchar *dir;
+	WheelTimer *timer;
+	GThread *thread;
+	int pending;              /* RELOAD_* to do when the timeout expires */
+	gboolean again;           /* changed again while reloading */
+	GMutex mutex;             /* protects saved, written by the journal thread */
+	struct stat saved;        /* connections.xml as we last wrote it */
+} watch;
+
+/* conn_watch_saved() - records a write of connections.xml, so that it's not reloaded */
+void conn_watch_saved(const struct stat *st)
+{
+	g_mutex_lock(&watch.mutex);
+	watch.saved = *st;
+	g_mutex_unlock(&watch.mutex);
+}
+
+static gboolean is_own_write(void)
+{
+	struct stat st;
+	gboolean ret;
+	if (stat(watch.xml_file, &st))
+		return TRUE;    /* deleted: keep what we have, it'll be written back */
+	g_mutex_lock(&watch.mutex);
+	ret = st.st_ino == watch.saved.st_ino && st.st_size == watch.saved.st_size
+	      && st.st_mtim.tv_sec == watch.saved.st_mtim.tv_sec && st.st_mtim.tv_nsec == watch.saved.st_mtim.tv_nsec;
+	g_mutex_unlock(&watch.mutex);
+	return ret;
+}
+
+static gboolean same_connection(Connection *c1, Connection *c2)
+{
+	GByteArray *b1, *b2;
+	gboolean ret;
+	if (strcmp(c1->shard, c2->shard))
+		return FALSE;
+	b1 = g_byte_array_new();
+	b2 = g_byte_array_new();
+	conn_pack(b1, c1);
+	conn_pack(b2, c2);
+	ret = b1->len == b2->len && memcmp(b1->data, b2->data, b1->len) == 0;
+	g_byte_array_free(b1, TRUE);
+	g_byte_array_free(b2, TRUE);
+	return ret;
+}
+
+/* TRUE if the file version of a connection differs from the one last saved */
+static gboolean file_changed(Connection *p_file, GByteArray *base)
+{
+	GByteArray *b;
+	gboolean ret;
+	if (p_file == NULL || base == NULL)
+		return p_file != NULL || base != NULL;
+	b = g_byte_array_new();
+	conn_pack(b, p_file);
+	ret = b->len != base->len || memcmp(b->data, base->data, b->len);
+	g_byte_array_free(b, TRUE);
+	return ret;
+}
+
+static void collect_cb(gpointer data, gpointer user_data)
+{
+	g_ptr_array_add((GPtrArray *) user_data, data);
+}
+
+/* merges a connection found in p_cl (p_conn) and/or in the new file (p_file) */
+static void merge_one(ConnectionList *p_cl, const char *name, Connection *p_conn, Connection *p_file,
+                      gboolean shards, ConnMergeStats *stats, GString *conflicts)
+{
+	GByteArray *base;
+	if (shards) {
+		/* connections.xml hides connections.d, local changes included */
+		if (p_conn && !p_conn->shard[0])
+			return;
+	} else if (conn_journal_dirty(name, &base)) {
+		if (file_changed(p_file, base)) {
+			stats->n_conflicts ++;
+			if (conflicts)
+				g_string_append_printf(conflicts, "%s%s", conflicts->len ? ", " : "", name);
+		}
+		return;
+	}
+	if (p_conn && p_file) {
+		if (!same_connection(p_conn, p_file)) {
+			cl_update(p_cl, p_conn, p_file);
+			stats->n_changed ++;
+		}
+	} else if (p_file) {
+		cl_insert_sorted(p_cl, p_file);
+		stats->n_added ++;
+	} else if (p_conn) {
+		cl_remove(p_cl, name);
+		stats->n_removed ++;
+	}
+}
+
+/**
+ * conn_merge() - applies to p_cl the differences with p_new
+ * Only added, changed and removed entries are touched.
+ * @param[in] shards TRUE if p_new has the connections of connections.d, FALSE for connections.xml
+ * @param[out] conflicts names of the conflicting connections, may be NULL
+ */
+void conn_merge(ConnectionList *p_cl, ConnectionList *p_new, gboolean shards, ConnMergeStats *stats, GString *conflicts)
+{
+	GPtrArray *current, *incoming;
+	Connection *c;
+	int i;
+	memset(stats, 0, sizeof(ConnMergeStats));
+	/* snapshots: the list changes while merging */
+	current = g_ptr_array_new_with_free_func((GDestroyNotify) connection_unref);
+	incoming = g_ptr_array_new();
+	cl_foreach(p_cl, collect_cb, current);
+	for (i = 0; i < current->len; i++)
+		connection_ref(g_ptr_array_index(current, i));
+	cl_foreach(p_new, collect_cb, incoming);
+	for (i = 0; i < current->len; i++) {
+		c = g_ptr_array_index(current, i);
+		if (!c->shard[0] == !shards && cl_get_by_name(p_new, c->name) == NULL)
+			merge_one(p_cl, c->name, c, NULL, shards, stats, conflicts);
+	}
+	for (i = 0; i < incoming->len; i++) {
+		c = g_ptr_array_index(incoming, i);
+		merge_one(p_cl, c->name, cl_get_by_name(p_cl, c->name), c, shards, stats, conflicts);
+	}
+	g_ptr_array_free(current, TRUE);
+	g_ptr_array_free(incoming, TRUE);
+}
+
+static void schedule_reload(int what);
+
+static void merge_reloaded(ConnectionList *p_new, gboolean shards, const char *source)
+{
+	ConnMergeStats stats;
+	GString *conflicts = g_string_new("");
+	conn_merge(conn_list, p_new, shards, &stats, conflicts);
+	log_write("%s reloaded: %d added, %d changed, %d removed, %d conflicts\n", source,
+	          stats.n_added, stats.n_changed, stats.n_removed, stats.n_conflicts);
+	if (stats.n_conflicts)
+		msgbox_info("Connections changed by another program and not saved here:\n%s\n\nYour changes have been kept.", conflicts->str);
+	g_string_free(conflicts, TRUE);
+}
+
+static gboolean reload_done(gpointer data)
+{
+	struct Reload *r = data;
+	if (watch.thread) {
+		g_thread_join(watch.thread);
+		watch.thread = NULL;
+	}
+	if (watch.monitor) {
+		if (r->p_xml)
+			merge_reloaded(r->p_xml, FALSE, watch.xml_file);
+		if (r->p_shards)
+			merge_reloaded(r->p_shards, TRUE, watch.dir);
+	}
+	cl_release(r->p_xml);
+	cl_release(r->p_shards);
+	g_free(r);
+	if (watch.again) {
+		watch.again = FALSE;
+		schedule_reload(0);
+	}
+	return G_SOURCE_REMOVE;
+}
+
+static gpointer reload_thread(gpointer data)
+{
+	struct Reload *r = data;
+	struct stat st;
+	if (r->what & RELOAD_XML) {
+		r->p_xml = cl_new();
+		if (load_connection_list_from_file_xml(watch.xml_file, r->p_xml, &st)) {
+			cl_release(r->p_xml);
+			r->p_xml = NULL;
+		} else
+			conn_cache_update(r->p_xml, watch.cache_file, &st);
+	}
+	if (r->what & RELOAD_SHARDS) {
+		/* unreadable files (being rewritten?) keep their connections until the next change */
+		r->p_shards = cl_new();
+		if (load_connection_shards(watch.dir, r->p_shards)) {
+			cl_release(r->p_shards);
+			r->p_shards = NULL;
+		}
+	}
+	g_idle_add(reload_done, r);
+	return NULL;
+}
+
+static gboolean reload_timeout_cb(gpointer data)
+{
+	struct Reload *r;
+	watch.timer = NULL;
+	if (watch.thread) {
+		watch.again = TRUE;
+		return G_SOURCE_REMOVE;
+	}
+	if ((watch.pending & RELOAD_XML) && is_own_write())
+		watch.pending &= ~RELOAD_XML;
+	if (watch.pending == 0)
+		return G_SOURCE_REMOVE;
+	r = g_new0(struct Reload, 1);
+	r->what = watch.pending;
+	watch.pending = 0;
+	log_write("%s changed, reloading\n", r->what & RELOAD_XML ? watch.xml_file : watch.dir);
+	watch.thread = g_thread_new("connwatch", reload_thread, r);
+	return G_SOURCE_REMOVE;
+}
+
+/* schedule_reload() - adds what to the pending reloads, 0 to retry the pending ones */
+static void schedule_reload(int what)
+{
+	watch.pending |= what;
+	if (watch.timer)
+		wheel_timer_restart(watch.timer, CONN_WATCH_DELAY_MS);
+	else
+		watch.timer = wheel_timer_add(CONN_WATCH_DELAY_MS, reload_timeout_cb, NULL);
+}
+
+static void file_changed_cb(GFileMonitor *monitor, GFile *file, GFile *other_file, GFileMonitorEvent event_type, gpointer user_data)
+{
+	switch (event_type) {
+	case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+	case G_FILE_MONITOR_EVENT_CREATED:
+	case G_FILE_MONITOR_EVENT_MOVED_IN:
+	case G_FILE_MONITOR_EVENT_RENAMED:
+		schedule_reload(RELOAD_XML);
+		break;
+	default:
+		break;
+	}
+}
+
+static void dir_changed_cb(GFileMonitor *monitor, GFile *file, GFile *other_file, GFileMonitorEvent event_type, gpointer user_data)
+{
+	switch (event_type) {
+	case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+	case G_FILE_MONITOR_EVENT_DELETED:
+	case G_FILE_MONITOR_EVENT_MOVED_IN:
+	case G_FILE_MONITOR_EVENT_MOVED_OUT:
+	case G_FILE_MONITOR_EVENT_RENAMED:
+		schedule_reload(RELOAD_SHARDS);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * conn_watch_start() - reloads xml_file and the files in dir when changed by someone else
+ * Call once conn_list is loaded.
+ */
+void conn_watch_start(const char *xml_file, const char *cache_file, const char *dir)
+{
+	GFile *file;
+	GError *error = NULL;
+	if (watch.monitor)
+		return;
+	file = g_file_new_for_path(xml_file);
+	/* atomic replacements by other tools are seen as renames */
+	watch.monitor = g_file_monitor_file(file, G_FILE_MONITOR_WATCH_MOVES, NULL, &error);
+	g_object_unref(file);
+	if (!watch.monitor) {
+		log_write("[%s] can't watch %s: %s\n", __func__, xml_file, error->message);
+		g_error_free(error);
+		return;
+	}
+	watch.xml_file = g_strdup(xml_file);
+	watch.cache_file = g_strdup(cache_file);
+	g_signal_connect(watch.monitor, "changed", G_CALLBACK(file_changed_cb), NULL);
+	/* the directory may be created later: then it's seen at the next start */
+	if (g_file_test(dir, G_FILE_TEST_IS_DIR)) {
+		file = g_file_new_for_path(dir);
+		watch.dir_monitor = g_file_monitor_directory(file, G_FILE_MONITOR_WATCH_MOVES, NULL, &error);
+		g_object_unref(file);
+		if (watch.dir_monitor)
+			g_signal_connect(watch.dir_monitor, "changed", G_CALLBACK(dir_changed_cb), NULL);
+		else {
+			log_write("[%s] can't watch %s: %s\n", __func__, dir, error->message);
+			g_error_free(error);
+		}
+	}
+	watch.dir = g_strdup(dir);
+}
+
+/* conn_watch_stop() - stops watching, a reload in progress is discarded */
+void conn_watch_stop(void)
+{
+	if (!watch.monitor)
+		return;
+	g_file_monitor_cancel(watch.monitor);
+	g_object_unref(watch.monitor);
+	watch.monitor = NULL;
+	if (watch.dir_monitor) {
+		g_file_monitor_cancel(watch.dir_monitor);
+		g_object_unref(watch.dir_monitor);
+		watch.dir_monitor = NULL;
+	}
+	watch.pending = 0;
+	wheel_timer_cancel(watch.timer);
+	watch.timer = NULL;
+	if (watch.thread) {
+		g_thread_join(watch.thread);
+		watch.thread = NULL;
+	}
+	g_free(watch.xml_file);
+	g_free(watch.cache_file);
+	g_free(watch.dir);
+	watch.xml_file = watch.cache_file = watch.dir = NULL;
+}
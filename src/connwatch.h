@@ -0,0 +1,22 @@
+
+#ifndef _CONNWATCH_H
+#define _CONNWATCH_H
+
+#include "connection.h"
+
+/* changes closer than this are reloaded once */
+#define CONN_WATCH_DELAY_MS 300
+
+typedef struct _ConnMergeStats {
+	int n_added;
+	int n_changed;
+	int n_removed;
+	int n_conflicts;    /* changed both in the file and locally, local kept */
+} ConnMergeStats;
+
+void conn_watch_start(const char *xml_file, const char *cache_file, const char *dir);
+void conn_watch_stop(void);
+void conn_watch_saved(const struct stat *st);
+void conn_merge(ConnectionList *p_cl, ConnectionList *p_new, gboolean shards, ConnMergeStats *stats, GString *conflicts);
+
+#endif
@@ -28,18 +28,28 @@
 #include <openssl/md5.h>
 #include <sys/utsname.h>
 #include <sys/types.h>
-#include <sys/wait.h>
+#include <signal.h>
 #include <string.h>
 #include <time.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include "main.h"
 #include "connection.h"
+#include "import.h"
 #include "preferences.h"
 #include "profile.h"
 #include "gui.h"
 #include "utils.h"
+#include "sshmux.h"
+#include "ptypool.h"
+#include "sshbackend.h"
+#include "batchopen.h"
+#include "prober.h"
+#include "procwatch.h"
+#include "reconnect.h"
+#include "timerwheel.h"
 #include "terminal.h"
+#include "ptyio.h"
 
 extern Globals globals;
 extern Prefs prefs;
@@ -88,6 +98,8 @@ GActionEntry main_menu_items[] = {
 	{ "log_on", connection_log_on },
 	{ "log_off", connection_log_off },
 	{ "duplicate", connection_duplicate },
+	{ "auto_reconnect", connection_toggle_auto_reconnect },
+	{ "import", connection_import },
 	{ "quit", application_quit },
 
 	{ "copy", edit_copy },
@@ -99,6 +111,8 @@ GActionEntry main_menu_items[] = {
 	{ "pref", show_preferences },
 
 	{ "reset", terminal_reset },
+	{ "pause_output", terminal_toggle_pause_output },
+	{ "output_rate", terminal_output_rate },
 	{ "detach_right", terminal_detach_right },
 	{ "detach_down", terminal_detach_down },
 	{ "attach_current", terminal_attach_current_to_main },
@@ -176,15 +190,22 @@ gint msgbox_yes_no(const char *fmt, ...)
 	return result;
 }
 
-/**
- * child_exit() - handler of SIGCHLD
- */
-static void child_exit()
+/* child_exit() - the process of a tab ended, reported by procwatch.c */
+static void child_exit(GPid pid, const ProcExit *info, gpointer data)
 {
-	int pid, status;
-	pid = wait(&status);
-	if (status > 0)
-		printf("process %d terminated with code %d (%s)\n", pid, status, strerror(status));
+	struct ConnectionTab *p_ct = data;
+	char desc[64];
+	p_ct->pid = 0;
+	log_write("%s: process %d %s after %.1f s, cpu %.2f s\n", p_ct->connection->name, pid,
+	          proc_exit_desc(info, desc, sizeof(desc)), info->lifetime / 1e6, info->cpu / 1e6);
+	child_exited_cb(VTE_TERMINAL(p_ct->vte), info->status, p_ct);
+}
+
+/* connection_tab_watch_child() - the process started in a tab */
+void connection_tab_watch_child(struct ConnectionTab *p_ct, GPid pid)
+{
+	p_ct->pid = pid;
+	proc_watch(pid, child_exit, p_ct);
 }
 
 void tabInitConnection(SConnectionTab *pConn)
@@ -205,9 +226,33 @@ char *tabGetConnectionStatusDesc(int status)
 
 void tabSetConnectionStatus(SConnectionTab *pConn, int status)
 {
+	if (status == TAB_CONN_STATUS_CONNECTED && pConn->connectionStatus != TAB_CONN_STATUS_CONNECTED)
+		pConn->connected_time = g_get_monotonic_time();
 	pConn->connectionStatus = status;
 }
 
+/* tabSetMuxState() - records if the tab shares its ssh connection, shown in the tab tooltip */
+void tabSetMuxState(SConnectionTab *pConn, int state)
+{
+	pConn->mux_state = state;
+	tabUpdateTooltip(pConn);
+}
+
+/* tabUpdateTooltip() - name, connection sharing and reconnection state of the tab */
+void tabUpdateTooltip(SConnectionTab *pConn)
+{
+	gchar *tooltip;
+	const char *reconnect;
+	char buf[128];
+	if (!GTK_IS_WIDGET(pConn->label))
+		return;
+	reconnect = reconnect_desc(pConn, buf, sizeof(buf));
+	tooltip = g_strdup_printf("%s\n%s%s%s", pConn->connection->name, ssh_mux_state_desc(pConn->mux_state),
+	                          reconnect ? "\n" : "", reconnect ? reconnect : "");
+	gtk_widget_set_tooltip_text(pConn->label, tooltip);
+	g_free(tooltip);
+}
+
 int tabGetConnectionStatus(SConnectionTab *pConn)
 {
 	return (pConn->connectionStatus);
@@ -218,6 +263,26 @@ int tabIsConnected(SConnectionTab *pConn)
 	return (pConn->connectionStatus >= TAB_CONN_STATUS_CONNECTED);
 }
 
+/**
+ * tabApplyOutputLimits() - gives the pause and the byte rate of the tab to what reads its output
+ * A libssh channel (see sshbackend.c) or the reader of ptyio.c.
+ * @return 0 if ok, 1 if the terminal reads its pty itself and can't be limited
+ */
+int tabApplyOutputLimits(SConnectionTab *pConn)
+{
+	PtyIO *io;
+	if (pConn->ssh_channel) {
+		ssh_backend_set_output(pConn, pConn->output_paused, pConn->output_rate * 1024);
+		return 0;
+	}
+	io = pty_io_get(VTE_TERMINAL(pConn->vte));
+	if (io == NULL)
+		return 1;
+	pty_io_pause(io, pConn->output_paused);
+	pty_io_set_rate(io, pConn->output_rate * 1024);
+	return 0;
+}
+
 void tabSetFlag(SConnectionTab *pConn, unsigned int bitmask)
 {
 	pConn->flags |= bitmask;
@@ -247,11 +312,13 @@ static void set_title(char *user_s)
 
 /**
  * query_value() - open a dialog asking for a parameter value
+ * @param[out] buffer receiving the value, truncated to size
  * @return length of value or -1 if user cancelled operation
  */
-static int query_value(char *title, char *labeltext, char *default_value, char *buffer, int type)
+static int query_value(char *title, char *labeltext, char *default_value, char *buffer, gsize size, int type)
 {
 	int ret;
+	const gchar *end;
 	char imagefile[256];
 	GtkWidget *dialog;
 	GtkWidget *p_label;
@@ -266,7 +333,7 @@ static int query_value(char *title, char *labeltext, char *default_value, char *
 	gtk_box_set_spacing(GTK_BOX(gtk_dialog_get_content_area(GTK_DIALOG(dialog))), 10);
 	gtk_container_set_border_width(GTK_CONTAINER(dialog), 5);
 	user_entry = gtk_entry_new();
-	gtk_entry_set_max_length(GTK_ENTRY(user_entry), 512);
+	gtk_entry_set_max_length(GTK_ENTRY(user_entry), MIN(size - 1, 512));
 	gtk_entry_set_text(GTK_ENTRY(user_entry), default_value);
 	gtk_entry_set_activates_default(GTK_ENTRY(user_entry), TRUE);
 	gtk_entry_set_visibility(GTK_ENTRY(user_entry), type == QUERY_PASSWORD ? FALSE : TRUE);
@@ -317,7 +384,10 @@ static int query_value(char *title, char *labeltext, char *default_value, char *
 	gint result = gtk_dialog_run(GTK_DIALOG(dialog));
 	strcpy(buffer, "");
 	if (result == GTK_RESPONSE_OK) {
-		strcpy(buffer, gtk_entry_get_text(GTK_ENTRY(user_entry)));
+		g_strlcpy(buffer, gtk_entry_get_text(GTK_ENTRY(user_entry)), size);
+		/* no character cut in half */
+		g_utf8_validate(buffer, -1, &end);
+		*(char *) end = 0;
 		ret = strlen(buffer);
 	} else
 		ret = -1;
@@ -326,86 +396,70 @@ static int query_value(char *title, char *labeltext, char *default_value, char *
 }
 
 /**
- * expand_args() - expands command line parameters
- * @param[in] p_conn pointer to chosen connection (ip, port)
- * @param[in] args string to be expanded
- * @param[in] prefix a static string to put before expended
- * @param[out] dest string buffer receiving the expanded string
- * @return 0 if ok, 1 otherwise
+ * expand_arg() - value of a command line variable, see cmd_template_expand()
+ * %h host, %p port, %u user, %P password (asked if needed), %k keep alive
+ * interval, %t connect timeout, %i identity file, %m control socket, %c
+ * control socket persistence, %a address found by the prober
+ * @param[in] data the chosen connection, receiving user and password
+ * @return the value, NULL if the user cancelled a question
  */
-int expand_args(Connection *p_conn, char *args, char *prefix, char *dest)
+const char *expand_arg(int var, char *buf, gsize size, gpointer data)
 {
-	int i, c, i_dest;
-	int go_on;
-	char expanded[256];
+	Connection *p_conn = data;
 	char title[256];
 	char label[512];
-	i = 0;
-	go_on = 1;
-	strcpy(dest, prefix != NULL ? prefix : "");
-	if (prefix)
-		strcat(dest, " ");
-	i_dest = strlen(dest);
-	while (go_on > 0 && i < strlen(args)) {
-		c = args[i];
-		if (c == '%') {
-			i ++;
-			c = args[i];
-			switch (c) {
-			/* host */
-			case 'h':
-				strcpy(expanded, p_conn->host);
-				break;
-			/* port */
-			case 'p':
-				sprintf(expanded, "%d", p_conn->port);
-				break;
-			/* user */
-			case 'u':
-				if (p_conn->auth_mode == CONN_AUTH_MODE_SAVE || p_conn->user[0]) {
-					strcpy(expanded, p_conn->user);
-				} else {
-					strcpy(title, "Log on");
-					sprintf(label, ("Enter user for <b>%s</b>:"), p_conn->name);
-					go_on = query_value(title, label, p_conn->last_user, expanded, QUERY_USER);
-					strcpy(p_conn->user, expanded);
-					//p_conn->auth_flags |= AUTH_STEP_USER;
-				}
-				rtrim(p_conn->user);
-				if (p_conn->user[0] != 0) {
-					strcpy(p_conn->last_user, p_conn->user);
-					if (conn_update_last_user(p_conn->name, p_conn->last_user))
-						printf("unable to update last user '%s' for connection %s\n", p_conn->user, p_conn->name);
-				}
-				break;
-			/* password */
-			case 'P':
-				if (p_conn->auth_mode == CONN_AUTH_MODE_SAVE || p_conn->password[0]) {
-					strcpy(expanded, p_conn->password);
-				} else {
-					strcpy(title, "Log on");
-					sprintf(label, ("Enter password for <b>%s@%s</b>:"), p_conn->user, p_conn->name);
-					go_on = query_value(title, label, "", expanded, QUERY_PASSWORD);
-					strcpy(p_conn->password, expanded);
-				}
-				break;
-			case '%':
-				strcpy(expanded, "%");
-				break;
-			default:
-				strcpy(expanded, "");
-				break;
-			}
-			strcat(dest, expanded);
-			i_dest += strlen(expanded);
+	switch (var) {
+	case 'h':
+		return p_conn->host;
+	case 'p':
+		g_snprintf(buf, size, "%d", p_conn->port);
+		return buf;
+	case 'k':
+		g_snprintf(buf, size, "%d", p_conn->sshOptions.keepAliveInterval);
+		return buf;
+	case 't':
+		g_snprintf(buf, size, "%d", p_conn->sshOptions.connectTimeout);
+		return buf;
+	case 'i':
+		return p_conn->identityFile;
+	case 'm':
+		return NVL(ssh_mux_path(p_conn, buf, size), "none");
+	case 'a':
+		return NVL(prober_address(p_conn->host, p_conn->port), p_conn->host);
+	case 'c':
+		if (prefs.ssh_mux_persist <= 0)
+			return "no";
+		g_snprintf(buf, size, "%d", prefs.ssh_mux_persist);
+		return buf;
+	case 'u':
+		if (p_conn->auth_mode == CONN_AUTH_MODE_SAVE || p_conn->user[0]) {
+			g_strlcpy(buf, p_conn->user, size);
 		} else {
-			dest[i_dest] = c;
-			dest[i_dest + 1] = 0;
-			i_dest ++;
+			strcpy(title, "Log on");
+			sprintf(label, ("Enter user for <b>%s</b>:"), p_conn->name);
+			if (query_value(title, label, (char *) p_conn->last_user, buf, size, QUERY_USER) <= 0)
+				return NULL;
+		}
+		rtrim(buf);
+		conn_set(p_conn->user, buf);
+		if (p_conn->user[0] != 0) {
+			p_conn->last_user = p_conn->user;
+			if (conn_update_last_user(p_conn->name, p_conn->last_user))
+				log_write("[%s] unable to update last user '%s' for connection %s\n", __func__, p_conn->user, p_conn->name);
 		}
-		i++;
+		return p_conn->user;
+	case 'P':
+		if (p_conn->auth_mode != CONN_AUTH_MODE_SAVE && !p_conn->password[0]) {
+			strcpy(title, "Log on");
+			sprintf(label, ("Enter password for <b>%s@%s</b>:"), p_conn->user, p_conn->name);
+			if (query_value(title, label, "", buf, size, QUERY_PASSWORD) <= 0)
+				return NULL;
+			connection_set_password(p_conn, buf);
+		}
+		return p_conn->password;
+	default:
+		return "";
 	}
-	return (go_on > 0 ? 0 : 1);
 }
 
 static int connection_tab_count(void)
@@ -440,7 +494,7 @@ void connection_tab_close(struct ConnectionTab *p_ct)
 	int page, retcode, can_close;
 	char prompt[512];
 	if (tabIsConnected(p_ct)) {
-		sprintf(prompt, ("Close connection to %s?"), p_ct->connection.name);
+		sprintf(prompt, ("Close connection to %s?"), p_ct->connection->name);
 		retcode = msgbox_yes_no(prompt);
 		if (retcode == GTK_RESPONSE_YES)
 			can_close = 1;
@@ -449,13 +503,22 @@ void connection_tab_close(struct ConnectionTab *p_ct)
 	} else
 		can_close = 1;
 	if (can_close) {
+		reconnect_cancel(p_ct);
+		if (p_ct->status_timer) {
+			wheel_timer_cancel(p_ct->status_timer);
+			p_ct->status_timer = NULL;
+		}
+		ssh_backend_log_off(p_ct);
+		/* the child ends with its pty, it's still reaped */
+		if (p_ct->pid)
+			proc_unwatch(p_ct->pid);
 		// Regroup this tab to adjust the view
 		if (p_ct->notebook != notebook)
 			terminal_attach_to_main(p_ct);
 		page = gtk_notebook_page_num(GTK_NOTEBOOK(p_ct->notebook), p_ct->hbox_terminal);
 		log_write("page = %d\n", page);
 		if (page >= 0) {
-			log_write("Removing page %d %s\n", page, p_ct->connection.name);
+			log_write("Removing page %d %s\n", page, p_ct->connection->name);
 			gtk_notebook_remove_page(GTK_NOTEBOOK(p_ct->notebook), page);
 			connection_tab_list = g_list_remove(connection_tab_list, p_ct);
 			if (gtk_notebook_get_n_pages(GTK_NOTEBOOK(notebook)) == 0)
@@ -477,14 +540,16 @@ static struct ConnectionTab * connection_tab_new()
 	connection_tab = g_new0(struct ConnectionTab, 1);
 	connection_tab_list = g_list_append(connection_tab_list, connection_tab);
 	connection_tab->vte = vte_terminal_new();
-	g_signal_connect(connection_tab->vte, "child-exited", G_CALLBACK(child_exited_cb), connection_tab);
 	g_signal_connect(connection_tab->vte, "eof", G_CALLBACK(eof_cb), connection_tab);
 //	g_signal_connect(connection_tab->vte, "button-press-event", G_CALLBACK(button_press_event_cb), connection_tab->vte);
 	g_signal_connect(connection_tab->vte, "selection-changed", G_CALLBACK(selection_changed_cb), connection_tab);
 	g_signal_connect(connection_tab->vte, "contents-changed", G_CALLBACK(contents_changed_cb), connection_tab);
 	g_signal_connect(connection_tab->vte, "grab-focus", G_CALLBACK(terminal_focus_cb), connection_tab);
 	tabInitConnection(connection_tab);
-	memset(&connection_tab->connection, 0, sizeof(Connection));
+	connection_tab->auto_reconnect = prefs.auto_reconnect;
+	connection_tab->output_rate = prefs.rate_limit;
+	connection_tab->connection = connection_new();
+	connection_tab->last_connection = connection_new();
 	return (connection_tab);
 }
 
@@ -506,7 +571,7 @@ void connection_tab_add(struct ConnectionTab *connection_tab, gboolean dup)
 	gtk_box_set_spacing(GTK_BOX(tab_label), 8);
 	GtkWidget *image_type;
 	image_type = gtk_image_new_from_icon_name("network-workgroup", GTK_ICON_SIZE_MENU);
-	connection_tab->label = gtk_label_new(connection_tab->connection.name);
+	connection_tab->label = gtk_label_new(connection_tab->connection->name);
 	close_button = gtk_button_new();
 	gtk_button_set_relief(GTK_BUTTON(close_button), GTK_RELIEF_NONE);
 	gtk_container_set_border_width(GTK_CONTAINER(close_button), 0);
@@ -519,10 +584,10 @@ void connection_tab_add(struct ConnectionTab *connection_tab, gboolean dup)
 	gtk_widget_show_all(tab_label);
 	if (dup) {
 		new_pagenum = gtk_notebook_get_current_page(GTK_NOTEBOOK(notebook)) + 1;
-		gtk_notebook_insert_page_menu(GTK_NOTEBOOK(notebook), connection_tab->hbox_terminal, tab_label, gtk_label_new(connection_tab->connection.name), new_pagenum);
+		gtk_notebook_insert_page_menu(GTK_NOTEBOOK(notebook), connection_tab->hbox_terminal, tab_label, gtk_label_new(connection_tab->connection->name), new_pagenum);
 	} else {
 		new_pagenum = gtk_notebook_get_n_pages(GTK_NOTEBOOK(notebook));
-		gtk_notebook_append_page_menu(GTK_NOTEBOOK(notebook), connection_tab->hbox_terminal, tab_label, gtk_label_new(connection_tab->connection.name));
+		gtk_notebook_append_page_menu(GTK_NOTEBOOK(notebook), connection_tab->hbox_terminal, tab_label, gtk_label_new(connection_tab->connection->name));
 	}
 	gtk_notebook_set_tab_reorderable(GTK_NOTEBOOK(notebook), connection_tab->hbox_terminal, TRUE);
 	gtk_notebook_set_tab_detachable(GTK_NOTEBOOK(notebook), connection_tab->hbox_terminal, FALSE);
@@ -590,31 +655,72 @@ int connection_tab_getcwd(struct ConnectionTab *p_ct, char *directory)
 	return 0;
 }
 
-void connection_log_on_param(Connection *p_conn)
+/**
+ * connection_log_on_param() - opens a tab for a connection, chosen by the user if NULL
+ * @return the new tab, NULL if the user cancelled
+ */
+struct ConnectionTab *connection_log_on_param(Connection *p_conn)
 {
 	int retcode = 0;
 	struct ConnectionTab *p_connection_tab;
 	p_connection_tab = connection_tab_new();
 	if (p_conn) {
-		connection_copy(&p_connection_tab->connection, p_conn);
+		connection_unref(p_connection_tab->connection);
+		p_connection_tab->connection = connection_ref(p_conn);
 		p_connection_tab->auth_attempt = 0;
 		tabResetFlag(p_connection_tab, TAB_LOGGED);
-		log_debug("connection '%s' log on with user '%s'\n", p_connection_tab->connection.name, p_connection_tab->connection.user);
+		log_debug("connection '%s' log on with user '%s'\n", p_connection_tab->connection->name, p_connection_tab->connection->user);
 	} else
 		retcode = choose_manage_connection(&p_connection_tab->connection);
 	if (retcode == 0) {
-		if (p_connection_tab->connection.auth_mode == CONN_AUTH_MODE_SAVE && p_connection_tab->connection.auth_user[0])
-			strcpy(p_connection_tab->connection.user, p_connection_tab->connection.auth_user);
-		if (p_connection_tab->connection.auth_mode == CONN_AUTH_MODE_SAVE && p_connection_tab->connection.auth_password[0])
-			strcpy(p_connection_tab->connection.password, p_connection_tab->connection.auth_password);
+		if (p_connection_tab->connection->auth_mode == CONN_AUTH_MODE_SAVE) {
+			Connection *c = connection_make_writable(&p_connection_tab->connection);
+			if (c->auth_user[0])
+				c->user = c->auth_user;
+			if (c->auth_password[0])
+				connection_set_password(c, c->auth_password);
+		}
 		/* Add the new tab */
+		p_connection_tab->open_time = g_get_monotonic_time();
 		connection_tab_add(p_connection_tab, (p_conn != NULL));
 		p_current_connection_tab = p_connection_tab;
 		refreshTabStatus(p_current_connection_tab);
 		log_write("Log on...\n");
 		log_on(p_connection_tab);
 		refreshTabStatus(p_current_connection_tab);
+		return p_connection_tab;
 	}
+	return NULL;
+}
+
+static void collect_conn_cb(gpointer data, gpointer user_data)
+{
+	g_ptr_array_add((GPtrArray *) user_data, connection_ref((Connection *) data));
+}
+
+/**
+ * connection_log_on_folder() - opens a tab for each connection in a folder and its subfolders
+ */
+void connection_log_on_folder(const char *folder)
+{
+	GPtrArray *conns;
+	char title[256];
+	int count;
+	count = cl_folder_count(conn_list, folder);
+	if (count == 0)
+		return;
+	if (msgbox_yes_no("Open %d connections in folder '%s'?", count, folder) != GTK_RESPONSE_YES)
+		return;
+	/* take references first: logging on may update the list */
+	conns = g_ptr_array_new_with_free_func((GDestroyNotify) connection_unref);
+	cl_foreach_in_folder(conn_list, folder, collect_conn_cb, conns);
+	g_snprintf(title, sizeof(title), "Opening folder %s", folder);
+	batch_open(title, conns);
+}
+
+static void connection_log_on_ready(gpointer data)
+{
+	connection_log_on_param(NULL);
 }
 
 /**
@@ -622,14 +728,66 @@ void connection_log_on_param(Connection *p_conn)
  */
 void connection_log_on()
 {
-	connection_log_on_param(NULL);
+	connections_when_ready(connection_log_on_ready, NULL);
+}
+
+static void connection_import_done(int rc, ConnImportStats *stats, gpointer user_data)
+{
+	if (rc)
+		msgbox_error("Can't read the selected files");
+	else
+		msgbox_info("%d connections imported\n%d hosts found, %d already present", stats->n_added, stats->n_found, stats->n_duplicates);
+}
+
+static void connection_import_ready(gpointer data)
+{
+	GtkWidget *dialog;
+	GSList *list, *l;
+	gchar **files, *ssh_dir;
+	int i;
+	dialog = gtk_file_chooser_dialog_new("Import connections", GTK_WINDOW(main_window),
+	                                     GTK_FILE_CHOOSER_ACTION_OPEN,
+	                                     "_Cancel", GTK_RESPONSE_CANCEL,
+	                                     "_Import", GTK_RESPONSE_ACCEPT,
+	                                     NULL);
+	gtk_file_chooser_set_local_only(GTK_FILE_CHOOSER(dialog), TRUE);
+	gtk_file_chooser_set_select_multiple(GTK_FILE_CHOOSER(dialog), TRUE);
+	gtk_file_chooser_set_show_hidden(GTK_FILE_CHOOSER(dialog), TRUE);
+	ssh_dir = g_build_filename(globals.home_dir, ".ssh", NULL);
+	gtk_file_chooser_set_current_folder(GTK_FILE_CHOOSER(dialog), ssh_dir);
+	g_free(ssh_dir);
+	if (gtk_dialog_run(GTK_DIALOG(dialog)) != GTK_RESPONSE_ACCEPT) {
+		gtk_widget_destroy(dialog);
+		return;
+	}
+	list = gtk_file_chooser_get_filenames(GTK_FILE_CHOOSER(dialog));
+	gtk_widget_destroy(dialog);
+	files = g_new0(gchar *, g_slist_length(list) + 1);
+	for (l = list, i = 0; l; l = l->next)
+		files[i++] = l->data;
+	g_slist_free(list);
+	conn_import(conn_list, files, "Imported", connection_import_done, NULL);
+	g_strfreev(files);
+}
+
+/**
+ * connection_import() - imports connections from ssh_config, known_hosts or inventory files
+ */
+void connection_import()
+{
+	connections_when_ready(connection_import_ready, NULL);
 }
 
 void connection_log_off()
 {
 	if (!p_current_connection_tab)
 		return;
-	if (tabIsConnected(p_current_connection_tab)) {
+	reconnect_cancel(p_current_connection_tab);
+	if (p_current_connection_tab->ssh_channel) {
+		ssh_backend_log_off(p_current_connection_tab);
+		connection_tab_disconnected(p_current_connection_tab, FALSE);
+		log_write("Terminal closed\n");
+	} else if (tabIsConnected(p_current_connection_tab) && p_current_connection_tab->pid) {
 		kill(p_current_connection_tab->pid, SIGTERM);
 		log_write("Terminal closed\n");
 		tabInitConnection(p_current_connection_tab);
@@ -643,7 +801,7 @@ void connection_duplicate()
 		return;
 	connection_tab_getcwd(p_current_connection_tab, directory);
 	/* force autentication */
-	connection_log_on_param(&p_current_connection_tab->connection);
+	connection_log_on_param(p_current_connection_tab->connection);
 }
 
 void connection_close_tab()
@@ -802,6 +960,52 @@ void terminal_reset()
 	vte_terminal_reset(VTE_TERMINAL(p_current_connection_tab->vte), TRUE, FALSE);
 }
 
+static void output_limits_unavailable(struct ConnectionTab *p_ct)
+{
+	terminal_write_ex(p_ct, "\n\rThe terminal reads its output itself, set pty_io=1 in [TERMINAL] to limit it.\n\r");
+}
+
+/* terminal_toggle_pause_output() - stops or restarts reading the output of the current tab */
+void terminal_toggle_pause_output()
+{
+	struct ConnectionTab *p_ct = p_current_connection_tab;
+	if (!p_ct)
+		return;
+	p_ct->output_paused = !p_ct->output_paused;
+	if (tabApplyOutputLimits(p_ct)) {
+		p_ct->output_paused = FALSE;
+		output_limits_unavailable(p_ct);
+		return;
+	}
+	terminal_write_ex(p_ct, "\n\rOutput %s for this tab.\n\r", p_ct->output_paused ? "paused" : "resumed");
+}
+
+/* terminal_output_rate() - asks the byte rate of the output of the current tab */
+void terminal_output_rate()
+{
+	struct ConnectionTab *p_ct = p_current_connection_tab;
+	char label[512], current[16], value[16];
+	int rate;
+	if (!p_ct)
+		return;
+	g_snprintf(current, sizeof(current), "%d", p_ct->output_rate);
+	g_snprintf(label, sizeof(label), "Output read from <b>%s</b>, in KB per second (0 for no limit):", p_ct->connection->name);
+	if (query_value("Output rate", label, current, value, sizeof(value), 0) <= 0)
+		return;
+	rate = atoi(value);
+	if (rate < 0)
+		return;
+	p_ct->output_rate = rate;
+	if (tabApplyOutputLimits(p_ct)) {
+		output_limits_unavailable(p_ct);
+		return;
+	}
+	if (rate)
+		terminal_write_ex(p_ct, "\n\rOutput limited to %d KB/s for this tab.\n\r", rate);
+	else
+		terminal_write_ex(p_ct, "\n\rOutput not limited for this tab.\n\r");
+}
+
 void moveTab(struct ConnectionTab *connTab, GtkWidget *child, GtkWidget *notebookFrom, GtkWidget *notebookTo)
 {
 	// Detach tab label
@@ -811,7 +1015,7 @@ void moveTab(struct ConnectionTab *connTab, GtkWidget *child, GtkWidget *noteboo
 	// Move terminal to the new notebook
 	g_object_ref(child);
 	gtk_container_remove(GTK_CONTAINER(notebookFrom), child);
-	gtk_notebook_append_page_menu(GTK_NOTEBOOK(notebookTo), child, tab_label, gtk_label_new(p_current_connection_tab->connection.name));
+	gtk_notebook_append_page_menu(GTK_NOTEBOOK(notebookTo), child, tab_label, gtk_label_new(p_current_connection_tab->connection->name));
 	connTab->notebook = notebookTo;
 }
 
@@ -826,7 +1030,7 @@ void terminal_detach(GtkOrientation orientation)
 	GtkWidget *child = gtk_notebook_get_nth_page(GTK_NOTEBOOK(notebook), gtk_notebook_get_current_page(GTK_NOTEBOOK(notebook)));
 	//GtkWidget *child = currentTab->hbox_terminal;
 	currentTab = get_connection_tab_from_child(child);
-	log_write("Detaching %s\n", currentTab->connection.name);
+	log_write("Detaching %s\n", currentTab->connection->name);
 	GtkWidget *parent; // Main notebook parent
 	GtkWidget *hpaned_split;
 	// Detaching a tab causes switching to another tab, so disable switch management
@@ -937,7 +1141,7 @@ void cluster_set_selected(int i, gboolean value)
 	gtk_tree_model_get_iter(model, &iter, path);
 	STabSelection *selectedTab = &g_array_index(tabSelectionArray, STabSelection, i);
 	selectedTab->selected = value;
-	log_debug("send-cluster: %s %d\n", selectedTab->pTab->connection.name, selectedTab->selected);
+	log_debug("send-cluster: %s %d\n", selectedTab->pTab->connection->name, selectedTab->selected);
 	gtk_list_store_set(GTK_LIST_STORE(model), &iter, COLUMN_CLUSTER_TERM_SELECTED, selectedTab->selected, -1);
 }
 
@@ -1023,7 +1227,7 @@ void terminal_cluster()
 	for (i = 0; i < g_list_length(connection_tab_list); i++) {
 		item = g_list_nth(connection_tab_list, i);
 		p_ct = (struct ConnectionTab *) item->data;
-		char *label = p_ct->connection.name;
+		const char *label = p_ct->connection->name;
 		if (!tabIsConnected(p_ct)) {
 			log_write("Cluster: tab %s is disconnected\n", label);
 			continue;
@@ -1070,7 +1274,7 @@ void terminal_cluster()
 		for (i = 0; i < tabSelectionArray->len; i++) {
 			STabSelection *tab = &g_array_index(tabSelectionArray, STabSelection, i);
 			if (tab->selected) {
-				log_write("Sending cluster command to %s\n", tab->pTab->connection.name);
+				log_write("Sending cluster command to %s\n", tab->pTab->connection->name);
 				terminal_write_child_ex(tab->pTab, gtk_entry_get_text(GTK_ENTRY(entry_command)));
 				terminal_write_child_ex(tab->pTab, "\n");
 			}
@@ -1192,21 +1396,48 @@ void terminal_popup_menu(GdkEventButton *event)
 }
 
 /**
- * child_exited_cb() - This signal is emitted when the terminal detects that a child started using vte_terminal_fork_command() has exited
+ * child_exited_cb() - the connection of a tab ended, with the exit status of its process if any
  */
 void child_exited_cb(VteTerminal *vteterminal,
                      gint         status,
                      gpointer     user_data)
 {
 	struct ConnectionTab *p_ct;
+	int delay;
 	p_ct = (struct ConnectionTab *) user_data;
-	log_write("%s\n", p_ct->connection.name);
+	log_write("%s\n", p_ct->connection->name);
 	tabInitConnection(p_ct);
 	/* in case of remote connection save it and keep tab, else remove tab */
-	connection_copy(&p_ct->last_connection, &p_ct->connection);
+	connection_unref(p_ct->last_connection);
+	p_ct->last_connection = connection_ref(p_ct->connection);
 	refreshTabStatus(p_ct);
-	log_debug("connection '%s' disconnecting\n", p_ct->connection.name);
-	terminal_write_ex(p_ct, "\n\rDisconnected. Hit enter to reconnect.\n\r", -1);
+	log_debug("connection '%s' disconnecting\n", p_ct->connection->name);
+	delay = reconnect_tab_lost(p_ct, status);
+	if (delay)
+		terminal_write_ex(p_ct, "\n\rConnection lost, reconnecting in %d s. Hit enter to reconnect now.\n\r", (delay + 999) / 1000);
+	else
+		terminal_write_ex(p_ct, "\n\rDisconnected. Hit enter to reconnect.\n\r", -1);
+}
+
+/**
+ * connection_tab_disconnected() - the connection of a tab without a child process ended
+ * @param[in] lost TRUE if it failed or was lost, as when ssh exits with 255
+ */
+void connection_tab_disconnected(struct ConnectionTab *p_ct, gboolean lost)
+{
+	child_exited_cb(VTE_TERMINAL(p_ct->vte), lost ? RECONNECT_LOST_STATUS : 0, p_ct);
+}
+
+/* connection_toggle_auto_reconnect() - auto reconnection of the current tab */
+void connection_toggle_auto_reconnect()
+{
+	struct ConnectionTab *p_ct = p_current_connection_tab;
+	if (!p_ct)
+		return;
+	p_ct->auto_reconnect = !p_ct->auto_reconnect;
+	if (!p_ct->auto_reconnect)
+		reconnect_cancel(p_ct);
+	terminal_write_ex(p_ct, "\n\rAuto reconnect %s for this tab.\n\r", p_ct->auto_reconnect ? "on" : "off");
 }
 
 /**
@@ -1216,8 +1447,9 @@ void eof_cb(VteTerminal *vteterminal, gpointer user_data)
 {
 	struct ConnectionTab *p_ct;
 	p_ct = (struct ConnectionTab *) user_data;
-	log_write("[%s] : %s\n", __func__, p_ct->connection.name);
-	connection_copy(&p_ct->last_connection, &p_ct->connection);
+	log_write("[%s] : %s\n", __func__, p_ct->connection->name);
+	connection_unref(p_ct->last_connection);
+	p_ct->last_connection = connection_ref(p_ct->connection);
 	tabInitConnection(p_ct);
 	refreshTabStatus(p_ct);
 }
@@ -1243,10 +1475,21 @@ void selection_changed_cb(VteTerminal *vteterminal, gpointer user_data)
 		terminal_copy_to_clipboard(VTE_TERMINAL(p_current_connection_tab->vte));
 }
 
+static gboolean status_timer_cb(gpointer user_data)
+{
+	SConnectionTab *pTab = user_data;
+	pTab->status_timer = NULL;
+	refreshTabStatus(pTab);
+	return G_SOURCE_REMOVE;
+}
+
 void contents_changed_cb(VteTerminal *vteterminal, gpointer user_data)
 {
-	tabSetFlag((SConnectionTab*)user_data, TAB_CHANGED);
-	refreshTabStatus(user_data);
+	SConnectionTab *pTab = user_data;
+	tabSetFlag(pTab, TAB_CHANGED);
+	/* output comes in many chunks, the label is updated once for those of a while */
+	if (pTab->status_timer == NULL)
+		pTab->status_timer = wheel_timer_add(TAB_STATUS_REFRESH_MS, status_timer_cb, pTab);
 }
 
 gboolean key_press_event_cb(GtkWidget *widget, GdkEventKey *event, gpointer user_data)
@@ -1258,8 +1501,9 @@ gboolean key_press_event_cb(GtkWidget *widget, GdkEventKey *event, gpointer user
 		if (!p_current_connection_tab)
 			return FALSE;
 		if (tabGetConnectionStatus(p_current_connection_tab) == TAB_CONN_STATUS_DISCONNECTED &&
-		    p_current_connection_tab->last_connection.name[0] != 0) {
+		    p_current_connection_tab->last_connection->name[0] != 0) {
 			log_debug("Enter/Return key pressed\n");
+			reconnect_cancel(p_current_connection_tab);
 			tabInitConnection(p_current_connection_tab);
 			p_current_connection_tab->enter_key_relogging = 1;
 			log_on(p_current_connection_tab);
@@ -1285,7 +1529,7 @@ void notebook_switch_page_cb(GtkNotebook *notebook, GtkWidget *page, gint page_n
 	log_write("Switched to page id: %d\n", page_num);
 	child = gtk_notebook_get_nth_page(notebook, page_num);
 	p_current_connection_tab = get_connection_tab_from_child(child);  /* try with g_list_find () */
-	log_write("Page name: %s\n", p_current_connection_tab->connection.name);
+	log_write("Page name: %s\n", p_current_connection_tab->connection->name);
 	update_by_tab(p_current_connection_tab);
 	switch_tab_enabled = TRUE;
 }
@@ -1401,7 +1645,6 @@ static void setup_shortcuts(void)
 void start_gtk(GApplication *app)
 {
 	GtkWidget *vbox;          /* main vbox */
-	signal(SIGCHLD, child_exit);  /* a child process ends */
 	connection_tab_list = NULL;
 	p_current_connection_tab = NULL;
 	log_write("Creating main window...\n");
@@ -1427,8 +1670,9 @@ void start_gtk(GApplication *app)
 	add_toolbar(vbox);
 	/* Paned window */
 	hpaned = gtk_paned_new(GTK_ORIENTATION_HORIZONTAL);
-	/* list store for connetions */
-	load_connections();
+	/* list of connections, actions needing it wait until it's loaded */
+	log_write("Loading connections...\n");
+	load_connections_async();
 	/* Notebook */
 	notebook = gtk_notebook_new();
 	gtk_notebook_set_scrollable(GTK_NOTEBOOK(notebook), TRUE);
@@ -1443,12 +1687,11 @@ void start_gtk(GApplication *app)
 	g_signal_connect(main_window, "key-press-event", G_CALLBACK(key_press_event_cb), NULL);
 	gtk_window_set_default_size(GTK_WINDOW(main_window), prefs.w, prefs.h);   /* keep this before gtk_widget_show() */
 	gtk_widget_show(main_window);
-	/* init list of connections for the first time, needed by terminal popup menu */
-	log_write("Loading connections...\n");
-	load_connections();
 	/* Ensure that buttons images will be shown */
 	GtkSettings *default_settings = gtk_settings_get_default();
 	g_object_set(default_settings, "gtk-button-images", TRUE, NULL);
 
 	setup_shortcuts();
+	/* children ready to start the ssh of new tabs */
+	pty_pool_init();
 }
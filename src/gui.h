@@ -29,9 +29,12 @@ enum { TAB_CONN_STATUS_DISCONNECTED = 0, TAB_CONN_STATUS_CONNECTING, TAB_CONN_ST
 #define TAB_CHANGED 1
 #define TAB_LOGGED 2
 
+/* the label shows new output at most this often */
+#define TAB_STATUS_REFRESH_MS 200
+
 typedef struct ConnectionTab {
-	Connection connection;
-	Connection last_connection;
+	Connection *connection;       /* shared snapshot, copied on write */
+	Connection *last_connection;
 
 	int connectionStatus;
 	int enter_key_relogging;
@@ -48,6 +51,15 @@ typedef struct ConnectionTab {
 	GtkWidget *notebook; // Notebook containing the terminal
 
 	pid_t pid;
+	int mux_state;                /* SSH_MUX_* */
+	gint64 open_time;             /* when the tab was opened, until its command starts */
+	gint64 connected_time;        /* when its connection last became connected */
+	struct _SshChannel *ssh_channel; /* shell of a libssh session, see sshbackend.c */
+	int auto_reconnect;           /* reconnect when the connection fails */
+	int output_paused;            /* output not read, the command blocks once the pty is full */
+	int output_rate;              /* KB per second of output read at most, 0 for no cap */
+	struct _Reconnect *reconnect; /* attempts in progress, see reconnect.c */
+	struct _WheelTimer *status_timer; /* pending refresh of the label */
 } SConnectionTab;
 
 /* stock objects */
@@ -78,18 +90,24 @@ typedef struct ConnectionTab {
 void msgbox_error(const char *fmt, ...);
 void msgbox_info(const char *fmt, ...);
 gint msgbox_yes_no(const char *fmt, ...);
-int expand_args(Connection *p_conn, char *args, char *prefix, char *dest);
+const char *expand_arg(int var, char *buf, gsize size, gpointer data);
 
 void tabInitConnection(SConnectionTab *pConn);
 char *tabGetConnectionStatusDesc(int status);
 void tabSetConnectionStatus(SConnectionTab *pConn, int status);
+void tabSetMuxState(SConnectionTab *pConn, int state);
+void tabUpdateTooltip(SConnectionTab *pConn);
 int tabGetConnectionStatus(SConnectionTab *pConn);
 int tabIsConnected(SConnectionTab *pConn);
+int tabApplyOutputLimits(SConnectionTab *pConn);
 
-void connection_log_on_param(Connection *p_conn);
+struct ConnectionTab *connection_log_on_param(Connection *p_conn);
+void connection_log_on_folder(const char *folder);
 void connection_log_on();
 void connection_log_off();
 void connection_duplicate();
+void connection_toggle_auto_reconnect();
+void connection_import();
 void connection_edit_protocols();
 void connection_new_terminal_dir(char *directory);
 void connection_new_terminal();
@@ -104,6 +122,8 @@ void edit_find();
 void edit_select_all();
 
 void terminal_reset();
+void terminal_toggle_pause_output();
+void terminal_output_rate();
 void terminal_detach_right();
 void terminal_detach_down();
 void terminal_attach_to_main(struct ConnectionTab *connectionTab);
@@ -125,6 +145,8 @@ void update_all_profiles();
 
 void start_gtk(GApplication *app);
 void connection_tab_close(struct ConnectionTab *p_ct);
+void connection_tab_disconnected(struct ConnectionTab *p_ct, gboolean lost);
+void connection_tab_watch_child(struct ConnectionTab *p_ct, GPid pid);
 
 static inline void get_monitor_size(GtkWindow *win, int *width, int *height)
 {
@@ -0,0 +1,531 @@
+/**
+ * Copyright (C) 2009-2017 Fabio Leone
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * @file import.c
+ * @brief Bulk import of connections from ssh_config, known_hosts and inventory files
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <glob.h>
+#include <glib.h>
+#include "connection.h"
+#include "connjournal.h"
+#include "cfgfile.h"
+#include "import.h"
+#include "main.h"
+
+/*
+ * Files are read in memory by a worker thread and parsed by a thread
+ * pool: one job per file, known_hosts files are also split in chunks at
+ * line boundaries. Jobs only produce Connection values (interning is
+ * thread safe). Once all jobs are done the worker returns to the main
+ * thread, which alone touches the list: duplicates are dropped, the rest
+ * is inserted and connections.xml is rewritten once.
+ */
+
+extern Globals globals;
+
+typedef struct _ImportJob {
+	const char *filename;
+	int type;
+	const gchar *data;    /* part of the file to parse */
+	gsize len;
+	const char *folder;
+	GArray *conns;        /* Connection */
+	int n_errors;
+} ImportJob;
+
+typedef struct _Import {
+	ConnectionList *p_cl;
+	gchar **files;
+	gchar *folder;
+	ConnImportFunc func;
+	gpointer user_data;
+	ConnImportStats stats;
+	GThread *thread;
+	GPtrArray *buffers;   /* CfgBuffer * */
+	GPtrArray *jobs;      /* ImportJob *, in file order */
+	GPtrArray *folders;   /* folder of each file */
+	gint64 t0;
+} Import;
+
+static gboolean is_pattern(const char *s)
+{
+	return strpbrk(s, "*?!") != NULL;
+}
+
+/* next line of [*p, end), without the trailing newline */
+static gboolean next_line(const gchar **p, const gchar *end, char *line, gsize size)
+{
+	const gchar *nl;
+	gsize len;
+	if (*p >= end)
+		return FALSE;
+	nl = memchr(*p, '\n', end - *p);
+	if (nl == NULL)
+		nl = end;
+	len = MIN(nl - *p, size - 1);
+	memcpy(line, *p, len);
+	line[len] = 0;
+	*p = nl < end ? nl + 1 : end;
+	return TRUE;
+}
+
+static void add_conn(ImportJob *job, const char *name, const char *host, int port, const char *user, const char *identity, const char *folder)
+{
+	Connection conn;
+	connection_init(&conn);
+	conn_set(conn.name, name);
+	conn_set(conn.host, host && host[0] ? host : name);
+	conn.port = port > 0 ? port : globals.ssh_proto.port;
+	conn_set(conn.auth_user, user);
+	if (identity && identity[0]) {
+		conn_set(conn.identityFile, identity);
+		conn.auth_mode = CONN_AUTH_MODE_KEY;
+	} else
+		conn.auth_mode = CONN_AUTH_MODE_PROMPT;
+	conn.folder = conn_folder_normalize(folder);
+	g_array_append_val(job->conns, conn);
+}
+
+/* ---[ ssh_config ]--- */
+
+/* values of the current Host block, the first one found wins as in ssh */
+struct SshHostBlock {
+	GPtrArray *names;
+	char host[256];
+	char user[128];
+	char identity[512];
+	int port;
+};
+
+static void ssh_block_flush(ImportJob *job, struct SshHostBlock *b)
+{
+	gchar *host, **parts;
+	int i;
+	for (i = 0; i < b->names->len; i++) {
+		const char *name = g_ptr_array_index(b->names, i);
+		host = NULL;
+		if (b->host[0]) {
+			/* in HostName %h stands for the alias */
+			parts = g_strsplit(b->host, "%h", -1);
+			host = g_strjoinv(name, parts);
+			g_strfreev(parts);
+		}
+		add_conn(job, name, host, b->port, b->user, b->identity, job->folder);
+		g_free(host);
+	}
+	g_ptr_array_set_size(b->names, 0);
+	b->host[0] = b->user[0] = b->identity[0] = 0;
+	b->port = 0;
+}
+
+/* expands ~ and makes paths relative to ~/.ssh as ssh does for Include */
+static gchar *ssh_config_path(const char *path)
+{
+	if (path[0] == '~' && path[1] == '/')
+		return g_build_filename(globals.home_dir, path + 2, NULL);
+	if (path[0] == '/')
+		return g_strdup(path);
+	return g_build_filename(globals.home_dir, ".ssh", path, NULL);
+}
+
+static void parse_ssh_config_file(ImportJob *job, const char *filename, int depth);
+
+static void parse_ssh_config(ImportJob *job, const gchar *data, gsize len, int depth)
+{
+	const gchar *p = data, *end = data + len;
+	struct SshHostBlock b;
+	char line[2048];
+	gchar **argv;
+	gchar *path;
+	glob_t g;
+	int argc, i;
+	gboolean in_match = FALSE;
+	memset(&b, 0, sizeof(b));
+	b.names = g_ptr_array_new_with_free_func(g_free);
+	while (next_line(&p, end, line, sizeof(line))) {
+		/* keyword and arguments are separated by blanks or by '=' */
+		g_strdelimit(line, "=\t\r", ' ');
+		g_strstrip(line);
+		if (line[0] == 0 || line[0] == '#')
+			continue;
+		argv = g_strsplit_set(line, " ", -1);
+		/* drop the empty strings left by repeated blanks */
+		for (argc = 0, i = 0; argv[i]; i++) {
+			if (argv[i][0])
+				argv[argc++] = argv[i];
+			else
+				g_free(argv[i]);
+		}
+		argv[argc] = NULL;
+		if (!g_ascii_strcasecmp(argv[0], "Host")) {
+			ssh_block_flush(job, &b);
+			in_match = FALSE;
+			for (i = 1; i < argc; i++)
+				if (!is_pattern(argv[i]))
+					g_ptr_array_add(b.names, g_strdup(argv[i]));
+		} else if (!g_ascii_strcasecmp(argv[0], "Match")) {
+			ssh_block_flush(job, &b);
+			in_match = TRUE;
+		} else if (!g_ascii_strcasecmp(argv[0], "Include") && depth < IMPORT_MAX_INCLUDE_DEPTH) {
+			ssh_block_flush(job, &b);
+			for (i = 1; i < argc; i++) {
+				path = ssh_config_path(argv[i]);
+				if (glob(path, 0, NULL, &g) == 0) {
+					size_t k;
+					for (k = 0; k < g.gl_pathc; k++)
+						parse_ssh_config_file(job, g.gl_pathv[k], depth + 1);
+					globfree(&g);
+				}
+				g_free(path);
+			}
+		} else if (!in_match && argc > 1 && b.names->len) {
+			if (!g_ascii_strcasecmp(argv[0], "HostName") && !b.host[0])
+				g_strlcpy(b.host, argv[1], sizeof(b.host));
+			else if (!g_ascii_strcasecmp(argv[0], "User") && !b.user[0])
+				g_strlcpy(b.user, argv[1], sizeof(b.user));
+			else if (!g_ascii_strcasecmp(argv[0], "Port") && !b.port)
+				b.port = atoi(argv[1]);
+			else if (!g_ascii_strcasecmp(argv[0], "IdentityFile") && !b.identity[0]) {
+				path = argv[1][0] == '~' ? ssh_config_path(argv[1]) : g_strdup(argv[1]);
+				g_strlcpy(b.identity, path, sizeof(b.identity));
+				g_free(path);
+			}
+		}
+		g_strfreev(argv);
+	}
+	ssh_block_flush(job, &b);
+	g_ptr_array_free(b.names, TRUE);
+}
+
+static void parse_ssh_config_file(ImportJob *job, const char *filename, int depth)
+{
+	CfgBuffer buf;
+	if (cfg_buffer_open(&buf, filename)) {
+		job->n_errors ++;
+		return;
+	}
+	parse_ssh_config(job, buf.data, buf.len, depth);
+	cfg_buffer_close(&buf);
+}
+
+/* ---[ known_hosts ]--- */
+
+static void parse_known_hosts(ImportJob *job)
+{
+	const gchar *p = job->data, *end = job->data + job->len;
+	char line[4096], name[300];
+	char *hosts, *host, *sp, *comma;
+	int port;
+	while (next_line(&p, end, line, sizeof(line))) {
+		hosts = line;
+		while (*hosts == ' ' || *hosts == '\t')
+			hosts ++;
+		/* @cert-authority, @revoked */
+		if (*hosts == '@') {
+			hosts = strchr(hosts, ' ');
+			if (hosts == NULL)
+				continue;
+			while (*hosts == ' ')
+				hosts ++;
+		}
+		/* hashed names can't be imported */
+		if (*hosts == 0 || *hosts == '#' || *hosts == '|')
+			continue;
+		sp = strpbrk(hosts, " \t");
+		if (sp == NULL)
+			continue;
+		*sp = 0;
+		/* "name,address": the first name is enough */
+		comma = strchr(hosts, ',');
+		if (comma)
+			*comma = 0;
+		if (is_pattern(hosts))
+			continue;
+		host = hosts;
+		port = 0;
+		if (host[0] == '[') {
+			/* [host]:port */
+			char *close = strchr(host, ']');
+			if (close == NULL)
+				continue;
+			*close = 0;
+			host ++;
+			if (close[1] == ':')
+				port = atoi(close + 2);
+		}
+		if (port && port != globals.ssh_proto.port)
+			g_snprintf(name, sizeof(name), "%s:%d", host, port);
+		else
+			g_strlcpy(name, host, sizeof(name));
+		add_conn(job, name, host, port, NULL, NULL, job->folder);
+	}
+}
+
+/* ---[ inventory ]--- */
+
+/*
+ * Ansible-like INI inventory:
+ *   [group]
+ *   alias ansible_host=10.0.0.1 ansible_port=2222 ansible_user=root
+ * or a plain list of "alias [host[:port]] [user]" lines.
+ * Groups become subfolders; [group:vars] and [group:children] are skipped.
+ */
+static void parse_inventory(ImportJob *job)
+{
+	const gchar *p = job->data, *end = job->data + job->len;
+	char line[2048], folder[512];
+	char host[256], user[128];
+	gchar **argv;
+	char *value, *colon;
+	int i, n_plain, port;
+	gboolean skip = FALSE;
+	g_strlcpy(folder, job->folder, sizeof(folder));
+	while (next_line(&p, end, line, sizeof(line))) {
+		g_strstrip(line);
+		if (line[0] == 0 || line[0] == '#' || line[0] == ';')
+			continue;
+		if (line[0] == '[') {
+			value = strchr(line, ']');
+			if (value)
+				*value = 0;
+			skip = strchr(line, ':') != NULL;
+			g_snprintf(folder, sizeof(folder), "%s/%s", job->folder, line + 1);
+			continue;
+		}
+		if (skip)
+			continue;
+		argv = g_strsplit_set(line, " \t", -1);
+		host[0] = user[0] = 0;
+		port = 0;
+		n_plain = 0;
+		for (i = 1; argv[i]; i++) {
+			if (argv[i][0] == 0)
+				continue;
+			value = strchr(argv[i], '=');
+			if (value) {
+				*value++ = 0;
+				if (!strcmp(argv[i], "ansible_host") || !strcmp(argv[i], "ansible_ssh_host") || !strcmp(argv[i], "host"))
+					g_strlcpy(host, value, sizeof(host));
+				else if (!strcmp(argv[i], "ansible_port") || !strcmp(argv[i], "ansible_ssh_port") || !strcmp(argv[i], "port"))
+					port = atoi(value);
+				else if (!strcmp(argv[i], "ansible_user") || !strcmp(argv[i], "ansible_ssh_user") || !strcmp(argv[i], "user"))
+					g_strlcpy(user, value, sizeof(user));
+			} else if (n_plain++ == 0)
+				g_strlcpy(host, argv[i], sizeof(host));
+			else if (n_plain == 2)
+				g_strlcpy(user, argv[i], sizeof(user));
+		}
+		if (!host[0])
+			g_strlcpy(host, argv[0], sizeof(host));
+		/* host:port, IPv6 addresses are left alone */
+		colon = strchr(host, ':');
+		if (colon && colon == strrchr(host, ':')) {
+			*colon = 0;
+			if (!port)
+				port = atoi(colon + 1);
+		}
+		if (!is_pattern(argv[0]))
+			add_conn(job, argv[0], host, port, user, NULL, folder);
+		g_strfreev(argv);
+	}
+}
+
+static void import_job_run(gpointer data, gpointer user_data)
+{
+	ImportJob *job = (ImportJob *) data;
+	switch (job->type) {
+	case IMPORT_SSH_CONFIG:
+		parse_ssh_config(job, job->data, job->len, 0);
+		break;
+	case IMPORT_KNOWN_HOSTS:
+		parse_known_hosts(job);
+		break;
+	case IMPORT_INVENTORY:
+		parse_inventory(job);
+		break;
+	}
+}
+
+/* conn_import_file_type() - guesses the format from the file name */
+int conn_import_file_type(const char *filename)
+{
+	gchar *base = g_path_get_basename(filename);
+	int type;
+	if (g_str_has_prefix(base, "known_hosts"))
+		type = IMPORT_KNOWN_HOSTS;
+	else if (!strcmp(base, "config") || strstr(base, "ssh_config"))
+		type = IMPORT_SSH_CONFIG;
+	else
+		type = IMPORT_INVENTORY;
+	g_free(base);
+	return type;
+}
+
+static ImportJob *job_new(const char *filename, int type, const gchar *data, gsize len, const char *folder)
+{
+	ImportJob *job = g_new0(ImportJob, 1);
+	job->filename = filename;
+	job->type = type;
+	job->data = data;
+	job->len = len;
+	job->folder = folder;
+	job->conns = g_array_new(FALSE, FALSE, sizeof(Connection));
+	return job;
+}
+
+/* duplicates are found by name and by address */
+static gchar *address_key(Connection *p_conn)
+{
+	return g_strdup_printf("%s@%s:%d", p_conn->auth_user, p_conn->host, p_conn->port);
+}
+
+static void add_address_cb(gpointer data, gpointer user_data)
+{
+	g_hash_table_add((GHashTable *) user_data, address_key((Connection *) data));
+}
+
+static gboolean import_done(gpointer data);
+
+/* reads and parses the files, then returns to the main thread */
+static gpointer import_thread(gpointer data)
+{
+	Import *imp = data;
+	ConnImportStats *stats = &imp->stats;
+	GThreadPool *pool;
+	CfgBuffer *buf;
+	ImportJob *job;
+	const gchar *p, *end, *cut;
+	gchar *base;
+	int i, type;
+	pool = g_thread_pool_new(import_job_run, NULL, g_get_num_processors(), FALSE, NULL);
+	for (i = 0; imp->files[i]; i++) {
+		stats->n_files ++;
+		buf = g_new0(CfgBuffer, 1);
+		if (cfg_buffer_open(buf, imp->files[i])) {
+			log_write("[%s] can't read %s\n", __func__, imp->files[i]);
+			stats->n_errors ++;
+			g_free(buf);
+			continue;
+		}
+		g_ptr_array_add(imp->buffers, buf);
+		type = conn_import_file_type(imp->files[i]);
+		base = g_path_get_basename(imp->files[i]);
+		if (base[0] == '.')
+			base[0] = '_';
+		g_ptr_array_add(imp->folders, g_strdup_printf("%s/%s", imp->folder, base));
+		g_free(base);
+		p = buf->data;
+		end = buf->data + buf->len;
+		do {
+			/* only known_hosts lines are independent from each other */
+			cut = end;
+			if (type == IMPORT_KNOWN_HOSTS && end - p > IMPORT_CHUNK_SIZE) {
+				cut = memchr(p + IMPORT_CHUNK_SIZE, '\n', end - p - IMPORT_CHUNK_SIZE);
+				cut = cut ? cut + 1 : end;
+			}
+			job = job_new(imp->files[i], type, p, cut - p, g_ptr_array_index(imp->folders, imp->folders->len - 1));
+			g_ptr_array_add(imp->jobs, job);
+			g_thread_pool_push(pool, job, NULL);
+			p = cut;
+		} while (p < end);
+	}
+	/* waits for all jobs */
+	g_thread_pool_free(pool, FALSE, TRUE);
+	log_debug("%d files parsed by %d jobs in %" G_GINT64_FORMAT " us\n", stats->n_files, imp->jobs->len, g_get_monotonic_time() - imp->t0);
+	g_idle_add(import_done, imp);
+	return NULL;
+}
+
+/* merges the parsed connections into the list, on the main thread */
+static gboolean import_done(gpointer data)
+{
+	Import *imp = data;
+	ConnImportStats *stats = &imp->stats;
+	ConnectionList *p_cl = imp->p_cl;
+	GHashTable *addresses;
+	ImportJob *job;
+	Connection *c;
+	gchar *key;
+	int i, j;
+	g_thread_join(imp->thread);
+	/* merge in file order, so that the first definition wins */
+	addresses = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	cl_foreach(p_cl, add_address_cb, addresses);
+	for (i = 0; i < imp->jobs->len; i++) {
+		job = g_ptr_array_index(imp->jobs, i);
+		stats->n_errors += job->n_errors;
+		for (j = 0; j < job->conns->len; j++) {
+			c = &g_array_index(job->conns, Connection, j);
+			stats->n_found ++;
+			key = address_key(c);
+			if (cl_get_by_name(p_cl, c->name) || g_hash_table_contains(addresses, key)) {
+				stats->n_duplicates ++;
+				g_free(key);
+				continue;
+			}
+			g_hash_table_add(addresses, key);
+			if (cl_insert_sorted(p_cl, c))
+				stats->n_added ++;
+		}
+		g_array_free(job->conns, TRUE);
+		g_free(job);
+	}
+	g_hash_table_destroy(addresses);
+	for (i = 0; i < imp->buffers->len; i++) {
+		cfg_buffer_close(g_ptr_array_index(imp->buffers, i));
+		g_free(g_ptr_array_index(imp->buffers, i));
+	}
+	/* one rewrite for the whole batch instead of one journal record per host */
+	if (stats->n_added)
+		conn_journal_compact(p_cl);
+	log_write("Imported %d connections (%d found, %d duplicates, %d errors) in %" G_GINT64_FORMAT " ms\n",
+	          stats->n_added, stats->n_found, stats->n_duplicates, stats->n_errors, (g_get_monotonic_time() - imp->t0) / 1000);
+	imp->func(stats->n_files > 0 && stats->n_errors == stats->n_files, stats, imp->user_data);
+	g_ptr_array_free(imp->buffers, TRUE);
+	g_ptr_array_free(imp->jobs, TRUE);
+	g_ptr_array_free(imp->folders, TRUE);
+	g_strfreev(imp->files);
+	g_free(imp->folder);
+	g_free(imp);
+	return G_SOURCE_REMOVE;
+}
+
+/**
+ * conn_import() - imports hosts from files into a connection list, in background
+ * The files are read and parsed in other threads, then the list is updated
+ * and func is called on the main thread, with 1 as rc if nothing could be read.
+ * @param[in] files NULL-terminated list of files, the format is taken from the name
+ * @param[in] folder folder receiving the imported connections, one subfolder per file
+ */
+void conn_import(ConnectionList *p_cl, gchar **files, const char *folder, ConnImportFunc func, gpointer user_data)
+{
+	Import *imp = g_new0(Import, 1);
+	imp->p_cl = p_cl;
+	imp->files = g_strdupv(files);
+	imp->folder = g_strdup(folder);
+	imp->func = func;
+	imp->user_data = user_data;
+	imp->buffers = g_ptr_array_new();
+	imp->jobs = g_ptr_array_new();
+	imp->folders = g_ptr_array_new_with_free_func(g_free);
+	imp->t0 = g_get_monotonic_time();
+	imp->thread = g_thread_new("import", import_thread, imp);
+}
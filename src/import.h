@@ -0,0 +1,31 @@
+
+#ifndef _IMPORT_H
+#define _IMPORT_H
+
+#include "connection.h"
+
+#define IMPORT_SSH_CONFIG 1
+#define IMPORT_KNOWN_HOSTS 2
+#define IMPORT_INVENTORY 3
+
+/* known_hosts files are split in chunks of this size to be parsed in parallel */
+#define IMPORT_CHUNK_SIZE (1024 * 1024)
+
+/* nesting limit of Include directives in ssh_config */
+#define IMPORT_MAX_INCLUDE_DEPTH 16
+
+typedef struct _ConnImportStats {
+	int n_files;
+	int n_found;        /* hosts read from the files */
+	int n_added;
+	int n_duplicates;   /* already in the list or read twice */
+	int n_errors;       /* unreadable files */
+} ConnImportStats;
+
+/* end of an import, rc is 1 if no file could be read */
+typedef void (*ConnImportFunc)(int rc, ConnImportStats *stats, gpointer user_data);
+
+int conn_import_file_type(const char *filename);
+void conn_import(ConnectionList *p_cl, gchar **files, const char *folder, ConnImportFunc func, gpointer user_data);
+
+#endif
@@ -27,7 +27,6 @@
 #include <locale.h>
 #include <libgen.h>
 #include <string.h>
-#include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <gtk/gtk.h>
@@ -40,6 +39,13 @@
 #include "profile.h"
 #include "connection.h"
 #include "utils.h"
+#include "conncache.h"
+#include "connjournal.h"
+#include "connwatch.h"
+#include "sshmux.h"
+#include "ptypool.h"
+#include "sshbackend.h"
+#include "prober.h"
 
 Globals globals;
 Prefs prefs;
@@ -48,20 +54,6 @@ GtkApplication *g_app;
 
 static void help();
 
-// Access to ssh operations
-pthread_mutex_t mutexSSH = PTHREAD_MUTEX_INITIALIZER;
-
-void lockSSH(const char *caller, gboolean flagLock)
-{
-	if (flagLock) {
-		log_debug("[%s] locking SSH mutex...\n", caller);
-		pthread_mutex_lock(&mutexSSH);
-	} else {
-		log_debug("[%s] unlocking SSH mutex...\n", caller);
-		pthread_mutex_unlock(&mutexSSH);
-	}
-}
-
 static void log_reset()
 {
 	FILE *log_fp;
@@ -95,34 +87,6 @@ void log_write(const char *fmt, ...)
 	fclose(log_fp);
 }
 
-static int sTimeout = 0;
-static void AlarmHandler(int sig)
-{
-	log_debug("[thread %ld] %d\n", pthread_self(), sig);
-	sTimeout = 1;
-}
-
-void timerStart(int seconds)
-{
-	signal(SIGALRM, AlarmHandler);
-	sTimeout = 0;
-	alarm(seconds);
-	log_debug("Timer started: %d\n", seconds);
-}
-
-void timerStop()
-{
-	signal(SIGALRM, SIG_DFL);
-	sTimeout = 0;
-	alarm(0);
-	log_debug("Timer stopped\n");
-}
-
-int timedOut()
-{
-	return (sTimeout == 1);
-}
-
 static void activate(GApplication *app, gpointer user_data)
 {
 	log_write("Building gui...\n");
@@ -154,6 +118,9 @@ int main(int argc, char *argv[])
 	strcpy(globals.home_dir, homeDir);
 	sprintf(globals.app_dir, "%s/.%s", globals.home_dir, PACKAGE);
 	sprintf(globals.connections_xml, "%s/connections.xml", globals.app_dir);
+	sprintf(globals.connections_cache, "%s/connections.cache", globals.app_dir);
+	sprintf(globals.connections_journal, "%s/connections.journal", globals.app_dir);
+	sprintf(globals.connections_dir, "%s/connections.d", globals.app_dir);
 	sprintf(globals.log_file, "%s/lterm.log", globals.app_dir);
 	sprintf(globals.profiles_file, "%s/profiles.xml", globals.app_dir);
 	sprintf(globals.conf_file, "%s/%s.conf", globals.app_dir, PACKAGE);
@@ -177,6 +144,7 @@ int main(int argc, char *argv[])
 	}
 
 	globals.ssh_proto = (struct Protocol){ "ssh", "-p %p -l %u %h", 22, PROT_FLAG_ASKPASSWORD };
+	ssh_mux_init();
 	log_write("Initializing threads...\n");
 	ssh_threads_set_callbacks(ssh_threads_get_pthread());
 	ssh_init();
@@ -186,7 +154,14 @@ int main(int argc, char *argv[])
 	g_application_run(G_APPLICATION(g_app), argc, argv);
 
 	log_write("Saving connections...\n");
-	save_connections(conn_list, globals.connections_xml);
+	conn_watch_stop();
+	load_connections_wait();
+	conn_journal_close(conn_list);
+	conn_cache_wait();
+	ssh_backend_shutdown();
+	ssh_mux_shutdown();
+	pty_pool_shutdown();
+	prober_shutdown();
 	log_write("Saving settings...\n");
 	save_settings();
 	log_write("Saving profiles...\n");
@@ -31,6 +31,7 @@ struct Protocol {
 	char args[256];
 	int port;
 	unsigned int flags;
+	struct _CmdTemplate *tmpl;    /* command and args compiled at first use, see cmdline.c */
 };
 
 /*
@@ -43,6 +44,9 @@ struct _globals {
 	char img_dir[512];
 	char data_dir[512];
 	char connections_xml[512];    /* Server list file (xml format)*/
+	char connections_cache[512];  /* Binary copy of the server list, see conncache.c */
+	char connections_journal[512]; /* Changes not yet saved in connections_xml */
+	char connections_dir[512];    /* Read-only fragments (*.xml) added to connections_xml */
 	char conf_file[512];
 	char log_file[512];
 	char profiles_file[512];
@@ -68,6 +72,9 @@ struct _prefs {
 	int scrollback_lines;
 	int scroll_on_keystroke;
 	int scroll_on_output;
+	int pty_io;                   /* lterm reads the pty and feeds the terminal, experimental, see ptyio.c */
+	int background_buffer;        /* KB read ahead of a terminal off screen before holding its command up, 0 for no bound */
+	int rate_limit;               /* KB per second read from the pty of a new tab, 0 for no cap */
 	int mouse_autohide;
 	int mouse_copy_on_select;
 	int mouse_paste_on_right_button;
@@ -77,15 +84,17 @@ struct _prefs {
 	char tab_status_disconnected_color [32];
 	char tab_status_disconnected_alert_color [32];
 	char font_fixed [128];
+	int ssh_mux;                  /* share ssh connections between tabs, see sshmux.c */
+	int ssh_mux_persist;          /* seconds they are kept after the last tab, 0 to close with the first tab */
+	int ssh_backend;              /* SSH_BACKEND_COMMAND or SSH_BACKEND_LIBSSH */
+	int batch_concurrency;        /* tabs connecting at the same time when opening a folder */
+	int auto_reconnect;           /* default of new tabs: reconnect when the connection fails */
+	int reconnect_concurrency;    /* tabs reconnecting at the same time */
 };
 
 typedef struct _prefs Prefs;
 
-void lockSSH(const char *caller, gboolean flagLock);
 void log_write(const char *fmt, ...);
-void timerStart(int seconds);
-void timerStop();
-int timedOut();
 
 extern GtkApplication *g_app;
 
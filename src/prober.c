@@ -0,0 +1,307 @@
+/**
+ * Copyright (C) 2009-2017 Fabio Leone
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * @file prober.c
+ * @brief Background reachability and latency probes of the connections
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <glib.h>
+#include <gio/gio.h>
+#include "main.h"
+#include "prober.h"
+
+/*
+ * Each host:port is resolved and connected to by a pool of worker
+ * threads, the connection is closed right away. Results are kept in a
+ * cache owned by the main thread, which also queues the probes: a result
+ * older than PROBE_TTL is probed again when looked up, while the old one
+ * is still returned. The address that answered is given to log_on(), so
+ * that a tab opened shortly after doesn't resolve the host again.
+ */
+
+typedef struct _ProbeEntry {
+	ProbeResult res;
+	gboolean queued;
+} ProbeEntry;
+
+typedef struct _ProbeJob {
+	gchar *key;
+	gchar *host;
+	int port;
+	ProbeResult res;
+} ProbeJob;
+
+typedef struct _ProbeWatch {
+	ProbeNotify func;
+	gpointer data;
+} ProbeWatch;
+
+static GHashTable *cache = NULL;    /* host:port -> ProbeEntry * */
+static GThreadPool *pool = NULL;
+static GList *watches = NULL;       /* ProbeWatch * */
+static gboolean stopped = FALSE;
+
+/**
+ * prober_connect() - connects to a numeric address with a timeout
+ * @return the connected socket, blocking, -1 if failed
+ */
+int prober_connect(const char *address, int port, int timeout_ms)
+{
+	struct addrinfo hints, *ai;
+	struct pollfd pfd;
+	char service[16];
+	socklen_t len;
+	int fd, flags, err = 0;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+	sprintf(service, "%d", port);
+	if (getaddrinfo(address, service, &hints, &ai) != 0)
+		return -1;
+	fd = socket(ai->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		freeaddrinfo(ai);
+		return -1;
+	}
+	flags = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	if (connect(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+		err = errno;
+		if (err == EINPROGRESS) {
+			pfd.fd = fd;
+			pfd.events = POLLOUT;
+			if (poll(&pfd, 1, timeout_ms) == 1) {
+				len = sizeof(err);
+				getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+			} else
+				err = ETIMEDOUT;
+		}
+	}
+	freeaddrinfo(ai);
+	if (err) {
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, flags);
+	return fd;
+}
+
+static gboolean probe_done(gpointer data)
+{
+	ProbeJob *job = data;
+	ProbeEntry *entry;
+	GList *l;
+	entry = g_hash_table_lookup(cache, job->key);
+	/* dropped from the cache meanwhile */
+	if (entry) {
+		entry->res = job->res;
+		entry->queued = FALSE;
+		for (l = watches; l; l = l->next) {
+			ProbeWatch *w = l->data;
+			w->func(w->data);
+		}
+	}
+	g_free(job->key);
+	g_free(job->host);
+	g_free(job);
+	return G_SOURCE_REMOVE;
+}
+
+static void probe_func(gpointer data, gpointer user_data)
+{
+	ProbeJob *job = data;
+	GResolver *resolver;
+	GList *addresses, *l;
+	GError *error = NULL;
+	gchar *address;
+	gint64 t0;
+	int fd;
+	resolver = g_resolver_get_default();
+	addresses = g_resolver_lookup_by_name(resolver, job->host, NULL, &error);
+	g_object_unref(resolver);
+	if (addresses == NULL) {
+		log_debug("%s: %s\n", job->host, error->message);
+		g_error_free(error);
+		job->res.state = PROBE_UNRESOLVED;
+	} else {
+		job->res.state = PROBE_DOWN;
+		for (l = addresses; l && job->res.state != PROBE_UP && !stopped; l = l->next) {
+			address = g_inet_address_to_string(l->data);
+			if (l == addresses)
+				g_strlcpy(job->res.address, address, sizeof(job->res.address));
+			t0 = g_get_monotonic_time();
+			fd = prober_connect(address, job->port, PROBE_TIMEOUT_MS);
+			if (fd != -1) {
+				job->res.rtt = g_get_monotonic_time() - t0;
+				job->res.state = PROBE_UP;
+				g_strlcpy(job->res.address, address, sizeof(job->res.address));
+				close(fd);
+			}
+			g_free(address);
+		}
+		g_resolver_free_addresses(addresses);
+	}
+	job->res.time = g_get_monotonic_time();
+	g_idle_add(probe_done, job);
+}
+
+static gboolean stale(const ProbeResult *res)
+{
+	return g_get_monotonic_time() - res->time > (gint64) PROBE_TTL * G_USEC_PER_SEC;
+}
+
+/* makes room in the cache, keeping the probes in progress */
+static void cache_trim(void)
+{
+	GHashTableIter iter;
+	ProbeEntry *entry;
+	int pass;
+	for (pass = 0; pass < 2 && g_hash_table_size(cache) >= PROBE_CACHE_MAX; pass++) {
+		g_hash_table_iter_init(&iter, cache);
+		while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &entry)) {
+			/* first the expired results, then any of them */
+			if (!entry->queued && (pass == 1 || stale(&entry->res)))
+				g_hash_table_iter_remove(&iter);
+		}
+	}
+}
+
+/**
+ * prober_lookup() - last result for host:port, probing it if missing or expired
+ * @return the result, valid until the next call
+ */
+const ProbeResult *prober_lookup(const char *host, int port)
+{
+	ProbeEntry *entry;
+	ProbeJob *job;
+	gchar *key;
+	if (cache == NULL) {
+		cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+		pool = g_thread_pool_new(probe_func, NULL, PROBE_THREADS, FALSE, NULL);
+	}
+	key = g_strdup_printf("%s:%d", host, port);
+	entry = g_hash_table_lookup(cache, key);
+	if (entry == NULL) {
+		cache_trim();
+		entry = g_new0(ProbeEntry, 1);
+		entry->res.state = PROBE_PENDING;
+		g_hash_table_insert(cache, g_strdup(key), entry);
+	} else if (entry->queued || !stale(&entry->res)) {
+		g_free(key);
+		return &entry->res;
+	}
+	if (host[0] == 0 || stopped) {
+		entry->res.state = PROBE_UNRESOLVED;
+		entry->res.time = g_get_monotonic_time();
+		g_free(key);
+		return &entry->res;
+	}
+	entry->queued = TRUE;
+	job = g_new0(ProbeJob, 1);
+	job->key = key;
+	job->host = g_strdup(host);
+	job->port = port;
+	g_thread_pool_push(pool, job, NULL);
+	return &entry->res;
+}
+
+/**
+ * prober_cached() - recent result for host:port, without probing
+ * @return the result, NULL if unknown or expired
+ */
+const ProbeResult *prober_cached(const char *host, int port)
+{
+	ProbeEntry *entry;
+	gchar *key;
+	if (cache == NULL)
+		return NULL;
+	key = g_strdup_printf("%s:%d", host, port);
+	entry = g_hash_table_lookup(cache, key);
+	g_free(key);
+	if (entry == NULL || entry->res.time == 0 || stale(&entry->res))
+		return NULL;
+	return &entry->res;
+}
+
+/**
+ * prober_address() - address of host:port that answered recently
+ * @return numeric address, NULL if unknown, expired or not answering
+ */
+const char *prober_address(const char *host, int port)
+{
+	const ProbeResult *res = prober_cached(host, port);
+	return res && res->state == PROBE_UP ? res->address : NULL;
+}
+
+const char *prober_state_desc(const ProbeResult *res, char *buf, gsize size)
+{
+	switch (res->state) {
+	case PROBE_UP:
+		if (res->rtt < 1000)
+			return "< 1 ms";
+		g_snprintf(buf, size, "%d ms", (int) (res->rtt / 1000));
+		return buf;
+	case PROBE_DOWN:
+		return "down";
+	case PROBE_UNRESOLVED:
+		return "unknown host";
+	default:
+		return "...";
+	}
+}
+
+/* prober_watch() - calls func with each new result */
+void prober_watch(ProbeNotify func, gpointer data)
+{
+	ProbeWatch *w = g_new0(ProbeWatch, 1);
+	w->func = func;
+	w->data = data;
+	watches = g_list_append(watches, w);
+}
+
+void prober_unwatch(ProbeNotify func, gpointer data)
+{
+	GList *l;
+	for (l = watches; l; l = l->next) {
+		ProbeWatch *w = l->data;
+		if (w->func == func && w->data == data) {
+			watches = g_list_delete_link(watches, l);
+			g_free(w);
+			return;
+		}
+	}
+}
+
+/**
+ * prober_shutdown() - drops the queued probes
+ * Probes in progress end by themselves, their results are never used.
+ */
+void prober_shutdown(void)
+{
+	stopped = TRUE;
+	if (pool)
+		g_thread_pool_free(pool, TRUE, FALSE);
+	pool = NULL;
+}
@@ -0,0 +1,39 @@
+
+#ifndef _PROBER_H
+#define _PROBER_H
+
+#include <glib.h>
+
+enum { PROBE_UNKNOWN = 0, PROBE_PENDING, PROBE_UP, PROBE_DOWN, PROBE_UNRESOLVED };
+
+/* hosts probed at the same time */
+#define PROBE_THREADS 8
+
+/* connect timeout of a probe */
+#define PROBE_TIMEOUT_MS 3000
+
+/* seconds a result, and the address it found, are reused */
+#define PROBE_TTL 60
+
+/* results kept, the older ones are dropped beyond */
+#define PROBE_CACHE_MAX 4096
+
+typedef struct _ProbeResult {
+	int state;
+	gint64 rtt;             /* connect time in microseconds, PROBE_UP only */
+	char address[64];       /* first address answering, or first resolved */
+	gint64 time;            /* monotonic time of the result */
+} ProbeResult;
+
+typedef void (*ProbeNotify)(gpointer data);
+
+const ProbeResult *prober_lookup(const char *host, int port);
+const ProbeResult *prober_cached(const char *host, int port);
+const char *prober_address(const char *host, int port);
+const char *prober_state_desc(const ProbeResult *res, char *buf, gsize size);
+int prober_connect(const char *address, int port, int timeout_ms);
+void prober_watch(ProbeNotify func, gpointer data);
+void prober_unwatch(ProbeNotify func, gpointer data);
+void prober_shutdown(void);
+
+#endif
@@ -0,0 +1,158 @@
+/**
+ * Copyright (C) 2009-2017 Fabio Leone
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * @file procwatch.c
+ * @brief Supervision of the child processes
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <glib.h>
+#include <glib-unix.h>
+#include "main.h"
+#include "procwatch.h"
+
+/*
+ * Every child started by lterm is reaped here, and only those: each one
+ * is watched through a pidfd and reaped with wait4() by its own pid, so
+ * that its resource usage comes with the exit status. Without pidfd
+ * support a GLib child watch does the same, without the CPU time.
+ * Nothing waits for any child, processes spawned by libraries keep their
+ * own reaping. A child may be watched before it has an owner (the pty
+ * pool) and get one later.
+ */
+
+typedef struct _Proc {
+	GPid pid;
+	int pidfd;
+	guint source_id;
+	gint64 start;
+	ProcExitFunc func;
+	gpointer data;
+} Proc;
+
+static GHashTable *procs = NULL;    /* pid -> Proc * */
+
+static int pidfd_open(GPid pid)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	return -1;
+#endif
+}
+
+static void proc_exited(Proc *p, int status, const struct rusage *ru)
+{
+	ProcExit info;
+	char desc[64];
+	info.status = status;
+	info.lifetime = g_get_monotonic_time() - p->start;
+	info.cpu = ru ? (gint64) (ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * G_USEC_PER_SEC
+	           + ru->ru_utime.tv_usec + ru->ru_stime.tv_usec : -1;
+	/* the owner may watch a new child with the same pid */
+	g_hash_table_remove(procs, GINT_TO_POINTER(p->pid));
+	log_debug("process %d %s, cpu %" G_GINT64_FORMAT " us, lifetime %" G_GINT64_FORMAT " us\n",
+	          p->pid, proc_exit_desc(&info, desc, sizeof(desc)), info.cpu, info.lifetime);
+	if (p->func)
+		p->func(p->pid, &info, p->data);
+	g_free(p);
+}
+
+static gboolean pidfd_cb(gint fd, GIOCondition condition, gpointer data)
+{
+	Proc *p = data;
+	struct rusage ru;
+	int status;
+	pid_t rc;
+	rc = wait4(p->pid, &status, WNOHANG, &ru);
+	if (rc == 0)
+		return G_SOURCE_CONTINUE;
+	close(p->pidfd);
+	p->source_id = 0;
+	/* reaped by someone else: status unknown */
+	if (rc == p->pid)
+		proc_exited(p, status, &ru);
+	else
+		proc_exited(p, -1, NULL);
+	return G_SOURCE_REMOVE;
+}
+
+static void child_watch_cb(GPid pid, gint status, gpointer data)
+{
+	Proc *p = data;
+	p->source_id = 0;
+	g_spawn_close_pid(pid);
+	proc_exited(p, status, NULL);
+}
+
+/**
+ * proc_watch() - reaps a child and reports its end to func
+ * Watching an already watched child changes its owner and restarts its
+ * lifetime.
+ * @param[in] func called once the child is reaped, NULL just to reap it
+ * @return 0 if ok, 1 if the child can't be watched
+ */
+int proc_watch(GPid pid, ProcExitFunc func, gpointer data)
+{
+	Proc *p;
+	if (pid <= 0)
+		return 1;
+	if (procs == NULL)
+		procs = g_hash_table_new(g_direct_hash, g_direct_equal);
+	p = g_hash_table_lookup(procs, GINT_TO_POINTER(pid));
+	if (p == NULL) {
+		p = g_new0(Proc, 1);
+		p->pid = pid;
+		p->pidfd = pidfd_open(pid);
+		if (p->pidfd >= 0)
+			p->source_id = g_unix_fd_add(p->pidfd, G_IO_IN, pidfd_cb, p);
+		else
+			p->source_id = g_child_watch_add(pid, child_watch_cb, p);
+		g_hash_table_insert(procs, GINT_TO_POINTER(pid), p);
+	}
+	p->start = g_get_monotonic_time();
+	p->func = func;
+	p->data = data;
+	return 0;
+}
+
+/* proc_unwatch() - the owner is gone, the child is still reaped */
+void proc_unwatch(GPid pid)
+{
+	Proc *p;
+	if (procs && (p = g_hash_table_lookup(procs, GINT_TO_POINTER(pid))) != NULL) {
+		p->func = NULL;
+		p->data = NULL;
+	}
+}
+
+const char *proc_exit_desc(const ProcExit *info, char *buf, gsize size)
+{
+	if (info->status == -1)
+		g_strlcpy(buf, "exited", size);
+	else if (WIFSIGNALED(info->status))
+		g_snprintf(buf, size, "killed by signal %d", WTERMSIG(info->status));
+	else
+		g_snprintf(buf, size, "exited with code %d", WEXITSTATUS(info->status));
+	return buf;
+}
+
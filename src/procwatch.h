@@ -0,0 +1,19 @@
+
+#ifndef _PROCWATCH_H
+#define _PROCWATCH_H
+
+#include <glib.h>
+
+typedef struct _ProcExit {
+	int status;             /* as from waitpid() */
+	gint64 cpu;             /* user and system time in microseconds, -1 if unknown */
+	gint64 lifetime;        /* microseconds since watched */
+} ProcExit;
+
+typedef void (*ProcExitFunc)(GPid pid, const ProcExit *info, gpointer data);
+
+int proc_watch(GPid pid, ProcExitFunc func, gpointer data);
+void proc_unwatch(GPid pid);
+const char *proc_exit_desc(const ProcExit *info, char *buf, gsize size);
+
+#endif
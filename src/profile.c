@@ -28,6 +28,11 @@
 #include "profile.h"
 #include "utils.h"
 #include "xml.h"
+#include "cfgfile.h"
+#include "sshmux.h"
+#include "sshbackend.h"
+#include "batchopen.h"
+#include "reconnect.h"
 
 Prefs prefs;
 Globals globals;
@@ -69,6 +74,9 @@ void load_settings(void)
 	prefs.scrollback_lines = config_load_int(kf, "TERMINAL", "scrollback_lines", 512);
 	prefs.scroll_on_keystroke = config_load_int(kf, "TERMINAL", "scroll_on_keystroke", 1);
 	prefs.scroll_on_output = config_load_int(kf, "TERMINAL", "scroll_on_output", 1);
+	prefs.pty_io = config_load_int(kf, "TERMINAL", "pty_io", 0);
+	prefs.background_buffer = config_load_int(kf, "TERMINAL", "background_buffer", 0);
+	prefs.rate_limit = config_load_int(kf, "TERMINAL", "rate_limit", 0);
 	prefs.mouse_autohide = config_load_int(kf, "MOUSE", "autohide", 1);
 	prefs.mouse_copy_on_select = config_load_int(kf, "MOUSE", "copy_on_select", 0);
 	prefs.mouse_paste_on_right_button = config_load_int(kf, "MOUSE", "paste_on_right_button", 0);
@@ -79,6 +87,12 @@ void load_settings(void)
 	config_load_string(kf, "GUI", "tab_status_changed_color", prefs.tab_status_changed_color, "blue");
 	config_load_string(kf, "GUI", "tab_status_disconnected_color", prefs.tab_status_disconnected_color, "#707070");
 	config_load_string(kf, "GUI", "tab_status_disconnected_alert_color", prefs.tab_status_disconnected_alert_color, "darkred");
+	prefs.ssh_mux = config_load_int(kf, "SSH", "multiplexing", 1);
+	prefs.ssh_mux_persist = config_load_int(kf, "SSH", "multiplexing_persist", SSH_MUX_PERSIST);
+	prefs.ssh_backend = config_load_int(kf, "SSH", "backend", SSH_BACKEND_COMMAND);
+	prefs.batch_concurrency = config_load_int(kf, "SSH", "batch_concurrency", BATCH_OPEN_CONCURRENCY);
+	prefs.auto_reconnect = config_load_int(kf, "SSH", "auto_reconnect", 1);
+	prefs.reconnect_concurrency = config_load_int(kf, "SSH", "reconnect_concurrency", RECONNECT_CONCURRENCY);
 
 	g_key_file_free(kf);
 }
@@ -94,6 +108,9 @@ void save_settings(void)
 	g_key_file_set_integer(kf, "TERMINAL", "scrollback_lines", prefs.scrollback_lines);
 	g_key_file_set_integer(kf, "TERMINAL", "scroll_on_keystroke", prefs.scroll_on_keystroke);
 	g_key_file_set_integer(kf, "TERMINAL", "scroll_on_output", prefs.scroll_on_output);
+	g_key_file_set_integer(kf, "TERMINAL", "pty_io", prefs.pty_io);
+	g_key_file_set_integer(kf, "TERMINAL", "background_buffer", prefs.background_buffer);
+	g_key_file_set_integer(kf, "TERMINAL", "rate_limit", prefs.rate_limit);
 	g_key_file_set_integer(kf, "TERMINAL", "rows", prefs.rows);
 	g_key_file_set_integer(kf, "TERMINAL", "columns", prefs.columns);
 	g_key_file_set_string(kf, "TERMINAL", "extra_word_chars", prefs.extra_word_chars);
@@ -104,6 +121,12 @@ void save_settings(void)
 	g_key_file_set_integer(kf, "GUI", "w", prefs.w);
 	g_key_file_set_integer(kf, "GUI", "h", prefs.h);
 	g_key_file_set_integer(kf, "GUI", "tab_alerts", prefs.tab_alerts);
+	g_key_file_set_integer(kf, "SSH", "multiplexing", prefs.ssh_mux);
+	g_key_file_set_integer(kf, "SSH", "multiplexing_persist", prefs.ssh_mux_persist);
+	g_key_file_set_integer(kf, "SSH", "backend", prefs.ssh_backend);
+	g_key_file_set_integer(kf, "SSH", "batch_concurrency", prefs.batch_concurrency);
+	g_key_file_set_integer(kf, "SSH", "auto_reconnect", prefs.auto_reconnect);
+	g_key_file_set_integer(kf, "SSH", "reconnect_concurrency", prefs.reconnect_concurrency);
 
 	if (!g_key_file_save_to_file(kf, globals.conf_file, &error)) {
 		log_debug("Error saving config file: %s\n", error->message);
@@ -113,37 +136,25 @@ void save_settings(void)
 }
 int load_profile(struct Profile *pf, char *filename)
 {
-	char *xml;
-	char line[2048];
 	char tmp_s[32];
-	FILE *fp;
-	/* put xml content into a string */
-	fp = fopen(filename, "r");
-	if (fp == NULL)
-		return (1);
-	xml = (char *) malloc(2048);
-	strcpy(xml, "");
-	while (fgets(line, 1024, fp) != 0) {
-		if (strlen(xml) + strlen(line) > sizeof(xml))
-			xml = (char *) realloc(xml, strlen(xml) + strlen(line) + 1);
-		strcat(xml, line);
-	}
-	fclose(fp);
-	/* parse the xml document */
 	XML xmldoc;
 	XMLNode *node, *child, *node_2;
-	xml_parse(xml, &xmldoc);
-	if (xmldoc.error.code) {
-		log_write("%s\n", xmldoc.error.message);
+	/* parse the xml document */
+	if (xml_load(&xmldoc, filename)) {
+		if (xmldoc.error.code)
+			log_write("%s\n", xmldoc.error.message);
 		return 1;
 	}
+	if (!xmldoc.cur_root)
+		return 1;
 	if (strcmp(xmldoc.cur_root->name, "lterm-profiles")) {
 		log_write("[%s] can't find root node: lterm-profiles\n", __func__);
+		xml_free(&xmldoc);
 		return 2;
 	}
 	memset(pf, 0, sizeof(struct Profile));
 	node = xmldoc.cur_root->children;
-	if (!strcmp(node->name, "profile")) {
+	if (node && !strcmp(node->name, "profile")) {
 		if ((child = xml_node_get_child(node, "fg-color")))
 			strcpy(pf->fg_color, NVL(xml_node_get_value(child), ""));
 		if ((node_2 = xml_node_get_child(node, "fonts"))) {
@@ -178,21 +189,19 @@ int load_profile(struct Profile *pf, char *filename)
 		}
 	}
 	xml_free(&xmldoc);
-	free(xml);
 	return 0;
 }
 
 int save_profile(struct Profile *pf, char *filename)
 {
-	FILE *fp;
-	fp = fopen(filename, "w");
-	if (fp == NULL)
+	CfgWriter w;
+	if (cfg_writer_open(&w, filename))
 		return (1);
-	fprintf(fp,
+	cfg_writer_printf(&w,
 	        "<?xml version = '1.0'?>\n"
 	        "<!DOCTYPE lterm-profiles>\n"
 	        "<lterm-profiles>\n");
-	fprintf(fp, "  <profile>\n"
+	cfg_writer_printf(&w, "  <profile>\n"
 	        "    <fonts>\n"
 	        "      <use-system>%d</use-system>\n"
 	        "      <font>%s</font>\n"
@@ -210,9 +219,8 @@ int save_profile(struct Profile *pf, char *filename)
 	        pf->font_use_system, pf->font, pf->fg_color,
 	        pf->bg_color, pf->alpha,
 	        pf->cursor_shape, pf->cursor_blinking);
-	fprintf(fp, "</lterm-profiles>\n");
-	fclose(fp);
-	return (0);
+	cfg_writer_printf(&w, "</lterm-profiles>\n");
+	return cfg_writer_commit(&w);
 }
 
 void profile_create_default(struct Profile *pf)
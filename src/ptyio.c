@@ -0,0 +1,514 @@
+/**
+ * Copyright (C) 2009-2017 Fabio Leone
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * @file ptyio.c
+ * @brief Terminal output read by lterm from the pty, in batches through a ring buffer
+ */
+
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib-unix.h>
+#include <gtk/gtk.h>
+#include <vte/vte.h>
+#include "main.h"
+#include "timerwheel.h"
+#include "ptyio.h"
+
+extern Prefs prefs;
+
+/*
+ * Normally the terminal reads its pty itself, the default: this reader
+ * is experimental (prefs.pty_io) until its throughput is shown to match,
+ * see test/ptyio_bench.c. Here lterm keeps the pty master: a thread per terminal reads it into a ring buffer and the main
+ * loop feeds what was read to the terminal, at most PTY_IO_BATCH bytes
+ * at once and below the priority of redraws, so that a flood of output
+ * is parsed in a few large chunks and still painted frame after frame.
+ * Input goes the other way through the "commit" signal, resizes through
+ * vte_pty_set_size().
+ *
+ * The ring has a single producer (the reader) and a single consumer (the
+ * main loop): each one moves its own free running index and only reads
+ * the other one, no lock is taken. When the ring is full, or reading is
+ * paused, the reader sleeps until the main loop wakes it through an
+ * eventfd; the pty fills up and the command blocks on its writes, as
+ * with a slow terminal. The reader queues a drain in the main loop when
+ * none is queued.
+ *
+ * Output is fed according to what the user sees:
+ * - on screen, as soon as it is read;
+ * - on screen and flooded (more than a batch left after a batch), all
+ *   that was read at each frame, skipping the frames in between;
+ * - off screen, all that was read every PTY_IO_HIDDEN_MS. With
+ *   prefs.background_buffer the reader holds up the command when that
+ *   much is waiting, instead of PTY_IO_RING_SIZE.
+ * The reader may also be held to a byte rate, with a token bucket of
+ * PTY_IO_RATE_BURST_MS, or paused: both are set for each tab (see
+ * tabApplyOutputLimits()), the rate from prefs.rate_limit by default.
+ */
+
+#define PTY_IO_KEY "lterm-pty-io"
+
+/* after the redraws (GDK_PRIORITY_REDRAW) */
+#define PTY_IO_PRIORITY G_PRIORITY_DEFAULT_IDLE
+
+struct _PtyIO {
+	VteTerminal *vte;           /* NULL once detached */
+	VtePty *pty;
+	int fd;                     /* pty master */
+	int wake_fd;                /* eventfd waking the reader */
+	GThread *thread;
+	char *ring;
+	gint head;                  /* written by the reader */
+	gint tail;                  /* written by the main loop */
+	gint limit;                 /* bytes buffered before the reader waits */
+	gint paused;
+	gint waiting;               /* the reader sleeps until woken */
+	gint scheduled;             /* a drain is queued in the main loop */
+	gint quit;
+	gint ref;                   /* the terminal and a queued drain */
+	gint stalls;
+	gint rate;                  /* bytes per second read at most, 0 for any */
+	gboolean hidden;            /* not on screen */
+	guint tick_id;              /* flooded, fed at each frame */
+	WheelTimer *hidden_timer;   /* off screen, fed from time to time */
+	guint64 bytes_fed;
+	guint64 bytes_written;
+	guint64 batches;
+	GByteArray *out;            /* input the pty didn't take yet */
+	guint out_id;
+	gulong commit_id;
+	gulong size_id;
+	gulong map_id;
+	gulong unmap_id;
+	int columns;
+	int rows;
+};
+
+static void pty_io_unref(gpointer data)
+{
+	PtyIO *io = data;
+	if (!g_atomic_int_dec_and_test(&io->ref))
+		return;
+	close(io->wake_fd);
+	g_object_unref(io->pty);
+	g_byte_array_free(io->out, TRUE);
+	g_free(io->ring);
+	g_free(io);
+}
+
+static void wake(PtyIO *io)
+{
+	guint64 one = 1;
+	if (write(io->wake_fd, &one, sizeof(one)) < 0)
+		log_debug("wake: %s\n", g_strerror(errno));
+}
+
+/* wakes the reader if it sleeps, after the main loop made room or changed the limits */
+static void wake_reader(PtyIO *io)
+{
+	if (g_atomic_int_compare_and_exchange(&io->waiting, 1, 0))
+		wake(io);
+}
+
+/* feeds up to max bytes to the terminal, returns the bytes left */
+static guint feed(PtyIO *io, guint max)
+{
+	guint head, tail, off, n, fed = 0;
+	head = (guint) g_atomic_int_get(&io->head);
+	tail = (guint) io->tail;
+	while (tail != head && fed < max) {
+		off = tail & (PTY_IO_RING_SIZE - 1);
+		n = MIN(head - tail, PTY_IO_RING_SIZE - off);
+		n = MIN(n, max - fed);
+		vte_terminal_feed(io->vte, io->ring + off, n);
+		tail += n;
+		fed += n;
+	}
+	g_atomic_int_set(&io->tail, (gint) tail);
+	io->bytes_fed += fed;
+	if (fed)
+		io->batches ++;
+	wake_reader(io);
+	return head - tail;
+}
+
+/*
+ * Gives the draining back to the reader when all was fed.
+ * @return FALSE if the reader added some in the meantime, still to drain
+ */
+static gboolean drain_done(PtyIO *io)
+{
+	guint tail = (guint) io->tail;
+	g_atomic_int_set(&io->scheduled, 0);
+	/* the reader may have added some, seeing a drain still queued */
+	return tail == (guint) g_atomic_int_get(&io->head) || !g_atomic_int_compare_and_exchange(&io->scheduled, 0, 1);
+}
+
+static gboolean detached(PtyIO *io)
+{
+	return io->vte == NULL || gtk_widget_in_destruction(GTK_WIDGET(io->vte));
+}
+
+static gboolean drain_cb(gpointer data);
+
+/* queues a drain from the main loop, the reader's one being taken */
+static void drain_queue(PtyIO *io)
+{
+	g_atomic_int_inc(&io->ref);
+	g_idle_add_full(PTY_IO_PRIORITY, drain_cb, io, pty_io_unref);
+}
+
+static gboolean hidden_cb(gpointer data)
+{
+	PtyIO *io = data;
+	if (detached(io)) {
+		g_atomic_int_set(&io->scheduled, 0);
+		io->hidden_timer = NULL;
+		return G_SOURCE_REMOVE;
+	}
+	if (feed(io, PTY_IO_RING_SIZE) == 0 && drain_done(io)) {
+		io->hidden_timer = NULL;
+		return G_SOURCE_REMOVE;
+	}
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean tick_cb(GtkWidget *widget, GdkFrameClock *frame_clock, gpointer data)
+{
+	PtyIO *io = data;
+	guint pending = (guint) g_atomic_int_get(&io->head) - (guint) io->tail;
+	feed(io, PTY_IO_RING_SIZE);
+	/* over the flood: no frame to skip */
+	if (pending < PTY_IO_BATCH) {
+		io->tick_id = 0;
+		if (!drain_done(io))
+			drain_queue(io);
+		return G_SOURCE_REMOVE;
+	}
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean drain_cb(gpointer data)
+{
+	PtyIO *io = data;
+	if (detached(io)) {
+		g_atomic_int_set(&io->scheduled, 0);
+		return G_SOURCE_REMOVE;
+	}
+	if (io->hidden) {
+		if (io->hidden_timer == NULL)
+			io->hidden_timer = wheel_timer_add(PTY_IO_HIDDEN_MS, hidden_cb, io);
+		return G_SOURCE_REMOVE;
+	}
+	if (feed(io, PTY_IO_BATCH) >= PTY_IO_BATCH) {
+		io->tick_id = gtk_widget_add_tick_callback(GTK_WIDGET(io->vte), tick_cb, io, NULL);
+		return G_SOURCE_REMOVE;
+	}
+	if ((guint) io->tail != (guint) g_atomic_int_get(&io->head))
+		return G_SOURCE_CONTINUE;
+	return drain_done(io) ? G_SOURCE_REMOVE : G_SOURCE_CONTINUE;
+}
+
+/* called by the reader */
+static void drain_schedule(PtyIO *io)
+{
+	if (g_atomic_int_compare_and_exchange(&io->scheduled, 0, 1))
+		drain_queue(io);
+}
+
+/* room in the ring, 0 if the reader has to wait */
+static guint room(PtyIO *io, guint head)
+{
+	guint used = head - (guint) g_atomic_int_get(&io->tail);
+	guint limit = (guint) g_atomic_int_get(&io->limit);
+	if (g_atomic_int_get(&io->paused) || used >= limit)
+		return 0;
+	return limit - used;
+}
+
+static gpointer reader_thread(gpointer data)
+{
+	PtyIO *io = data;
+	struct pollfd fds[2];
+	guint head = 0, space, off;
+	guint64 count;
+	gint64 now, last = g_get_monotonic_time(), tokens = 0, burst;
+	int rate, timeout;
+	ssize_t n;
+	fds[1].fd = io->wake_fd;
+	fds[1].events = POLLIN;
+	while (!g_atomic_int_get(&io->quit)) {
+		space = room(io, head);
+		if (space == 0) {
+			/* flagged before looking again, or a wake up may be missed */
+			g_atomic_int_set(&io->waiting, 1);
+			if ((space = room(io, head)) != 0)
+				g_atomic_int_set(&io->waiting, 0);
+			else
+				g_atomic_int_inc(&io->stalls);
+		}
+		timeout = -1;
+		if (space && (rate = g_atomic_int_get(&io->rate)) > 0) {
+			now = g_get_monotonic_time();
+			burst = MAX((gint64) rate * PTY_IO_RATE_BURST_MS / 1000, 1);
+			tokens = MIN(tokens + MIN(now - last, G_USEC_PER_SEC) * rate / G_USEC_PER_SEC, burst);
+			last = now;
+			if (tokens <= 0) {
+				/* until half the burst is allowed, not to read byte by byte */
+				timeout = (burst / 2 - tokens) * 1000 / rate + 1;
+				space = 0;
+			} else {
+				space = MIN(space, tokens);
+			}
+		}
+		/* a full ring doesn't listen to the pty, not even to a hang up */
+		fds[0].fd = space ? io->fd : -1;
+		fds[0].events = POLLIN;
+		if (poll(fds, 2, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[1].revents & POLLIN) {
+			if (read(io->wake_fd, &count, sizeof(count)) < 0)
+				continue;
+		}
+		if (space == 0 || fds[0].revents == 0)
+			continue;
+		off = head & (PTY_IO_RING_SIZE - 1);
+		n = read(io->fd, io->ring + off, MIN(MIN(space, PTY_IO_RING_SIZE - off), PTY_IO_READ_SIZE));
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		/* EIO once the command and its children are gone */
+		if (n <= 0)
+			break;
+		head += n;
+		tokens -= n;
+		g_atomic_int_set(&io->head, (gint) head);
+		drain_schedule(io);
+	}
+	return NULL;
+}
+
+static gboolean flush_cb(gint fd, GIOCondition condition, gpointer data)
+{
+	PtyIO *io = data;
+	ssize_t n = write(fd, io->out->data, io->out->len);
+	if (n < 0 && errno != EAGAIN && errno != EINTR) {
+		log_debug("%s\n", g_strerror(errno));
+		g_byte_array_set_size(io->out, 0);
+	} else if (n > 0) {
+		g_byte_array_remove_range(io->out, 0, n);
+		io->bytes_written += n;
+	}
+	if (io->out->len)
+		return G_SOURCE_CONTINUE;
+	io->out_id = 0;
+	return G_SOURCE_REMOVE;
+}
+
+static void commit_cb(VteTerminal *vte, gchar *text, guint size, gpointer user_data)
+{
+	PtyIO *io = user_data;
+	ssize_t n = 0;
+	/* in order, after what is still waiting */
+	if (io->out->len == 0) {
+		n = write(io->fd, text, size);
+		if (n < 0)
+			n = 0;
+		io->bytes_written += n;
+	}
+	if ((guint) n == size)
+		return;
+	g_byte_array_append(io->out, (guint8 *) text + n, size - n);
+	if (io->out_id == 0)
+		io->out_id = g_unix_fd_add(io->fd, G_IO_OUT, flush_cb, io);
+}
+
+static void set_size(PtyIO *io)
+{
+	GError *error = NULL;
+	int columns = vte_terminal_get_column_count(io->vte);
+	int rows = vte_terminal_get_row_count(io->vte);
+	if (columns == io->columns && rows == io->rows)
+		return;
+	io->columns = columns;
+	io->rows = rows;
+	if (!vte_pty_set_size(io->pty, rows, columns, &error)) {
+		log_debug("%s\n", error->message);
+		g_error_free(error);
+	}
+}
+
+static void size_allocate_cb(GtkWidget *widget, GdkRectangle *allocation, gpointer user_data)
+{
+	set_size(user_data);
+}
+
+static void apply_limit(PtyIO *io)
+{
+	gint limit = PTY_IO_RING_SIZE;
+	if (io->hidden && prefs.background_buffer > 0)
+		limit = MIN(limit, prefs.background_buffer * 1024);
+	g_atomic_int_set(&io->limit, limit);
+	wake_reader(io);
+}
+
+/* moves the draining to the timer when off screen, back to the reader when on screen */
+static void set_hidden(PtyIO *io, gboolean hidden)
+{
+	io->hidden = hidden;
+	apply_limit(io);
+	if (hidden && io->tick_id) {
+		gtk_widget_remove_tick_callback(GTK_WIDGET(io->vte), io->tick_id);
+		io->tick_id = 0;
+		io->hidden_timer = wheel_timer_add(PTY_IO_HIDDEN_MS, hidden_cb, io);
+	} else if (!hidden && io->hidden_timer) {
+		wheel_timer_cancel(io->hidden_timer);
+		io->hidden_timer = NULL;
+		drain_queue(io);
+	}
+}
+
+static void map_cb(GtkWidget *widget, gpointer user_data)
+{
+	set_hidden(user_data, FALSE);
+}
+
+static void unmap_cb(GtkWidget *widget, gpointer user_data)
+{
+	set_hidden(user_data, TRUE);
+}
+
+/* destroy notify of the terminal's data */
+static void pty_io_close(gpointer data)
+{
+	PtyIO *io = data;
+	PtyIOStats stats;
+	if (g_signal_handler_is_connected(io->vte, io->commit_id))
+		g_signal_handler_disconnect(io->vte, io->commit_id);
+	if (g_signal_handler_is_connected(io->vte, io->size_id))
+		g_signal_handler_disconnect(io->vte, io->size_id);
+	if (g_signal_handler_is_connected(io->vte, io->map_id))
+		g_signal_handler_disconnect(io->vte, io->map_id);
+	if (g_signal_handler_is_connected(io->vte, io->unmap_id))
+		g_signal_handler_disconnect(io->vte, io->unmap_id);
+	if (io->tick_id && !detached(io))
+		gtk_widget_remove_tick_callback(GTK_WIDGET(io->vte), io->tick_id);
+	if (io->hidden_timer)
+		wheel_timer_cancel(io->hidden_timer);
+	g_atomic_int_set(&io->quit, 1);
+	wake(io);
+	g_thread_join(io->thread);
+	if (io->out_id)
+		g_source_remove(io->out_id);
+	pty_io_stats(io, &stats);
+	log_debug("%" G_GUINT64_FORMAT " bytes read, %" G_GUINT64_FORMAT " fed in %" G_GUINT64_FORMAT " batches, "
+	          "%" G_GUINT64_FORMAT " written, %u stalls\n",
+	          stats.bytes_read, stats.bytes_fed, stats.batches, stats.bytes_written, stats.stalls);
+	/* a queued drain finds it detached */
+	io->vte = NULL;
+	pty_io_unref(io);
+}
+
+/**
+ * pty_io_attach() - makes lterm read the pty and feed the terminal with its output
+ * Replaces the pty of the terminal, if any. The terminal takes a reference on pty.
+ * @return 0 if ok, 1 on error
+ */
+int pty_io_attach(VteTerminal *vte, VtePty *pty)
+{
+	PtyIO *io;
+	int fd = vte_pty_get_fd(pty);
+	int wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (wake_fd < 0 || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+		log_write("[%s] %s\n", __func__, g_strerror(errno));
+		if (wake_fd >= 0)
+			close(wake_fd);
+		return 1;
+	}
+	vte_terminal_set_pty(vte, NULL);
+	io = g_new0(PtyIO, 1);
+	io->vte = vte;
+	io->pty = g_object_ref(pty);
+	io->fd = fd;
+	io->wake_fd = wake_fd;
+	io->ring = g_malloc(PTY_IO_RING_SIZE);
+	io->limit = PTY_IO_RING_SIZE;
+	io->rate = prefs.rate_limit * 1024;
+	io->ref = 1;
+	io->out = g_byte_array_new();
+	/* the size is set before the command reads it */
+	set_size(io);
+	io->commit_id = g_signal_connect(vte, "commit", G_CALLBACK(commit_cb), io);
+	io->size_id = g_signal_connect(vte, "size-allocate", G_CALLBACK(size_allocate_cb), io);
+	io->map_id = g_signal_connect(vte, "map", G_CALLBACK(map_cb), io);
+	io->unmap_id = g_signal_connect(vte, "unmap", G_CALLBACK(unmap_cb), io);
+	set_hidden(io, !gtk_widget_get_mapped(GTK_WIDGET(vte)));
+	io->thread = g_thread_new("pty-io", reader_thread, io);
+	/* closes the previous one */
+	g_object_set_data_full(G_OBJECT(vte), PTY_IO_KEY, io, pty_io_close);
+	return 0;
+}
+
+/* pty_io_detach() - stops reading the pty of the terminal, if lterm does */
+void pty_io_detach(VteTerminal *vte)
+{
+	g_object_set_data(G_OBJECT(vte), PTY_IO_KEY, NULL);
+}
+
+/* pty_io_get() - the pipeline of the terminal, NULL if the terminal reads its pty */
+PtyIO *pty_io_get(VteTerminal *vte)
+{
+	return g_object_get_data(G_OBJECT(vte), PTY_IO_KEY);
+}
+
+/* pty_io_stats() - byte counters, from the main thread */
+void pty_io_stats(PtyIO *io, PtyIOStats *stats)
+{
+	stats->pending = (guint) g_atomic_int_get(&io->head) - (guint) io->tail;
+	stats->bytes_fed = io->bytes_fed;
+	stats->bytes_read = io->bytes_fed + stats->pending;
+	stats->bytes_written = io->bytes_written;
+	stats->batches = io->batches;
+	stats->stalls = (guint) g_atomic_int_get(&io->stalls);
+}
+
+/* pty_io_set_rate() - bytes per second read from the pty at most, 0 for no cap */
+void pty_io_set_rate(PtyIO *io, guint rate)
+{
+	g_atomic_int_set(&io->rate, (gint) MIN(rate, G_MAXINT));
+	wake_reader(io);
+}
+
+/* pty_io_pause() - stops or restarts reading the pty, the command blocks once it is full */
+void pty_io_pause(PtyIO *io, gboolean pause)
+{
+	g_atomic_int_set(&io->paused, pause ? 1 : 0);
+	wake_reader(io);
+}
+
+/* pty_io_flush() - feeds the terminal all that was read, before looking at what it shows */
+void pty_io_flush(PtyIO *io)
+{
+	feed(io, PTY_IO_RING_SIZE);
+}
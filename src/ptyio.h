@@ -0,0 +1,41 @@
+
+#ifndef _PTYIO_H
+#define _PTYIO_H
+
+#include <vte/vte.h>
+
+/* bytes buffered between the reader and the terminal, a power of two */
+#define PTY_IO_RING_SIZE (1 << 20)
+
+/* longest read from the pty */
+#define PTY_IO_READ_SIZE 65536
+
+/* most bytes fed to the terminal at once, between two redraws */
+#define PTY_IO_BATCH 262144
+
+/* interval of the feeds to a terminal off screen */
+#define PTY_IO_HIDDEN_MS 300
+
+/* largest burst allowed by a byte rate */
+#define PTY_IO_RATE_BURST_MS 100
+
+typedef struct _PtyIO PtyIO;
+
+typedef struct _PtyIOStats {
+	guint64 bytes_read;     /* from the pty */
+	guint64 bytes_fed;      /* to the terminal */
+	guint64 bytes_written;  /* typed or pasted, to the pty */
+	guint64 batches;        /* feeds to the terminal */
+	guint stalls;           /* times the reader waited for room */
+	gsize pending;          /* read and not yet fed */
+} PtyIOStats;
+
+int pty_io_attach(VteTerminal *vte, VtePty *pty);
+void pty_io_detach(VteTerminal *vte);
+PtyIO *pty_io_get(VteTerminal *vte);
+void pty_io_stats(PtyIO *io, PtyIOStats *stats);
+void pty_io_set_rate(PtyIO *io, guint rate);
+void pty_io_pause(PtyIO *io, gboolean pause);
+void pty_io_flush(PtyIO *io);
+
+#endif
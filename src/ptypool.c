@@ -0,0 +1,293 @@
+/**
+ * Copyright (C) 2009-2017 Fabio Leone
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * @file ptypool.c
+ * @brief Pre-forked children on their own pty, ready to run a command
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <vte/vte.h>
+#include "ptypool.h"
+#include "procwatch.h"
+#include "ptyio.h"
+#include "main.h"
+
+extern Prefs prefs;
+
+/*
+ * Opening a tab used to create the pty, fork and search PATH for the
+ * command after the terminal was built. Here a few children are forked
+ * in advance, when the main loop is idle: each one already has its pty
+ * as controlling terminal and no other descriptor than a pipe where it
+ * waits for the resolved path and the arguments, written at once. The
+ * terminal adopts the pty and the child execs. Program paths are looked
+ * up once and remembered. Children are reaped by procwatch.c, also the
+ * waiting ones. The terminal reads the pty, or lterm does (see ptyio.c).
+ */
+
+typedef struct _PoolEntry {
+	VtePty *pty;
+	GPid pid;
+	int fd;               /* write end of the child's pipe */
+} PoolEntry;
+
+static struct {
+	GArray *entries;      /* PoolEntry */
+	GHashTable *paths;    /* program name -> full path */
+	guint idle_id;
+	gchar **envp;         /* environment of the commands */
+	long open_max;
+} pool;
+
+/*
+ * The child's copies, filled before forking. lterm has threads, so after
+ * fork() the child may only make system calls: no allocation, no locks.
+ */
+static char child_args[PTY_POOL_ARGS_MAX];
+static char *child_argv[PTY_POOL_ARGC_MAX + 1];
+
+/* closes everything but stdin/out/err and keep */
+static void child_close_fds(int keep)
+{
+	int fd;
+#ifdef SYS_close_range
+	if ((keep == 3 || syscall(SYS_close_range, 3, keep - 1, 0) == 0)
+	    && syscall(SYS_close_range, keep + 1, ~0U, 0) == 0)
+		return;
+#endif
+	/* kernel older than 5.9 */
+	for (fd = 3; fd < pool.open_max; fd++)
+		if (fd != keep)
+			close(fd);
+}
+
+/* runs in the forked child, never returns */
+static void child_wait(VtePty *pty, int fd)
+{
+	ssize_t n, len = 0;
+	int argc = 0;
+	char *p;
+	vte_pty_child_setup(pty);
+	child_close_fds(fd);
+	while ((n = read(fd, child_args + len, sizeof(child_args) - 1 - len)) > 0)
+		len += n;
+	/* lterm exited or gave up on this child */
+	if (len == 0)
+		_exit(0);
+	child_args[len] = 0;
+	/* path, then the arguments, separated by nul characters */
+	for (p = child_args + strlen(child_args) + 1; p < child_args + len && argc < PTY_POOL_ARGC_MAX; p += strlen(p) + 1)
+		child_argv[argc++] = p;
+	child_argv[argc] = NULL;
+	signal(SIGPIPE, SIG_DFL);
+	execve(child_args, child_argv, pool.envp);
+	_exit(127);
+}
+
+static int pool_add(void)
+{
+	PoolEntry e;
+	GError *error = NULL;
+	int fds[2];
+	e.pty = vte_pty_new_sync(VTE_PTY_DEFAULT, NULL, &error);
+	if (e.pty == NULL) {
+		log_write("[%s] %s\n", __func__, error->message);
+		g_error_free(error);
+		return 1;
+	}
+	if (pipe2(fds, O_CLOEXEC)) {
+		g_object_unref(e.pty);
+		return 1;
+	}
+	e.pid = fork();
+	if (e.pid == 0)
+		child_wait(e.pty, fds[0]);
+	close(fds[0]);
+	if (e.pid < 0) {
+		close(fds[1]);
+		g_object_unref(e.pty);
+		return 1;
+	}
+	e.fd = fds[1];
+	proc_watch(e.pid, NULL, NULL);
+	g_array_append_val(pool.entries, e);
+	return 0;
+}
+
+static gboolean fill_cb(gpointer data)
+{
+	/* one per iteration, not to delay events */
+	if (pool.entries->len < PTY_POOL_SIZE && pool_add() == 0)
+		return G_SOURCE_CONTINUE;
+	pool.idle_id = 0;
+	return G_SOURCE_REMOVE;
+}
+
+static void pool_fill(void)
+{
+	if (pool.idle_id == 0)
+		pool.idle_id = g_idle_add_full(G_PRIORITY_LOW, fill_cb, NULL, NULL);
+}
+
+/* pty_pool_init() - starts filling the pool in background */
+void pty_pool_init(void)
+{
+	char vte_version[16];
+	pool.entries = g_array_new(FALSE, FALSE, sizeof(PoolEntry));
+	pool.paths = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	/* a child may die before its command line is written */
+	signal(SIGPIPE, SIG_IGN);
+	/* what vte sets for the commands it spawns */
+	g_snprintf(vte_version, sizeof(vte_version), "%d",
+	           VTE_MAJOR_VERSION * 10000 + VTE_MINOR_VERSION * 100 + VTE_MICRO_VERSION);
+	pool.envp = g_get_environ();
+	pool.envp = g_environ_setenv(pool.envp, "TERM", "xterm-256color", TRUE);
+	pool.envp = g_environ_setenv(pool.envp, "COLORTERM", "truecolor", TRUE);
+	pool.envp = g_environ_setenv(pool.envp, "VTE_VERSION", vte_version, TRUE);
+	pool.open_max = sysconf(_SC_OPEN_MAX);
+	pool_fill();
+}
+
+static const char *find_program(const char *name)
+{
+	gchar *path;
+	if (strchr(name, '/'))
+		return name;
+	path = g_hash_table_lookup(pool.paths, name);
+	if (path == NULL && (path = g_find_program_in_path(name)) != NULL)
+		g_hash_table_insert(pool.paths, g_strdup(name), path);
+	return path;
+}
+
+/* gives the pty to the terminal or to lterm's reader, NULL takes it back */
+static void pty_attach(VteTerminal *vte, VtePty *pty)
+{
+	if (pty && prefs.pty_io && pty_io_attach(vte, pty) == 0)
+		return;
+	pty_io_detach(vte);
+	vte_terminal_set_pty(vte, pty);
+}
+
+static int write_all(int fd, const char *data, gsize len)
+{
+	ssize_t n;
+	while (len) {
+		if ((n = write(fd, data, len)) < 0)
+			return 1;
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * pty_pool_spawn() - runs argv in the terminal with a child of the pool
+ * argv[0] is searched in PATH. The caller takes the child with proc_watch().
+ * @return 0 if ok, 1 if the pool can't be used (empty, command not found...)
+ */
+int pty_pool_spawn(VteTerminal *vte, char **argv, GPid *pid)
+{
+	PoolEntry e;
+	const char *path;
+	GString *args;
+	int i, rc;
+	if (pool.entries == NULL || pool.entries->len == 0 || (path = find_program(argv[0])) == NULL)
+		return 1;
+	/* path, then the arguments, each one with its nul terminator */
+	args = g_string_new(path);
+	g_string_append_c(args, 0);
+	for (i = 0; argv[i]; i++)
+		g_string_append_len(args, argv[i], strlen(argv[i]) + 1);
+	if (args->len >= PTY_POOL_ARGS_MAX || i > PTY_POOL_ARGC_MAX) {
+		g_string_free(args, TRUE);
+		return 1;
+	}
+	/* first in, first out: the oldest child is surely ready */
+	e = g_array_index(pool.entries, PoolEntry, 0);
+	g_array_remove_index(pool.entries, 0);
+	pool_fill();
+	rc = write_all(e.fd, args->str, args->len);
+	g_string_free(args, TRUE);
+	close(e.fd);
+	if (rc) {
+		log_write("[%s] child %d is gone\n", __func__, e.pid);
+		g_object_unref(e.pty);
+		return 1;
+	}
+	pty_attach(vte, e.pty);
+	g_object_unref(e.pty);
+	*pid = e.pid;
+	return 0;
+}
+
+static void spawn_setup(gpointer data)
+{
+	vte_pty_child_setup(data);
+	signal(SIGPIPE, SIG_DFL);
+}
+
+/**
+ * pty_spawn() - runs argv in the terminal with a new child, when the pool can't
+ * Unlike vte_terminal_spawn_async() the child is left to procwatch.c,
+ * the caller takes it with proc_watch().
+ * @return 0 if ok, 1 on error
+ */
+int pty_spawn(VteTerminal *vte, char **argv, GPid *pid, GError **error)
+{
+	VtePty *pty;
+	gboolean ok;
+	pty = vte_pty_new_sync(VTE_PTY_DEFAULT, NULL, error);
+	if (pty == NULL)
+		return 1;
+	/* the size is set before the command reads it */
+	pty_attach(vte, pty);
+	ok = g_spawn_async(NULL, argv, pool.envp, G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD, spawn_setup, pty, pid, error);
+	if (ok)
+		proc_watch(*pid, NULL, NULL);
+	else
+		pty_attach(vte, NULL);
+	g_object_unref(pty);
+	return ok ? 0 : 1;
+}
+
+/* pty_pool_shutdown() - lets the waiting children exit */
+void pty_pool_shutdown(void)
+{
+	int i;
+	if (pool.entries == NULL)
+		return;
+	if (pool.idle_id)
+		g_source_remove(pool.idle_id);
+	for (i = 0; i < pool.entries->len; i++) {
+		PoolEntry *e = &g_array_index(pool.entries, PoolEntry, i);
+		close(e->fd);
+		g_object_unref(e->pty);
+	}
+	g_array_free(pool.entries, TRUE);
+	g_hash_table_destroy(pool.paths);
+	g_strfreev(pool.envp);
+	pool.entries = NULL;
+	pool.envp = NULL;
+}
@@ -0,0 +1,19 @@
+
+#ifndef _PTYPOOL_H
+#define _PTYPOOL_H
+
+#include <vte/vte.h>
+
+/* children waiting for a command line */
+#define PTY_POOL_SIZE 2
+
+/* longest command line (path and arguments) a pooled child accepts */
+#define PTY_POOL_ARGS_MAX 16384
+#define PTY_POOL_ARGC_MAX 512
+
+void pty_pool_init(void);
+int pty_pool_spawn(VteTerminal *vte, char **argv, GPid *pid);
+int pty_spawn(VteTerminal *vte, char **argv, GPid *pid, GError **error);
+void pty_pool_shutdown(void);
+
+#endif
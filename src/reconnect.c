@@ -0,0 +1,274 @@
+/**
+ * Copyright (C) 2009-2017 Fabio Leone
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * @file reconnect.c
+ * @brief Automatic reconnection of the tabs with exponential backoff
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include "main.h"
+#include "gui.h"
+#include "terminal.h"
+#include "timerwheel.h"
+#include "ptyio.h"
+#include "reconnect.h"
+
+extern Prefs prefs;
+
+/*
+ * A tab whose connection failed or was lost (ssh exiting with 255, the
+ * libssh session lost) waits RECONNECT_DELAY_MS, doubled at each failed
+ * attempt up to RECONNECT_DELAY_MAX_MS, with a random part so that tabs
+ * lost together don't come back together. Then it reconnects if fewer
+ * than prefs.reconnect_concurrency tabs are reconnecting, or waits in a
+ * queue. An attempt ends when the tab is lost again, or succeeds when it
+ * is still connected after RECONNECT_STABLE_MS. A clean exit, a log off
+ * or enter pressed by the user stop the attempts.
+ * Only a session that ran, connected for RECONNECT_STABLE_MS, starts the
+ * attempts: ssh also exits with 255 when it can't log in. A login or host
+ * key refused, as the last lines of the tab tell, stops them at once, so
+ * that retries don't lock the account or get the address banned.
+ */
+
+#define STATE_IDLE 0
+#define STATE_WAITING 1       /* timer before the next attempt */
+#define STATE_QUEUED 2        /* too many tabs reconnecting */
+#define STATE_CONNECTING 3
+
+/* what ssh and the libssh backend print when they won't be let in */
+static const char *refused_messages[] = {
+	"Permission denied",
+	"Host key verification failed",
+	"REMOTE HOST IDENTIFICATION HAS CHANGED",
+	"Too many authentication failures",
+	"has changed, connection refused",
+	NULL
+};
+
+typedef struct _Reconnect {
+	struct ConnectionTab *tab;
+	int state;
+	int attempt;              /* attempts since the connection was lost */
+	guint delay;              /* ms of the current wait */
+	WheelTimer *timer;
+} Reconnect;
+
+static GQueue queue = G_QUEUE_INIT;    /* Reconnect * */
+static int n_connecting = 0;
+
+static int concurrency(void)
+{
+	return prefs.reconnect_concurrency > 0 ? prefs.reconnect_concurrency : RECONNECT_CONCURRENCY;
+}
+
+static void start(Reconnect *r);
+
+static void start_queued(void)
+{
+	Reconnect *r;
+	while (n_connecting < concurrency() && (r = g_queue_pop_head(&queue)) != NULL)
+		start(r);
+}
+
+/* stop() - back to idle, freeing the place of a reconnecting tab */
+static void stop(Reconnect *r)
+{
+	int state = r->state;
+	wheel_timer_cancel(r->timer);
+	r->timer = NULL;
+	r->state = STATE_IDLE;
+	if (state == STATE_QUEUED)
+		g_queue_remove(&queue, r);
+	if (state == STATE_CONNECTING) {
+		n_connecting --;
+		start_queued();
+	}
+}
+
+/* checks an attempt, until the tab is connected or lost */
+static gboolean check_cb(gpointer data)
+{
+	Reconnect *r = data;
+	switch (tabGetConnectionStatus(r->tab)) {
+	case TAB_CONN_STATUS_CONNECTING:
+		return G_SOURCE_CONTINUE;
+	case TAB_CONN_STATUS_CONNECTED:
+		log_write("[%s] %s reconnected after %d attempts\n", __func__, r->tab->connection->name, r->attempt);
+		r->timer = NULL;
+		r->attempt = 0;
+		stop(r);
+		break;
+	default:
+		/* the command didn't start, there is no exit to wait for */
+		r->timer = NULL;
+		reconnect_tab_lost(r->tab, RECONNECT_LOST_STATUS);
+		break;
+	}
+	tabUpdateTooltip(r->tab);
+	return G_SOURCE_REMOVE;
+}
+
+static void start(Reconnect *r)
+{
+	struct ConnectionTab *p_ct = r->tab;
+	r->state = STATE_CONNECTING;
+	r->attempt ++;
+	n_connecting ++;
+	log_write("[%s] %s attempt %d\n", __func__, p_ct->connection->name, r->attempt);
+	terminal_write_ex(p_ct, "Reconnecting, attempt %d...\r\n", r->attempt);
+	tabInitConnection(p_ct);
+	tabUpdateTooltip(p_ct);
+	r->timer = wheel_timer_add(RECONNECT_STABLE_MS, check_cb, r);
+	if (log_on(p_ct)) {
+		/* a question was cancelled */
+		reconnect_cancel(p_ct);
+		terminal_write_ex(p_ct, "Hit enter to reconnect.\r\n");
+	}
+	refreshTabStatus(p_ct);
+}
+
+static gboolean wait_cb(gpointer data)
+{
+	Reconnect *r = data;
+	r->timer = NULL;
+	if (n_connecting < concurrency()) {
+		start(r);
+	} else {
+		r->state = STATE_QUEUED;
+		g_queue_push_tail(&queue, r);
+		tabUpdateTooltip(r->tab);
+	}
+	return G_SOURCE_REMOVE;
+}
+
+/*
+ * TRUE if the end of the tab shows a refused login or host key, in the
+ * last lines or, during an attempt, since it started
+ */
+static gboolean refused(struct ConnectionTab *p_ct, gboolean attempt)
+{
+	VteTerminal *vte = VTE_TERMINAL(p_ct->vte);
+	PtyIO *io = pty_io_get(vte);
+	gchar *text, *p, *mark;
+	int i, n;
+	gboolean ret = FALSE;
+	if (io)
+		pty_io_flush(io);
+#if VTE_CHECK_VERSION(0, 76, 0)
+	text = vte_terminal_get_text_format(vte, VTE_FORMAT_TEXT);
+#else
+	text = vte_terminal_get_text(vte, NULL, NULL, NULL);
+#endif
+	if (text == NULL)
+		return FALSE;
+	g_strchomp(text);
+	for (p = text + strlen(text), n = 0; p > text; p--)
+		if (p[-1] == '\n' && ++n == RECONNECT_REFUSED_LINES)
+			break;
+	if (attempt && (mark = g_strrstr(text, "Reconnecting, attempt")) != NULL)
+		p = mark;
+	for (i = 0; refused_messages[i] && !ret; i++)
+		ret = strstr(p, refused_messages[i]) != NULL;
+	g_free(text);
+	return ret;
+}
+
+/* the session of the tab ran, instead of failing to start */
+static gboolean session_ran(struct ConnectionTab *p_ct)
+{
+	return p_ct->connected_time && g_get_monotonic_time() - p_ct->connected_time >= RECONNECT_STABLE_MS * 1000;
+}
+
+/**
+ * reconnect_tab_lost() - the connection of a tab ended, schedules a new attempt if it failed
+ * @param[in] status wait status of the ssh program, RECONNECT_LOST_STATUS if lost
+ * @return milliseconds before the attempt, 0 if there won't be any
+ */
+int reconnect_tab_lost(struct ConnectionTab *p_ct, int status)
+{
+	Reconnect *r = p_ct->reconnect;
+	gboolean attempt = r && r->state == STATE_CONNECTING;
+	guint delay;
+	if (!p_ct->auto_reconnect || status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 255) {
+		reconnect_cancel(p_ct);
+		return 0;
+	}
+	/* a failed log in is not a lost connection, and would fail again */
+	if ((!attempt && !session_ran(p_ct)) || refused(p_ct, attempt)) {
+		log_write("[%s] %s: not reconnecting, the log in failed\n", __func__, p_ct->connection->name);
+		reconnect_cancel(p_ct);
+		return 0;
+	}
+	if (r == NULL) {
+		r = p_ct->reconnect = g_new0(Reconnect, 1);
+		r->tab = p_ct;
+	}
+	/* lost after a stable connection: a new series */
+	if (r->state != STATE_CONNECTING)
+		r->attempt = 0;
+	stop(r);
+	if (r->attempt >= RECONNECT_MAX_ATTEMPTS) {
+		log_write("[%s] %s: giving up after %d attempts\n", __func__, p_ct->connection->name, r->attempt);
+		r->attempt = 0;
+		tabUpdateTooltip(p_ct);
+		return 0;
+	}
+	delay = MIN(RECONNECT_DELAY_MAX_MS, RECONNECT_DELAY_MS << MIN(r->attempt, 16));
+	delay = delay / 2 + g_random_int_range(0, delay / 2 + 1);
+	r->delay = delay;
+	r->state = STATE_WAITING;
+	r->timer = wheel_timer_add(delay, wait_cb, r);
+	tabUpdateTooltip(p_ct);
+	return delay;
+}
+
+/* reconnect_cancel() - stops the attempts of a tab */
+void reconnect_cancel(struct ConnectionTab *p_ct)
+{
+	Reconnect *r = p_ct->reconnect;
+	if (r == NULL || r->state == STATE_IDLE)
+		return;
+	log_debug("%s\n", p_ct->connection->name);
+	stop(r);
+	r->attempt = 0;
+	tabUpdateTooltip(p_ct);
+}
+
+/* reconnect_desc() - state shown on the tab, NULL if not reconnecting */
+const char *reconnect_desc(struct ConnectionTab *p_ct, char *buf, gsize size)
+{
+	Reconnect *r = p_ct->reconnect;
+	if (r == NULL)
+		return NULL;
+	switch (r->state) {
+	case STATE_WAITING:
+		g_snprintf(buf, size, "Reconnecting in %d s (attempt %d of %d)", (r->delay + 999) / 1000,
+		           r->attempt + 1, RECONNECT_MAX_ATTEMPTS);
+		return buf;
+	case STATE_QUEUED:
+		return "Waiting to reconnect";
+	case STATE_CONNECTING:
+		g_snprintf(buf, size, "Reconnecting (attempt %d of %d)", r->attempt, RECONNECT_MAX_ATTEMPTS);
+		return buf;
+	default:
+		return NULL;
+	}
+}
@@ -0,0 +1,37 @@
+
+#ifndef _RECONNECT_H
+#define _RECONNECT_H
+
+#include "gui.h"
+
+/* wait before the first attempt, doubled at each failure up to the max */
+#define RECONNECT_DELAY_MS 1000
+#define RECONNECT_DELAY_MAX_MS 60000
+
+/* attempts before waiting for the user again */
+#define RECONNECT_MAX_ATTEMPTS 10
+
+/*
+ * an attempt succeeded if the tab is still connected after this time, and
+ * only a tab that was connected this long starts reconnecting when lost
+ */
+#define RECONNECT_STABLE_MS 10000
+
+/* last lines of the tab searched for a refused login or host key */
+#define RECONNECT_REFUSED_LINES 3
+
+/* default of tabs reconnecting at the same time */
+#define RECONNECT_CONCURRENCY 4
+
+/* keep alive given to the ssh program when the connection has none */
+#define RECONNECT_ALIVE_INTERVAL 10
+#define RECONNECT_ALIVE_COUNT 3
+
+/* wait status of ssh when the connection failed or was lost */
+#define RECONNECT_LOST_STATUS (255 << 8)
+
+int reconnect_tab_lost(struct ConnectionTab *p_ct, int status);
+void reconnect_cancel(struct ConnectionTab *p_ct);
+const char *reconnect_desc(struct ConnectionTab *p_ct, char *buf, gsize size);
+
+#endif
@@ -0,0 +1,836 @@
+/**
+ * Copyright (C) 2009-2017 Fabio Leone
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * @file sshbackend.c
+ * @brief Terminals served by libssh sessions, one per host shared by the tabs
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <glib.h>
+#include <glib-unix.h>
+#include <gtk/gtk.h>
+#include <vte/vte.h>
+#include <libssh/libssh.h>
+#include "main.h"
+#include "connection.h"
+#include "gui.h"
+#include "terminal.h"
+#include "sshmux.h"
+#include "prober.h"
+#include "timerwheel.h"
+#include "ptyio.h"
+#include "reconnect.h"
+#include "utils.h"
+#include "sshbackend.h"
+
+extern Prefs prefs;
+
+/*
+ * A host (user@host:port) is connected and authenticated once, in a
+ * worker thread, then each tab opens its own channel with a pty and a
+ * shell. When the worker needs the user (unknown host key, password) it
+ * returns to the main thread, which asks and restarts it at the next
+ * step. Once connected the session is non-blocking and its socket is
+ * watched by the main loop: when readable, every channel is drained into
+ * its terminal and the channels being opened go on with their requests.
+ * Any other libssh call may read packets of every channel into libssh
+ * buffers, leaving nothing for the socket watch, so each one schedules
+ * the same drain; output libssh couldn't send yet is flushed when the
+ * socket is writable. The session belongs to the worker while it runs,
+ * then to the main thread, so libssh is never called from two threads at
+ * once and no lock is needed. The session is closed with its last channel.
+ *
+ * Output is throttled per tab as ptyio.c does for a pty: a tab off
+ * screen is fed every PTY_IO_HIDDEN_MS, a paused one not at all, and a
+ * rate holds the reads to a token bucket. What isn't read waits in libssh,
+ * which grows the channel window only when the channel is read, so the
+ * remote command is held by the window; prefs.background_buffer doesn't
+ * apply, the window bounds what waits. The socket is still read for the
+ * other channels and the keep alive answers, with the event of the host.
+ *
+ * An idle session sends a keep alive asking for an answer. The round
+ * trip is smoothed as TCP does (RFC 6298), and without any answer within
+ * the smoothed round trip plus four deviations the session is lost, so
+ * that its tabs can reconnect.
+ */
+
+#define STEP_CONNECT 0
+#define STEP_AUTH 1
+#define STEP_PASSWORD 2
+
+#define RESULT_OK 0
+#define RESULT_ERROR 1
+#define RESULT_HOST_UNKNOWN 2
+#define RESULT_NEED_PASSWORD 3
+#define RESULT_REFUSED 4          /* host key or key refused: retrying won't help */
+
+#define CHANNEL_OPEN 0
+#define CHANNEL_PTY 1
+#define CHANNEL_SHELL 2
+#define CHANNEL_READY 3
+
+typedef struct _SshHost {
+	gchar *key;                 /* user@host:port */
+	Connection *conn;           /* private copy, options of the session */
+	char address[64];           /* found by the prober, "" to resolve the host */
+	ssh_session session;        /* used by the thread alone while it runs */
+	ssh_event event;            /* reads the socket into the channels, held or not */
+	gboolean ready;
+	GThread *thread;            /* connection in progress */
+	int step;                   /* where the thread starts */
+	int result;
+	int n_password;
+	gboolean prompting;         /* asking the user, the host outlives its channels */
+	char error[256];
+	guint watch_id;             /* socket in the main loop */
+	guint out_id;               /* socket writable, while libssh has output queued */
+	guint drain_id;             /* drain after a libssh call */
+	WheelTimer *keepalive;      /* postponed by traffic */
+	guint alive_ms;             /* idle time before a keep alive, 0 for none */
+	WheelTimer *dead;           /* no answer to the keep alive yet */
+	gint64 alive_sent;          /* when the keep alive was sent */
+	gint64 srtt, rttvar;        /* smoothed round trip and its deviation, us */
+	GList *channels;            /* SshChannel *, also those waiting for the connection */
+} SshHost;
+
+typedef struct _SshChannel {
+	SshHost *host;
+	struct ConnectionTab *tab;
+	ssh_channel channel;        /* NULL until the host is ready */
+	int state;                  /* CHANNEL_*, the request in progress */
+	GByteArray *out;            /* typed, beyond the channel window */
+	int columns, rows;
+	gulong commit_id, size_id, map_id, unmap_id;
+	gboolean paused;            /* nothing read */
+	guint rate;                 /* bytes per second read at most, 0 for any */
+	gint64 tokens, last;        /* token bucket of the rate */
+	gboolean hidden;            /* off screen, fed by the hold timer */
+	gboolean due;               /* the hold timer fired, feed what waits */
+	WheelTimer *hold;           /* end of the wait, off screen or over the rate */
+} SshChannel;
+
+static GHashTable *hosts = NULL;    /* key -> SshHost * */
+
+/* ssh_backend_usable() - TRUE if the connection can be served in process */
+int ssh_backend_usable(Connection *p_conn)
+{
+	/* forwardings and options of the ssh program are left to it */
+	return prefs.ssh_backend == SSH_BACKEND_LIBSSH && p_conn->user_options[0] == 0
+	       && !p_conn->sshOptions.x11Forwarding && !p_conn->sshOptions.agentForwarding;
+}
+
+static gboolean drain_cb(gpointer data);
+
+/* host_schedule() - drains the host soon, after a call that may have read its socket */
+static void host_schedule(SshHost *host)
+{
+	if (host->drain_id == 0)
+		host->drain_id = g_idle_add(drain_cb, host);
+}
+
+static void host_free(SshHost *host)
+{
+	if (host->watch_id)
+		g_source_remove(host->watch_id);
+	if (host->out_id)
+		g_source_remove(host->out_id);
+	if (host->drain_id)
+		g_source_remove(host->drain_id);
+	wheel_timer_cancel(host->keepalive);
+	wheel_timer_cancel(host->dead);
+	if (host->event) {
+		ssh_event_remove_session(host->event, host->session);
+		ssh_event_free(host->event);
+	}
+	if (host->session) {
+		ssh_disconnect(host->session);
+		ssh_free(host->session);
+	}
+	g_hash_table_remove(hosts, host->key);
+	connection_unref(host->conn);
+	g_free(host->key);
+	g_free(host);
+}
+
+/* channel_free() - detaches a channel from its tab and host, closes the host with its last channel */
+static void channel_free(SshChannel *ch)
+{
+	SshHost *host = ch->host;
+	if (ch->commit_id)
+		g_signal_handler_disconnect(ch->tab->vte, ch->commit_id);
+	if (ch->size_id)
+		g_signal_handler_disconnect(ch->tab->vte, ch->size_id);
+	if (ch->map_id)
+		g_signal_handler_disconnect(ch->tab->vte, ch->map_id);
+	if (ch->unmap_id)
+		g_signal_handler_disconnect(ch->tab->vte, ch->unmap_id);
+	wheel_timer_cancel(ch->hold);
+	ch->tab->ssh_channel = NULL;
+	if (ch->channel) {
+		ssh_channel_close(ch->channel);
+		ssh_channel_free(ch->channel);
+	}
+	host->channels = g_list_remove(host->channels, ch);
+	if (ch->out)
+		g_byte_array_free(ch->out, TRUE);
+	g_free(ch);
+	/* while the thread runs or the user is asked the host is freed after */
+	if (host->channels == NULL && host->thread == NULL && !host->prompting) {
+		log_write("[%s] closing session %s\n", __func__, host->key);
+		host_free(host);
+	} else if (host->ready)
+		host_schedule(host);
+}
+
+/* the remote side closed a channel, as when the ssh program exits */
+static void channel_closed(SshChannel *ch, const char *message)
+{
+	struct ConnectionTab *p_ct = ch->tab;
+	channel_free(ch);
+	if (message)
+		terminal_write_ex(p_ct, "%s\r\n", message);
+	connection_tab_disconnected(p_ct, message != NULL);
+}
+
+/* host_failed() - the session couldn't be opened, retry if not refused by the user */
+static void host_failed(SshHost *host, gboolean retry)
+{
+	GList *channels = host->channels, *l;
+	log_write("[%s] %s: %s\n", __func__, host->key, host->error);
+	host->channels = NULL;
+	for (l = channels; l; l = l->next) {
+		SshChannel *ch = l->data;
+		ch->tab->ssh_channel = NULL;
+		terminal_write_ex(ch->tab, "%s\r\n", host->error);
+		if (retry) {
+			connection_tab_disconnected(ch->tab, TRUE);
+		} else {
+			reconnect_cancel(ch->tab);
+			tabInitConnection(ch->tab);
+			refreshTabStatus(ch->tab);
+		}
+		g_free(ch);
+	}
+	g_list_free(channels);
+	host_free(host);
+}
+
+static gboolean connect_done(gpointer data);
+
+static gpointer connect_thread(gpointer data)
+{
+	SshHost *host = data;
+	Connection *c = host->conn;
+	ssh_session session = host->session;
+	int rc, timeout, fd;
+	host->result = RESULT_ERROR;
+	switch (host->step) {
+	case STEP_CONNECT:
+		session = ssh_new();
+		ssh_options_set(session, SSH_OPTIONS_HOST, c->host);
+		ssh_options_set(session, SSH_OPTIONS_PORT, &c->port);
+		if (c->user[0])
+			ssh_options_set(session, SSH_OPTIONS_USER, c->user);
+		if (c->sshOptions.flagConnectTimeout) {
+			timeout = c->sshOptions.connectTimeout;
+			ssh_options_set(session, SSH_OPTIONS_TIMEOUT, &timeout);
+		}
+		if (c->auth_mode == CONN_AUTH_MODE_KEY && c->identityFile[0])
+			ssh_options_set(session, SSH_OPTIONS_ADD_IDENTITY, c->identityFile);
+		/* known hosts still use the name, libssh takes the socket */
+		if (host->address[0]) {
+			fd = prober_connect(host->address, c->port, c->sshOptions.flagConnectTimeout ?
+			                    c->sshOptions.connectTimeout * 1000 : PROBE_TIMEOUT_MS);
+			if (fd != -1)
+				ssh_options_set(session, SSH_OPTIONS_FD, &fd);
+		}
+		if (ssh_connect(session) != SSH_OK) {
+			g_snprintf(host->error, sizeof(host->error), "%s", ssh_get_error(session));
+			break;
+		}
+		switch (ssh_session_is_known_server(session)) {
+		case SSH_KNOWN_HOSTS_OK:
+			break;
+		case SSH_KNOWN_HOSTS_UNKNOWN:
+		case SSH_KNOWN_HOSTS_NOT_FOUND:
+			/* as StrictHostKeyChecking=no: accept and remember */
+			if (c->sshOptions.disableStrictKeyChecking) {
+				ssh_session_update_known_hosts(session);
+				break;
+			}
+			host->result = RESULT_HOST_UNKNOWN;
+			goto out;
+		case SSH_KNOWN_HOSTS_CHANGED:
+		case SSH_KNOWN_HOSTS_OTHER:
+			g_snprintf(host->error, sizeof(host->error), "The host key of %s has changed, connection refused", c->host);
+			host->result = RESULT_REFUSED;
+			goto out;
+		default:
+			g_snprintf(host->error, sizeof(host->error), "%s", ssh_get_error(session));
+			goto out;
+		}
+	/* fall through */
+	case STEP_AUTH:
+		rc = ssh_userauth_none(session, NULL);
+		/* agent, then the identity files */
+		if (rc != SSH_AUTH_SUCCESS && rc != SSH_AUTH_ERROR)
+			rc = ssh_userauth_publickey_auto(session, NULL, NULL);
+		if (rc == SSH_AUTH_SUCCESS) {
+			host->result = RESULT_OK;
+			break;
+		}
+		if (rc == SSH_AUTH_ERROR) {
+			g_snprintf(host->error, sizeof(host->error), "%s", ssh_get_error(session));
+			break;
+		}
+		if (c->auth_mode == CONN_AUTH_MODE_KEY) {
+			g_snprintf(host->error, sizeof(host->error), "Key authentication failed");
+			host->result = RESULT_REFUSED;
+			break;
+		}
+		if (!c->password[0]) {
+			host->result = RESULT_NEED_PASSWORD;
+			break;
+		}
+	/* fall through */
+	case STEP_PASSWORD:
+		rc = ssh_userauth_password(session, NULL, c->password);
+		if (rc == SSH_AUTH_SUCCESS)
+			host->result = RESULT_OK;
+		else if (rc == SSH_AUTH_ERROR)
+			g_snprintf(host->error, sizeof(host->error), "%s", ssh_get_error(session));
+		else {
+			g_snprintf(host->error, sizeof(host->error), "Permission denied");
+			host->result = RESULT_NEED_PASSWORD;
+		}
+		break;
+	}
+out:
+	/* handed to the main thread, which reads it after joining */
+	host->session = session;
+	g_idle_add(connect_done, host);
+	return NULL;
+}
+
+static void connect_start(SshHost *host, int step)
+{
+	host->step = step;
+	host->thread = g_thread_new("ssh-connect", connect_thread, host);
+}
+
+static void channel_open(SshChannel *ch);
+static gboolean host_io_cb(gint fd, GIOCondition condition, gpointer data);
+
+/* answer time allowed to a keep alive */
+static guint dead_timeout(SshHost *host)
+{
+	gint64 ms = (host->srtt + 4 * host->rttvar) / 1000;
+	return CLAMP(ms, SSH_BACKEND_DEAD_MIN_MS, SSH_BACKEND_DEAD_MAX_MS);
+}
+
+static void rtt_sample(SshHost *host, gint64 rtt)
+{
+	if (host->srtt == 0) {
+		host->srtt = rtt;
+		host->rttvar = rtt / 2;
+	} else {
+		host->rttvar = (3 * host->rttvar + ABS(host->srtt - rtt)) / 4;
+		host->srtt = (7 * host->srtt + rtt) / 8;
+	}
+}
+
+/* no answer to the keep alive: the session is lost */
+static gboolean dead_cb(gpointer data)
+{
+	SshHost *host = data;
+	GList *channels, *l;
+	host->dead = NULL;
+	log_write("[%s] %s: no answer in %d ms\n", __func__, host->key, dead_timeout(host));
+	if (host->watch_id) {
+		g_source_remove(host->watch_id);
+		host->watch_id = 0;
+	}
+	/* the last one frees the host */
+	channels = g_list_copy(host->channels);
+	for (l = channels; l; l = l->next)
+		channel_closed(l->data, "Connection lost");
+	g_list_free(channels);
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean keepalive_cb(gpointer data)
+{
+	SshHost *host = data;
+	ssh_send_keepalive(host->session);
+	host_schedule(host);
+	if (host->dead == NULL) {
+		host->alive_sent = g_get_monotonic_time();
+		host->dead = wheel_timer_add(dead_timeout(host), dead_cb, host);
+	}
+	return G_SOURCE_CONTINUE;
+}
+
+/**
+ * host_ask_done() - a dialog of the host was closed
+ * Its tabs may have been closed while the dialog ran the main loop.
+ * @return TRUE if the host is still used, else it was freed
+ */
+static gboolean host_ask_done(SshHost *host)
+{
+	host->prompting = FALSE;
+	if (host->channels)
+		return TRUE;
+	host_free(host);
+	return FALSE;
+}
+
+static gboolean connect_done(gpointer data)
+{
+	SshHost *host = data;
+	GList *l, *waiting;
+	const ProbeResult *res;
+	gchar *message;
+	const char *password;
+	int response;
+	char buf[256];
+	g_thread_join(host->thread);
+	host->thread = NULL;
+	if (host->channels == NULL) {
+		/* all the tabs were closed meanwhile */
+		host_free(host);
+		return G_SOURCE_REMOVE;
+	}
+	switch (host->result) {
+	case RESULT_OK:
+		log_write("[%s] %s connected\n", __func__, host->key);
+		host->ready = TRUE;
+		ssh_set_blocking(host->session, 0);
+		host->event = ssh_event_new();
+		ssh_event_add_session(host->event, host->session);
+		host->watch_id = g_unix_fd_add(ssh_get_fd(host->session), G_IO_IN | G_IO_HUP | G_IO_ERR, host_io_cb, host);
+		if (host->conn->sshOptions.flagKeepAlive && host->conn->sshOptions.keepAliveInterval > 0)
+			host->alive_ms = host->conn->sshOptions.keepAliveInterval * 1000;
+		else if (prefs.auto_reconnect)
+			host->alive_ms = RECONNECT_ALIVE_INTERVAL * 1000;
+		if (host->alive_ms)
+			host->keepalive = wheel_timer_add(host->alive_ms, keepalive_cb, host);
+		/* the probe gives a first round trip */
+		res = prober_cached(host->conn->host, host->conn->port);
+		if (res && res->state == PROBE_UP)
+			rtt_sample(host, res->rtt);
+		waiting = g_list_copy(host->channels);
+		for (l = waiting; l; l = l->next)
+			channel_open(l->data);
+		g_list_free(waiting);
+		break;
+	case RESULT_HOST_UNKNOWN:
+		message = g_strdup_printf("The authenticity of host '%s' can't be established.\nContinue connecting?", host->conn->host);
+		host->prompting = TRUE;
+		response = msgbox_yes_no("%s", message);
+		g_free(message);
+		if (!host_ask_done(host))
+			break;
+		if (response == GTK_RESPONSE_YES) {
+			ssh_session_update_known_hosts(host->session);
+			connect_start(host, STEP_AUTH);
+		} else {
+			g_snprintf(host->error, sizeof(host->error), "Host key verification failed");
+			host_failed(host, FALSE);
+		}
+		break;
+	case RESULT_NEED_PASSWORD:
+		if (host->n_password ++ == SSH_BACKEND_MAX_PASSWORD) {
+			host_failed(host, FALSE);
+			break;
+		}
+		/* a password was refused, saved or typed: ask, never send it again */
+		if (host->conn->password[0]) {
+			host->conn->auth_mode = CONN_AUTH_MODE_PROMPT;
+			connection_set_password(host->conn, "");
+		}
+		host->prompting = TRUE;
+		password = expand_arg('P', buf, sizeof(buf), host->conn);
+		if (!host_ask_done(host))
+			break;
+		if (password == NULL) {
+			g_snprintf(host->error, sizeof(host->error), "Authentication cancelled");
+			host_failed(host, FALSE);
+		} else
+			connect_start(host, STEP_PASSWORD);
+		break;
+	case RESULT_REFUSED:
+		host_failed(host, FALSE);
+		break;
+	default:
+		host_failed(host, TRUE);
+		break;
+	}
+	return G_SOURCE_REMOVE;
+}
+
+/* channel_flush() - writes what the channel window takes, the rest waits for it to grow */
+static int channel_flush(SshChannel *ch)
+{
+	int n;
+	if (ch->out->len == 0)
+		return 0;
+	n = ssh_channel_write(ch->channel, ch->out->data, ch->out->len);
+	if (n == SSH_ERROR)
+		return 1;
+	if (n > 0)
+		g_byte_array_remove_range(ch->out, 0, n);
+	return 0;
+}
+
+static void commit_cb(VteTerminal *vte, gchar *text, guint size, gpointer user_data)
+{
+	SshChannel *ch = user_data;
+	g_byte_array_append(ch->out, (const guint8 *) text, size);
+	channel_flush(ch);
+	host_schedule(ch->host);
+}
+
+static void size_allocate_cb(GtkWidget *widget, GdkRectangle *allocation, gpointer user_data)
+{
+	SshChannel *ch = user_data;
+	int columns = vte_terminal_get_column_count(VTE_TERMINAL(widget));
+	int rows = vte_terminal_get_row_count(VTE_TERMINAL(widget));
+	if (columns == ch->columns && rows == ch->rows)
+		return;
+	ch->columns = columns;
+	ch->rows = rows;
+	ssh_channel_change_pty_size(ch->channel, columns, rows);
+	host_schedule(ch->host);
+}
+
+static void map_cb(GtkWidget *widget, gpointer user_data)
+{
+	SshChannel *ch = user_data;
+	ch->hidden = FALSE;
+	host_schedule(ch->host);
+}
+
+static void unmap_cb(GtkWidget *widget, gpointer user_data)
+{
+	SshChannel *ch = user_data;
+	ch->hidden = TRUE;
+}
+
+static gboolean hold_cb(gpointer data)
+{
+	SshChannel *ch = data;
+	ch->hold = NULL;
+	ch->due = TRUE;
+	host_schedule(ch->host);
+	return G_SOURCE_REMOVE;
+}
+
+static void channel_hold(SshChannel *ch, guint ms)
+{
+	if (ch->hold == NULL)
+		ch->hold = wheel_timer_add(ms, hold_cb, ch);
+}
+
+/**
+ * channel_quota() - bytes the channel may feed to its terminal now
+ * Off screen only when the hold timer fired, with a rate the tokens it has.
+ * Starts the hold timer when it has to wait.
+ */
+static gint64 channel_quota(SshChannel *ch)
+{
+	gint64 now, burst;
+	if (ch->paused)
+		return 0;
+	if (ch->hidden && !ch->due) {
+		channel_hold(ch, PTY_IO_HIDDEN_MS);
+		return 0;
+	}
+	if (ch->rate == 0)
+		return G_MAXINT64;
+	now = g_get_monotonic_time();
+	burst = MAX((gint64) ch->rate * PTY_IO_RATE_BURST_MS / 1000, 1);
+	ch->tokens = MIN(ch->tokens + MIN(now - ch->last, G_USEC_PER_SEC) * ch->rate / G_USEC_PER_SEC, burst);
+	ch->last = now;
+	if (ch->tokens <= 0)
+		channel_hold(ch, (burst / 2 - ch->tokens) * 1000 / ch->rate + 1);
+	return MAX(ch->tokens, 0);
+}
+
+/* channel_open() - starts opening the shell of a tab on a ready session, the drains go on */
+static void channel_open(SshChannel *ch)
+{
+	SshHost *host = ch->host;
+	VteTerminal *vte = VTE_TERMINAL(ch->tab->vte);
+	ch->columns = vte_terminal_get_column_count(vte);
+	ch->rows = vte_terminal_get_row_count(vte);
+	ch->channel = ssh_channel_new(host->session);
+	if (ch->channel == NULL) {
+		g_snprintf(host->error, sizeof(host->error), "%s", ssh_get_error(host->session));
+		channel_closed(ch, host->error);
+		return;
+	}
+	ch->state = CHANNEL_OPEN;
+	ch->out = g_byte_array_new();
+	host_schedule(host);
+}
+
+/**
+ * channel_progress() - sends the next requests of a channel being opened
+ * Each one is answered in a later drain, until the shell is running.
+ * @return SSH_OK when ready, SSH_AGAIN while waiting for an answer, SSH_ERROR
+ */
+static int channel_progress(SshChannel *ch)
+{
+	VteTerminal *vte = VTE_TERMINAL(ch->tab->vte);
+	int rc = SSH_OK;
+	switch (ch->state) {
+	case CHANNEL_OPEN:
+		rc = ssh_channel_open_session(ch->channel);
+		if (rc != SSH_OK)
+			break;
+		ch->state = CHANNEL_PTY;
+	/* fall through */
+	case CHANNEL_PTY:
+		rc = ssh_channel_request_pty_size(ch->channel, "xterm-256color", ch->columns, ch->rows);
+		if (rc != SSH_OK)
+			break;
+		ch->state = CHANNEL_SHELL;
+	/* fall through */
+	case CHANNEL_SHELL:
+		rc = ssh_channel_request_shell(ch->channel);
+		if (rc != SSH_OK)
+			break;
+		ch->state = CHANNEL_READY;
+		ch->commit_id = g_signal_connect(vte, "commit", G_CALLBACK(commit_cb), ch);
+		ch->size_id = g_signal_connect(vte, "size-allocate", G_CALLBACK(size_allocate_cb), ch);
+		ch->map_id = g_signal_connect(vte, "map", G_CALLBACK(map_cb), ch);
+		ch->unmap_id = g_signal_connect(vte, "unmap", G_CALLBACK(unmap_cb), ch);
+		ch->hidden = !gtk_widget_get_mapped(GTK_WIDGET(vte));
+		ch->last = g_get_monotonic_time();
+		tabSetConnectionStatus(ch->tab, TAB_CONN_STATUS_CONNECTED);
+		refreshTabStatus(ch->tab);
+		break;
+	}
+	return rc;
+}
+
+static gboolean host_out_cb(gint fd, GIOCondition condition, gpointer data);
+
+/* watches the socket for room while libssh has output it couldn't send */
+static void host_watch_output(SshHost *host)
+{
+	gboolean pending = (ssh_get_poll_flags(host->session) & SSH_WRITE_PENDING) != 0;
+	if (pending && host->out_id == 0) {
+		host->out_id = g_unix_fd_add(ssh_get_fd(host->session), G_IO_OUT, host_out_cb, host);
+	} else if (!pending && host->out_id) {
+		g_source_remove(host->out_id);
+		host->out_id = 0;
+	}
+}
+
+/**
+ * host_drain() - drains the channels of a host into their terminals
+ * Each one as much as channel_quota() allows. Also goes on with the
+ * channels being opened and the input waiting for room. The host may be
+ * freed when it returns.
+ * @param[in] readable TRUE if the socket was, so the session is alive
+ */
+static void host_drain(SshHost *host, gboolean readable)
+{
+	GList *l, *closed = NULL, *failed = NULL;
+	SshChannel *ch;
+	char buf[16384], error[256];
+	int n, is_stderr;
+	gint64 quota, fed;
+	gboolean connected;
+	/* into the buffers of the channels, also of those held */
+	if (readable)
+		ssh_event_dopoll(host->event, 0);
+	for (l = host->channels; l; l = l->next) {
+		ch = l->data;
+		if (ch->channel == NULL)
+			continue;
+		if (ch->state != CHANNEL_READY) {
+			if (channel_progress(ch) == SSH_ERROR)
+				failed = g_list_prepend(failed, ch);
+			continue;
+		}
+		quota = channel_quota(ch);
+		fed = n = 0;
+		for (is_stderr = 0; is_stderr <= 1; is_stderr++)
+			while (fed < quota && (n = ssh_channel_read_nonblocking(ch->channel, buf, MIN((gint64) sizeof(buf), quota - fed), is_stderr)) > 0) {
+				vte_terminal_feed(VTE_TERMINAL(ch->tab->vte), buf, n);
+				fed += n;
+				readable = TRUE;
+			}
+		ch->due = FALSE;
+		if (ch->rate) {
+			ch->tokens -= fed;
+			/* more waits, read it when the tokens are back */
+			if (fed == quota)
+				channel_quota(ch);
+		}
+		if (n == SSH_ERROR || channel_flush(ch) || ssh_channel_is_eof(ch->channel) || !ssh_channel_is_open(ch->channel))
+			closed = g_list_prepend(closed, ch);
+	}
+	/* a busy session needs no keep alive, anything read answers it */
+	if (readable && host->keepalive)
+		wheel_timer_restart(host->keepalive, host->alive_ms);
+	if (readable && host->dead) {
+		rtt_sample(host, g_get_monotonic_time() - host->alive_sent);
+		wheel_timer_cancel(host->dead);
+		host->dead = NULL;
+	}
+	g_snprintf(error, sizeof(error), "%s", ssh_get_error(host->session));
+	connected = ssh_is_connected(host->session);
+	if (connected) {
+		host_watch_output(host);
+	} else {
+		g_list_free(closed);
+		g_list_free(failed);
+		failed = NULL;
+		closed = g_list_copy(host->channels);
+		if (host->watch_id) {
+			g_source_remove(host->watch_id);
+			host->watch_id = 0;
+		}
+	}
+	/* may free the host */
+	for (l = failed; l; l = l->next)
+		channel_closed(l->data, error);
+	for (l = closed; l; l = l->next)
+		channel_closed(l->data, connected ? NULL : "Connection lost");
+	g_list_free(failed);
+	g_list_free(closed);
+}
+
+static gboolean host_io_cb(gint fd, GIOCondition condition, gpointer data)
+{
+	/* the source is removed with the host or the session */
+	host_drain(data, TRUE);
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean host_out_cb(gint fd, GIOCondition condition, gpointer data)
+{
+	SshHost *host = data;
+	ssh_blocking_flush(host->session, 0);
+	host_drain(host, FALSE);
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean drain_cb(gpointer data)
+{
+	SshHost *host = data;
+	host->drain_id = 0;
+	host_drain(host, FALSE);
+	return G_SOURCE_REMOVE;
+}
+
+/**
+ * ssh_backend_log_on() - opens a shell for the tab, sharing the session of its host
+ * The tab is connecting until the channel is open.
+ * @return 0 if ok, 1 if cancelled by the user
+ */
+int ssh_backend_log_on(struct ConnectionTab *p_ct)
+{
+	Connection *p_conn = p_ct->connection;
+	SshChannel *ch;
+	SshHost *host;
+	gchar *key;
+	char buf[256];
+	if (hosts == NULL)
+		hosts = g_hash_table_new(g_str_hash, g_str_equal);
+	/* the user is part of the key */
+	if (expand_arg('u', buf, sizeof(buf), p_conn) == NULL)
+		return 1;
+	key = g_strdup_printf("%s@%s:%d", p_conn->user, p_conn->host, p_conn->port);
+	ch = g_new0(SshChannel, 1);
+	ch->tab = p_ct;
+	ch->paused = p_ct->output_paused;
+	ch->rate = p_ct->output_rate * 1024;
+	p_ct->ssh_channel = ch;
+	host = g_hash_table_lookup(hosts, key);
+	if (host) {
+		g_free(key);
+		ch->host = host;
+		host->channels = g_list_append(host->channels, ch);
+		log_write("[%s] sharing session %s\n", __func__, host->key);
+		tabSetMuxState(p_ct, SSH_MUX_SHARED);
+		if (host->ready)
+			channel_open(ch);
+		return 0;
+	}
+	host = g_new0(SshHost, 1);
+	host->key = key;
+	host->conn = connection_dup(p_conn);
+	g_strlcpy(host->address, NVL(prober_address(p_conn->host, p_conn->port), ""), sizeof(host->address));
+	g_hash_table_insert(hosts, host->key, host);
+	ch->host = host;
+	host->channels = g_list_append(host->channels, ch);
+	log_write("[%s] connecting %s\n", __func__, host->key);
+	tabSetMuxState(p_ct, SSH_MUX_MASTER);
+	connect_start(host, STEP_CONNECT);
+	return 0;
+}
+
+/* ssh_backend_set_output() - pauses the output of the tab, or holds it to rate bytes per second, 0 for any */
+void ssh_backend_set_output(struct ConnectionTab *p_ct, gboolean paused, guint rate)
+{
+	SshChannel *ch = p_ct->ssh_channel;
+	ch->paused = paused;
+	ch->rate = rate;
+	ch->tokens = 0;
+	ch->last = g_get_monotonic_time();
+	if (ch->host->ready)
+		host_schedule(ch->host);
+}
+
+/* ssh_backend_log_off() - closes the channel of the tab */
+void ssh_backend_log_off(struct ConnectionTab *p_ct)
+{
+	if (p_ct->ssh_channel)
+		channel_free(p_ct->ssh_channel);
+}
+
+/* ssh_backend_shutdown() - closes all the sessions */
+void ssh_backend_shutdown(void)
+{
+	GList *list, *l;
+	SshHost *host;
+	int n;
+	if (hosts == NULL)
+		return;
+	list = g_hash_table_get_values(hosts);
+	for (l = list; l; l = l->next) {
+		host = l->data;
+		if (host->thread) {
+			g_thread_join(host->thread);
+			host->thread = NULL;
+		}
+		/* the last channel frees the host */
+		n = g_list_length(host->channels);
+		if (n == 0)
+			host_free(host);
+		while (n--)
+			channel_free(host->channels->data);
+	}
+	g_list_free(list);
+	g_hash_table_destroy(hosts);
+	hosts = NULL;
+}
@@ -0,0 +1,23 @@
+
+#ifndef _SSHBACKEND_H
+#define _SSHBACKEND_H
+
+#include "gui.h"
+
+#define SSH_BACKEND_COMMAND 0     /* ssh program in the terminal */
+#define SSH_BACKEND_LIBSSH 1      /* in-process sessions shared by the tabs */
+
+/* failed password attempts before giving up */
+#define SSH_BACKEND_MAX_PASSWORD 3
+
+/* bounds of the wait for an answer to a keep alive, before the session is lost */
+#define SSH_BACKEND_DEAD_MIN_MS 3000
+#define SSH_BACKEND_DEAD_MAX_MS 30000
+
+int ssh_backend_usable(Connection *p_conn);
+int ssh_backend_log_on(struct ConnectionTab *p_ct);
+void ssh_backend_set_output(struct ConnectionTab *p_ct, gboolean paused, guint rate);
+void ssh_backend_log_off(struct ConnectionTab *p_ct);
+void ssh_backend_shutdown(void);
+
+#endif
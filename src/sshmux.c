@@ -0,0 +1,140 @@
+/**
+ * Copyright (C) 2009-2017 Fabio Leone
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * @file sshmux.c
+ * @brief OpenSSH connection sharing (ControlMaster) between tabs
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <string.h>
+#include <stdio.h>
+#include <glib.h>
+#include "connection.h"
+#include "sshmux.h"
+#include "main.h"
+
+extern Prefs prefs;
+
+/*
+ * Each user@host:port gets a control socket in a private directory. The
+ * first tab starts ssh with ControlMaster=auto and becomes the master,
+ * later tabs (duplicates, reconnections) find the socket and attach to
+ * it without a new handshake and authentication. With ControlPersist the
+ * master runs in background, so tabs can be closed in any order, and it
+ * outlives the last tab for a while to be reused. When lterm exits the
+ * masters it started stop accepting new sessions and exit with their
+ * last one: sockets of other lterm instances are only attached to, and
+ * their sessions keep running.
+ */
+
+static struct {
+	gchar *dir;
+	GHashTable *paths;    /* control sockets of the masters started by this instance */
+} mux;
+
+/* ssh_mux_init() - creates the directory of the control sockets */
+void ssh_mux_init(void)
+{
+	struct sockaddr_un addr;
+	mux.dir = g_build_filename(g_get_user_runtime_dir(), PACKAGE, NULL);
+	/* socket names are 20 characters */
+	if (strlen(mux.dir) + 22 > sizeof(addr.sun_path) || g_mkdir_with_parents(mux.dir, S_IRWXU)) {
+		log_write("[%s] can't use %s, connection sharing disabled\n", __func__, mux.dir);
+		g_free(mux.dir);
+		mux.dir = NULL;
+		return;
+	}
+	mux.paths = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+}
+
+/**
+ * ssh_mux_path() - control socket for the connection, once the user is known
+ * @return buf, NULL if connection sharing is disabled
+ */
+const char *ssh_mux_path(Connection *p_conn, char *buf, gsize size)
+{
+	gchar *key, *sum;
+	if (mux.dir == NULL || !prefs.ssh_mux)
+		return NULL;
+	key = g_strdup_printf("%s@%s:%d", p_conn->user, p_conn->host, p_conn->port);
+	sum = g_compute_checksum_for_string(G_CHECKSUM_SHA1, key, -1);
+	g_snprintf(buf, size, "%s/%.20s", mux.dir, sum);
+	g_free(sum);
+	g_free(key);
+	return buf;
+}
+
+/**
+ * ssh_mux_state() - tells if ssh will open or share the connection of a socket
+ * Stale sockets are removed by ssh, which then becomes the master.
+ */
+int ssh_mux_state(const char *path)
+{
+	struct stat st;
+	if (path == NULL)
+		return SSH_MUX_OFF;
+	if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		return SSH_MUX_SHARED;
+	if (!g_hash_table_contains(mux.paths, path))
+		g_hash_table_add(mux.paths, g_strdup(path));
+	return SSH_MUX_MASTER;
+}
+
+const char *ssh_mux_state_desc(int state)
+{
+	switch (state) {
+	case SSH_MUX_MASTER:
+		return "shared connection opened by this tab";
+	case SSH_MUX_SHARED:
+		return "attached to a shared connection";
+	default:
+		return "not shared";
+	}
+}
+
+/* ssh_mux_shutdown() - lets the masters started by this instance exit with their last session */
+void ssh_mux_shutdown(void)
+{
+	GHashTableIter iter;
+	gpointer path;
+	struct stat st;
+	gchar *control_path;
+	gchar *argv[] = { "ssh", "-O", "stop", "-o", NULL, "lterm", NULL };
+	GError *error = NULL;
+	if (mux.paths == NULL)
+		return;
+	g_hash_table_iter_init(&iter, mux.paths);
+	while (g_hash_table_iter_next(&iter, &path, NULL)) {
+		if (stat(path, &st) || !S_ISSOCK(st.st_mode))
+			continue;
+		/* the host is required but not used */
+		control_path = g_strdup_printf("ControlPath=%s", (char *) path);
+		argv[4] = control_path;
+		if (!g_spawn_async(NULL, argv, NULL, G_SPAWN_SEARCH_PATH | G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+		                   NULL, NULL, NULL, &error)) {
+			log_write("[%s] %s\n", __func__, error->message);
+			g_clear_error(&error);
+		}
+		g_free(control_path);
+	}
+	g_hash_table_destroy(mux.paths);
+	mux.paths = NULL;
+	g_free(mux.dir);
+	mux.dir = NULL;
+}
@@ -0,0 +1,21 @@
+
+#ifndef _SSHMUX_H
+#define _SSHMUX_H
+
+#include <glib.h>
+#include "connection.h"
+
+#define SSH_MUX_OFF 0
+#define SSH_MUX_MASTER 1      /* opened the shared connection */
+#define SSH_MUX_SHARED 2      /* attached to an existing one */
+
+/* default seconds a shared connection is kept open after the last tab */
+#define SSH_MUX_PERSIST 600
+
+void ssh_mux_init(void);
+const char *ssh_mux_path(Connection *p_conn, char *buf, gsize size);
+int ssh_mux_state(const char *path);
+const char *ssh_mux_state_desc(int state);
+void ssh_mux_shutdown(void);
+
+#endif
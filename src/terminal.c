@@ -32,6 +32,12 @@
 #include "preferences.h"
 #include "gui.h"
 #include "utils.h"
+#include "cmdline.h"
+#include "sshmux.h"
+#include "ptypool.h"
+#include "sshbackend.h"
+#include "prober.h"
+#include "reconnect.h"
 #include "terminal.h"
 
 extern Globals globals;
@@ -52,76 +58,145 @@ void spawn_cb(VteTerminal *terminal, GPid pid, GError *error, gpointer user_data
 		terminal_write_ex(p_conn_tab, "%s\r\n", error_msg);
 		return;
 	}
-	p_conn_tab->pid = pid;
+	connection_tab_watch_child(p_conn_tab, pid);
+	/* a new pty reader starts with the defaults */
+	tabApplyOutputLimits(p_conn_tab);
 	tabSetConnectionStatus(p_conn_tab, TAB_CONN_STATUS_CONNECTED);
+	if (p_conn_tab->open_time) {
+		log_write("%s: tab ready in %" G_GINT64_FORMAT " us\n", p_conn_tab->connection->name,
+		          g_get_monotonic_time() - p_conn_tab->open_time);
+		p_conn_tab->open_time = 0;
+	}
+}
+/* ssh options added to the protocol arguments, compiled once (see cmdline.c) */
+static struct {
+	CmdTemplate *x11;
+	CmdTemplate *agent;
+	CmdTemplate *no_strict_key_checking;
+	CmdTemplate *keep_alive;
+	CmdTemplate *connect_timeout;
+	CmdTemplate *identity;
+	CmdTemplate *sshpass;
+	CmdTemplate *mux;
+	CmdTemplate *address;
+	CmdTemplate *address_port;
+	CmdTemplate *alive;
+} ssh_templates;
+
+static void compile_ssh_templates(struct Protocol *p_prot)
+{
+	gchar *cmd;
+	if (p_prot->tmpl)
+		return;
+	cmd = g_strdup_printf("%s %s", p_prot->command, p_prot->args);
+	p_prot->tmpl = cmd_template_new(cmd, TRUE);
+	g_free(cmd);
+	ssh_templates.x11 = cmd_template_new("-X", FALSE);
+	ssh_templates.agent = cmd_template_new("-A", FALSE);
+	ssh_templates.no_strict_key_checking = cmd_template_new("-o StrictHostKeyChecking=no", FALSE);
+	ssh_templates.keep_alive = cmd_template_new("-o ServerAliveInterval=%k", TRUE);
+	ssh_templates.connect_timeout = cmd_template_new("-o ConnectTimeout=%t", TRUE);
+	ssh_templates.identity = cmd_template_new("-i %i", TRUE);
+	ssh_templates.sshpass = cmd_template_new("sshpass -p %P", TRUE);
+	ssh_templates.mux = cmd_template_new("-o ControlMaster=auto -o ControlPath=%m -o ControlPersist=%c", TRUE);
+	/* known_hosts keeps the name, with the port when not 22 as ssh does without alias */
+	ssh_templates.address = cmd_template_new("-o Hostname=%a -o HostKeyAlias=%h", TRUE);
+	ssh_templates.address_port = cmd_template_new("-o Hostname=%a -o HostKeyAlias=[%h]:%p", TRUE);
+	cmd = g_strdup_printf("-o ServerAliveInterval=%d -o ServerAliveCountMax=%d", RECONNECT_ALIVE_INTERVAL, RECONNECT_ALIVE_COUNT);
+	ssh_templates.alive = cmd_template_new(cmd, FALSE);
+	g_free(cmd);
 }
+
 /**
  * log_on() - starts a connection with the given protocol (called by connection_log_on())
  * @return 0 if ok, not zero otherwise
  */
 int log_on(struct ConnectionTab *p_conn_tab)
 {
-	char expanded_args[1024], temp[64];
+	CmdTemplate *parts[13], *user_options = NULL;
+	Connection *p_conn;
 	char **p_params;
-	int ret;
-	int prefix_len = 0;
+	gchar *cmdline;
+	char mux_path[256];
+	gboolean mux;
+	GPid pid;
+	GError *error = NULL;
+	int n = 0, prefix_args = 0;
 	struct Protocol *p_prot = &globals.ssh_proto;
 
 	p_conn_tab->auth_attempt = 0;
 	p_conn_tab->auth_state = AUTH_STATE_NOT_LOGGED;
-	log_write("[%s] server:%s\n", __func__, p_conn_tab->connection.host);
+	log_write("[%s] server:%s\n", __func__, p_conn_tab->connection->host);
 	tabSetConnectionStatus(p_conn_tab, TAB_CONN_STATUS_CONNECTING);
 	log_write("Init ssh\n");
 	p_conn_tab->enter_key_relogging = 0;
+	/* expand_arg() stores user and password in the connection */
+	connection_make_writable(&p_conn_tab->connection);
+	p_conn = p_conn_tab->connection;
+	if (ssh_backend_usable(p_conn)) {
+		terminal_write_ex(p_conn_tab, "Logging in...\n\r");
+		return ssh_backend_log_on(p_conn_tab);
+	}
+	compile_ssh_templates(p_prot);
 
 #ifdef HAVE_SSHPASS
-	if (p_conn_tab->connection.password[0]) {
-		char cmd[300];
-		prefix_len = sprintf(cmd, "sshpass -p %s %s", p_conn_tab->connection.password, p_prot->command);
-		ret = expand_args(&p_conn_tab->connection, p_prot->args, cmd, expanded_args);
-	} else
+	if (p_conn->password[0]) {
+		parts[n++] = ssh_templates.sshpass;
+		prefix_args = 3;
+	}
 #endif
-		ret = expand_args(&p_conn_tab->connection, p_prot->args, p_prot->command, expanded_args);
-	if (ret)
-		return 1;
+	parts[n++] = p_prot->tmpl;
 	// Add SSH options
-	if (p_conn_tab->connection.sshOptions.x11Forwarding)
-		strcat(expanded_args, " -X");
-	if (p_conn_tab->connection.sshOptions.agentForwarding)
-		strcat(expanded_args, " -A");
-	if (p_conn_tab->connection.sshOptions.disableStrictKeyChecking)
-		strcat(expanded_args, " -o StrictHostKeyChecking=no");
-	if (p_conn_tab->connection.sshOptions.flagKeepAlive) {
-		sprintf(temp, " -o ServerAliveInterval=%d", p_conn_tab->connection.sshOptions.keepAliveInterval);
-		strcat(expanded_args, temp);
-	}
-	if (p_conn_tab->connection.sshOptions.flagConnectTimeout) {
-		sprintf(temp, " -o ConnectTimeout=%d", p_conn_tab->connection.sshOptions.connectTimeout);
-		strcat(expanded_args, temp);
-	}
-	if (p_conn_tab->connection.auth_mode == CONN_AUTH_MODE_KEY
-	    && p_conn_tab->connection.identityFile[0]) {
-		strcat(expanded_args, " -i \"");
-		strcat(expanded_args, p_conn_tab->connection.identityFile);
-		strcat(expanded_args, "\"");
-	}
-	/* Add user options */
-	if (p_conn_tab->connection.user_options[0] != 0) {
-		strcat(expanded_args, " ");
-		strcat(expanded_args, p_conn_tab->connection.user_options);
-	}
-	/* omit password */
-	log_debug("expand_args : %s\n", expanded_args + prefix_len);
-	p_params = splitString(expanded_args, " ", TRUE, "\"", TRUE, NULL);
+	if (p_conn->sshOptions.x11Forwarding)
+		parts[n++] = ssh_templates.x11;
+	if (p_conn->sshOptions.agentForwarding)
+		parts[n++] = ssh_templates.agent;
+	if (p_conn->sshOptions.disableStrictKeyChecking)
+		parts[n++] = ssh_templates.no_strict_key_checking;
+	if (p_conn->sshOptions.flagKeepAlive)
+		parts[n++] = ssh_templates.keep_alive;
+	/* a dead link is noticed in seconds, for the reconnection */
+	else if (p_conn_tab->auto_reconnect && !strstr(p_conn->user_options, "ServerAlive"))
+		parts[n++] = ssh_templates.alive;
+	if (p_conn->sshOptions.flagConnectTimeout)
+		parts[n++] = ssh_templates.connect_timeout;
+	if (p_conn->auth_mode == CONN_AUTH_MODE_KEY && p_conn->identityFile[0])
+		parts[n++] = ssh_templates.identity;
+	/* share the connection with other tabs, unless the user options configure it */
+	mux = prefs.ssh_mux && !strstr(p_conn->user_options, "Control");
+	if (mux)
+		parts[n++] = ssh_templates.mux;
+	/* the address found by the prober saves a resolution */
+	if (prober_address(p_conn->host, p_conn->port) && !strstr(p_conn->user_options, "Host"))
+		parts[n++] = p_conn->port == 22 ? ssh_templates.address : ssh_templates.address_port;
+	/* Add user options, taken as they are */
+	if (p_conn->user_options[0] != 0)
+		parts[n++] = user_options = cmd_template_new(p_conn->user_options, FALSE);
 	/*
-	 * now the array is something like
-	 * char *params[] = { "ssh", "fabio@localhost", NULL };
+	 * the array is something like
+	 * char *params[] = { "ssh", "-p", "22", "-l", "fabio", "localhost", NULL };
 	 */
+	p_params = cmd_template_expand(parts, n, expand_arg, p_conn);
+	cmd_template_free(user_options);
+	if (p_params == NULL)
+		return 1;
+	/* omit password */
+	cmdline = g_strjoinv(" ", p_params + prefix_args);
+	log_debug("command line : %s\n", cmdline);
+	g_free(cmdline);
+	/* the user, part of the socket name, is known after the expansion */
+	tabSetMuxState(p_conn_tab, mux ? ssh_mux_state(ssh_mux_path(p_conn, mux_path, sizeof(mux_path))) : SSH_MUX_OFF);
 	terminal_write_ex(p_conn_tab, "Logging in...\n\r");
-	GSpawnFlags spawn_flags = G_SPAWN_SEARCH_PATH;
-	vte_terminal_spawn_async(VTE_TERMINAL(p_conn_tab->vte), VTE_PTY_DEFAULT, NULL, p_params, NULL,
-	                         spawn_flags, NULL, NULL, NULL, 10000/* 10s */, NULL, spawn_cb, p_conn_tab);
-	free(p_params);
+	if (pty_pool_spawn(VTE_TERMINAL(p_conn_tab->vte), p_params, &pid) == 0) {
+		log_debug("started by pooled child %d\n", pid);
+		spawn_cb(VTE_TERMINAL(p_conn_tab->vte), pid, NULL, p_conn_tab);
+	} else if (pty_spawn(VTE_TERMINAL(p_conn_tab->vte), p_params, &pid, &error) == 0) {
+		spawn_cb(VTE_TERMINAL(p_conn_tab->vte), pid, NULL, p_conn_tab);
+	} else {
+		spawn_cb(VTE_TERMINAL(p_conn_tab->vte), -1, error, p_conn_tab);
+		g_error_free(error);
+	}
+	g_free(p_params);
 	return 0;
 }
 
@@ -0,0 +1,196 @@
+/**
+ * Copyright (C) 2009-2017 Fabio Leone
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * @file timerwheel.c
+ * @brief Timers of the main loop kept in a hashed wheel
+ */
+
+#include <glib.h>
+#include "main.h"
+#include "timerwheel.h"
+
+/*
+ * A timer due at tick d waits in slot d % TIMER_WHEEL_SLOTS, with the
+ * number of whole turns left before it fires. Arming and cancelling only
+ * link and unlink it. A single main loop source wakes up at the first
+ * tick having a timer, not at every tick, and is removed when no timer
+ * is armed. Ticks are counted from the monotonic clock, so the ones
+ * missed while the loop was busy are processed at the next wake-up.
+ */
+
+#define TICK_US ((gint64) TIMER_WHEEL_TICK_MS * 1000)
+#define FIRING TIMER_WHEEL_SLOTS    /* pseudo slot of the timers being processed */
+
+struct _WheelTimer {
+	WheelTimer *prev, *next;
+	int slot;                   /* -1 when not armed */
+	guint rounds;               /* turns left */
+	guint interval;             /* ms, used again when func returns G_SOURCE_CONTINUE */
+	GSourceFunc func;
+	gpointer data;
+	gboolean running;           /* in func */
+	gboolean cancelled;         /* while running */
+};
+
+static struct {
+	WheelTimer *slots[TIMER_WHEEL_SLOTS + 1];
+	gint64 start;               /* monotonic time of tick 0 */
+	gint64 tick;                /* last processed */
+	gint64 wake_tick;           /* tick the source is set for */
+	guint source_id;
+	int count;                  /* armed timers */
+} wheel;
+
+static gint64 now_tick(void)
+{
+	return (g_get_monotonic_time() - wheel.start) / TICK_US;
+}
+
+static void unlink_timer(WheelTimer *t)
+{
+	if (t->slot < 0)
+		return;
+	if (t->prev)
+		t->prev->next = t->next;
+	else
+		wheel.slots[t->slot] = t->next;
+	if (t->next)
+		t->next->prev = t->prev;
+	t->prev = t->next = NULL;
+	t->slot = -1;
+	wheel.count --;
+}
+
+static void link_timer(WheelTimer *t, int slot)
+{
+	t->slot = slot;
+	t->prev = NULL;
+	t->next = wheel.slots[slot];
+	if (t->next)
+		t->next->prev = t;
+	wheel.slots[slot] = t;
+	wheel.count ++;
+}
+
+static gboolean wheel_cb(gpointer data);
+
+static void schedule(gint64 tick)
+{
+	gint64 delay;
+	if (wheel.source_id) {
+		if (wheel.wake_tick <= tick)
+			return;
+		g_source_remove(wheel.source_id);
+	}
+	delay = (wheel.start + tick * TICK_US - g_get_monotonic_time() + 999) / 1000;
+	wheel.wake_tick = tick;
+	wheel.source_id = g_timeout_add(delay > 0 ? delay : 0, wheel_cb, NULL);
+}
+
+static void arm(WheelTimer *t, guint ms)
+{
+	gint64 due, base;
+	if (wheel.start == 0)
+		wheel.start = g_get_monotonic_time();
+	/* nothing to catch up with an empty wheel */
+	if (wheel.count == 0)
+		wheel.tick = MAX(wheel.tick, now_tick());
+	base = MAX(now_tick(), wheel.tick);
+	due = base + MAX(1, (ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS);
+	t->interval = ms;
+	t->rounds = (due - wheel.tick - 1) / TIMER_WHEEL_SLOTS;
+	link_timer(t, due % TIMER_WHEEL_SLOTS);
+	/* first visit of the slot */
+	schedule(due - (gint64) t->rounds * TIMER_WHEEL_SLOTS);
+}
+
+/* first tick with a timer in its slot, within one turn */
+static gint64 next_tick(void)
+{
+	gint64 tick;
+	for (tick = wheel.tick + 1; tick <= wheel.tick + TIMER_WHEEL_SLOTS; tick++) {
+		if (wheel.slots[tick % TIMER_WHEEL_SLOTS])
+			return tick;
+	}
+	return -1;
+}
+
+static gboolean wheel_cb(gpointer data)
+{
+	gint64 now = now_tick(), tick;
+	WheelTimer *t;
+	wheel.source_id = 0;
+	while (wheel.tick < now) {
+		wheel.tick ++;
+		/* the slot moves aside: callbacks may arm or cancel timers */
+		t = wheel.slots[wheel.tick % TIMER_WHEEL_SLOTS];
+		wheel.slots[wheel.tick % TIMER_WHEEL_SLOTS] = NULL;
+		wheel.slots[FIRING] = t;
+		for (; t; t = t->next)
+			t->slot = FIRING;
+		while ((t = wheel.slots[FIRING]) != NULL) {
+			unlink_timer(t);
+			if (t->rounds) {
+				t->rounds --;
+				link_timer(t, wheel.tick % TIMER_WHEEL_SLOTS);
+				continue;
+			}
+			t->running = TRUE;
+			if (t->func(t->data) && !t->cancelled && t->slot < 0)
+				arm(t, t->interval);
+			t->running = FALSE;
+			if (t->cancelled || t->slot < 0)
+				g_free(t);
+		}
+	}
+	if (wheel.count && (tick = next_tick()) != -1)
+		schedule(tick);
+	return G_SOURCE_REMOVE;
+}
+
+/**
+ * wheel_timer_add() - calls func after ms milliseconds, again while it returns G_SOURCE_CONTINUE
+ * @return the timer, freed after func returns G_SOURCE_REMOVE or by wheel_timer_cancel()
+ */
+WheelTimer *wheel_timer_add(guint ms, GSourceFunc func, gpointer data)
+{
+	WheelTimer *t = g_new0(WheelTimer, 1);
+	t->slot = -1;
+	t->func = func;
+	t->data = data;
+	arm(t, ms);
+	return t;
+}
+
+/* wheel_timer_restart() - postpones a timer, to ms milliseconds from now */
+void wheel_timer_restart(WheelTimer *t, guint ms)
+{
+	unlink_timer(t);
+	arm(t, ms);
+}
+
+/* wheel_timer_cancel() - disarms and frees a timer, also from its own callback */
+void wheel_timer_cancel(WheelTimer *t)
+{
+	if (t == NULL)
+		return;
+	unlink_timer(t);
+	if (t->running)
+		t->cancelled = TRUE;
+	else
+		g_free(t);
+}
@@ -0,0 +1,19 @@
+
+#ifndef _TIMERWHEEL_H
+#define _TIMERWHEEL_H
+
+#include <glib.h>
+
+/* resolution of the timers */
+#define TIMER_WHEEL_TICK_MS 100
+
+/* slots of the wheel, one turn is TIMER_WHEEL_SLOTS * TIMER_WHEEL_TICK_MS */
+#define TIMER_WHEEL_SLOTS 512
+
+typedef struct _WheelTimer WheelTimer;
+
+WheelTimer *wheel_timer_add(guint ms, GSourceFunc func, gpointer data);
+void wheel_timer_restart(WheelTimer *t, guint ms);
+void wheel_timer_cancel(WheelTimer *t);
+
+#endif
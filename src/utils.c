@@ -151,15 +151,14 @@ char ** splitString(char *str, char *delimiters, int skipNulls, char *quotes, in
 		tmp[t] = 0;
 		i += k;
 		if (tmp[0] || (tmp[0] == 0 && !skipNulls)) {
-			splitted = realloc(splitted, sizeof(char *) * n + 1);
-			splitted[n] = (char *) malloc(strlen(tmp) + 1);
-			memcpy(splitted[n], tmp, strlen(tmp) + 1);
-			free(tmp);
+			splitted = realloc(splitted, sizeof(char *) * (n + 1));
+			splitted[n] = tmp;
 			n ++;
-		}
+		} else
+			free(tmp);
 	}
 	if (trailingNull) {
-		splitted = realloc(splitted, sizeof(char *) * n + 1);
+		splitted = realloc(splitted, sizeof(char *) * (n + 1));
 		splitted[n] = 0;
 	}
 	if (pCount)
@@ -179,15 +178,24 @@ char *password_encode(char *clear_text)
 	return (secret_text);
 }
 
-char *password_decode(char *ecrypted_text)
+/**
+ * password_decode() - decodes a base64 password into a caller supplied buffer
+ * @param[in] ecrypted_text base64 text
+ * @param[out] clear_text buffer receiving the decoded password
+ * @param[in] size size of clear_text
+ * @return clear_text
+ */
+char *password_decode(const char *ecrypted_text, char *clear_text, size_t size)
 {
-	static char clear_text[4096];
 	char *p_bin;
 	gsize len;
-	if (strlen(ecrypted_text) == 0)
-		return ("");
+	clear_text[0] = 0;
+	if (ecrypted_text[0] == 0)
+		return (clear_text);
 	p_bin = (char *) g_base64_decode(ecrypted_text, &len);
-	strncpy(clear_text, p_bin, len);
+	if (len >= size)
+		len = size - 1;
+	memcpy(clear_text, p_bin, len);
 	clear_text[len] = 0;
 	g_free(p_bin);
 	return (clear_text);
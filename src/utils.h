@@ -8,6 +8,7 @@
 #define _UTILS_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #define MAXLINE 1024
 #define MAXBUFLEN   1024
@@ -26,7 +27,7 @@ int list_count(char *list, char sep);
 int list_get_nth(char *list, int n, char sep, char *elem);
 
 char *password_encode(char *clear_text);
-char *password_decode(char *ecrypted_text);
+char *password_decode(const char *ecrypted_text, char *clear_text, size_t size);
 
 #endif
 
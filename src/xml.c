@@ -25,80 +25,110 @@
 #include <string.h>
 #include "main.h"
 #include "xml.h"
+#include "cfgfile.h"
 
 
-typedef struct {
-	gchar *key;
-	gchar *value;
-} KeyValuePair;
+/*
+ * A document allocates its nodes and attributes from big blocks and its
+ * strings from a GStringChunk: nothing is freed until the whole document
+ * is. Parents keep a pointer to their last child, so appending is O(1),
+ * and nodes with many children get a name index for xml_node_get_child().
+ */
+
+#define XML_ARENA_BLOCK_SIZE (32 * 1024)
 
-static void xml_node_free(XMLNode *node);
-static XMLNode *xml_node_last_child(XMLNode *node);
+struct _XMLArena {
+	GSList *blocks;
+	gchar *pos;           /* free space in the current block */
+	gsize left;
+	GStringChunk *strings;
+	GSList *indexes;      /* child indexes to destroy */
+	GSList *foreign;      /* nodes of other arenas added as children */
+	XMLNode *owner;       /* node freeing the arena, NULL if owned by an XML */
+};
 
-static void xml_node_free(XMLNode *node)
+static XMLArena *xml_arena_new(void)
 {
-	XMLNode *l;
-	GSList        *list;
-	g_return_if_fail(node != NULL);
-	for (l = node->children; l;) {
-		XMLNode *next = l->next;
-		xml_node_unref(l);
-		l = next;
-	}
-	g_free(node->name);
-	g_free(node->value);
-	for (list = node->attributes; list; list = list->next) {
-		KeyValuePair *kvp = (KeyValuePair *) list->data;
-		g_free(kvp->key);
-		g_free(kvp->value);
-		g_free(kvp);
-	}
-	g_slist_free(node->attributes);
-	g_free(node);
+	XMLArena *arena = g_new0(XMLArena, 1);
+	arena->strings = g_string_chunk_new(4096);
+	return arena;
 }
 
-static XMLNode *xml_node_last_child(XMLNode *node)
+static gpointer xml_arena_alloc(XMLArena *arena, gsize size)
 {
-	XMLNode *l;
-	g_return_val_if_fail(node != NULL, NULL);
-	if (!node->children) {
-		return NULL;
-	}
-	l = node->children;
-	while (l->next) {
-		l = l->next;
+	gpointer ret;
+	gchar *block;
+	size = (size + 15) & ~(gsize) 15;
+	if (size > arena->left) {
+		/* big requests get their own block, the current one stays in use */
+		if (size > XML_ARENA_BLOCK_SIZE / 4) {
+			block = g_malloc0(size);
+			arena->blocks = g_slist_prepend(arena->blocks, block);
+			return block;
+		}
+		block = g_malloc0(XML_ARENA_BLOCK_SIZE);
+		arena->blocks = g_slist_prepend(arena->blocks, block);
+		arena->pos = block;
+		arena->left = XML_ARENA_BLOCK_SIZE;
 	}
-	return l;
+	ret = arena->pos;
+	arena->pos += size;
+	arena->left -= size;
+	return ret;
 }
 
-XMLNode *_xml_node_new(const gchar *name)
+static void xml_arena_free(XMLArena *arena)
+{
+	if (arena == NULL)
+		return;
+	g_slist_free_full(arena->foreign, (GDestroyNotify) xml_node_unref);
+	g_slist_free_full(arena->indexes, (GDestroyNotify) g_hash_table_destroy);
+	g_slist_free_full(arena->blocks, g_free);
+	g_string_chunk_free(arena->strings);
+	g_free(arena);
+}
+
+static XMLNode *xml_node_new_in(XMLArena *arena, const gchar *name)
 {
 	XMLNode *node;
-	node = g_new0(XMLNode, 1);
-	node->name       = g_strdup(name);
-	node->value      = NULL;
-	node->raw_mode   = FALSE;
-	node->attributes = NULL;
-	node->next       = NULL;
-	node->prev       = NULL;
-	node->parent     = NULL;
-	node->children   = NULL;
-	node->ref_count  = 1;
+	node = xml_arena_alloc(arena, sizeof(XMLNode));
+	node->name = g_string_chunk_insert_const(arena->strings, name);
+	node->arena = arena;
+	node->ref_count = 1;
 	return node;
 }
+
+/* creates a node not belonging to a document, freed by its last xml_node_unref() */
+XMLNode *_xml_node_new(const gchar *name)
+{
+	XMLArena *arena = xml_arena_new();
+	arena->owner = xml_node_new_in(arena, name);
+	return arena->owner;
+}
+
+static void xml_node_index_child(XMLNode *node, XMLNode *child)
+{
+	if (!g_hash_table_contains(node->child_index, child->name))
+		g_hash_table_insert(node->child_index, (gpointer) child->name, child);
+}
+
 void _xml_node_add_child_node(XMLNode *node, XMLNode *child)
 {
-	XMLNode *prev;
 	g_return_if_fail(node != NULL);
-	prev = xml_node_last_child(node);
-	xml_node_ref(child);
-	if (prev) {
-		prev->next    = child;
-		child->prev   = prev;
-	} else {
+	/* a node of another arena must outlive this one */
+	if (child->arena != node->arena)
+		node->arena->foreign = g_slist_prepend(node->arena->foreign, xml_node_ref(child));
+	child->prev = node->last_child;
+	child->next = NULL;
+	if (node->last_child)
+		node->last_child->next = child;
+	else
 		node->children = child;
-	}
+	node->last_child = child;
+	node->n_children ++;
 	child->parent = node;
+	if (node->child_index)
+		xml_node_index_child(node, child);
 }
 
 /**
@@ -120,17 +150,12 @@ const gchar *xml_node_get_value(XMLNode *node)
  * @node: an #XMLNode
  * @value: the new value.
  *
- * Sets the value of @node. If a previous value is set it will be freed.
+ * Sets the value of @node. The previous value is released with the document.
  **/
 void xml_node_set_value(XMLNode *node, const gchar *value)
 {
 	g_return_if_fail(node != NULL);
-	g_free(node->value);
-	if (!value) {
-		node->value = NULL;
-		return;
-	}
-	node->value = g_strdup(value);
+	node->value = value ? g_string_chunk_insert(node->arena->strings, value) : NULL;
 }
 
 /**
@@ -150,10 +175,9 @@ XMLNode *xml_node_add_child(XMLNode *node,
 	XMLNode *child;
 	g_return_val_if_fail(node != NULL, NULL);
 	g_return_val_if_fail(name != NULL, NULL);
-	child = _xml_node_new(name);
+	child = xml_node_new_in(node->arena, name);
 	xml_node_set_value(child, value);
 	_xml_node_add_child_node(node, child);
-	xml_node_unref(child);
 	return child;
 }
 
@@ -182,6 +206,30 @@ void xml_node_set_attributes(XMLNode *node,
 	va_end(args);
 }
 
+static XMLAttribute *xml_node_lookup_attribute(XMLNode *node, const gchar *name)
+{
+	XMLAttribute *a;
+	for (a = node->attributes; a; a = a->next) {
+		/* interned names of the same document match by address */
+		if (a->name == name || strcmp(a->name, name) == 0)
+			return a;
+	}
+	return NULL;
+}
+
+static void xml_node_append_attribute(XMLNode *node, const gchar *name, const gchar *value)
+{
+	XMLAttribute *a;
+	a = xml_arena_alloc(node->arena, sizeof(XMLAttribute));
+	a->name = g_string_chunk_insert_const(node->arena->strings, name);
+	a->value = g_string_chunk_insert(node->arena->strings, value);
+	if (node->last_attribute)
+		node->last_attribute->next = a;
+	else
+		node->attributes = a;
+	node->last_attribute = a;
+}
+
 /**
  * xml_node_set_attribute:
  * @node: an #XMLNode
@@ -194,27 +242,15 @@ void xml_node_set_attribute(XMLNode *node,
                             const gchar   *name,
                             const gchar   *value)
 {
-	gboolean  found = FALSE;
-	GSList   *l;
+	XMLAttribute *a;
 	g_return_if_fail(node != NULL);
 	g_return_if_fail(name != NULL);
 	g_return_if_fail(value != NULL);
-	for (l = node->attributes; l; l = l->next) {
-		KeyValuePair *kvp = (KeyValuePair *) l->data;
-		if (strcmp(kvp->key, name) == 0) {
-			g_free(kvp->value);
-			kvp->value = g_strdup(value);
-			found = TRUE;
-			break;
-		}
-	}
-	if (!found) {
-		KeyValuePair *kvp;
-		kvp = g_new0(KeyValuePair, 1);
-		kvp->key = g_strdup(name);
-		kvp->value = g_strdup(value);
-		node->attributes = g_slist_prepend(node->attributes, kvp);
-	}
+	a = xml_node_lookup_attribute(node, name);
+	if (a)
+		a->value = g_string_chunk_insert(node->arena->strings, value);
+	else
+		xml_node_append_attribute(node, name, value);
 }
 
 /**
@@ -228,17 +264,11 @@ void xml_node_set_attribute(XMLNode *node,
  **/
 const gchar *xml_node_get_attribute(XMLNode *node, const gchar *name)
 {
-	GSList      *l;
-	const gchar *ret_val = NULL;
+	XMLAttribute *a;
 	g_return_val_if_fail(node != NULL, NULL);
 	g_return_val_if_fail(name != NULL, NULL);
-	for (l = node->attributes; l; l = l->next) {
-		KeyValuePair *kvp = (KeyValuePair *) l->data;
-		if (strcmp(kvp->key, name) == 0) {
-			ret_val = kvp->value;
-		}
-	}
-	return ret_val;
+	a = xml_node_lookup_attribute(node, name);
+	return a ? a->value : NULL;
 }
 
 /**
@@ -254,6 +284,14 @@ const gchar *xml_node_get_attribute(XMLNode *node, const gchar *name)
 XMLNode *xml_node_get_child(XMLNode *node, const gchar *child_name)
 {
 	XMLNode *l;
+	if (node->child_index == NULL && node->n_children >= XML_CHILD_INDEX_MIN) {
+		node->child_index = g_hash_table_new(g_str_hash, g_str_equal);
+		node->arena->indexes = g_slist_prepend(node->arena->indexes, node->child_index);
+		for (l = node->children; l; l = l->next)
+			xml_node_index_child(node, l);
+	}
+	if (node->child_index)
+		return g_hash_table_lookup(node->child_index, child_name);
 	for (l = node->children; l; l = l->next) {
 		if (!strcmp(l->name, child_name)) {
 			return (l);
@@ -339,76 +377,117 @@ XMLNode *xml_node_ref(XMLNode *node)
  * xml_node_unref:
  * @node: an #XMLNode
  *
- * Removes a reference from @node. When no more references are present the
- * node is freed. When freed xml_node_unref() will be called on all
- * children. If caller needs to keep references to the children a call to
- * xml_node_ref() needs to be done before the call to
- *lm_message_unref().
+ * Removes a reference from @node. Nodes of a document are freed with the
+ * document (see xml_free()); a node created on its own is freed, with its
+ * children, when no more references are present.
  **/
 void xml_node_unref(XMLNode *node)
 {
 	g_return_if_fail(node != NULL);
 	node->ref_count--;
-	if (node->ref_count == 0) {
-		xml_node_free(node);
+	if (node->ref_count == 0 && node->arena->owner == node)
+		xml_arena_free(node->arena);
+}
+
+#define XML_WRITE(s) write(sink, (s), sizeof(s) - 1)
+
+/* writes text replacing the characters that can't appear in XML as they are */
+static void xml_write_escaped(XMLWriteFunc write, gpointer sink, const gchar *text, gboolean raw_mode)
+{
+	const gchar *p, *run;
+	if (raw_mode) {
+		write(sink, text, strlen(text));
+		return;
+	}
+	for (p = run = text; *p; p++) {
+		const gchar *entity;
+		switch (*p) {
+		case '&':
+			entity = "&amp;";
+			break;
+		case '<':
+			entity = "&lt;";
+			break;
+		case '>':
+			entity = "&gt;";
+			break;
+		case '"':
+			entity = "&quot;";
+			break;
+		case '\'':
+			entity = "&apos;";
+			break;
+		default:
+			continue;
+		}
+		if (p > run)
+			write(sink, run, p - run);
+		write(sink, entity, strlen(entity));
+		run = p + 1;
+	}
+	if (p > run)
+		write(sink, run, p - run);
+}
+
+/**
+ * xml_node_write:
+ * @node: an #XMLNode
+ * @write: function receiving the output
+ * @sink: first argument of @write
+ *
+ * Serializes @node and its children without building intermediate strings.
+ **/
+void xml_node_write(XMLNode *node, XMLWriteFunc write, gpointer sink)
+{
+	XMLAttribute *a;
+	XMLNode *child;
+	g_return_if_fail(node != NULL);
+	if (node->name == NULL)
+		return;
+	XML_WRITE("<");
+	write(sink, node->name, strlen(node->name));
+	for (a = node->attributes; a; a = a->next) {
+		XML_WRITE(" ");
+		write(sink, a->name, strlen(a->name));
+		XML_WRITE("=\"");
+		xml_write_escaped(write, sink, a->value, node->raw_mode);
+		XML_WRITE("\"");
 	}
+	XML_WRITE(">");
+	if (node->value)
+		xml_write_escaped(write, sink, node->value, node->raw_mode);
+	for (child = node->children; child; child = child->next)
+		xml_node_write(child, write, sink);
+	XML_WRITE("</");
+	write(sink, node->name, strlen(node->name));
+	XML_WRITE(">\n");
+}
+
+static void gstring_sink(gpointer sink, const gchar *data, gsize len)
+{
+	g_string_append_len((GString *) sink, data, len);
 }
 
-int g_indent = 0;
+static void cfg_writer_sink(gpointer sink, const gchar *data, gsize len)
+{
+	cfg_writer_write((CfgWriter *) sink, data, len);
+}
 
 /**
  * xml_node_to_string:
  * @node: an #XMLNode
  *
- * Returns an XML string representing the node. This is what is sent over the
- * wire. This is used internally Loudmouth and is external for debugging
- * purposes.
+ * Returns an XML string representing the node, mostly for debugging
+ * purposes: use xml_node_write() to send a document somewhere.
  *
  * Return value: an XML string representation of @node
  **/
 gchar *xml_node_to_string(XMLNode *node)
 {
-	GString       *ret;
-	GSList        *l;
-	XMLNode *child;
+	GString *ret;
 	g_return_val_if_fail(node != NULL, NULL);
-	if (node->name == NULL) {
-		return g_strdup("");
-	}
-	ret = g_string_new("<");
-	g_string_append(ret, node->name);
-	for (l = node->attributes; l; l = l->next) {
-		KeyValuePair *kvp = (KeyValuePair *) l->data;
-		if (node->raw_mode == FALSE) {
-			gchar *escaped;
-			escaped = g_markup_escape_text(kvp->value, -1);
-			g_string_append_printf(ret, " %s=\"%s\"",
-			                       kvp->key, escaped);
-			g_free(escaped);
-		} else {
-			g_string_append_printf(ret, " %s=\"%s\"",
-			                       kvp->key, kvp->value);
-		}
-	}
-	g_string_append_c(ret, '>');
-	if (node->value) {
-		gchar *tmp;
-		if (node->raw_mode == FALSE) {
-			tmp = g_markup_escape_text(node->value, -1);
-			g_string_append(ret,  tmp);
-			g_free(tmp);
-		} else {
-			g_string_append(ret, node->value);
-		}
-	}
-	g_indent += 2;
-	for (child = node->children; child; child = child->next) {
-		gchar *child_str = xml_node_to_string(child);
-		g_string_append(ret, child_str);
-		g_free(child_str);
-	}
-	g_indent -= 2;
-	g_string_append_printf(ret, "</%s>\n", node->name);
+	ret = g_string_new("");
+	xml_node_write(node, gstring_sink, ret);
 	return g_string_free(ret, FALSE);
 }
 
@@ -421,27 +500,21 @@ static void xml_parser_start_element_handler(GMarkupParseContext *context, const
         const gchar **attribute_values, gpointer user_data, GError **error)
 {
 	int i;
-	//log_debug("%s\n", element_name);
 	XML *p_xml = (XML *) user_data;
-	if (!p_xml->cur_root) {
-		p_xml->cur_root = _xml_node_new(element_name);
-		p_xml->cur_node = p_xml->cur_root;
-		//log_debug("root element: %s\n", p_xml->cur_root->name);
-	} else {
-		XMLNode *parent_node;
-		parent_node = p_xml->cur_node;
-		p_xml->cur_node = _xml_node_new(element_name);
-		_xml_node_add_child_node(parent_node, p_xml->cur_node);
-	}
-	for (i = 0; attribute_names[i]; ++i) {
-		//log_debug("attribute: %s=%s\n", attribute_names[i], attribute_values[i]);
-		xml_node_set_attributes(p_xml->cur_node, attribute_names[i], attribute_values[i], NULL);
-	}
+	XMLNode *node;
+	node = xml_node_new_in(p_xml->arena, element_name);
+	if (!p_xml->cur_root)
+		p_xml->cur_root = node;
+	else
+		_xml_node_add_child_node(p_xml->cur_node, node);
+	p_xml->cur_node = node;
+	/* GMarkup already rejects duplicated attributes */
+	for (i = 0; attribute_names[i]; ++i)
+		xml_node_append_attribute(node, attribute_names[i], attribute_values[i]);
 }
 
 static void xml_parser_end_element_handler(GMarkupParseContext *context, const gchar *element_name, gpointer user_data, GError **error)
 {
-	//log_debug("%s\n", element_name);
 	XML *p_xml = (XML *) user_data;
 	if (!p_xml->cur_node) {
 		/* FIXME */
@@ -457,16 +530,26 @@ static void xml_parser_end_element_handler(GMarkupParseContext *context, const g
 static void xml_parser_error_handler(GMarkupParseContext *context, GError *error, gpointer user_data)
 {
 	XML *p_xml = (XML *) user_data;
-	memcpy(&p_xml->error, error, sizeof(GError));
+	p_xml->error.domain = error->domain;
+	p_xml->error.code = error->code;
+	g_strlcpy(p_xml->error_text, error->message, sizeof(p_xml->error_text));
+	p_xml->error.message = p_xml->error_text;
 }
 
 static void xml_parser_text_handler(GMarkupParseContext *context, const gchar *text, gsize text_len, gpointer user_data, GError **error)
 {
-	//log_debug("%s\n", text);
 	XML *p_xml = (XML *) user_data;
-	if (p_xml->cur_node && strcmp(text, "")) {
-		xml_node_set_value(p_xml->cur_node, text);
+	gsize i;
+	if (!p_xml->cur_node || text_len == 0)
+		return;
+	/* indentation between child elements is not a value */
+	if (p_xml->cur_node->children) {
+		for (i = 0; i < text_len && g_ascii_isspace(text[i]); i++)
+			;
+		if (i == text_len)
+			return;
 	}
+	p_xml->cur_node->value = g_string_chunk_insert_len(p_xml->arena->strings, text, text_len);
 }
 
 static void xml_parser_passthrough_handler(GMarkupParseContext *context, const gchar *passthrough_text, gsize text_len, gpointer user_data, GError **error)
@@ -481,58 +564,52 @@ static const GMarkupParser xml_parser = {
 	xml_parser_error_handler
 };
 
-int xml_parse(char *doc, XML *p_xml)
+/* parses len bytes of doc (-1 if nul-terminated) */
+int xml_parse(const char *doc, gssize len, XML *p_xml)
 {
 	xml_init(p_xml);
+	p_xml->arena = xml_arena_new();
 	p_xml->context = g_markup_parse_context_new(&xml_parser, G_MARKUP_TREAT_CDATA_AS_TEXT, p_xml, NULL);
-	if (!g_markup_parse_context_parse(p_xml->context, doc, strlen(doc), NULL)) {
-		g_markup_parse_context_free(p_xml->context);
-		return 0;
+	if (!g_markup_parse_context_parse(p_xml->context, doc, len, NULL)
+	    || !g_markup_parse_context_end_parse(p_xml->context, NULL)) {
+		/* the error handler has filled p_xml->error */
+		if (p_xml->error.code == 0)
+			p_xml->error.code = G_MARKUP_ERROR_PARSE;
 	}
 	g_markup_parse_context_free(p_xml->context);
+	p_xml->context = NULL;
+	if (p_xml->error.code) {
+		xml_arena_free(p_xml->arena);
+		p_xml->arena = NULL;
+		p_xml->cur_root = p_xml->cur_node = NULL;
+	}
 	return (p_xml->error.code);
 }
 
 int xml_load(XML *p_xmldoc, char *filename)
 {
-	char *xml;
-	char line[2048];
-	FILE *fp;
-	/* put xml content into a string */
-	fp = fopen(filename, "r");
-	if (fp == NULL)
+	CfgBuffer buf;
+	xml_init(p_xmldoc);
+	if (cfg_buffer_open(&buf, filename))
 		return (1);
-	xml = (char *) malloc(2048);
-	strcpy(xml, "");
-	while (fgets(line, 1024, fp) != 0) {
-		if (strlen(xml) + strlen(line) > sizeof(xml))
-			xml = (char *) realloc(xml, strlen(xml) + strlen(line) + 1);
-		strcat(xml, line);
-	}
-	fclose(fp);
-	xml_parse(xml, p_xmldoc);
-	free(xml);
+	xml_parse(buf.data, buf.len, p_xmldoc);
+	cfg_buffer_close(&buf);
 	return (p_xmldoc->error.code);
 }
 
 int xml_save(XML *p_xmldoc, char *filename)
 {
-	int rc = 0;
-	gchar *xmltext;
-	FILE *fp;
-	fp = fopen(filename, "w");
-	if (fp == NULL)
+	CfgWriter w;
+	if (cfg_writer_open(&w, filename))
 		return (1);
-	g_indent = 0;
-	xmltext = xml_node_to_string(p_xmldoc->cur_root);
-	fprintf(fp, "%s\n", xmltext);
-	fclose(fp);
-	return (rc);
+	xml_node_write(p_xmldoc->cur_root, cfg_writer_sink, &w);
+	cfg_writer_write(&w, "\n", 1);
+	return cfg_writer_commit(&w);
 }
 
 void xml_free(XML *p_xml)
 {
-	xml_node_free(p_xml->cur_root);
+	xml_arena_free(p_xml->arena);
+	p_xml->arena = NULL;
+	p_xml->cur_root = p_xml->cur_node = NULL;
 }
-
-
@@ -5,23 +5,46 @@
 #include <glib.h>
 
 typedef struct _XMLNode XMLNode;
+typedef struct _XMLAttribute XMLAttribute;
+typedef struct _XMLArena XMLArena;
 
+/* children are indexed by name once a node has this many */
+#define XML_CHILD_INDEX_MIN 8
+
+struct _XMLAttribute {
+	const gchar *name;    /* interned */
+	const gchar *value;
+	XMLAttribute *next;
+};
+
+/*
+ * Nodes, names and values of a document live in its arena and are freed
+ * together with it; names are interned, so equal names share one copy.
+ */
 struct _XMLNode {
-	gchar *name;
-	gchar *value;
+	const gchar *name;
+	const gchar *value;
 	gboolean raw_mode;
 
 	XMLNode *next;
 	XMLNode *prev;
 	XMLNode *parent;
 	XMLNode *children;
+	XMLNode *last_child;
+	guint n_children;
+	GHashTable *child_index;    /* name -> first child, see XML_CHILD_INDEX_MIN */
 
-	GSList *attributes;
+	XMLAttribute *attributes;
+	XMLAttribute *last_attribute;
+	XMLArena *arena;
 	gint ref_count;
 };
 
 typedef struct _XML XML;
 
+/* output of the serializer, see xml_node_write() */
+typedef void (*XMLWriteFunc)(gpointer sink, const gchar *data, gsize len);
+
 struct _XML {
 	gpointer user_data;
 
@@ -30,6 +53,8 @@ struct _XML {
 
 	GMarkupParseContext *context;
 	GError error;
+	gchar error_text[256];      /* error.message points here */
+	XMLArena *arena;
 };
 
 const gchar *xml_node_get_value(XMLNode *node);
@@ -45,7 +70,8 @@ void xml_node_set_raw_mode(XMLNode *node, gboolean raw_mode);
 XMLNode *xml_node_ref(XMLNode *node);
 void xml_node_unref(XMLNode *node);
 gchar * xml_node_to_string(XMLNode *node);
-int xml_parse(char *doc, XML *p_xml);
+void xml_node_write(XMLNode *node, XMLWriteFunc write, gpointer sink);
+int xml_parse(const char *doc, gssize len, XML *p_xml);
 int xml_load(XML *xmldoc, char *filename);
 int xml_save(XML *p_xmldoc, char *filename);
 void xml_free(XML *p_xml);
@@ -0,0 +1,146 @@
+/**
+ * Copyright (C) 2009-2017 Fabio Leone
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * @file cmdline_bench.c
+ * @brief Time of building the ssh argv, compiled templates against strcat and splitString()
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <glib.h>
+#include "cmdline.h"
+#include "utils.h"
+
+/*
+ * The argv of a connection with keep alive, connect timeout, identity
+ * file and connection sharing is built as log_on() did before the
+ * templates (character by character expansion, strcat of the options
+ * into a 1024 byte buffer, splitString(), free of every token) and as it
+ * does now (one cmd_template_expand(), one g_free()).
+ *
+ * usage: cmdline_bench [iterations]
+ */
+
+static const char *templates[] = {
+	"ssh -p %p -l %u %h",
+	"-o ServerAliveInterval=%k",
+	"-o ConnectTimeout=%t",
+	"-i %i",
+	"-o ControlMaster=auto -o ControlPath=%m -o ControlPersist=%c",
+};
+
+#define N_TEMPLATES (sizeof(templates) / sizeof(templates[0]))
+
+static const char *lookup(int var, char *buf, gsize size, gpointer data)
+{
+	switch (var) {
+	case 'h':
+		return "build-42.example.com";
+	case 'p':
+		g_snprintf(buf, size, "%d", 2222);
+		return buf;
+	case 'u':
+		return "deploy";
+	case 'k':
+	case 't':
+		g_snprintf(buf, size, "%d", 30);
+		return buf;
+	case 'i':
+		return "/home/deploy/.ssh/id_ed25519";
+	case 'm':
+		return "/run/user/1000/lterm/0123456789abcdef0123";
+	case 'c':
+		return "600";
+	default:
+		return "";
+	}
+}
+
+/* expand_args() of lterm 1.6 */
+static void old_expand(const char *args, char *dest)
+{
+	char expanded[256];
+	int i, i_dest = strlen(dest);
+	for (i = 0; i < strlen(args); i++) {
+		if (args[i] == '%') {
+			i ++;
+			strcpy(expanded, args[i] == '%' ? "%" : lookup(args[i], expanded, sizeof(expanded), NULL));
+			strcat(dest, expanded);
+			i_dest += strlen(expanded);
+		} else {
+			dest[i_dest] = args[i];
+			dest[i_dest + 1] = 0;
+			i_dest ++;
+		}
+	}
+}
+
+static gint64 run_old(int iterations)
+{
+	char cmdline[1024];
+	char **argv;
+	gint64 t0 = g_get_monotonic_time();
+	int i, j, n;
+	for (i = 0; i < iterations; i++) {
+		cmdline[0] = 0;
+		for (j = 0; j < N_TEMPLATES; j++) {
+			if (j)
+				strcat(cmdline, " ");
+			old_expand(templates[j], cmdline);
+		}
+		argv = splitString(cmdline, " ", TRUE, "\"", TRUE, &n);
+		for (j = 0; j < n; j++)
+			free(argv[j]);
+		free(argv);
+	}
+	return g_get_monotonic_time() - t0;
+}
+
+static gint64 run_new(int iterations)
+{
+	CmdTemplate *parts[N_TEMPLATES];
+	char **argv;
+	gint64 t0;
+	int i;
+	for (i = 0; i < N_TEMPLATES; i++)
+		parts[i] = cmd_template_new(templates[i], TRUE);
+	t0 = g_get_monotonic_time();
+	for (i = 0; i < iterations; i++) {
+		argv = cmd_template_expand(parts, N_TEMPLATES, lookup, NULL);
+		g_free(argv);
+	}
+	t0 = g_get_monotonic_time() - t0;
+	for (i = 0; i < N_TEMPLATES; i++)
+		cmd_template_free(parts[i]);
+	return t0;
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations = argc > 1 ? atoi(argv[1]) : 1000000;
+	gint64 t_old, t_new;
+	/* warm up the allocator */
+	run_old(iterations / 100 + 1);
+	run_new(iterations / 100 + 1);
+	t_old = run_old(iterations);
+	t_new = run_new(iterations);
+	printf("cmdline: %d argv of %d templates\n", iterations, (int) N_TEMPLATES);
+	printf("  expand + splitString  %8.1f ns/argv\n", t_old * 1000.0 / iterations);
+	printf("  cmd_template_expand   %8.1f ns/argv\n", t_new * 1000.0 / iterations);
+	return 0;
+}
@@ -0,0 +1,228 @@
+/**
+ * Copyright (C) 2009-2017 Fabio Leone
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * @file cmdline_test.c
+ * @brief Compiled command lines against expansion then splitString()
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <glib.h>
+#include "cmdline.h"
+#include "utils.h"
+
+/*
+ * Random templates of spaces, quotes, letters and '%' sequences are
+ * compiled and expanded, and compared with what log_on() did before the
+ * templates: expand the variables in the text, then split it with
+ * splitString(text, " ", TRUE, "\"", TRUE). Values here are not empty and
+ * have no space or quote, the only case where both agree: a value with
+ * them must stay a single argument, which is checked apart, and an empty
+ * one at the start of an argument made a following quote open it. Templates are split each on
+ * its own: an unterminated quote or a trailing % no longer reaches into
+ * the options appended after the protocol arguments.
+ *
+ * usage: cmdline_test [iterations [seed]]
+ */
+
+static const char alphabet[] = "  \"\"%%%abhuPx-=";
+
+static const char *lookup(int var, char *buf, gsize size, gpointer data)
+{
+	switch (var) {
+	case 'h':
+		return "host.example.com";
+	case 'u':
+		return "user";
+	case 'P':
+		g_strlcpy(buf, "se%cr=et", size);
+		return buf;
+	case 'a':
+		return (const char *) data;
+	default:
+		return "v";
+	}
+}
+
+static const char *empty_lookup(int var, char *buf, gsize size, gpointer data)
+{
+	return "";
+}
+
+/* expand_args() of lterm 1.6, with the same lookup */
+static void old_expand(const char *args, char *dest)
+{
+	char buf[CMD_VAR_SIZE];
+	const char *value;
+	int i;
+	for (i = 0; args[i]; i++) {
+		if (args[i] != '%') {
+			*dest++ = args[i];
+			continue;
+		}
+		i ++;
+		if (args[i] == '%')
+			value = "%";
+		else if (args[i] == 0) {
+			/* a trailing % is dropped */
+			break;
+		} else
+			value = lookup(args[i], buf, sizeof(buf), "10.0.0.1");
+		strcpy(dest, value);
+		dest += strlen(value);
+	}
+	*dest = 0;
+}
+
+static void random_text(GRand *rand, char *text, int max)
+{
+	int i, len = g_rand_int_range(rand, 0, max);
+	for (i = 0; i < len; i++)
+		text[i] = alphabet[g_rand_int_range(rand, 0, sizeof(alphabet) - 1)];
+	text[len] = 0;
+}
+
+static void print_argv(const char *label, char **argv, int n)
+{
+	int i;
+	fprintf(stderr, "  %s:", label);
+	for (i = 0; i < n && argv[i]; i++)
+		fprintf(stderr, " [%s]", argv[i]);
+	fprintf(stderr, "\n");
+}
+
+static int same_argv(char **a, char **b, int n)
+{
+	int i;
+	if (a == NULL)
+		return 0;
+	for (i = 0; i < n; i++)
+		if (a[i] == NULL || strcmp(a[i], b[i]))
+			return 0;
+	return a[n] == NULL;
+}
+
+/* the old split of a template appended to argv */
+static int old_split(const char *text, gboolean expand_vars, char **argv, int n)
+{
+	char expanded[4096];
+	char **split;
+	int i, n_split;
+	if (expand_vars)
+		old_expand(text, expanded);
+	else
+		strcpy(expanded, text);
+	split = splitString(expanded, " ", TRUE, "\"", TRUE, &n_split);
+	for (i = 0; i < n_split; i++)
+		argv[n++] = split[i];
+	argv[n] = NULL;
+	free(split);
+	return n;
+}
+
+/* two templates, as log_on() concatenates the protocol and its options */
+static int check_split(const char *t1, const char *t2, gboolean expand_vars)
+{
+	CmdTemplate *parts[2];
+	char *split[256];
+	char **argv;
+	int n, ok;
+	n = old_split(t1, expand_vars, split, 0);
+	n = old_split(t2, expand_vars, split, n);
+	parts[0] = cmd_template_new(t1, expand_vars);
+	parts[1] = cmd_template_new(t2, expand_vars);
+	argv = cmd_template_expand(parts, 2, lookup, "10.0.0.1");
+	ok = same_argv(argv, split, n);
+	if (!ok) {
+		fprintf(stderr, "mismatch for '%s' + '%s'%s\n", t1, t2, expand_vars ? "" : " (not expanded)");
+		print_argv("splitString", split, n);
+		print_argv("template", argv, n + 1);
+	}
+	g_free(argv);
+	while (n--)
+		free(split[n]);
+	cmd_template_free(parts[0]);
+	cmd_template_free(parts[1]);
+	return ok;
+}
+
+/* values are never split nor unquoted */
+static int check_values(void)
+{
+	const char *value = " \"a b\"  c ";
+	CmdTemplate *tmpl = cmd_template_new("-o Hostname=%a \"%a\" %a", TRUE);
+	char **argv = cmd_template_expand(&tmpl, 1, lookup, (gpointer) value);
+	gchar *expected = g_strconcat("Hostname=", value, NULL);
+	int ok = argv[0] && !strcmp(argv[0], "-o") && argv[1] && !strcmp(argv[1], expected)
+	         && argv[2] && !strcmp(argv[2], value) && argv[3] && !strcmp(argv[3], value) && argv[4] == NULL;
+	if (!ok)
+		fprintf(stderr, "value with spaces and quotes split or changed\n");
+	g_free(expected);
+	g_free(argv);
+	cmd_template_free(tmpl);
+	return ok;
+}
+
+/* an empty value drops the argument, as an empty token was skipped */
+static int check_empty(void)
+{
+	CmdTemplate *tmpl = cmd_template_new("a %x \"%x\" b", TRUE);
+	char **argv = cmd_template_expand(&tmpl, 1, empty_lookup, NULL);
+	int ok = argv[0] && !strcmp(argv[0], "a") && argv[1] && !strcmp(argv[1], "b") && argv[2] == NULL;
+	if (!ok)
+		fprintf(stderr, "empty value not dropped\n");
+	g_free(argv);
+	cmd_template_free(tmpl);
+	return ok;
+}
+
+/* the buffers given to the lookup are only used up by the values put there */
+static int check_many_vars(void)
+{
+	CmdTemplate *tmpl = cmd_template_new("%b%c%d%e%f%g%i%j %a %h %P %u", TRUE);
+	char **argv = cmd_template_expand(&tmpl, 1, lookup, "10.0.0.1");
+	int ok = argv && argv[0] && !strcmp(argv[0], "vvvvvvvv") && argv[1] && !strcmp(argv[1], "10.0.0.1")
+	         && argv[2] && !strcmp(argv[2], "host.example.com") && argv[3] && !strcmp(argv[3], "se%cr=et")
+	         && argv[4] && !strcmp(argv[4], "user") && argv[5] == NULL;
+	if (!ok)
+		fprintf(stderr, "expansion of %d variables failed\n", 12);
+	g_free(argv);
+	cmd_template_free(tmpl);
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	char t1[64], t2[64];
+	int i, iterations = argc > 1 ? atoi(argv[1]) : 200000;
+	guint32 seed = argc > 2 ? strtoul(argv[2], NULL, 10) : 1;
+	int failed = 0;
+	GRand *rand = g_rand_new_with_seed(seed);
+	failed += !check_values();
+	failed += !check_empty();
+	failed += !check_many_vars();
+	for (i = 0; i < iterations && failed < 10; i++) {
+		random_text(rand, t1, sizeof(t1));
+		random_text(rand, t2, sizeof(t2));
+		failed += !check_split(t1, t2, TRUE);
+		failed += !check_split(t1, t2, FALSE);
+	}
+	g_rand_free(rand);
+	printf("cmdline: %d random template pairs, seed %u, %s\n", i, seed, failed ? "FAILED" : "ok");
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,201 @@
+/**
+ * Copyright (C) 2009-2017 Fabio Leone
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * @file connlist_bench.c
+ * @brief Time of the connection list operations, 1k to 100k connections
+ */
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <glib.h>
+#include "connection.h"
+#include "conncache.h"
+
+/*
+ * n connections named in random order, in folders "dcN/rackM", are
+ * inserted, looked up by name, iterated in order and removed, with the
+ * ConnectionList and with the sorted GList of lterm 1.6 (names compared
+ * with strcasecmp, found by a linear search). The GList is only timed up
+ * to 10k connections: beyond, its quadratic inserts take minutes.
+ * Then the list is written to a binary cache (see conncache.c) and the
+ * startup load of the cache into a new list is timed.
+ *
+ * usage: connlist_bench [max [glist_max]]
+ */
+
+/* what the connection manager used before ConnectionList */
+static int namecmp(const void *n1, const void *n2)
+{
+	return strcasecmp(((const Connection *) n1)->name, ((const Connection *) n2)->name);
+}
+
+static int namefind(const void *c, const void *name)
+{
+	return strcasecmp(((const Connection *) c)->name, name);
+}
+
+static void count_cb(gpointer data, gpointer user_data)
+{
+	(*(int *) user_data)++;
+}
+
+static double usec_per_op(gint64 t, int n)
+{
+	return (double) t / n;
+}
+
+static void print_row(const char *what, int n, gint64 t_insert, gint64 t_lookup, gint64 t_iterate, gint64 t_remove)
+{
+	printf("  %-14s %7d  %9.3f %9.3f %9.3f %9.3f\n", what, n, usec_per_op(t_insert, n), usec_per_op(t_lookup, n),
+	       usec_per_op(t_iterate, n), usec_per_op(t_remove, n));
+}
+
+static void run_list(Connection *conns, int *order, int n)
+{
+	ConnectionList *p_cl = cl_new();
+	gint64 t0, t_insert, t_lookup, t_iterate, t_remove;
+	int i, count = 0, missing = 0;
+	t0 = g_get_monotonic_time();
+	for (i = 0; i < n; i++)
+		cl_insert_sorted(p_cl, &conns[order[i]]);
+	t_insert = g_get_monotonic_time() - t0;
+	t0 = g_get_monotonic_time();
+	for (i = 0; i < n; i++)
+		missing += cl_get_by_name(p_cl, conns[i].name) == NULL;
+	t_lookup = g_get_monotonic_time() - t0;
+	t0 = g_get_monotonic_time();
+	cl_foreach(p_cl, count_cb, &count);
+	t_iterate = g_get_monotonic_time() - t0;
+	t0 = g_get_monotonic_time();
+	for (i = 0; i < n; i++)
+		cl_remove(p_cl, conns[order[i]].name);
+	t_remove = g_get_monotonic_time() - t0;
+	if (missing || count != n || cl_count(p_cl))
+		fprintf(stderr, "ConnectionList: %d missing, %d iterated, %d left\n", missing, count, cl_count(p_cl));
+	cl_release(p_cl);
+	print_row("ConnectionList", n, t_insert, t_lookup, t_iterate, t_remove);
+}
+
+static void run_glist(Connection *conns, int *order, int n)
+{
+	GList *list = NULL, *l;
+	gint64 t0, t_insert, t_lookup, t_iterate, t_remove;
+	int i, count = 0, missing = 0;
+	t0 = g_get_monotonic_time();
+	for (i = 0; i < n; i++)
+		list = g_list_insert_sorted(list, g_slice_dup(Connection, &conns[order[i]]), namecmp);
+	t_insert = g_get_monotonic_time() - t0;
+	t0 = g_get_monotonic_time();
+	for (i = 0; i < n; i++)
+		missing += g_list_find_custom(list, conns[i].name, namefind) == NULL;
+	t_lookup = g_get_monotonic_time() - t0;
+	t0 = g_get_monotonic_time();
+	for (l = list; l; l = l->next)
+		count++;
+	t_iterate = g_get_monotonic_time() - t0;
+	t0 = g_get_monotonic_time();
+	for (i = 0; i < n; i++) {
+		l = g_list_find_custom(list, conns[order[i]].name, namefind);
+		g_slice_free(Connection, l->data);
+		list = g_list_delete_link(list, l);
+	}
+	t_remove = g_get_monotonic_time() - t0;
+	if (missing || count != n || list)
+		fprintf(stderr, "GList: %d missing, %d iterated\n", missing, count);
+	print_row("GList", n, t_insert, t_lookup, t_iterate, t_remove);
+}
+
+/* time of conn_cache_load() of the n connections, into an empty list */
+static void run_cache(Connection *conns, int n)
+{
+	ConnectionList *p_cl = cl_new(), *p_loaded = cl_new();
+	gchar *dir = g_dir_make_tmp("connlist_bench.XXXXXX", NULL);
+	gchar *xml_file = g_build_filename(dir, "connections.xml", NULL);
+	gchar *cache_file = g_build_filename(dir, "connections.cache", NULL);
+	GByteArray *data;
+	struct stat st;
+	gint64 t0;
+	int i, rc;
+	for (i = 0; i < n; i++)
+		cl_insert_sorted(p_cl, &conns[i]);
+	/* the cache is only used for the xml file it was made from */
+	g_file_set_contents(xml_file, "", 0, NULL);
+	stat(xml_file, &st);
+	data = conn_cache_build(p_cl);
+	conn_cache_stamp(data, &st);
+	conn_cache_write(data, cache_file);
+	t0 = g_get_monotonic_time();
+	rc = conn_cache_load(p_loaded, cache_file, xml_file);
+	t0 = g_get_monotonic_time() - t0;
+	if (rc || cl_count(p_loaded) != n)
+		fprintf(stderr, "cache: %d connections loaded, %d expected\n", cl_count(p_loaded), n);
+	printf("  %-14s %7d  %9.3f  (%.1f ms, %u KB)\n", "cache load", n, usec_per_op(t0, n), t0 / 1000.0, data->len / 1024);
+	g_byte_array_free(data, TRUE);
+	unlink(cache_file);
+	unlink(xml_file);
+	rmdir(dir);
+	g_free(cache_file);
+	g_free(xml_file);
+	g_free(dir);
+	cl_release(p_loaded);
+	cl_release(p_cl);
+}
+
+int main(int argc, char *argv[])
+{
+	int max = argc > 1 ? atoi(argv[1]) : 100000;
+	int glist_max = argc > 2 ? atoi(argv[2]) : 10000;
+	GRand *rand = g_rand_new_with_seed(1);
+	Connection *conns;
+	char buf[64];
+	int *order, i, j, n, tmp;
+	printf("connection list, microseconds per connection\n");
+	printf("  %-14s %7s  %9s %9s %9s %9s\n", "", "n", "insert", "lookup", "iterate", "remove");
+	for (n = 1000; n <= max; n *= 10) {
+		conns = g_new(Connection, n);
+		order = g_new(int, n);
+		for (i = 0; i < n; i++) {
+			connection_init(&conns[i]);
+			g_snprintf(buf, sizeof(buf), "Host-%07d", i);
+			conns[i].name = conn_intern(buf);
+			g_snprintf(buf, sizeof(buf), "%07d.example.com", i);
+			conns[i].host = conn_intern(buf);
+			g_snprintf(buf, sizeof(buf), "dc%d/rack%d", i % 7, i % 31);
+			conns[i].folder = conn_intern(buf);
+			order[i] = i;
+		}
+		/* inserted and removed in random order */
+		for (i = n - 1; i > 0; i--) {
+			j = g_rand_int_range(rand, 0, i + 1);
+			tmp = order[i];
+			order[i] = order[j];
+			order[j] = tmp;
+		}
+		run_list(conns, order, n);
+		if (n <= glist_max)
+			run_glist(conns, order, n);
+		run_cache(conns, n);
+		g_free(order);
+		g_free(conns);
+	}
+	g_rand_free(rand);
+	return 0;
+}
@@ -0,0 +1,132 @@
+/**
+ * Copyright (C) 2009-2017 Fabio Leone
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * @file prober_test.c
+ * @brief Probes of loopback listeners standing in for the hosts
+ */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <glib.h>
+#include "prober.h"
+
+/*
+ * A socket listening on 127.0.0.1 stands in for a host that is up, the
+ * port of a socket bound and closed for one that is down. Both are
+ * connected to directly with prober_connect(), then probed by the worker
+ * threads through prober_lookup() while the main loop waits for the
+ * results announced to prober_watch().
+ */
+
+#define WAIT_MS 10000
+
+/* a socket bound to a free loopback port, listening or not */
+static int loopback(gboolean listening, int *port)
+{
+	struct sockaddr_in sa;
+	socklen_t len = sizeof(sa);
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (fd == -1 || bind(fd, (struct sockaddr *) &sa, sizeof(sa)) || (listening && listen(fd, 8))
+	    || getsockname(fd, (struct sockaddr *) &sa, &len)) {
+		perror("loopback");
+		return -1;
+	}
+	*port = ntohs(sa.sin_port);
+	return fd;
+}
+
+static int check(int ok, const char *what)
+{
+	if (!ok)
+		fprintf(stderr, "failed: %s\n", what);
+	return ok;
+}
+
+static int check_connect(int up_port, int down_port)
+{
+	int fd, ok = 1;
+	fd = prober_connect("127.0.0.1", up_port, 1000);
+	ok &= check(fd != -1, "connect to a listener");
+	if (fd != -1)
+		close(fd);
+	ok &= check(prober_connect("127.0.0.1", down_port, 1000) == -1, "connect to a closed port");
+	/* names are resolved by the probe, not here */
+	ok &= check(prober_connect("localhost", up_port, 1000) == -1, "connect to a name");
+	return ok;
+}
+
+static void notify_cb(gpointer data)
+{
+	(*(int *) data)++;
+}
+
+static gboolean timeout_cb(gpointer data)
+{
+	*(gboolean *) data = TRUE;
+	return G_SOURCE_REMOVE;
+}
+
+static int check_probe(int up_port, int down_port)
+{
+	const ProbeResult *up, *down;
+	gboolean timeout = FALSE;
+	char buf[32];
+	int notified = 0, ok = 1;
+	prober_watch(notify_cb, &notified);
+	up = prober_lookup("127.0.0.1", up_port);
+	ok &= check(up->state == PROBE_PENDING, "first lookup pending");
+	ok &= check(prober_cached("127.0.0.1", up_port) == NULL, "nothing cached while pending");
+	down = prober_lookup("127.0.0.1", down_port);
+	g_timeout_add(WAIT_MS, timeout_cb, &timeout);
+	while (notified < 2 && !timeout)
+		g_main_context_iteration(NULL, TRUE);
+	ok &= check(notified == 2, "results announced");
+	up = prober_lookup("127.0.0.1", up_port);
+	down = prober_lookup("127.0.0.1", down_port);
+	ok &= check(up->state == PROBE_UP && up->rtt >= 0, "listener up");
+	ok &= check(!strcmp(up->address, "127.0.0.1"), "address of the listener");
+	ok &= check(g_str_has_suffix(prober_state_desc(up, buf, sizeof(buf)), " ms"), "round trip described");
+	ok &= check(down->state == PROBE_DOWN, "closed port down");
+	ok &= check(prober_address("127.0.0.1", up_port) && !strcmp(prober_address("127.0.0.1", up_port), "127.0.0.1"),
+	            "address given to log_on()");
+	ok &= check(prober_address("127.0.0.1", down_port) == NULL, "no address when down");
+	ok &= check(prober_lookup("", up_port)->state == PROBE_UNRESOLVED, "empty host unresolved");
+	prober_unwatch(notify_cb, &notified);
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	int listener, closed, up_port, down_port, ok;
+	if ((listener = loopback(TRUE, &up_port)) == -1 || (closed = loopback(FALSE, &down_port)) == -1)
+		return 1;
+	/* nothing listens there any more */
+	close(closed);
+	ok = check_connect(up_port, down_port);
+	ok &= check_probe(up_port, down_port);
+	prober_shutdown();
+	close(listener);
+	printf("prober: loopback ports %d up, %d down, %s\n", up_port, down_port, ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
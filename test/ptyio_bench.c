@@ -0,0 +1,256 @@
+/**
+ * Copyright (C) 2009-2017 Fabio Leone
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * @file ptyio_bench.c
+ * @brief Terminal reading its pty against ptyio.c: CPU of noisy tabs off screen, throughput of cat
+ */
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <gtk/gtk.h>
+#include <vte/vte.h>
+#include "main.h"
+#include "ptyio.h"
+
+/*
+ * A window shows one tab of a notebook, the other ones are off screen
+ * and each runs a command printing a few KB every 10 ms, like a busy
+ * tail -f. The CPU time of this process (main loop, terminals and pty
+ * readers) is measured for a while with the terminals reading their pty
+ * themselves, then with ptyio.c: as is, with a background buffer and with
+ * a byte rate.
+ *
+ * Then cat prints a file of MB megabytes in a tab on screen, read by the
+ * terminal (until its "eof" signal) and by ptyio.c (until all the bytes,
+ * with the carriage returns the pty adds, are fed). Both include the
+ * parsing and the redraws.
+ *
+ * Needs a display, skipped without.
+ *
+ * usage: ptyio_bench [tabs [seconds [MB]]]
+ */
+
+Prefs prefs;
+
+#define NOISE "while :; do seq 1000; sleep 0.01; done"
+
+typedef struct _Tab {
+	GtkWidget *vte;
+	GPid pid;
+} Tab;
+
+static void child_setup(gpointer data)
+{
+	vte_pty_child_setup(data);
+}
+
+static int tab_start(Tab *tab, GtkWidget *notebook, gboolean pty_io, guint rate)
+{
+	char *argv[] = { "/bin/sh", "-c", NOISE, NULL };
+	GError *error = NULL;
+	VtePty *pty;
+	tab->vte = vte_terminal_new();
+	vte_terminal_set_scrollback_lines(VTE_TERMINAL(tab->vte), 1000);
+	gtk_notebook_append_page(GTK_NOTEBOOK(notebook), tab->vte, NULL);
+	gtk_widget_show(tab->vte);
+	if ((pty = vte_pty_new_sync(VTE_PTY_DEFAULT, NULL, &error)) == NULL
+	    || !g_spawn_async(NULL, argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD, child_setup, pty, &tab->pid, &error)) {
+		fprintf(stderr, "%s\n", error->message);
+		g_error_free(error);
+		return 1;
+	}
+	if (pty_io) {
+		pty_io_attach(VTE_TERMINAL(tab->vte), pty);
+		pty_io_set_rate(pty_io_get(VTE_TERMINAL(tab->vte)), rate);
+	} else
+		vte_terminal_set_pty(VTE_TERMINAL(tab->vte), pty);
+	g_object_unref(pty);
+	return 0;
+}
+
+static void tab_stop(Tab *tab)
+{
+	kill(tab->pid, SIGKILL);
+	waitpid(tab->pid, NULL, 0);
+	gtk_widget_destroy(tab->vte);
+}
+
+static gint64 cpu_time(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return (gint64) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * G_USEC_PER_SEC + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static gboolean quit_cb(gpointer data)
+{
+	*(gboolean *) data = TRUE;
+	return G_SOURCE_REMOVE;
+}
+
+static void run_for(guint ms)
+{
+	gboolean done = FALSE;
+	g_timeout_add(ms, quit_cb, &done);
+	while (!done)
+		g_main_context_iteration(NULL, TRUE);
+}
+
+typedef struct _Cat {
+	gboolean exited;
+	gboolean done;
+} Cat;
+
+static void cat_exit_cb(GPid pid, gint status, gpointer data)
+{
+	((Cat *) data)->exited = TRUE;
+	g_spawn_close_pid(pid);
+}
+
+static void cat_eof_cb(VteTerminal *vte, gpointer data)
+{
+	((Cat *) data)->done = TRUE;
+}
+
+/* a file of lines of 80 bytes, the number of bytes cat prints through the pty */
+static guint64 cat_file(const char *path, int mb)
+{
+	char line[81];
+	guint64 i, lines = (guint64) mb * 1024 * 1024 / 80;
+	FILE *f = fopen(path, "w");
+	if (f == NULL)
+		return 0;
+	for (i = 0; i < lines; i++) {
+		g_snprintf(line, sizeof(line), "%012" G_GUINT64_FORMAT " %066d\n", i, 0);
+		fputs(line, f);
+	}
+	fclose(f);
+	/* each newline becomes \r\n */
+	return lines * 81;
+}
+
+/* seconds for cat to print the file in a tab on screen */
+static double cat_time(GtkWidget *notebook, const char *path, guint64 expected, gboolean pty_io)
+{
+	char *argv[] = { "cat", (char *) path, NULL };
+	GError *error = NULL;
+	Cat cat = { FALSE, FALSE };
+	PtyIOStats stats;
+	GtkWidget *vte;
+	VtePty *pty;
+	GPid pid;
+	gint64 t0;
+	vte = vte_terminal_new();
+	gtk_notebook_append_page(GTK_NOTEBOOK(notebook), vte, NULL);
+	gtk_widget_show(vte);
+	gtk_notebook_set_current_page(GTK_NOTEBOOK(notebook), -1);
+	run_for(500);
+	g_signal_connect(vte, "eof", G_CALLBACK(cat_eof_cb), &cat);
+	t0 = g_get_monotonic_time();
+	if ((pty = vte_pty_new_sync(VTE_PTY_DEFAULT, NULL, &error)) == NULL
+	    || !g_spawn_async(NULL, argv, NULL, G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD, child_setup, pty, &pid, &error)) {
+		fprintf(stderr, "%s\n", error->message);
+		g_error_free(error);
+		gtk_widget_destroy(vte);
+		return -1;
+	}
+	g_child_watch_add(pid, cat_exit_cb, &cat);
+	if (pty_io)
+		pty_io_attach(VTE_TERMINAL(vte), pty);
+	else
+		vte_terminal_set_pty(VTE_TERMINAL(vte), pty);
+	g_object_unref(pty);
+	while (!cat.done) {
+		g_main_context_iteration(NULL, TRUE);
+		if (pty_io) {
+			pty_io_stats(pty_io_get(VTE_TERMINAL(vte)), &stats);
+			cat.done = stats.bytes_fed >= expected;
+		}
+	}
+	t0 = g_get_monotonic_time() - t0;
+	while (!cat.exited)
+		g_main_context_iteration(NULL, TRUE);
+	gtk_widget_destroy(vte);
+	return (double) t0 / G_USEC_PER_SEC;
+}
+
+/* CPU used by the tabs in one mode, in percent of one core */
+static double measure(GtkWidget *notebook, int n_tabs, int seconds, gboolean pty_io, int background_kb, guint rate)
+{
+	Tab *tabs = g_new0(Tab, n_tabs);
+	gint64 t0, cpu0;
+	double usage = -1;
+	int i;
+	prefs.background_buffer = background_kb;
+	for (i = 0; i < n_tabs; i++)
+		if (tab_start(&tabs[i], notebook, pty_io, rate))
+			goto out;
+	/* the first page is the one on screen */
+	gtk_notebook_set_current_page(GTK_NOTEBOOK(notebook), 0);
+	run_for(1000);
+	t0 = g_get_monotonic_time();
+	cpu0 = cpu_time();
+	run_for(seconds * 1000);
+	usage = (cpu_time() - cpu0) * 100.0 / (g_get_monotonic_time() - t0);
+out:
+	for (i = 0; i < n_tabs; i++)
+		if (tabs[i].vte)
+			tab_stop(&tabs[i]);
+	g_free(tabs);
+	return usage;
+}
+
+int main(int argc, char *argv[])
+{
+	GtkWidget *window, *notebook;
+	int n_tabs = argc > 1 ? atoi(argv[1]) : 50;
+	int seconds = argc > 2 ? atoi(argv[2]) : 10;
+	int mb = argc > 3 ? atoi(argv[3]) : 1024;
+	gchar *path;
+	guint64 expected;
+	double t;
+	if (!gtk_init_check(&argc, &argv)) {
+		printf("ptyio: no display, skipped\n");
+		return 0;
+	}
+	window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+	gtk_window_set_default_size(GTK_WINDOW(window), 800, 600);
+	notebook = gtk_notebook_new();
+	gtk_container_add(GTK_CONTAINER(window), notebook);
+	gtk_widget_show_all(window);
+	printf("ptyio: %d noisy tabs, %d off screen, %d s, CPU of one core\n", n_tabs, n_tabs - 1, seconds);
+	printf("  terminal reads its pty        %6.1f%%\n", measure(notebook, n_tabs, seconds, FALSE, 0, 0));
+	printf("  ptyio                         %6.1f%%\n", measure(notebook, n_tabs, seconds, TRUE, 0, 0));
+	printf("  ptyio, background_buffer=64   %6.1f%%\n", measure(notebook, n_tabs, seconds, TRUE, 64, 0));
+	printf("  ptyio, rate 64 KB/s           %6.1f%%\n", measure(notebook, n_tabs, seconds, TRUE, 0, 64 * 1024));
+	path = g_build_filename(g_get_tmp_dir(), "ptyio_bench.txt", NULL);
+	if ((expected = cat_file(path, mb)) > 0) {
+		printf("ptyio: cat of %d MB in a tab on screen\n", mb);
+		t = cat_time(notebook, path, expected, FALSE);
+		printf("  terminal reads its pty        %6.2f s  %7.1f MB/s\n", t, mb / t);
+		t = cat_time(notebook, path, expected, TRUE);
+		printf("  ptyio                         %6.2f s  %7.1f MB/s\n", t, mb / t);
+		remove(path);
+	}
+	g_free(path);
+	gtk_widget_destroy(window);
+	return 0;
+}